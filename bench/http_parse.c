@@ -0,0 +1,313 @@
+/**
+ * @file http_parse.c
+ * @brief Microbenchmark of response head and chunk framing parsing.
+ *
+ * Runs the same canned responses, cut into recv sized pieces, through
+ * the old approach (rescan the head with memmem after every read, then
+ * strcasestr per header, chunk framing a byte at a time) and through
+ * #http1.h.
+ *
+ * `make bench && ./bench/http_parse`
+ */
+#define _GNU_SOURCE
+#include "../src/lib/http1.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char HEAD[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 12 Oct 2026 10:00:00 GMT\r\n"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Connection: keep-alive\r\n"
+    "Server: cloudflare\r\n"
+    "Vary: Origin, Accept-Encoding\r\n"
+    "Access-Control-Allow-Credentials: true\r\n"
+    "Cache-Control: max-age=43200\r\n"
+    "Pragma: no-cache\r\n"
+    "Expires: -1\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Etag: W/\"5ef7-4Ad6/n39KWY9q6Ykm/ULNQ2F5IM\"\r\n"
+    "Via: 1.1 vegur\r\n"
+    "CF-Cache-Status: HIT\r\n"
+    "Age: 2374\r\n"
+    "Report-To: {\"endpoints\":[{\"url\":\"https://a.nel.cloudflare.com/report/v4?s=abc\"}],\"group\":\"cf-nel\",\"max_age\":604800}\r\n"
+    "NEL: {\"success_fraction\":0,\"report_to\":\"cf-nel\",\"max_age\":604800}\r\n"
+    "Alt-Svc: h3=\":443\"; ma=86400\r\n"
+    "\r\n";
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ---------------- old ---------------- */
+
+struct old_state {
+    char header_buf[8192];
+    size_t header_len;
+    bool chunked, keep_alive;
+    size_t content_length;
+
+    bool reading_chunk_size, reading_trailer;
+    char chunk_line[128];
+    size_t chunk_line_len;
+    size_t current_chunk_size;
+    int expecting_crlf;
+    bool done;
+    size_t body;
+};
+
+static long old_head(struct old_state *st, const char *data, size_t len) {
+    memcpy(st->header_buf + st->header_len, data, len);
+    st->header_len += len;
+    char *end = memmem(st->header_buf, st->header_len, "\r\n\r\n", 4);
+    if (!end) {
+        return 0;
+    }
+    st->header_buf[st->header_len] = '\0';
+    st->keep_alive = !strcasestr(st->header_buf, "Connection: close");
+    volatile char *ce = strcasestr(st->header_buf, "\r\nContent-Encoding:");
+    (void) ce;
+    st->chunked = strcasestr(st->header_buf, "Transfer-Encoding: chunked") != NULL;
+    char *cl = strcasestr(st->header_buf, "Content-Length:");
+    st->content_length = cl ? strtoul(cl + 15, NULL, 10) : 0;
+    return end + 4 - st->header_buf;
+}
+
+static void old_body(struct old_state *st, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && !st->done) {
+        if (st->reading_trailer) {
+            char c = data[i++];
+            if (c == '\r') continue;
+            if (c == '\n') {
+                if (st->chunk_line_len == 0) st->done = true;
+                st->chunk_line_len = 0;
+                continue;
+            }
+            st->chunk_line_len++;
+            continue;
+        }
+        if (st->reading_chunk_size) {
+            char c = data[i++];
+            if (c == '\r') continue;
+            if (c == '\n') {
+                st->chunk_line[st->chunk_line_len] = '\0';
+                st->current_chunk_size = strtoul(st->chunk_line, NULL, 16);
+                st->chunk_line_len = 0;
+                st->reading_chunk_size = false;
+                if (st->current_chunk_size == 0) st->reading_trailer = true;
+                continue;
+            }
+            if (st->chunk_line_len < sizeof(st->chunk_line) - 1) {
+                st->chunk_line[st->chunk_line_len++] = c;
+            }
+            continue;
+        }
+        if (st->current_chunk_size > 0) {
+            size_t n = len - i < st->current_chunk_size ? len - i : st->current_chunk_size;
+            st->body += n;
+            i += n;
+            st->current_chunk_size -= n;
+            if (st->current_chunk_size > 0) return;
+            st->expecting_crlf = 2;
+            continue;
+        }
+        if (st->expecting_crlf > 0) {
+            char c = data[i++];
+            if ((c == '\r' || c == '\n') && --st->expecting_crlf == 0) {
+                st->reading_chunk_size = true;
+            }
+            continue;
+        }
+        i++;
+    }
+}
+
+static size_t run_old(const char *resp, size_t len, size_t piece) {
+    struct old_state *st = calloc(1, sizeof(struct old_state));
+    st->reading_chunk_size = true;
+    size_t off = 0;
+    long head = 0;
+    while (off < len && head == 0) {
+        // Reads into the header buffer stop where it does
+        size_t room = sizeof(st->header_buf) - 1 - st->header_len;
+        size_t n = len - off < piece ? len - off : piece;
+        n = n < room ? n : room;
+        head = old_head(st, resp + off, n);
+        off += n;
+        if (head > 0) {
+            old_body(st, st->header_buf + head, st->header_len - head);
+        }
+    }
+    while (off < len && !st->done) {
+        size_t n = len - off < piece ? len - off : piece;
+        old_body(st, resp + off, n);
+        off += n;
+    }
+    size_t body = st->body;
+    free(st);
+    return body;
+}
+
+/* ---------------- new ---------------- */
+
+struct new_state {
+    char header_buf[8192];
+    size_t header_len;
+    struct http_head head;
+    bool chunked, keep_alive;
+
+    bool reading_trailer, expecting_crlf;
+    char chunk_line[128];
+    size_t chunk_line_len;
+    size_t current_chunk_size;
+    bool done;
+    size_t body;
+};
+
+static long new_head(struct new_state *st, const char *data, size_t len) {
+    memcpy(st->header_buf + st->header_len, data, len);
+    st->header_len += len;
+    ssize_t head = http_parse_head(&st->head, st->header_buf, st->header_len);
+    if (head <= 0) {
+        return head;
+    }
+    const struct http_header *c = http_head_get(&st->head, "Connection");
+    st->keep_alive = !(c && http_header_has_token(c, "close"));
+    volatile const struct http_header *ce = http_head_get(&st->head, "Content-Encoding");
+    (void) ce;
+    const struct http_header *te = http_head_get(&st->head, "Transfer-Encoding");
+    st->chunked = te && http_header_has_token(te, "chunked");
+    return head;
+}
+
+static void new_body(struct new_state *st, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && !st->done) {
+        if (st->current_chunk_size > 0) {
+            size_t n = len - i < st->current_chunk_size ? len - i : st->current_chunk_size;
+            st->body += n;
+            i += n;
+            st->current_chunk_size -= n;
+            st->expecting_crlf = st->current_chunk_size == 0;
+            continue;
+        }
+        // Lines that came in whole are read in place
+        size_t avail = len - i;
+        size_t lf = http_find_lf(data + i, avail);
+        const char *line;
+        size_t line_len;
+        if (lf < avail && st->chunk_line_len == 0) {
+            line = data + i;
+            line_len = lf;
+        } else {
+            size_t room = sizeof(st->chunk_line) - 1 - st->chunk_line_len;
+            size_t keep = lf < room ? lf : room;
+            memcpy(st->chunk_line + st->chunk_line_len, data + i, keep);
+            st->chunk_line_len += keep;
+            if (lf == avail) return;
+            line = st->chunk_line;
+            line_len = st->chunk_line_len;
+            st->chunk_line_len = 0;
+        }
+        i += lf + 1;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+
+        if (st->expecting_crlf) {
+            st->expecting_crlf = false;
+        } else if (st->reading_trailer) {
+            if (line_len == 0) st->done = true;
+        } else {
+            long long size = http_chunk_size(line, line_len);
+            if (size == 0) st->reading_trailer = true;
+            else st->current_chunk_size = size;
+        }
+    }
+}
+
+static size_t run_new(const char *resp, size_t len, size_t piece) {
+    struct new_state *st = calloc(1, sizeof(struct new_state));
+    size_t off = 0;
+    long head = 0;
+    while (off < len && head == 0) {
+        // Reads into the header buffer stop where it does
+        size_t room = sizeof(st->header_buf) - 1 - st->header_len;
+        size_t n = len - off < piece ? len - off : piece;
+        n = n < room ? n : room;
+        head = new_head(st, resp + off, n);
+        off += n;
+        if (head > 0) {
+            new_body(st, st->header_buf + head, st->header_len - head);
+        }
+    }
+    while (off < len && !st->done) {
+        size_t n = len - off < piece ? len - off : piece;
+        new_body(st, resp + off, n);
+        off += n;
+    }
+    size_t body = st->body;
+    free(st);
+    return body;
+}
+
+/* ---------------- driver ---------------- */
+
+// HEAD followed by BODY_LEN bytes of body in CHUNK sized chunks
+static char *make_response(size_t body_len, size_t chunk, size_t *len) {
+    size_t cap = sizeof(HEAD) + body_len + (body_len / chunk + 2) * 16 + 64;
+    char *resp = malloc(cap);
+    size_t off = sizeof(HEAD) - 1;
+    memcpy(resp, HEAD, off);
+    for (size_t sent = 0; sent < body_len; sent += chunk) {
+        size_t n = body_len - sent < chunk ? body_len - sent : chunk;
+        off += sprintf(resp + off, "%zx\r\n", n);
+        memset(resp + off, 'x', n);
+        off += n;
+        resp[off++] = '\r';
+        resp[off++] = '\n';
+    }
+    off += sprintf(resp + off, "0\r\n\r\n");
+    *len = off;
+    return resp;
+}
+
+static void bench(const char *label, size_t body_len, size_t chunk, size_t piece) {
+    size_t len;
+    char *resp = make_response(body_len, chunk, &len);
+    size_t bytes = 0;
+    int reps = (int) (2e8 / (len + 1)) + 1;
+
+    double t0 = now_s();
+    for (int r = 0; r < reps; r++) bytes += run_old(resp, len, piece);
+    double t_old = now_s() - t0;
+
+    t0 = now_s();
+    for (int r = 0; r < reps; r++) bytes -= run_new(resp, len, piece);
+    double t_new = now_s() - t0;
+
+    if (bytes != 0) {
+        fprintf(stderr, "%s: old and new disagree on the body\n", label);
+        exit(1);
+    }
+    double mb = (double) len * reps / 1e6;
+    printf("%-28s %9.0f MB/s %9.0f MB/s %6.2fx\n",
+           label, mb / t_old, mb / t_new, t_old / t_new);
+    free(resp);
+}
+
+int main(void) {
+    printf("%-28s %14s %14s %7s\n", "", "old", "new", "");
+    bench("head only, 1 read", 0, 1, 65536);
+    bench("head only, 64 B reads", 0, 1, 64);
+    bench("64 KiB body, 7 B chunks", 65536, 7, 4096);
+    bench("1 MiB body, 4 KiB chunks", 1 << 20, 4096, 16384);
+    bench("1 MiB body, 64 B chunks", 1 << 20, 64, 16384);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file reactor.c
+ * @brief Benchmark of the reactor's epoll and io_uring backends.
+ *
+ * Pairs of tasks play request/response over a socketpair a byte at a
+ * time, a client and an echo. Clients either keep watching for `EPOLLIN`
+ * and write blindly, or switch their watch between `EPOLLOUT` and `EPOLLIN`
+ * each round like a fetch going from sending to receiving. Each backend
+ * runs in its own process, since a process only ever starts one set of
+ * shards.
+ *
+ * `make bench && ./bench/reactor`
+ */
+#define _GNU_SOURCE
+#include "../src/lib/reactor.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct pingpong {
+    struct reactor_task task;
+    int fd;
+    bool echo;
+    bool switching;
+    long rounds;
+};
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static size_t running = 0;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_s(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+         + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool send_request(struct pingpong *pp) {
+    char byte = 'x';
+    if (write(pp->fd, &byte, 1) != 1) {
+        return false;
+    }
+    return reactor_watch(&pp->task, pp->fd, EPOLLIN) == 0;
+}
+
+static bool pp_start(struct reactor_task *task) {
+    struct pingpong *pp = (struct pingpong *) task;
+    if (pp->echo) {
+        return reactor_watch(task, pp->fd, EPOLLIN) == 0;
+    }
+    return pp->switching ? reactor_watch(task, pp->fd, EPOLLOUT) == 0 : send_request(pp);
+}
+
+static bool pp_ready(struct reactor_task *task, int fd, uint32_t events) {
+    struct pingpong *pp = (struct pingpong *) task;
+    if (events & EPOLLOUT) {
+        return send_request(pp);
+    }
+    char byte;
+    if (read(fd, &byte, 1) != 1) {
+        // Client hung up, or something broke
+        return false;
+    }
+    if (pp->echo) {
+        return write(fd, &byte, 1) == 1;
+    }
+    if (--pp->rounds == 0) {
+        return false;
+    }
+    return pp->switching ? reactor_watch(task, fd, EPOLLOUT) == 0 : send_request(pp);
+}
+
+static bool pp_expired(struct reactor_task *task) {
+    (void) task;
+    return true;
+}
+
+static void pp_finish(struct reactor_task *task) {
+    struct pingpong *pp = (struct pingpong *) task;
+    reactor_unwatch(task, pp->fd);
+    close(pp->fd);
+    free(pp);
+
+    pthread_mutex_lock(&done_lock);
+    if (--running == 0) {
+        pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void submit(int fd, bool echo, bool switching, long rounds) {
+    struct pingpong *pp = calloc(1, sizeof(*pp));
+    *pp = (struct pingpong) {
+        .task = {
+            .start = pp_start,
+            .ready = pp_ready,
+            .expired = pp_expired,
+            .finish = pp_finish,
+        },
+        .fd = fd,
+        .echo = echo,
+        .switching = switching,
+        .rounds = rounds,
+    };
+    if (reactor_submit(&pp->task) < 0) {
+        perror("reactor_submit()");
+        exit(1);
+    }
+}
+
+// PAIRS client and echo pairs doing ROUNDS round trips each, all at once.
+static void run(size_t pairs, long rounds, bool switching) {
+    running = pairs * 2;
+    double t0 = now_s(), c0 = cpu_s();
+    for (size_t i = 0; i < pairs; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+            perror("socketpair()");
+            exit(1);
+        }
+        submit(fds[0], false, switching, rounds);
+        submit(fds[1], true, false, 0);
+    }
+
+    pthread_mutex_lock(&done_lock);
+    while (running > 0) {
+        pthread_cond_wait(&done_cond, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+
+    double wall = now_s() - t0, cpu = cpu_s() - c0;
+    double trips = (double) pairs * rounds;
+    printf("%-9s %-9s %5zu pairs %10.0f trips/s %6.2f us cpu/trip\n",
+           reactor_backend() == REACTOR_IO_URING ? "io_uring" : "epoll",
+           switching ? "switching" : "steady", pairs, trips / wall, cpu / trips * 1e6);
+}
+
+static void bench(enum reactor_backend backend) {
+    reactor_configure(1);
+    reactor_use(backend);
+    for (int switching = 0; switching < 2; switching++) {
+        run(1, 100000, switching);
+        run(100, 2000, switching);
+        run(2000, 100, switching);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        bench(strcmp(argv[1], "io_uring") == 0 ? REACTOR_IO_URING : REACTOR_EPOLL);
+        return 0;
+    }
+    enum reactor_backend backends[] = { REACTOR_EPOLL, REACTOR_IO_URING };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench(backends[i]);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include "admit.h"
+#include "fetch.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Slots of one origin. Kept around, origins are few. */
+struct admit_origin {
+    char *key;
+    size_t running;
+    size_t waiting;
+    struct admit_origin *next;
+};
+
+/* Who fetches are for, a database connection say */
+struct group {
+    const void *key;
+    unsigned long long served;  // turn it last got a slot on
+    size_t flows;
+    struct group *next;
+};
+
+/* Fetches waiting for one origin on behalf of one flow, oldest first */
+struct flow {
+    const void *key;
+    struct group *group;
+    struct admit_origin *origin;
+    int priority;
+    unsigned long long served;
+    struct fetch_state *head;
+    struct fetch_state *tail;
+    struct flow *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Wakes the watchdog up when what waits changed */
+static int queued = -1;
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+
+static struct admit_origin *origins = NULL;
+static struct group *groups = NULL;
+static struct flow *flows = NULL;
+static size_t running = 0;
+static unsigned long long turns = 0;
+
+static size_t per_origin = ADMIT_PER_ORIGIN;
+static size_t total = ADMIT_TOTAL;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct admit_origin *find_origin(const char *key) {
+    for (struct admit_origin *o = origins; o; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+    struct admit_origin *o = calloc(1, sizeof(struct admit_origin));
+    if (!o) {
+        return NULL;
+    }
+    o->key = strdup(key);
+    if (!o->key) {
+        free(o);
+        return NULL;
+    }
+    o->next = origins;
+    origins = o;
+    return o;
+}
+
+// The queue FS waits in, made up if it's the first of its flow.
+static struct flow *find_flow(const struct fetch_state *fs, struct admit_origin *o) {
+    const struct admit_ticket *t = &fs->admit;
+    for (struct flow *f = flows; f; f = f->next) {
+        if (f->key == t->flow && f->group->key == t->group && f->origin == o
+            && f->priority == t->priority) {
+            return f;
+        }
+    }
+
+    struct group *g = groups;
+    while (g && g->key != t->group) {
+        g = g->next;
+    }
+    if (!g) {
+        g = calloc(1, sizeof(struct group));
+        if (!g) {
+            return NULL;
+        }
+        g->key = t->group;
+        g->next = groups;
+        groups = g;
+    }
+
+    struct flow *f = calloc(1, sizeof(struct flow));
+    if (!f) {
+        if (g->flows == 0) {
+            groups = g->next;
+            free(g);
+        }
+        return NULL;
+    }
+    *f = (struct flow) {
+        .key = t->flow,
+        .group = g,
+        .origin = o,
+        .priority = t->priority,
+        .next = flows,
+    };
+    g->flows++;
+    flows = f;
+    return f;
+}
+
+// Forget F, which ran out of fetches, and its group with its last flow.
+static void drop_flow(struct flow *f) {
+    struct flow **link = &flows;
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+
+    struct group *g = f->group;
+    if (--g->flows == 0) {
+        struct group **glink = &groups;
+        while (*glink != g) {
+            glink = &(*glink)->next;
+        }
+        *glink = g->next;
+        free(g);
+    }
+    free(f);
+}
+
+static bool has_room(const struct admit_origin *o) {
+    return o->running < per_origin && running < total;
+}
+
+static void take_slot(struct fetch_state *fs, struct admit_origin *o) {
+    o->running++;
+    running++;
+    fs->admit.held = true;
+    fs->admit.origin = o;
+}
+
+static bool overdue(const struct flow *f, long long now) {
+    return now - f->head->admit.queued_ms >= ADMIT_MAX_WAIT_MS;
+}
+
+// Whether flow A goes before flow B: what waited too long first, then
+// by priority, then whoever was served longest ago.
+static bool goes_before(const struct flow *a, const struct flow *b, long long now) {
+    if (overdue(a, now) != overdue(b, now)) {
+        return overdue(a, now);
+    }
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    if (a->group->served != b->group->served) {
+        return a->group->served < b->group->served;
+    }
+    return a->served < b->served;
+}
+
+// Next waiting fetch that may go, with its slot taken. Holds lock.
+static struct fetch_state *next_admitted(long long now) {
+    struct flow *best = NULL;
+    for (struct flow *f = flows; f; f = f->next) {
+        if ((has_room(f->origin) || overdue(f, now)) && (!best || goes_before(f, best, now))) {
+            best = f;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+
+    struct fetch_state *fs = best->head;
+    best->head = fs->admit.next;
+    if (!best->head) {
+        best->tail = NULL;
+    }
+    fs->admit.next = NULL;
+
+    if (!has_room(best->origin)) {
+        stat_add(STAT_ADMIT_OVERDUE, 1);
+    }
+    stat_add(STAT_ADMIT_WAIT_MS, now - fs->admit.queued_ms);
+    take_slot(fs, best->origin);
+    best->origin->waiting--;
+    best->served = best->group->served = ++turns;
+    if (!best->head) {
+        drop_flow(best);
+    }
+    return fs;
+}
+
+// Give back the slot FS holds. Holds lock.
+static void give_back(struct fetch_state *fs) {
+    fs->admit.origin->running--;
+    running--;
+    fs->admit.held = false;
+}
+
+// Submit whatever may go now.
+static void dispatch(void) {
+    for (bool admitted = false;; admitted = true) {
+        pthread_mutex_lock(&lock);
+        struct fetch_state *fs = next_admitted(now_ms());
+        pthread_mutex_unlock(&lock);
+        if (!fs) {
+            // The watchdog's poll() holds on to the outfd of whatever it
+            // watched, and a closed one only reaches EOF once it lets go
+            if (admitted && queued >= 0) {
+                eventfd_write(queued, 1);
+            }
+            return;
+        }
+        fetch_unpark(fs);
+        if (fetch_submit(fs) < 0) {
+            // Its consumer sees it end without rows
+            perror("fetch_submit()");
+            pthread_mutex_lock(&lock);
+            give_back(fs);
+            pthread_mutex_unlock(&lock);
+            fetch_end(fs);
+        }
+    }
+}
+
+// Whether the consumer of the fetch writing to FD hung up.
+static bool hung_up(int fd) {
+    struct pollfd p = { .fd = fd, .events = POLLRDHUP };
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// Take the waiting fetch whose consumer at FD hung up out of line, or
+// NULL if it's not waiting anymore. Holds lock.
+static struct fetch_state *unqueue(int fd) {
+    for (struct flow *f = flows; f; f = f->next) {
+        struct fetch_state *prev = NULL;
+        for (struct fetch_state *fs = f->head; fs; prev = fs, fs = fs->admit.next) {
+            // The fd may be somebody else's by now
+            if (fs->outfd != fd || !hung_up(fd)) {
+                continue;
+            }
+            if (prev) {
+                prev->admit.next = fs->admit.next;
+            } else {
+                f->head = fs->admit.next;
+            }
+            if (f->tail == fs) {
+                f->tail = prev;
+            }
+            fs->admit.next = NULL;
+            f->origin->waiting--;
+            if (!f->head) {
+                drop_flow(f);
+            }
+            return fs;
+        }
+    }
+    return NULL;
+}
+
+// Free FS, which never went, for a consumer that's gone.
+static void cancel(struct fetch_state *fs) {
+    if (fs->netfd >= 0) {
+        // Still idle, fetch_park() couldn't give it back
+        pool_release(fs->origin, (struct pooled) { .fd = fs->netfd, .ssl = fs->ssl });
+        fs->netfd = -1;
+        fs->ssl = NULL;
+    }
+    fs->http_done = true;
+    fetch_end(fs);
+}
+
+// Let fetches go that waited too long, whatever the caps say, and drop
+// the ones whose consumer hung up meanwhile.
+static void *watchdog(void *arg) {
+    (void) arg;
+    // The eventfd's entry, at least, is always there
+    struct pollfd *polls = malloc(sizeof(struct pollfd));
+    size_t cap = 1;
+    if (!polls) {
+        perror("malloc()");
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        long long oldest = -1;
+        size_t n = 1;
+        for (struct flow *f = flows; f; f = f->next) {
+            if (oldest < 0 || f->head->admit.queued_ms < oldest) {
+                oldest = f->head->admit.queued_ms;
+            }
+            for (struct fetch_state *fs = f->head; fs; fs = fs->admit.next) {
+                n++;
+            }
+        }
+        if (n > cap) {
+            struct pollfd *grown = realloc(polls, n * sizeof(struct pollfd));
+            if (grown) {
+                polls = grown;
+                cap = n;
+            }
+        }
+        // Short of memory, it's only the deadlines that are watched
+        n = cap < n ? 1 : n;
+        polls[0] = (struct pollfd) { .fd = queued, .events = POLLIN };
+        size_t i = 1;
+        for (struct flow *f = flows; f && i < n; f = f->next) {
+            for (struct fetch_state *fs = f->head; fs && i < n; fs = fs->admit.next) {
+                polls[i++] = (struct pollfd) { .fd = fs->outfd, .events = POLLRDHUP };
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        long long wait_ms = oldest < 0 ? -1 : oldest + ADMIT_MAX_WAIT_MS - now_ms();
+        if (poll(polls, n, wait_ms < 0 && oldest >= 0 ? 0 : wait_ms) < 0 && errno != EINTR) {
+            perror("poll()");
+            sleep(1);
+            continue;
+        }
+        if (polls[0].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(queued, &count);
+        }
+        for (i = 1; i < n; i++) {
+            if (!(polls[i].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+                continue;
+            }
+            pthread_mutex_lock(&lock);
+            struct fetch_state *fs = unqueue(polls[i].fd);
+            pthread_mutex_unlock(&lock);
+            if (fs) {
+                cancel(fs);
+            }
+        }
+        dispatch();
+    }
+    return NULL;
+}
+
+static void start_watchdog(void) {
+    queued = eventfd(0, EFD_CLOEXEC);
+    if (queued < 0) {
+        perror("eventfd()");
+        return;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, watchdog, NULL) == 0) {
+        pthread_detach(tid);
+    } else {
+        perror("pthread_create()");
+    }
+}
+
+int admit_submit(struct fetch_state *fs) {
+    pthread_mutex_lock(&lock);
+    struct admit_origin *o = find_origin(fs->origin);
+    if (!o) {
+        // Can't keep count of it, so let it through
+        pthread_mutex_unlock(&lock);
+        return fetch_submit(fs);
+    }
+
+    // Straight through, unless others got in line for the same slots first
+    if (has_room(o) && o->waiting == 0) {
+        take_slot(fs, o);
+        pthread_mutex_unlock(&lock);
+        if (fetch_submit(fs) < 0) {
+            pthread_mutex_lock(&lock);
+            give_back(fs);
+            pthread_mutex_unlock(&lock);
+            dispatch();
+            return -1;
+        }
+        return 0;
+    }
+
+    // Nobody else gets to use the connection FS came with while it waits,
+    // and the server may well close it by then
+    pthread_mutex_unlock(&lock);
+    fetch_park(fs);
+    pthread_mutex_lock(&lock);
+
+    struct flow *f = find_flow(fs, o);
+    if (!f) {
+        pthread_mutex_unlock(&lock);
+        return perror_rc(-1, "calloc()", 0);
+    }
+    fs->admit.queued_ms = now_ms();
+    fs->admit.next = NULL;
+    if (f->tail) {
+        f->tail->admit.next = fs;
+    } else {
+        f->head = fs;
+    }
+    f->tail = fs;
+    o->waiting++;
+    pthread_mutex_unlock(&lock);
+
+    stat_add(STAT_ADMIT_QUEUED, 1);
+    pthread_once(&watchdog_once, start_watchdog);
+    if (queued >= 0) {
+        eventfd_write(queued, 1);
+    }
+    // Whoever is first in line gets any slot that's free
+    dispatch();
+    return 0;
+}
+
+bool admit_try(struct fetch_state *fs) {
+    pthread_mutex_lock(&lock);
+    struct admit_origin *o = find_origin(fs->origin);
+    bool ok = o && has_room(o) && o->waiting == 0;
+    if (ok) {
+        take_slot(fs, o);
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void admit_release(struct fetch_state *fs) {
+    if (!fs->admit.held) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    give_back(fs);
+    pthread_mutex_unlock(&lock);
+    dispatch();
+}
+
+void admit_configure(size_t max_per_origin, size_t max_total) {
+    pthread_mutex_lock(&lock);
+    if (max_per_origin > 0) {
+        per_origin = max_per_origin;
+    }
+    if (max_total > 0) {
+        total = max_total;
+    }
+    pthread_mutex_unlock(&lock);
+    dispatch();
+}
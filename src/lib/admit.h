@@ -0,0 +1,84 @@
+/**
+ * @file admit.h
+ * @brief Admission of fetches to the network, under per origin and overall
+ * caps on how many run at once.
+ *
+ * A fetch holds a slot from the time it goes to the reactor until it's
+ * done with its connection. Fetches that find their origin, or everything,
+ * at the cap wait until a slot frees up.
+ *
+ * The next one to go is picked by priority first, highest wins. Among equal
+ * priorities, waiting fetches are grouped by who asked for them, a group
+ * (say a database connection) holding flows (say its cursors): the group
+ * that was served longest ago goes first, and within it the flow that was.
+ * A query with many fetches in flight then can't starve another one, and
+ * a chatty connection can't starve the others.
+ *
+ * A waiting fetch doesn't keep a connection out of the pool: the one it
+ * came with goes back, and it takes whichever is idle once it may go.
+ *
+ * Nothing waits longer than #ADMIT_MAX_WAIT_MS. A query that holds more
+ * slots than the cap while waiting on another one can't deadlock, it just
+ * goes over the cap for a while.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct fetch_state;
+
+/** Fetches to one origin running at once, by default. */
+#define ADMIT_PER_ORIGIN 8
+
+/** Fetches running at once overall, by default. */
+#define ADMIT_TOTAL 256
+
+/** Longest a fetch waits for a slot before it goes anyway. */
+#define ADMIT_MAX_WAIT_MS 10000
+
+/**
+ * @brief Where a fetch stands with the scheduler.
+ */
+struct admit_ticket {
+    /** Higher goes first. */
+    int priority;
+    /** Who the fetch is for, NULL for nobody in particular. */
+    const void *group;
+    const void *flow;
+
+    /* Scheduler's own bookkeeping */
+
+    /** Holds a slot of #origin, to give back once done. */
+    bool held;
+    struct admit_origin *origin;
+    /** When it started waiting (monotonic ms). */
+    long long queued_ms;
+    /** Next in its flow's queue. */
+    struct fetch_state *next;
+};
+
+/**
+ * @brief Set the caps, PER_ORIGIN and TOTAL. Zero leaves a cap unchanged.
+ */
+void admit_configure(size_t per_origin, size_t total);
+
+/**
+ * @brief #fetch_submit() FS once there's a slot for it.
+ *
+ * @retval 0 OK, FS is the scheduler's and then the reactor's.
+ * @retval -1 Error, FS is still the caller's.
+ */
+int admit_submit(struct fetch_state *fs);
+
+/**
+ * @brief Take a slot for FS only if one is free right now.
+ *
+ * @retval true FS holds a slot, submit it.
+ * @retval false All taken, FS isn't worth the wait.
+ */
+bool admit_try(struct fetch_state *fs);
+
+/**
+ * @brief Give FS's slot, if it holds one, to the next fetch in line.
+ */
+void admit_release(struct fetch_state *fs);
@@ -68,6 +68,8 @@ FILE *bhop_writable(struct deque8 *init) {
         free(w_bassoon);
         return NULL;
     }
+    // NDJSON bodies are one top level value after another
+    yajl_config(w_bassoon->parser, yajl_allow_multiple_values, 1);
 
     cookie_io_functions_t io = {
         .write = bhop_fwrite,
@@ -79,6 +81,27 @@ FILE *bhop_writable(struct deque8 *init) {
     return fopencookie(w_bassoon, "w", io);
 }
 
+int bhop_open(FILE *files[2]) {
+    struct deque8 *dq = calloc(1, sizeof(struct deque8));
+    if (!dq) {
+        return perror_rc(-1, "calloc", deque8_free(dq));
+    }
+    deque8_init(dq);
+
+    FILE *writable = bhop_writable(dq);
+    if (!writable) {
+        return perror_rc(-1, "bhop_writable", deque8_free(dq));
+    }
+    FILE *readable = bhop_readable(dq);
+    if (!readable) {
+        return perror_rc(-1, "bhop_readable", fclose(writable), deque8_free(dq));
+    }
+
+    files[0] = writable;
+    files[1] = readable;
+    return 0;
+}
+
 /* BEGIN STATIC */
 static ssize_t bhop_fwrite(void *cookie, const char *buf, size_t size) {
     struct bassoon_state *c = cookie;
@@ -17,3 +17,12 @@ FILE *bhop_readable(struct deque8 *deque);
  * @brief Returns a writable FILE handle bound to DEQUE.
  */
 FILE *bhop_writable(struct deque8 *deque);
+
+/**
+ * @brief Both ends over a fresh deque, the writable one in `FILES[0]` and
+ * the readable one, which frees the deque, in `FILES[1]`.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, `FILES` is left unchanged and errno is set.
+ */
+int bhop_open(FILE *files[2]);
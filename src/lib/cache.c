@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "fetch.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* First line of an entry: when it was stored and for how long it's fresh,
+ * in seconds. Fixed width, so a 304 can rewrite it in place. */
+#define ENTRY_LINE "yarts-cache 1 %020lld %020lld\n"
+
+struct cache_entry {
+    char *path;
+
+    /* The entry already there, if any */
+    char *map;
+    size_t map_len;
+    struct http_head head;      // pointing into map
+    size_t body_off;            // where the body starts in map
+    long long stored;
+    long long max_age;
+    bool replay;                // body goes out from map once the fetch ends
+
+    /* The new entry on its way in, renamed to path once whole */
+    FILE *out;
+    char *out_path;
+};
+
+// Next comma separated token of a header value in [*P, END), which is
+// past it after.
+static bool next_token(const char **p, const char *end, const char **token, size_t *len) {
+    while (*p < end && (**p == ' ' || **p == '\t' || **p == ',')) (*p)++;
+    if (*p == end) {
+        return false;
+    }
+    *token = *p;
+    while (*p < end && **p != ',') (*p)++;
+    *len = *p - *token;
+    while (*len > 0 && ((*token)[*len - 1] == ' ' || (*token)[*len - 1] == '\t')) (*len)--;
+    return true;
+}
+
+// N of a NAME=N directive of header H, -1 without one.
+static long long directive_seconds(const struct http_header *h, const char *name) {
+    size_t name_len = strlen(name);
+    const char *p = h->value, *end = h->value + h->value_len;
+    const char *token;
+    size_t len;
+    while (next_token(&p, end, &token, &len)) {
+        if (len > name_len && token[name_len] == '=' && strncasecmp(token, name, name_len) == 0) {
+            long long seconds = 0;
+            for (size_t i = name_len + 1; i < len && token[i] >= '0' && token[i] <= '9'; i++) {
+                seconds = MIN(seconds * 10 + (token[i] - '0'), 1LL << 40);
+            }
+            return seconds;
+        }
+    }
+    return -1;
+}
+
+// Seconds HEAD stays fresh from now on, -1 when it doesn't say.
+static long long lifetime(const struct http_head *head) {
+    const struct http_header *cc = http_head_get(head, "Cache-Control");
+    if (!cc) {
+        return -1;
+    }
+    if (http_header_has_token(cc, "no-cache")) {
+        return 0;
+    }
+    long long max_age = directive_seconds(cc, "max-age");
+    if (max_age < 0) {
+        return -1;
+    }
+    // Whatever it spent in caches on the way already counts
+    const struct http_header *age = http_head_get(head, "Age");
+    long long spent = 0;
+    for (size_t i = 0; age && i < age->value_len && age->value[i] >= '0' && age->value[i] <= '9'; i++) {
+        spent = MIN(spent * 10 + (age->value[i] - '0'), 1LL << 40);
+    }
+    return MAX(max_age - spent, 0);
+}
+
+// Whether HEAD is one of several responses to the same request, picked
+// by request headers other than the Accept-Encoding we always send.
+static bool varies(const struct http_head *head) {
+    const struct http_header *vary = http_head_get(head, "Vary");
+    if (!vary) {
+        return false;
+    }
+    const char *p = vary->value, *end = vary->value + vary->value_len;
+    const char *token;
+    size_t len;
+    while (next_token(&p, end, &token, &len)) {
+        if (len != strlen("Accept-Encoding") || strncasecmp(token, "Accept-Encoding", len) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// DIR/<SHA-256 of FS's origin and request, in hex>
+static char *entry_path(const char *dir, const struct fetch_state *fs) {
+    struct string key = dynamic("%s\n%.*s", fs->origin, (int) fs->request_len, fs->request);
+    if (!key.hd) {
+        return NULL;
+    }
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    int ok = EVP_Digest(key.hd, key.length, md, &md_len, EVP_sha256(), NULL);
+    free(key.hd);
+    if (!ok) {
+        return NULL;
+    }
+
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    for (unsigned int i = 0; i < md_len; i++) {
+        sprintf(hex + 2 * i, "%02x", md[i]);
+    }
+    return dynamic("%s/%s", dir, hex).hd;
+}
+
+// Map the entry at C's path, if there's a sound one.
+static bool map_entry(struct cache_entry *c) {
+    int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return perror_rc(false, "mmap()", 0);
+    }
+    size_t len = st.st_size;
+
+    char line[64];
+    size_t lf = http_find_lf(map, len);
+    ssize_t head_len = -1;
+    if (lf < sizeof(line)) {
+        memcpy(line, map, lf);
+        line[lf] = '\0';
+        if (sscanf(line, "yarts-cache 1 %lld %lld", &c->stored, &c->max_age) == 2) {
+            head_len = http_parse_head(&c->head, map + lf + 1, len - lf - 1);
+        }
+    }
+    if (head_len <= 0) {
+        fprintf(stderr, "cache: ignoring malformed entry %s\n", c->path);
+        munmap(map, len);
+        return false;
+    }
+
+    // Bodies are read front to back, once
+    madvise(map, len, MADV_SEQUENTIAL);
+    c->map = map;
+    c->map_len = len;
+    c->body_off = lf + 1 + head_len;
+    return true;
+}
+
+static void unmap_entry(struct cache_entry *c) {
+    munmap(c->map, c->map_len);
+    c->map = NULL;
+    c->map_len = 0;
+}
+
+// Ask about C again: send FS's request with the validators C has.
+static bool revalidate(struct fetch_state *fs, struct cache_entry *c) {
+    const struct http_header *etag = http_head_get(&c->head, "ETag");
+    const struct http_header *modified = http_head_get(&c->head, "Last-Modified");
+    char extra[1024] = "";
+    size_t len = 0;
+    if (etag && etag->value_len < 256) {
+        len += snprintf(extra + len, sizeof(extra) - len, "If-None-Match: %.*s\r\n",
+                        (int) etag->value_len, etag->value);
+    }
+    if (modified && modified->value_len < 256) {
+        len += snprintf(extra + len, sizeof(extra) - len, "If-Modified-Since: %.*s\r\n",
+                        (int) modified->value_len, modified->value);
+    }
+    if (len == 0) {
+        return false;
+    }
+
+    struct string request = fetch_request(fs->path, fs->authority, decoder_accept_encoding(), extra);
+    if (!request.hd) {
+        return perror_rc(false, "dynamic()", 0);
+    }
+    free(fs->request);
+    fs->request = request.hd;
+    fs->request_len = request.length;
+    return true;
+}
+
+int cache_attach(struct fetch_state *fs, const char *dir) {
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        return perror_rc(-1, "mkdir()", 0);
+    }
+    struct cache_entry *c = calloc(1, sizeof(struct cache_entry));
+    if (!c) {
+        return perror_rc(-1, "calloc()", 0);
+    }
+    c->path = entry_path(dir, fs);
+    if (!c->path) {
+        return perror_rc(-1, "entry_path()", free(c));
+    }
+    fs->cache = c;
+
+    if (!map_entry(c)) {
+        stat_add(STAT_CACHE_MISS, 1);
+        return 0;
+    }
+    if (c->stored + c->max_age > time(NULL)) {
+        c->replay = true;
+        stat_add(STAT_CACHE_HIT, 1);
+        return 0;
+    }
+    if (!revalidate(fs, c)) {
+        // Stale, and nothing to ask the server about it with
+        unmap_entry(c);
+        stat_add(STAT_CACHE_MISS, 1);
+    }
+    return 0;
+}
+
+/* A cached body on its way through a fetch's parser */
+struct replay {
+    struct reactor_task task;
+    struct fetch_state *fs;
+    size_t off;                 // how far into the entry it got
+};
+
+// Whether H says how the body was sent, which the entry's decoded body no
+// longer matches.
+static bool framing(const struct http_header *h) {
+    static const char *names[] = { "Content-Encoding", "Transfer-Encoding", "Content-Length" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (h->name_len == strlen(names[i]) && strncasecmp(h->name, names[i], h->name_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool replay_start(struct reactor_task *task) {
+    struct replay *r = (struct replay *) task;
+    struct fetch_state *fs = r->fs;
+    struct cache_entry *c = fs->cache;
+    if (!fs->headers_done && fs->netfd >= 0) {
+        // A fresh hit never needed the connection it came with
+        pool_release(fs->origin, (struct pooled) {
+            .fd = fs->netfd, .ssl = fs->ssl
+        });
+        fs->netfd = -1;
+        fs->ssl = NULL;
+    }
+
+    fs->status = c->head.status;
+    if (fs->response) {
+        for (size_t i = 0; i < c->head.headers_len; i++) {
+            const struct http_header *h = &c->head.headers[i];
+            if (framing(h)) {
+                continue;
+            }
+            fetch_response_add(fs->response, h->name, h->name_len, h->value, h->value_len);
+        }
+        fetch_response_publish(fs->response, fs->status);
+    }
+    // From here on it means the consumer's gone
+    fs->http_done = false;
+    return reactor_watch(task, fs->outfd, EPOLLOUT) == 0;
+}
+
+static bool replay_ready(struct reactor_task *task, int fd, uint32_t events) {
+    (void) fd;
+    (void) events;
+    struct replay *r = (struct replay *) task;
+    struct fetch_state *fs = r->fs;
+    struct cache_entry *c = fs->cache;
+    // A slice per turn, so the shard's other tasks get theirs, and none
+    // while the consumer has high_water of rows to catch up on
+    if (fetch_deliver(fs) < fs->high_water && r->off < c->map_len) {
+        size_t n = MIN(CACHE_REPLAY_SLICE, c->map_len - r->off);
+        fetch_emit(fs, c->map + r->off, n);
+        r->off += n;
+        fetch_deliver(fs);
+    }
+    return !fs->http_done && r->off < c->map_len;
+}
+
+static bool replay_expired(struct reactor_task *task) {
+    (void) task;
+    return true;
+}
+
+static void replay_finish(struct reactor_task *task) {
+    struct replay *r = (struct replay *) task;
+    r->fs->body_done = r->off == r->fs->cache->map_len;
+    reactor_unwatch(task, r->fs->outfd);
+    fetch_end(r->fs);
+    free(r);
+}
+
+bool cache_replay(struct fetch_state *fs) {
+    struct cache_entry *c = fs->cache;
+    if (!c || !c->replay) {
+        return false;
+    }
+    c->replay = false;
+
+    struct replay *r = malloc(sizeof(struct replay));
+    if (!r) {
+        return perror_rc(false, "malloc()", 0);
+    }
+    *r = (struct replay) {
+        .task = {
+            .start = replay_start,
+            .ready = replay_ready,
+            .expired = replay_expired,
+            .finish = replay_finish,
+        },
+        .fs = fs,
+        .off = c->body_off,
+    };
+    if (reactor_submit(&r->task) < 0) {
+        return perror_rc(false, "reactor_submit()", free(r));
+    }
+    return true;
+}
+
+bool cache_revalidated(struct fetch_state *fs) {
+    struct cache_entry *c = fs->cache;
+    if (!c->map) {
+        // Nothing was asked about
+        return false;
+    }
+    if (fs->status != 304) {
+        stat_add(STAT_CACHE_MISS, 1);
+        unmap_entry(c);
+        return false;
+    }
+
+    long long max_age = lifetime(&fs->head);
+    char line[64];
+    int len = snprintf(line, sizeof(line), ENTRY_LINE,
+                       (long long) time(NULL), max_age < 0 ? c->max_age : max_age);
+    int fd = open(c->path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || pwrite(fd, line, len, 0) != len) {
+        // Still good for this once
+        perror("cache: freshening entry");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    c->replay = true;
+    stat_add(STAT_CACHE_REVALIDATED, 1);
+    return true;
+}
+
+void cache_store(struct fetch_state *fs) {
+    struct cache_entry *c = fs->cache;
+    const struct http_head *head = &fs->head;
+    if (fs->status != 200 || varies(head)) {
+        return;
+    }
+    const struct http_header *cc = http_head_get(head, "Cache-Control");
+    if (cc && http_header_has_token(cc, "no-store")) {
+        return;
+    }
+    long long max_age = lifetime(head);
+    if (max_age <= 0 && !http_head_get(head, "ETag") && !http_head_get(head, "Last-Modified")) {
+        // Stale right away, with nothing to ask the server about it with
+        return;
+    }
+
+    // Written next to where it goes, so the rename is atomic
+    struct string tmp = dynamic("%s.XXXXXX", c->path);
+    if (!tmp.hd) {
+        perror("dynamic()");
+        return;
+    }
+    int fd = mkostemp(tmp.hd, O_CLOEXEC);
+    if (fd < 0) {
+        perror("mkostemp()");
+        free(tmp.hd);
+        return;
+    }
+    c->out = fdopen(fd, "w");
+    if (!c->out) {
+        perror("fdopen()");
+        close(fd);
+        unlink(tmp.hd);
+        free(tmp.hd);
+        return;
+    }
+    c->out_path = tmp.hd;
+    fprintf(c->out, ENTRY_LINE, (long long) time(NULL), MAX(max_age, 0));
+    fwrite(fs->header_buf, 1, head->parsed, c->out);
+}
+
+void cache_write(struct fetch_state *fs, const char *data, size_t len) {
+    struct cache_entry *c = fs->cache;
+    if (c->out && fwrite(data, 1, len, c->out) != len) {
+        perror("fwrite()");
+        cache_abandon(fs);
+    }
+}
+
+void cache_abandon(struct fetch_state *fs) {
+    struct cache_entry *c = fs->cache;
+    if (!c || !c->out) {
+        return;
+    }
+    fclose(c->out);
+    c->out = NULL;
+    unlink(c->out_path);
+    free(c->out_path);
+    c->out_path = NULL;
+}
+
+void cache_close(struct fetch_state *fs) {
+    struct cache_entry *c = fs->cache;
+    if (!c) {
+        return;
+    }
+    if (c->out) {
+        bool whole = fs->body_done;
+        if (fclose(c->out) != 0) {
+            perror("fclose()");
+            whole = false;
+        }
+        if (whole && rename(c->out_path, c->path) == 0) {
+            stat_add(STAT_CACHE_STORE, 1);
+        } else {
+            unlink(c->out_path);
+        }
+        free(c->out_path);
+    }
+    if (c->map) {
+        munmap(c->map, c->map_len);
+    }
+    free(c->path);
+    free(c);
+    fs->cache = NULL;
+}
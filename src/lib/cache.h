@@ -0,0 +1,75 @@
+/**
+ * @file cache.h
+ * @brief Responses kept on disk, to skip the network for a URL asked for
+ * again or at least its body.
+ *
+ * An entry is a file in the cache directory named after a hash of the
+ * origin and the request, holding the response head as it came in and the
+ * body after Content-Encoding was undone. Only `200` responses go in, and
+ * only ones that are fresh for a while (`Cache-Control: max-age`) or that
+ * can be asked about again (`ETag`, `Last-Modified`). `no-store` ones, and
+ * ones that `Vary` on anything but `Accept-Encoding`, stay out.
+ *
+ * A fresh entry is all a fetch needs: its body goes through the parser
+ * straight from a mapping of the file, nothing is sent. A stale one gets
+ * the request sent with `If-None-Match` and `If-Modified-Since`, and on a
+ * `304` the cached body goes out just the same, fresh again for as long as
+ * the `304` says. A new `200` replaces the entry once its whole body is in.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct fetch_state;
+
+/** Most bytes of a cached body parsed per turn on the shard. */
+#define CACHE_REPLAY_SLICE (64 << 10)
+
+/**
+ * @brief FS's entry in the cache at DIR, once FS has its request.
+ *
+ * A stale entry has its validators added to FS's request. Either way FS
+ * stores its response there if it can.
+ *
+ * @retval 0 OK, see #cache_replay() for what to do with FS.
+ * @retval -1 DIR isn't usable, FS goes without the cache.
+ */
+int cache_attach(struct fetch_state *fs, const char *dir);
+
+/**
+ * @brief Have FS's body come out of the cache, if it got a fresh entry or
+ * a `304` for one. FS goes to a shard task that ends it once through.
+ *
+ * @retval true FS is the shard's.
+ * @retval false Nothing to replay, or it couldn't go, FS is still the caller's.
+ */
+bool cache_replay(struct fetch_state *fs);
+
+/**
+ * @brief On FS's response head: if it's a `304` for FS's entry, freshen the
+ * entry up and have it replayed once FS ends.
+ *
+ * @return Whether it was, in which case the response to show is the cached one.
+ */
+bool cache_revalidated(struct fetch_state *fs);
+
+/**
+ * @brief On FS's response head: start a new entry with it, if it's one to keep.
+ */
+void cache_store(struct fetch_state *fs);
+
+/**
+ * @brief Append decoded body bytes DATA to FS's new entry, if it's making one.
+ */
+void cache_write(struct fetch_state *fs, const char *data, size_t len);
+
+/**
+ * @brief Drop FS's new entry, its body turned out bad.
+ */
+void cache_abandon(struct fetch_state *fs);
+
+/**
+ * @brief Put FS's new entry in place if its body came in whole, and let go of
+ * FS's entry.
+ */
+void cache_close(struct fetch_state *fs);
@@ -0,0 +1,198 @@
+#include "decode.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+static enum content_encoding encoding_of_token(const char *token, size_t len) {
+    struct { const char *name; enum content_encoding encoding; } names[] = {
+        { "identity", ENCODING_IDENTITY },
+        { "gzip", ENCODING_GZIP },
+        { "x-gzip", ENCODING_GZIP },
+        { "deflate", ENCODING_DEFLATE },
+#ifdef YARTS_ZSTD
+        { "zstd", ENCODING_ZSTD },
+#endif
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == len && strncasecmp(names[i].name, token, len) == 0) {
+            return names[i].encoding;
+        }
+    }
+    return ENCODING_UNSUPPORTED;
+}
+
+enum content_encoding content_encoding_of(const char *value) {
+    enum content_encoding encoding = ENCODING_IDENTITY;
+    const char *p = value;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0' || *p == '\r' || *p == '\n') {
+            return encoding;
+        }
+
+        const char *start = p;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        enum content_encoding next = encoding_of_token(start, p - start);
+        if (next == ENCODING_IDENTITY) {
+            continue;
+        }
+        if (encoding != ENCODING_IDENTITY) {
+            // Stacked encodings, e.g. "gzip, zstd", aren't worth the bother
+            return ENCODING_UNSUPPORTED;
+        }
+        encoding = next;
+    }
+}
+
+const char *decoder_accept_encoding(void) {
+#ifdef YARTS_ZSTD
+    return "zstd, gzip, deflate";
+#else
+    return "gzip, deflate";
+#endif
+}
+
+int decoder_init(struct decoder *dec, enum content_encoding encoding) {
+    memset(dec, 0, sizeof(*dec));
+    dec->encoding = encoding;
+
+    switch (encoding) {
+    case ENCODING_IDENTITY:
+        return 0;
+    case ENCODING_GZIP:
+    case ENCODING_DEFLATE:
+        // 32 on top of the window bits detects the zlib or gzip header
+        return inflateInit2(&dec->z, 15 + 32) == Z_OK ? 0 : -1;
+#ifdef YARTS_ZSTD
+    case ENCODING_ZSTD:
+        dec->zstd = ZSTD_createDStream();
+        if (!dec->zstd) {
+            return -1;
+        }
+        return ZSTD_isError(ZSTD_initDStream(dec->zstd)) ? -1 : 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+static int inflate_feed(struct decoder *dec, const char *bytes, size_t len,
+                        decode_sink sink, void *ctx)
+{
+    char out[DECODE_CHUNK];
+    dec->z.next_in = (Bytef *) bytes;
+    dec->z.avail_in = len;
+
+    for (;;) {
+        dec->z.next_out = (Bytef *) out;
+        dec->z.avail_out = sizeof(out);
+
+        int rc = inflate(&dec->z, Z_NO_FLUSH);
+        if (rc == Z_DATA_ERROR && dec->encoding == ENCODING_DEFLATE && !dec->z_started) {
+            // Plenty of servers send "deflate" as a raw deflate stream
+            // without the zlib wrapper RFC 9110 asks for
+            inflateEnd(&dec->z);
+            if (inflateInit2(&dec->z, -15) != Z_OK) {
+                return -1;
+            }
+            dec->z_started = true;
+            return inflate_feed(dec, bytes, len, sink, ctx);
+        }
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            fprintf(stderr, "inflate(): %s\n", dec->z.msg ? dec->z.msg : "error");
+            return -1;
+        }
+
+        size_t produced = sizeof(out) - dec->z.avail_out;
+        if (produced > 0) {
+            dec->z_started = true;
+            dec->decoded_bytes += produced;
+            sink(ctx, out, produced);
+        }
+
+        if (rc == Z_STREAM_END) {
+            if (dec->encoding == ENCODING_GZIP && dec->z.avail_in > 0) {
+                // Another gzip member follows
+                inflateReset(&dec->z);
+                continue;
+            }
+            dec->done = true;
+            break;
+        }
+        // A full output buffer means inflate may be holding more for us
+        if (dec->z.avail_out > 0 && (dec->z.avail_in == 0 || rc == Z_BUF_ERROR)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+#ifdef YARTS_ZSTD
+static int zstd_feed(struct decoder *dec, const char *bytes, size_t len,
+                     decode_sink sink, void *ctx)
+{
+    char out[DECODE_CHUNK];
+    ZSTD_inBuffer in = { .src = bytes, .size = len, .pos = 0 };
+
+    // Keep going while there's input, or while the last round filled
+    // the output buffer (the decoder may be holding on to more)
+    bool full = true;
+    while (in.pos < in.size || full) {
+        ZSTD_outBuffer output = { .dst = out, .size = sizeof(out), .pos = 0 };
+        size_t rc = ZSTD_decompressStream(dec->zstd, &output, &in);
+        if (ZSTD_isError(rc)) {
+            fprintf(stderr, "ZSTD_decompressStream(): %s\n", ZSTD_getErrorName(rc));
+            return -1;
+        }
+        if (output.pos > 0) {
+            dec->decoded_bytes += output.pos;
+            sink(ctx, out, output.pos);
+        }
+        full = output.pos == output.size;
+    }
+    return 0;
+}
+#endif
+
+int decoder_feed(struct decoder *dec, const char *bytes, size_t len,
+                 decode_sink sink, void *ctx)
+{
+    if (dec->done || len == 0) {
+        return 0;
+    }
+    dec->encoded_bytes += len;
+
+    switch (dec->encoding) {
+    case ENCODING_IDENTITY:
+        dec->decoded_bytes += len;
+        sink(ctx, bytes, len);
+        return 0;
+    case ENCODING_GZIP:
+    case ENCODING_DEFLATE:
+        return inflate_feed(dec, bytes, len, sink, ctx);
+#ifdef YARTS_ZSTD
+    case ENCODING_ZSTD:
+        return zstd_feed(dec, bytes, len, sink, ctx);
+#endif
+    default:
+        return -1;
+    }
+}
+
+void decoder_free(struct decoder *dec) {
+    switch (dec->encoding) {
+    case ENCODING_GZIP:
+    case ENCODING_DEFLATE:
+        inflateEnd(&dec->z);
+        break;
+#ifdef YARTS_ZSTD
+    case ENCODING_ZSTD:
+        ZSTD_freeDStream(dec->zstd);
+        break;
+#endif
+    default:
+        break;
+    }
+    memset(dec, 0, sizeof(*dec));
+}
@@ -0,0 +1,81 @@
+/**
+ * @file decode.h
+ * @brief Streaming HTTP `Content-Encoding` decoders.
+ *
+ * Compressed body bytes go in as they come off the wire, decoded bytes come
+ * out through a callback in bounded pieces, so no body is ever held whole.
+ * gzip and deflate are always there, zstd when built with `ZSTD=1`.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#ifdef YARTS_ZSTD
+#include <zstd.h>
+#endif
+
+enum content_encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_ZSTD,
+    /** Something we can't decode, like `br` or a stack of encodings. */
+    ENCODING_UNSUPPORTED,
+};
+
+/** Largest piece a #decoder hands its sink at once. */
+#define DECODE_CHUNK 16384
+
+/**
+ * @brief Where decoded bytes go.
+ */
+typedef void (*decode_sink)(void *ctx, const char *bytes, size_t len);
+
+struct decoder {
+    enum content_encoding encoding;
+    /** Reached the end of a gzip/deflate stream, anything after it is ignored. */
+    bool done;
+    /** Bytes fed in and handed out so far. */
+    size_t encoded_bytes;
+    size_t decoded_bytes;
+
+    z_stream z;
+    /** Whether inflate produced anything yet, see #decoder_feed(). */
+    bool z_started;
+#ifdef YARTS_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+};
+
+/**
+ * @brief The `Content-Encoding` header VALUE (up to its line end) as an encoding.
+ */
+enum content_encoding content_encoding_of(const char *value);
+
+/**
+ * @brief `Accept-Encoding` header value listing every encoding we decode.
+ */
+const char *decoder_accept_encoding(void);
+
+/**
+ * @brief Set up DEC to decode ENCODING.
+ *
+ * @retval 0 OK
+ * @retval -1 ENCODING isn't supported or the decoder couldn't be allocated.
+ */
+int decoder_init(struct decoder *dec, enum content_encoding encoding);
+
+/**
+ * @brief Decode LEN BYTES into SINK, at most #DECODE_CHUNK bytes per call.
+ *
+ * @retval 0 OK. Check #decoder.done to learn whether the stream ended.
+ * @retval -1 The bytes are corrupt, DEC can't go on.
+ */
+int decoder_feed(struct decoder *dec, const char *bytes, size_t len,
+                 decode_sink sink, void *ctx);
+
+/**
+ * @brief Free whatever DEC allocated. A zeroed DEC is fine too.
+ */
+void decoder_free(struct decoder *dec);
@@ -0,0 +1,303 @@
+#include "dns.h"
+#include "cfns.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define DEFAULT_POSITIVE_TTL_MS 60000
+#define DEFAULT_NEGATIVE_TTL_MS 5000
+/* How long past its TTL a good answer may still be served while it's refreshed */
+#define STALE_GRACE_MS 300000
+/* How long a caller waits on a host we've never resolved */
+#define RESOLVE_TIMEOUT_MS 10000
+#define RESOLVER_THREADS 2
+/* Past this many hosts, expired entries get dropped */
+#define MAX_ENTRIES 1024
+
+struct entry {
+    char *hostname;
+    char *port;
+
+    /* Answer, valid once `answered` */
+    bool answered;
+    int rc;
+    struct addrinfo *addr;
+    long long expires_ms;
+
+    /* Queued for (or being worked on by) a resolver thread */
+    bool resolving;
+
+    struct entry *next;
+    struct entry *next_queued;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signals resolver threads that the queue is nonempty */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+/* Broadcast whenever any entry gets an answer */
+static pthread_cond_t answered = PTHREAD_COND_INITIALIZER;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+
+static struct entry *entries = NULL;
+static size_t entries_len = 0;
+static struct entry *queue_head = NULL;
+static struct entry *queue_tail = NULL;
+
+static long positive_ttl_ms = DEFAULT_POSITIVE_TTL_MS;
+static long negative_ttl_ms = DEFAULT_NEGATIVE_TTL_MS;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void dns_freeaddrinfo(struct addrinfo *addr) {
+    while (addr) {
+        struct addrinfo *next = addr->ai_next;
+        free(addr);
+        addr = next;
+    }
+}
+
+// Copy the list at AI with each node and its sockaddr in a single block.
+static struct addrinfo *addrinfo_dup(const struct addrinfo *ai) {
+    struct addrinfo *head = NULL;
+    struct addrinfo **tail = &head;
+    for (; ai; ai = ai->ai_next) {
+        struct addrinfo *copy = malloc(sizeof(struct addrinfo) + ai->ai_addrlen);
+        if (!copy) {
+            dns_freeaddrinfo(head);
+            return NULL;
+        }
+        *copy = *ai;
+        copy->ai_addr = (struct sockaddr *) (copy + 1);
+        memcpy(copy->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        copy->ai_canonname = NULL;
+        copy->ai_next = NULL;
+
+        *tail = copy;
+        tail = &copy->ai_next;
+    }
+    return head;
+}
+
+static void free_entry(struct entry *e) {
+    dns_freeaddrinfo(e->addr);
+    free(e->hostname);
+    free(e->port);
+    free(e);
+}
+
+static void *resolver(void *arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!queue_head) {
+            pthread_cond_wait(&work, &lock);
+        }
+        struct entry *e = queue_head;
+        queue_head = e->next_queued;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        e->next_queued = NULL;
+        pthread_mutex_unlock(&lock);
+
+        // Entries are only freed when they aren't resolving,
+        // so E stays ours while the lock is down.
+        struct addrinfo *found = NULL;
+        int rc = tcp_getaddrinfo(e->hostname, e->port, &found);
+        struct addrinfo *copy = rc == 0 ? addrinfo_dup(found) : NULL;
+        if (found) {
+            freeaddrinfo(found);
+        }
+        if (rc == 0 && !copy) {
+            rc = EAI_MEMORY;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (rc == 0 || !e->answered || e->rc != 0) {
+            dns_freeaddrinfo(e->addr);
+            e->addr = copy;
+            e->rc = rc;
+            e->expires_ms = now_ms() + (rc == 0 ? positive_ttl_ms : negative_ttl_ms);
+        }
+        // else keep serving the stale good answer over a failed refresh
+        e->answered = true;
+        e->resolving = false;
+        pthread_cond_broadcast(&answered);
+        pthread_mutex_unlock(&lock);
+
+        if (rc != 0) {
+            stat_add(STAT_DNS_FAIL, 1);
+        }
+    }
+    return NULL;
+}
+
+static void start_resolvers(void) {
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, resolver, NULL) == 0) {
+            pthread_detach(tid);
+        }
+    }
+}
+
+// Queue E for a resolver thread unless it's already queued. Holds lock.
+static void enqueue(struct entry *e) {
+    if (e->resolving) {
+        return;
+    }
+    e->resolving = true;
+    if (queue_tail) {
+        queue_tail->next_queued = e;
+    } else {
+        queue_head = e;
+    }
+    queue_tail = e;
+    pthread_cond_signal(&work);
+}
+
+// Drop expired entries nobody is resolving. Holds lock.
+static void prune(long long now) {
+    struct entry **link = &entries;
+    while (*link) {
+        struct entry *e = *link;
+        if (!e->resolving && e->answered && now > e->expires_ms + STALE_GRACE_MS) {
+            *link = e->next;
+            entries_len--;
+            free_entry(e);
+            continue;
+        }
+        link = &e->next;
+    }
+}
+
+// Entry for HOSTNAME:PORT, created unanswered if missing. Holds lock.
+static struct entry *find_entry(const char *hostname, const char *port, long long now) {
+    for (struct entry *e = entries; e; e = e->next) {
+        if (strcmp(e->hostname, hostname) == 0 && strcmp(e->port, port) == 0) {
+            return e;
+        }
+    }
+
+    if (entries_len >= MAX_ENTRIES) {
+        prune(now);
+    }
+    struct entry *e = calloc(1, sizeof(struct entry));
+    if (!e) {
+        return NULL;
+    }
+    e->hostname = strdup(hostname);
+    e->port = strdup(port);
+    if (!e->hostname || !e->port) {
+        free_entry(e);
+        return NULL;
+    }
+    e->next = entries;
+    entries = e;
+    entries_len++;
+    return e;
+}
+
+// Serve E's answer into ADDR. Holds lock.
+static int answer(struct entry *e, struct addrinfo **addr) {
+    if (e->rc != 0) {
+        return e->rc;
+    }
+    *addr = addrinfo_dup(e->addr);
+    return *addr ? 0 : EAI_MEMORY;
+}
+
+// The one address of the Unix domain socket at PATH, nothing to look up.
+static int unix_addrinfo(const char *path, struct addrinfo **addr) {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    if (len >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "dns_resolve(%s): socket path too long\n", path);
+        return EAI_NONAME;
+    }
+    memcpy(sun.sun_path, path, len + 1);
+    struct addrinfo ai = {
+        .ai_family = AF_UNIX,
+        .ai_socktype = SOCK_STREAM,
+        .ai_addr = (struct sockaddr *) &sun,
+        .ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1,
+    };
+    *addr = addrinfo_dup(&ai);
+    return *addr ? 0 : EAI_MEMORY;
+}
+
+int dns_resolve(const char *hostname, const char *port, struct addrinfo **addr) {
+    if (!hostname || !port || !addr) {
+        fprintf(stderr, "HOSTNAME, PORT, or ADDR is NULL\n");
+        return EINVAL;
+    }
+    if (hostname[0] == '/') {
+        return unix_addrinfo(hostname, addr);
+    }
+    pthread_once(&threads_once, start_resolvers);
+
+    pthread_mutex_lock(&lock);
+    long long now = now_ms();
+    struct entry *e = find_entry(hostname, port, now);
+    if (!e) {
+        pthread_mutex_unlock(&lock);
+        return EAI_MEMORY;
+    }
+
+    if (e->answered && now < e->expires_ms) {
+        int rc = answer(e, addr);
+        pthread_mutex_unlock(&lock);
+        stat_add(STAT_DNS_HIT, 1);
+        return rc;
+    }
+
+    if (e->answered && e->rc == 0 && now < e->expires_ms + STALE_GRACE_MS) {
+        enqueue(e);
+        int rc = answer(e, addr);
+        pthread_mutex_unlock(&lock);
+        stat_add(STAT_DNS_STALE, 1);
+        return rc;
+    }
+
+    stat_add(STAT_DNS_MISS, 1);
+    enqueue(e);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RESOLVE_TIMEOUT_MS / 1000;
+    while (e->resolving) {
+        if (pthread_cond_timedwait(&answered, &lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&lock);
+            fprintf(stderr, "dns_resolve(hostname=%s, port=%s): timed out\n", hostname, port);
+            return EAI_AGAIN;
+        }
+    }
+
+    int rc = answer(e, addr);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+void dns_configure(long positive_ms, long negative_ms) {
+    pthread_mutex_lock(&lock);
+    if (positive_ms > 0) {
+        positive_ttl_ms = positive_ms;
+    }
+    if (negative_ms > 0) {
+        negative_ttl_ms = negative_ms;
+    }
+    pthread_mutex_unlock(&lock);
+}
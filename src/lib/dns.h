@@ -0,0 +1,40 @@
+/**
+ * @file dns.h
+ * @brief Caching name resolver that runs off the calling thread.
+ *
+ * Lookups are keyed by `hostname:port`. Answers are kept for a positive TTL
+ * and failures for a (shorter) negative TTL. Once a positive answer expires
+ * it is still served for a grace period while a resolver thread refreshes it
+ * in the background, so a host we've already seen never blocks the caller.
+ *
+ * \c getaddrinfo() doesn't tell us the record TTLs, so the TTLs here are
+ * fixed caps, see #dns_configure().
+ */
+#pragma once
+#include <netdb.h>
+
+/**
+ * @brief Resolve HOSTNAME and PORT into a private copy of the address list at ADDR.
+ *
+ * Only hosts missing from the cache (or whose negative answer expired)
+ * make the caller wait for a resolver thread. A HOSTNAME that's an absolute
+ * path is a Unix domain socket, whose one address comes back right away.
+ *
+ * @retval 0 OK. Free ADDR with #dns_freeaddrinfo(), *not* \c freeaddrinfo().
+ * @retval 22 EINVAL. At least one of HOSTNAME or PORT or ADDR is NULL.
+ * @retval ANYTHING_ELSE Error. The (possibly cached) \c getaddrinfo() error code.
+ */
+int dns_resolve(const char *hostname, const char *port, struct addrinfo **addr);
+
+/**
+ * @brief Free an address list returned by #dns_resolve().
+ */
+void dns_freeaddrinfo(struct addrinfo *addr);
+
+/**
+ * @brief Set how long answers (POSITIVE_TTL_MS) and failures (NEGATIVE_TTL_MS)
+ * are served from the cache.
+ *
+ * Zero leaves the corresponding setting unchanged.
+ */
+void dns_configure(long positive_ttl_ms, long negative_ttl_ms);
@@ -1,13 +1,20 @@
 #define _GNU_SOURCE
 
 #include "tcp.h"
+#include "bhop.h"
+#include "dns.h"
 #include "fetch.h"
+#include "pool.h"
+#include "reactor.h"
+#include "retry.h"
+#include "stats.h"
 
 #include <netdb.h>
 #include <openssl/types.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <pthread.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -24,6 +31,7 @@ void url_free(struct url *url) {
     if (url->protocol.hd) free(url->protocol.hd);
     if (url->hostname.hd) free(url->hostname.hd);
     if (url->pathname.hd) free(url->pathname.hd);
+    if (url->search.hd) free(url->search.hd);
     if (url->port.hd) free(url->port.hd);
 }
 
@@ -31,40 +39,99 @@ void dispatch_free(struct dispatch *dispatch) {
     // CALLER frees sockfd
     if (!dispatch) return;
     url_free(&dispatch->url);
-
-    if (dispatch->addrinfo) {
-        freeaddrinfo(dispatch->addrinfo);
-        dispatch->addrinfo = NULL;
-    }
+    free(dispatch->origin);
+    free(dispatch->request.hd);
+    dns_freeaddrinfo(dispatch->addrinfo);
     free(dispatch);
-    // if (dispatch->ssl || dispatch->ctx) {
-    //     tls_free(dispatch->ssl, dispatch->ctx);
-    // }
 }
 
 static struct url *url_of_string(const char *url);
-struct dispatch *fetch_socket(const char *url, const char *init[4]) {
+
+// The socket path of http+unix URL, whose host is the path percent-encoded,
+// with what URL asks for over it as an http URL in *TARGET.
+static char *unix_socket_of(const char *url, struct string *target) {
+    const char *authority = url + strlen(HTTP_UNIX);
+    size_t len = strcspn(authority, "/?#");
+    char *escaped = curl_easy_unescape(NULL, authority, len, NULL);
+    if (!escaped) {
+        return perror_rc(NULL, "curl_easy_unescape()", 0);
+    }
+    char *path = strdup(escaped);
+    curl_free(escaped);
+    if (!path) {
+        return perror_rc(NULL, "strdup()", 0);
+    }
+    *target = dynamic("http://localhost%s", authority + len);
+    if (!target->hd) {
+        return perror_rc(NULL, "dynamic()", free(path));
+    }
+    return path;
+}
+
+struct dispatch *fetch_socket(const char *url, const char *init[4], const char *unix_socket) {
     struct dispatch *disp = calloc(1, sizeof(struct dispatch));
     if (!disp) {
         return perror_rc(NULL, "calloc()", 0);
     }
+    disp->sockfd = -1;
 
-    struct url *URL = url_of_string(url);
-    if (!URL) {
-        return perror_rc(NULL, "url_of_string()", free(disp));
+    struct string target = {0};
+    char *path = NULL;
+    if (strncmp(url, HTTP_UNIX, strlen(HTTP_UNIX)) == 0) {
+        if (!(path = unix_socket_of(url, &target))) {
+            return perror_rc(NULL, "unix_socket_of()", free(disp));
+        }
+        url = target.hd;
+    } else if (unix_socket && !(path = strdup(unix_socket))) {
+        return perror_rc(NULL, "strdup()", free(disp));
     }
-    disp->url = *URL;
-    if (tcp_getaddrinfo(disp->url.hostname.hd, disp->url.port.hd, &disp->addrinfo)) {
-        return perror_rc(NULL, "tcp_getaddrinfo()", dispatch_free(disp));
+    if (path && path[0] != '/') {
+        fprintf(stderr, "fetch: socket path %s isn't absolute\n", path);
+        free(path);
+        free(target.hd);
+        free(disp);
+        errno = EINVAL;
+        return NULL;
     }
 
-    disp->sockfd = tcp_socket(disp->addrinfo);
-    if (disp->sockfd < 0) {
-        return perror_rc(NULL, "tcp_socket()", dispatch_free(disp));
+    struct url *URL = url_of_string(url);
+    free(target.hd);
+    if (!URL) {
+        return perror_rc(NULL, "url_of_string()", free(path), free(disp));
     }
+    disp->url = *URL;
     // just free the head, we need to keep the values alive
     // in dispatch
     free(URL);
+
+    if (path) {
+        // Plain HTTP to whatever listens at the path, which is what
+        // dns_resolve() takes for a host. The Host header stays the URL's.
+        free(disp->url.hostname.hd);
+        free(disp->url.protocol.hd);
+        disp->url.hostname = (struct string) { .hd = path, .length = strlen(path) };
+        disp->url.protocol = dynamic("http:");
+        disp->origin = dynamic("%s%s", HTTP_UNIX, path).hd;
+    } else {
+        disp->origin = dynamic("%s//%s:%s",
+            disp->url.protocol.hd, disp->url.hostname.hd, disp->url.port.hd).hd;
+    }
+    if (!disp->origin || !disp->url.protocol.hd) {
+        return perror_rc(NULL, "dynamic()", dispatch_free(disp));
+    }
+
+    struct pooled idle = {0};
+    if (pool_acquire(disp->origin, &idle)) {
+        disp->sockfd = idle.fd;
+        disp->ssl = idle.ssl;
+        disp->reused = true;
+        return disp;
+    }
+
+    // Connecting happens on a reactor shard, which mustn't block on DNS
+    if (dns_resolve(disp->url.hostname.hd, disp->url.port.hd, &disp->addrinfo)) {
+        return perror_rc(NULL, "dns_resolve()", dispatch_free(disp));
+    }
     return disp;
 }
 
@@ -72,145 +139,664 @@ static int set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0;
 }
-int use_fetch(int fds[4], struct dispatch *dispatch) {
-    // if (connect(dispatch->sockfd, dispatch->addrinfo->ai_addr, dispatch->addrinfo->ai_addrlen) < 0) {
-    //     return perror_rc(-1, "connect()", close(dispatch->sockfd), dispatch_free(dispatch));
-    // }
-    // if (is_tls) {
-    //     if (tls_connect(&dispatch->ssl, dispatch->sockfd, &dispatch->ctx, str(dispatch->url.hostname))) {
-    //         return perror_rc(-1, "tls_connect()", close(dispatch->sockfd), dispatch_free(dispatch));
-    //     } // else { ok! }
-    // }
-    bool is_tls = strncmp(dispatch->url.protocol.hd, "https:", 6) == 0;
-    SSL **ssl = is_tls ? &dispatch->ssl : NULL;
-    SSL_CTX **ctx = is_tls ? &dispatch->ctx : NULL;
-    const char *hostname = is_tls ? dispatch->url.hostname.hd : NULL;
-    if (ttcp_connect(
-        dispatch->sockfd, dispatch->addrinfo->ai_addr, dispatch->addrinfo->ai_addrlen,
-        ssl, ctx, hostname) < 0) {
-        return perror_rc(-1, "ttcp_connect()",
-            close(dispatch->sockfd),
-            dispatch_free(dispatch)
-        );
-    }
-
-    // make recv() nonblocking
-    if (set_nonblocking(dispatch->sockfd) < 0) {
-        return perror_rc(-1, "set_nonblocking()", close(dispatch->sockfd), dispatch_free(dispatch));
-    }
-    struct string GET = dynamic(
+
+struct string fetch_request(const char *path, const char *host,
+                            const char *accept_encoding, const char *extra)
+{
+    return dynamic(
         "GET %s HTTP/1.1\r\n"
         "Host: %s\r\n"
         "User-Agent: yarts/1.0\r\n"
         "Accept: */*\r\n"
-        "Connection: close\r\n"
+        "Accept-Encoding: %s\r\n"
+        "Connection: keep-alive\r\n"
+        "%s"
         "\r\n",
-        dispatch->url.pathname.hd,
-        dispatch->url.host.hd
+        path,
+        host,
+        accept_encoding,
+        extra
     );
-    if (!GET.hd) {
-        return perror_rc(-1, "prefix()", close(dispatch->sockfd), dispatch_free(dispatch));
-    }
+}
 
-    if (ttcp_send(dispatch->sockfd, GET.hd, GET.length, is_tls ? *ssl : NULL) < 0) {
-        return perror_rc(-1, "ttcp_send()", GET.hd, close(dispatch->sockfd), dispatch_free(dispatch));
+int use_fetch(int fds[3], struct dispatch *dispatch) {
+    struct string target = dynamic("%s%s", dispatch->url.pathname.hd, dispatch->url.search.hd);
+    if (!target.hd) {
+        return perror_rc(-1, "dynamic()", 0);
+    }
+    dispatch->request = fetch_request(target.hd, dispatch->url.host.hd,
+                                      decoder_accept_encoding(), "");
+    free(target.hd);
+    if (!dispatch->request.hd) {
+        return perror_rc(-1, "dynamic()", 0);
     }
-
-    // if (send_maybe_tls(dispatch->ssl, dispatch->sockfd, str(GET), len(GET)) < 0) {
-    //     if (errno != EAGAIN) {
-    //         return perror_rc(-1, "send_maybe_tls()", free(GET), close(dispatch->sockfd), dispatch_free(dispatch));
-    //     }
-    //     // TODO?
-    // }
-    free(GET.hd);
 
     int sv[2] = {0};
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
-        return perror_rc(-1, "socketpair()", close(dispatch->sockfd), dispatch_free(dispatch));
+        return perror_rc(-1, "socketpair()", 0);
     }
     int appfd = sv[0];
     int fetchfd = sv[1];
     if (set_nonblocking(fetchfd)) {
-        return perror_rc(-1, "set_nonblocking()", close(appfd), close(fetchfd), close(dispatch->sockfd), dispatch_free(dispatch));
-
-    }
-
-    int pollfd = epoll_create1(0);
-    if (pollfd < 0) {
-        return perror_rc(-1, "epoll_create1()", close(appfd), close(fetchfd), close(dispatch->sockfd), dispatch_free(dispatch));
-    }
-    struct epoll_event ev = { .events=EPOLLIN, .data.fd=dispatch->sockfd };
-    if (epoll_ctl(pollfd, EPOLL_CTL_ADD, dispatch->sockfd, &ev)) {
-        return perror_rc(-1, "epoll_create1()", close(pollfd), close(appfd), close(fetchfd), close(dispatch->sockfd), dispatch_free(dispatch));
+        return perror_rc(-1, "set_nonblocking()", close(appfd), close(fetchfd));
     }
 
     fds[0] = dispatch->sockfd;
     fds[1] = appfd;
     fds[2] = fetchfd;
-    fds[3] = pollfd;
     return 0;
 }
 
+// Free COPY, which never got its parser.
+static void clone_free(struct fetch_state *copy) {
+    if (copy->netfd >= 0) {
+        ttcp_tls_free(copy->ssl);
+        close(copy->netfd);
+    }
+    dns_freeaddrinfo(copy->addrinfo);
+    free(copy->request);
+    free(copy->hostname);
+    free(copy->port);
+    free(copy->origin);
+    free(copy->authority);
+    free(copy->path);
+    free(copy);
+}
+
+struct fetch_state *fetch_clone(const struct fetch_state *fs, struct string request) {
+    struct fetch_state *copy = calloc(1, sizeof(struct fetch_state));
+    if (!copy) {
+        return perror_rc(NULL, "calloc()", free(request.hd));
+    }
+    copy->netfd = -1;
+    copy->outfd = -1;
+    copy->closed_outfd = true;
+    copy->request = request.hd;
+    copy->request_len = request.length;
+    copy->hostname = strdup(fs->hostname);
+    copy->port = strdup(fs->port);
+    copy->origin = strdup(fs->origin);
+    copy->authority = strdup(fs->authority);
+    copy->path = strdup(fs->path);
+    copy->is_tls = fs->is_tls;
+    copy->connect_timeout_ms = fs->connect_timeout_ms;
+    copy->high_water = fs->high_water;
+    copy->raw = fs->raw;
+    if (!copy->request || !copy->hostname || !copy->port || !copy->origin
+        || !copy->authority || !copy->path) {
+        return perror_rc(NULL, "strdup()", clone_free(copy));
+    }
+
+    // FS just resolved the host, so the cache has it
+    struct pooled idle = {0};
+    if (pool_acquire(copy->origin, &idle)) {
+        copy->netfd = idle.fd;
+        copy->ssl = idle.ssl;
+    } else if (dns_resolve(copy->hostname, copy->port, &copy->addrinfo) != 0) {
+        return perror_rc(NULL, "dns_resolve()", clone_free(copy));
+    }
+
+    if (bhop_open(copy->bass) < 0) {
+        return perror_rc(NULL, "bhop_open()", clone_free(copy));
+    }
+    return copy;
+}
+
 static bool handle_http_headers(struct fetch_state *st);
-static void handle_http_body_bytes(struct fetch_state *st,
-                                   const char *data,
-                                   size_t len);
+static size_t handle_http_body_bytes(struct fetch_state *st,
+                                     const char *data,
+                                     size_t len);
 static void handle_http_body(struct fetch_state *st);
+static void splice_start(struct fetch_state *st);
+static void splice_body(struct fetch_state *st);
+static void splice_stop(struct fetch_state *st);
 
-static bool flush_pending(struct fetch_state *st);
 static void flush_bassoon(struct fetch_state *st);
+static void raw_rows(struct fetch_state *st, const char *data, size_t len);
+static ssize_t send_rows(struct fetch_state *st, const char *data, size_t len);
+static bool hold_rows(struct fetch_state *st, const char *data, size_t len);
+static void consumer_gone(struct fetch_state *st);
+static void pause_net(struct fetch_state *fs);
+static void resume_net(struct fetch_state *fs);
+static bool fetch_start(struct reactor_task *task);
+
+// Try FS again later, over a new connection, if it may: nothing of the
+// response reached the consumer and it has retries left. HEAD is the
+// response that asked for it, if any.
+static bool retry(struct fetch_state *fs, const struct http_head *head) {
+    // Pipelined requests go again with their pipeline instead
+    if (fs->task.start != fetch_start || fs->attempt >= fs->retries) {
+        return false;
+    }
+    long delay_ms = retry_delay_ms(fs->attempt, head);
+    if (delay_ms < 0) {
+        return false;
+    }
+
+    if (fs->phase == FETCH_CONNECTING) {
+        tcp_race_abort(&fs->race);
+    }
+    if (fs->net_events) {
+        reactor_unwatch(&fs->task, fs->netfd);
+        fs->net_events = 0;
+    }
+    if (fs->netfd >= 0) {
+        ttcp_tls_free(fs->ssl);
+        close(fs->netfd);
+    }
+    fs->netfd = -1;
+    fs->ssl = NULL;
+    fs->request_off = 0;
+    fs->headers_done = false;
+    fs->header_len = 0;
+    memset(&fs->head, 0, sizeof(fs->head));
+    fs->status = 0;
+    fs->sent_ms = 0;
+    fs->hedge_ms = 0;
+
+    fs->attempt++;
+    fs->retry_ms = reactor_now_ms() + delay_ms;
+    fs->phase = FETCH_BACKOFF;
+    stat_add(STAT_RETRY, 1);
+    return true;
+}
 
-void *fetcher(void *arg) {
-    struct fetch_state *fs = arg;
-    struct epoll_event events[4];
+// FS failed before any of the response came in.
+static void fail(struct fetch_state *fs) {
+    if (!retry(fs, NULL)) {
+        fs->http_done = true;
+    }
+}
 
-    /* ---------------------------
-       1. MAIN: Read HTTP response
-       --------------------------- */
-    while (!fs->http_done) {
-        int n = epoll_wait(fs->ep, events, 4, -1);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            break;
+// Have epoll wake us once netfd is ready for EVENTS, or not at all for 0.
+static void watch_net(struct fetch_state *fs, uint32_t events) {
+    if (fs->net_events == events) {
+        return;
+    }
+    if (events == 0) {
+        reactor_unwatch(&fs->task, fs->netfd);
+        fs->net_events = 0;
+        return;
+    }
+    if (reactor_watch(&fs->task, fs->netfd, events) < 0) {
+        perror("reactor_watch()");
+        fs->http_done = true;
+        return;
+    }
+    fs->net_events = events;
+}
+
+// Have epoll wake us once outfd is ready for EVENTS, and whenever the
+// consumer hangs up. That's how a cursor closing early reaches the
+// fetch, which then stops right away rather than at its next read.
+static bool watch_out(struct fetch_state *fs, uint32_t events) {
+    events |= EPOLLRDHUP;
+    if (fs->closed_outfd || fs->out_events == events) {
+        return true;
+    }
+    if (reactor_watch(&fs->task, fs->outfd, events) < 0) {
+        return perror_rc(false, "reactor_watch()", 0);
+    }
+    fs->out_events = events;
+    return true;
+}
+
+// Park netfd until it's ready for what ttcp result WANT asks for.
+static void wait_net(struct fetch_state *fs, ssize_t want) {
+    watch_net(fs, want == TTCP_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+}
+
+// Write out as much of the request as netfd takes right now.
+static void send_request(struct fetch_state *fs) {
+    while (fs->request_off < fs->request_len) {
+        ssize_t n = ttcp_send(fs->netfd, fs->request + fs->request_off,
+                              fs->request_len - fs->request_off, fs->ssl);
+        if (n > 0) {
+            fs->request_off += n;
+        } else if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            wait_net(fs, n);
+            return;
+        } else {
+            perror("ttcp_send()");
+            fail(fs);
+            return;
         }
+    }
+    fs->phase = FETCH_RECEIVING;
+    fs->sent_ms = reactor_now_ms();
+    // A copy would have no cached body to make sense of a 304 with
+    if (fs->hedge_percentile > 0 && !fs->hedge && !fs->cache) {
+        long ttfb = ttfb_percentile(fs->origin, fs->hedge_percentile);
+        fs->hedge_ms = ttfb < 0 ? 0 : fs->sent_ms + MAX(ttfb, HEDGE_MIN_MS);
+    }
+    watch_net(fs, EPOLLIN);
+}
 
-        for (int i = 0; i < n; i++) {
-            int fd = events[i].data.fd;
-            uint32_t ev = events[i].events;
+static void tls_handshake(struct fetch_state *fs) {
+    int rc = ttcp_tls_handshake(fs->netfd, &fs->ssl, fs->hostname, fs->port, NULL);
+    if (rc == TTCP_WANT_READ || rc == TTCP_WANT_WRITE) {
+        wait_net(fs, rc);
+        return;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "ttcp_tls_handshake(%s:%s) failed\n", fs->hostname, fs->port);
+        fail(fs);
+        return;
+    }
+    fs->phase = FETCH_SENDING;
+    send_request(fs);
+}
 
-            /* New data from the network */
-            if (fd == fs->netfd && (ev & EPOLLIN)) {
-                if (!fs->headers_done)
-                    handle_http_headers(fs);
-                else
-                    handle_http_body(fs);
-            }
+// Connected on FD, now do the TLS handshake (unless pooled) and send the request.
+static void on_connected(struct fetch_state *fs, int fd) {
+    fs->netfd = fd;
+    if (fs->is_tls && !fs->ssl) {
+        fs->phase = FETCH_HANDSHAKING;
+        tls_handshake(fs);
+    } else {
+        fs->phase = FETCH_SENDING;
+        send_request(fs);
+    }
+}
+
+// Outcome RC of a #tcp_race call.
+static void on_race(struct fetch_state *fs, int rc) {
+    if (rc >= 0) {
+        on_connected(fs, rc);
+    } else if (rc == -2) {
+        fprintf(stderr, "connect(%s:%s): %s\n", fs->hostname, fs->port, strerror(errno));
+        fail(fs);
+    }
+}
+
+// Keep the shard's timer on whatever FS waits for next, and tell the
+// shard whether FS is done.
+static bool settle(struct fetch_state *fs) {
+    long long deadline_ms = 0;
+    if (fs->http_done) {
+        deadline_ms = 0;
+    } else if (fs->phase == FETCH_CONNECTING) {
+        deadline_ms = reactor_now_ms() + tcp_race_timeout(&fs->race);
+    } else if (fs->phase == FETCH_BACKOFF) {
+        deadline_ms = fs->retry_ms;
+    } else if (fs->phase == FETCH_RECEIVING) {
+        deadline_ms = fs->hedge_ms;
+    }
+    fs->task.deadline_ms = deadline_ms;
+    return !fs->http_done;
+}
+
+static bool fetch_start(struct reactor_task *task) {
+    struct fetch_state *fs = (struct fetch_state *) task;
+    if (fs->hedge && reactor_watch(task, hedge_fd(fs->hedge, fs->hedge_side), EPOLLIN) < 0) {
+        perror("reactor_watch()");
+        fs->http_done = true;
+        return false;
+    }
+    // From here on, the consumer hanging up cancels the fetch
+    watch_out(fs, 0);
+    if (fs->netfd < 0) {
+        fs->phase = FETCH_CONNECTING;
+        on_race(fs, tcp_race_start(&fs->race, fs->addrinfo, task, fs->connect_timeout_ms));
+    } else {
+        // Pooled connections come connected (and TLS'd)
+        on_connected(fs, fs->netfd);
+    }
+    return settle(fs);
+}
+
+void fetch_park(struct fetch_state *fs) {
+    if (fs->netfd < 0) {
+        return;
+    }
+    // fetch_socket() doesn't resolve the host when the pool has a connection
+    if (!fs->addrinfo && dns_resolve(fs->hostname, fs->port, &fs->addrinfo) != 0) {
+        fprintf(stderr, "fetch: can't resolve %s, waiting with its connection\n", fs->hostname);
+        return;
+    }
+    pool_release(fs->origin, (struct pooled) { .fd = fs->netfd, .ssl = fs->ssl });
+    fs->netfd = -1;
+    fs->ssl = NULL;
+}
+
+void fetch_unpark(struct fetch_state *fs) {
+    struct pooled idle = {0};
+    if (fs->netfd < 0 && pool_acquire(fs->origin, &idle)) {
+        fs->netfd = idle.fd;
+        fs->ssl = idle.ssl;
+    }
+}
+
+// A retry's wait is over, go again on a connection from the pool or a new one.
+static void restart(struct fetch_state *fs) {
+    struct pooled idle = {0};
+    if (pool_acquire(fs->origin, &idle)) {
+        fs->netfd = idle.fd;
+        fs->ssl = idle.ssl;
+    } else if (!fs->addrinfo && dns_resolve(fs->hostname, fs->port, &fs->addrinfo) != 0) {
+        // The first attempt had a pooled connection, so nothing was resolved
+        fprintf(stderr, "fetch: can't resolve %s again\n", fs->hostname);
+        fs->http_done = true;
+        return;
+    }
+    fetch_start(&fs->task);
+}
+
+// FS's first byte is late, so race a copy of it on another connection.
+// The consumer goes to whichever copy gets its head in first.
+static void hedge_start(struct fetch_state *fs) {
+    struct fetch_state *twin = fetch_clone(fs, dynamic("%.*s", (int) fs->request_len, fs->request));
+    if (!twin) {
+        return;
+    }
+    // Another connection to an origin that's at its cap only adds to the queue
+    if (!admit_try(twin)) {
+        fetch_end(twin);
+        return;
+    }
+    struct hedge *h = hedge_new(fs->outfd, fs->response);
+    if (!h) {
+        admit_release(twin);
+        fetch_end(twin);
+        return;
+    }
+    // The consumer is the hedge's until one of the copies claims it
+    if (fs->out_events) {
+        reactor_unwatch(&fs->task, fs->outfd);
+        fs->out_events = 0;
+    }
+    fs->hedge = h;
+    fs->hedge_side = 0;
+    fs->outfd = -1;
+    fs->closed_outfd = true;
+    fs->response = NULL;
+    if (reactor_watch(&fs->task, hedge_fd(h, 0), EPOLLIN) < 0) {
+        // Still fine, just not cancelled until it reads something
+        perror("reactor_watch()");
+    }
+
+    twin->ranges = fs->ranges;
+    twin->hedge = h;
+    twin->hedge_side = 1;
+    if (fetch_submit(twin) < 0) {
+        perror("fetch_submit()");
+        hedge_release(h);
+        twin->hedge = NULL;
+        admit_release(twin);
+        fetch_end(twin);
+        return;
+    }
+    stat_add(STAT_HEDGE, 1);
+}
+
+static bool fetch_ready(struct reactor_task *task, int fd, uint32_t ev) {
+    struct fetch_state *fs = (struct fetch_state *) task;
+
+    /* The other copy of a hedged request won */
+    if (fs->hedge && fd == hedge_fd(fs->hedge, fs->hedge_side)) {
+        fs->http_done = true;
+        return settle(fs);
+    }
+
+    /* A connection attempt finished, one way or another */
+    if (fs->phase == FETCH_CONNECTING) {
+        if (tcp_race_owns(&fs->race, fd)) {
+            on_race(fs, tcp_race_ready(&fs->race, fd, ev));
+        }
+        return settle(fs);
+    }
+
+    /* The consumer hung up, or caught up on rows, maybe enough to read on */
+    if (fd == fs->outfd) {
+        if (ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            consumer_gone(fs);
+        } else if (fs->paused) {
+            resume_net(fs);
         }
+        return settle(fs);
+    }
+
+    if (fd != fs->netfd) {
+        return settle(fs);
+    }
+    switch (fs->phase) {
+    case FETCH_HANDSHAKING:
+        tls_handshake(fs);
+        break;
+    case FETCH_SENDING:
+        send_request(fs);
+        break;
+    default:
+        /* New data from the network */
+        if (!fs->headers_done)
+            handle_http_headers(fs);
+        else
+            handle_http_body(fs);
+    }
+    return settle(fs);
+}
+
+static bool fetch_expired(struct reactor_task *task) {
+    struct fetch_state *fs = (struct fetch_state *) task;
+    if (fs->phase == FETCH_CONNECTING) {
+        on_race(fs, tcp_race_tick(&fs->race));
+    } else if (fs->phase == FETCH_BACKOFF) {
+        restart(fs);
+    } else if (fs->phase == FETCH_RECEIVING && fs->hedge_ms > 0) {
+        fs->hedge_ms = 0;
+        hedge_start(fs);
+    }
+    return settle(fs);
+}
+
+static void fetch_finish(struct reactor_task *task) {
+    struct fetch_state *fs = (struct fetch_state *) task;
+    if (fs->phase == FETCH_CONNECTING) {
+        tcp_race_abort(&fs->race);
+    }
+
+    // Unregistering netfd first makes it safe to hand to whichever
+    // shard reuses it next. That happens before the consumer can see
+    // EOF, so a request it sends right after already finds the
+    // connection in the pool.
+    if (fs->net_events) {
+        reactor_unwatch(task, fs->netfd);
+    }
+    if (fs->out_events) {
+        reactor_unwatch(task, fs->outfd);
     }
+    if (fs->hedge) {
+        reactor_unwatch(task, hedge_fd(fs->hedge, fs->hedge_side));
+    }
+    if (fs->body_done && fs->keep_alive) {
+        pool_release(fs->origin, (struct pooled) {
+            .fd = fs->netfd, .ssl = fs->ssl
+        });
+    } else if (fs->netfd >= 0) {
+        ttcp_tls_free(fs->ssl);
+        close(fs->netfd);
+    }
+    admit_release(fs);
+    fetch_end(fs);
+}
+
+/* Rows a finished fetch still owes a consumer that fell behind */
+struct drain {
+    struct reactor_task task;
+    int fd;
+    char *buf;
+    size_t off;
+    size_t len;
+};
+
+static bool drain_start(struct reactor_task *task) {
+    struct drain *d = (struct drain *) task;
+    return reactor_watch(task, d->fd, EPOLLOUT) == 0;
+}
+
+static bool drain_ready(struct reactor_task *task, int fd, uint32_t events) {
+    (void) fd;
+    (void) events;
+    struct drain *d = (struct drain *) task;
+    while (d->off < d->len) {
+        ssize_t n = send(d->fd, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            // Otherwise the consumer hung up
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        d->off += n;
+    }
+    return false;
+}
+
+static bool drain_expired(struct reactor_task *task) {
+    (void) task;
+    return true;
+}
 
+static void drain_finish(struct reactor_task *task) {
+    struct drain *d = (struct drain *) task;
+    reactor_unwatch(task, d->fd);
+    close(d->fd);
+    free(d->buf);
+    free(d);
+}
+
+// Leave FS's outfd and the rows it couldn't take yet to a task of their
+// own, so FS and its connection needn't wait for the consumer.
+static void drain_rows(struct fetch_state *fs) {
+    struct drain *d = malloc(sizeof(struct drain));
+    if (!d) {
+        perror("malloc()");
+        close(fs->outfd);
+        return;
+    }
+    *d = (struct drain) {
+        .task = {
+            .start = drain_start,
+            .ready = drain_ready,
+            .expired = drain_expired,
+            .finish = drain_finish,
+        },
+        .fd = fs->outfd,
+        .buf = fs->pending_buf,
+        .off = fs->pending_off,
+        .len = fs->pending_len,
+    };
+    fs->pending_buf = NULL;
+    if (reactor_submit(&d->task) < 0) {
+        perror("reactor_submit()");
+        close(d->fd);
+        free(d->buf);
+        free(d);
+    }
+}
+
+void fetch_end(struct fetch_state *fs) {
+    // A 304 leaves the body to come out of the cache first
+    if (cache_replay(fs)) {
+        return;
+    }
+    // In place before the consumer sees EOF, for whatever it asks next
+    cache_close(fs);
+    if (fs->response && fs->body_done) {
+        atomic_store_explicit(&fs->response->complete, true, memory_order_release);
+    }
+
+    // Closing the parser's end pushes out the last rows
     fclose(fs->bass[0]);
     fs->bass[0] = NULL;
-
-    /* There may still be unflushed parsed objects */
     flush_bassoon(fs);
 
     fclose(fs->bass[1]);
     fs->bass[1] = NULL;
 
-    ttcp_tls_free(fs->ssl, fs->ssl_ctx);
-
     if (!fs->closed_outfd) {
-        close(fs->outfd);
+        if (fs->pending_off < fs->pending_len) {
+            drain_rows(fs);
+        } else {
+            close(fs->outfd);
+        }
         fs->closed_outfd = true;
     }
+    free(fs->pending_buf);
+    splice_stop(fs);
 
-    close(fs->netfd);
-    close(fs->ep);
-
+    if (fs->response) {
+        fetch_response_release(fs->response);
+    }
+    if (fs->hedge) {
+        hedge_release(fs->hedge);
+    }
+    decoder_free(&fs->decoder);
+    ring_free(&fs->ring);
+    dns_freeaddrinfo(fs->addrinfo);
+    free(fs->request);
+    free(fs->origin);
+    free(fs->port);
     free(fs->hostname);
+    free(fs->authority);
+    free(fs->path);
     free(fs);
+}
+
+void fetch_response_add(struct fetch_response *res,
+                        const char *name, size_t name_len,
+                        const char *value, size_t value_len)
+{
+    if (res->headers_len == res->headers_cap) {
+        size_t cap = res->headers_cap ? res->headers_cap * 2 : 16;
+        struct fetch_header *headers = realloc(res->headers, cap * sizeof(struct fetch_header));
+        if (!headers) {
+            return;
+        }
+        res->headers = headers;
+        res->headers_cap = cap;
+    }
 
-    return NULL;
+    char *lower = strndup(name, name_len);
+    char *copy = strndup(value, value_len);
+    if (!lower || !copy) {
+        free(lower);
+        free(copy);
+        return;
+    }
+    for (char *c = lower; *c; c++) {
+        *c = tolower((unsigned char) *c);
+    }
+    res->headers[res->headers_len++] = (struct fetch_header) { .name = lower, .value = copy };
+}
+
+void fetch_response_publish(struct fetch_response *res, int status) {
+    res->status = status;
+    atomic_store_explicit(&res->ready, true, memory_order_release);
+}
+
+struct fetch_response *fetch_response_retain(struct fetch_response *res) {
+    atomic_fetch_add(&res->refs, 1);
+    return res;
+}
+
+void fetch_response_release(struct fetch_response *res) {
+    if (atomic_fetch_sub(&res->refs, 1) != 1) {
+        return;
+    }
+    for (size_t i = 0; i < res->headers_len; i++) {
+        free(res->headers[i].name);
+        free(res->headers[i].value);
+    }
+    free(res->headers);
+    free(res);
+}
+
+int fetch_submit(struct fetch_state *fs) {
+    fs->task = (struct reactor_task) {
+        .start = fetch_start,
+        .ready = fetch_ready,
+        .expired = fetch_expired,
+        .finish = fetch_finish,
+    };
+    return reactor_submit(&fs->task);
 }
 
 static ssize_t read_full(int fd, void *buf, size_t len) {
@@ -249,336 +835,681 @@ static struct url *url_of_string(const char *url) {
     bool is_tls = strncmp(url, "https://", 8) == 0;
     char *host_c = NULL;
     char *path_c = NULL;
+    char *query_c = NULL;
     char *port_c = NULL;
 
     curl_url_get(u, CURLUPART_HOST, &host_c, 0);
     curl_url_get(u, CURLUPART_PATH, &path_c, 0);
+    curl_url_get(u, CURLUPART_QUERY, &query_c, 0);
     curl_url_get(u, CURLUPART_PORT, &port_c, CURLU_DEFAULT_PORT);
 
     URL->host = dynamic("%s:%s", host_c, port_c);
     URL->hostname = dynamic("%s", host_c);
     URL->pathname = dynamic("%s", path_c);
+    URL->search = dynamic("%s%s", query_c ? "?" : "", query_c ? query_c : "");
     URL->port = dynamic("%s", port_c);
     URL->protocol = dynamic("%s", is_tls ? "https:" : "http:");
 
     curl_free(host_c);
     curl_free(path_c);
+    curl_free(query_c);
     curl_free(port_c);
 
     curl_url_cleanup(u);
     return URL;
 }
 
+// Hand the head's header table over to whoever asked for it
+static void publish_head(struct fetch_state *st) {
+    if (!st->response) {
+        return;
+    }
+    for (size_t i = 0; i < st->head.headers_len; i++) {
+        const struct http_header *h = &st->head.headers[i];
+        fetch_response_add(st->response, h->name, h->name_len, h->value, h->value_len);
+    }
+    fetch_response_publish(st->response, st->status);
+}
+
 static void parse_http_headers(struct fetch_state *st) {
-    // Null-terminate header buffer for string scanning
-    size_t len = st->header_len;
+    const struct http_head *head = &st->head;
+    st->status = head->status;
+    if (retry_status(st->status) && retry(st, head)) {
+        return;
+    }
+    // Of a hedged request's two copies, the first to get here keeps the consumer
+    if (st->hedge) {
+        if (!hedge_claim(st->hedge, st->hedge_side, &st->outfd, &st->response)) {
+            st->http_done = true;
+            return;
+        }
+        st->closed_outfd = false;
+        watch_out(st, 0);
+        if (st->hedge_side == 1) {
+            stat_add(STAT_HEDGE_WON, 1);
+        }
+    }
+    // The cached response stands in for a 304 to its validators
+    if (!(st->cache && cache_revalidated(st))) {
+        publish_head(st);
+    }
 
-    // Safety check
-    if (len >= sizeof(st->header_buf))
-        len = sizeof(st->header_buf) - 1;
+    // HTTP/1.1 connections persist unless either side says otherwise,
+    // HTTP/1.0 ones never do as far as we're concerned
+    const struct http_header *connection = http_head_get(head, "Connection");
+    st->keep_alive = head->minor_version >= 1
+        && !(connection && http_header_has_token(connection, "close"));
+
+    // Header values are followed by their line end in header_buf, which
+    // is where content_encoding_of() stops
+    const struct http_header *ce = http_head_get(head, "Content-Encoding");
+    enum content_encoding encoding = ce ? content_encoding_of(ce->value) : ENCODING_IDENTITY;
+    if (decoder_init(&st->decoder, encoding) < 0) {
+        fprintf(stderr, "fetch: can't decode Content-Encoding: %.*s\n",
+                (int) ce->value_len, ce->value);
+        st->http_done = true;
+        return;
+    }
+    if (st->segment.active && !ranges_head(st)) {
+        st->http_done = true;
+        st->keep_alive = false;
+        return;
+    }
+    if (st->cache) {
+        cache_store(st);
+    }
 
-    st->header_buf[len] = '\0';
+    // These never have a body, whatever the headers say
+    if (st->status == 204 || st->status == 304) {
+        st->chunked_mode = false;
+        st->has_content_length = true;
+        st->content_length = 0;
+        return;
+    }
 
-    // Detect Transfer-Encoding: chunked
-    if (strcasestr(st->header_buf, "Transfer-Encoding: chunked")) {
+    // Detect Transfer-Encoding: chunked, which wins over any Content-Length
+    const struct http_header *te = http_head_get(head, "Transfer-Encoding");
+    if (te && http_header_has_token(te, "chunked")) {
         st->chunked_mode = true;
         return;
     }
 
     // Detect Content-Length
-    char *cl = strcasestr(st->header_buf, "Content-Length:");
-    if (cl) {
+    const struct http_header *cl = http_head_get(head, "Content-Length");
+    char *digits = NULL;
+    unsigned long long length = cl ? strtoull(cl->value, &digits, 10) : 0;
+    if (cl && cl->value_len > 0 && digits == cl->value + cl->value_len) {
         st->chunked_mode = false;
-        st->content_length = strtoul(cl + 15, NULL, 10);
+        st->has_content_length = true;
+        st->content_length = length;
         return;
     }
 
     // Fallback if neither header is found
-    // Many servers default to identity + Connection: close
+    // Many servers default to identity + Connection: close,
+    // so the body only ends when the peer hangs up
     st->chunked_mode = false;
     st->content_length = 0;
+    st->keep_alive = false;
 }
 
-static void handle_http_body_bytes(struct fetch_state *st,
-                                   const char *data,
-                                   size_t len)
-{
-    size_t i = 0;
-
-    while (i < len) {
-        /* 1. READ THE CHUNK-SIZE LINE */
-        if (st->reading_chunk_size) {
-            char c = data[i++];
-
-            // Accumulate until CRLF
-            if (c == '\r') {
-                continue; // skip
-            }
-
-            if (c == '\n') {
-                // End of chunk-size line
-                st->chunk_line[st->chunk_line_len] = '\0';
+void fetch_emit(struct fetch_state *st, const char *data, size_t len) {
+    if (st->raw) {
+        raw_rows(st, data, len);
+    } else {
+        fwrite(data, 1, len, st->bass[0]);
+    }
+}
 
-                // Hex decode the chunk size
-                st->current_chunk_size =
-                    strtoul(st->chunk_line, NULL, 16);
+// Decoded body bytes go on to the JSON parser
+static void body_sink(void *ctx, const char *bytes, size_t len) {
+    struct fetch_state *st = ctx;
+    fetch_emit(st, bytes, len);
+    if (st->cache) {
+        cache_write(st, bytes, len);
+    }
+}
 
-                st->chunk_line_len = 0;
+void fetch_body(struct fetch_state *st, const char *data, size_t len) {
+    size_t decoded = st->decoder.decoded_bytes;
+    if (decoder_feed(&st->decoder, data, len, body_sink, st) < 0) {
+        // Corrupt body, so the connection can't be trusted either
+        st->http_done = true;
+        st->keep_alive = false;
+        cache_abandon(st);
+    }
+    stat_add(STAT_BODY_WIRE, len);
+    stat_add(STAT_BODY_DECODED, st->decoder.decoded_bytes - decoded);
+}
 
-                if (st->current_chunk_size == 0) {
-                    st->http_done = true;
-                } else {
-                    st->reading_chunk_size = false;
-                }
+// Identity body: a whole read goes to the parser in one write, and with
+// a Content-Length we know exactly where the response ends.
+static size_t handle_identity_bytes(struct fetch_state *st,
+                                    const char *data,
+                                    size_t len)
+{
+    if (st->has_content_length) {
+        len = MIN(len, st->content_length - st->body_received);
+    }
+    if (st->body_received == 0 && st->ranges > 1 && !st->segment.active) {
+        // A split hands the consumer to the merge, and gives us a new outfd
+        if (st->out_events) {
+            reactor_unwatch(&st->task, st->outfd);
+            st->out_events = 0;
+        }
+        ranges_split(st, data, len);
+        watch_out(st, 0);
+    }
 
-                continue;
-            }
+    if (st->segment.active) {
+        // Only the lines inside the segment's range are its to parse
+        size_t skip, keep;
+        if (ranges_clip(&st->segment, st->segment.base + st->body_received,
+                        data, len, &skip, &keep)) {
+            st->http_done = true;
+        }
+        fetch_body(st, data + skip, keep);
+    } else {
+        fetch_body(st, data, len);
+    }
+    st->body_received += len;
 
-            if (st->chunk_line_len < sizeof(st->chunk_line) - 1) {
-                st->chunk_line[st->chunk_line_len++] = c;
-            }
+    if (st->has_content_length && st->body_received == st->content_length) {
+        st->body_done = true;
+        st->http_done = true;
+    }
+    return len;
+}
 
-            continue;
+// Next chunk framing line from DATA[*I, LEN) into LINE, its CRLF dropped.
+// Lines that came in whole are read where they are, ones split across
+// reads get pieced together in chunk_line. False while incomplete.
+static bool take_chunk_line(struct fetch_state *st, const char *data, size_t len,
+                            size_t *i, const char **line, size_t *line_len)
+{
+    size_t avail = len - *i;
+    size_t lf = http_find_lf(data + *i, avail);
+
+    if (lf < avail && st->chunk_line_len == 0) {
+        *line = data + *i;
+        *line_len = lf;
+    } else {
+        // Only the size matters, so overly long extensions are cut off
+        size_t room = sizeof(st->chunk_line) - 1 - st->chunk_line_len;
+        size_t keep = MIN(lf, room);
+        memcpy(st->chunk_line + st->chunk_line_len, data + *i, keep);
+        st->chunk_line_len += keep;
+        if (lf == avail) {
+            *i = len;
+            return false;
         }
+        *line = st->chunk_line;
+        *line_len = st->chunk_line_len;
+        st->chunk_line_len = 0;
+    }
 
-        /* 2. READ CHUNK PAYLOAD */
-        if (!st->reading_chunk_size && st->current_chunk_size > 0) {
-            size_t available = len - i;
-            size_t need = st->current_chunk_size;
-
-            size_t to_copy = (available < need) ? available : need;
+    *i += lf + 1;
+    if (*line_len > 0 && (*line)[*line_len - 1] == '\r') {
+        (*line_len)--;
+    }
+    return true;
+}
 
-            // Feed payload bytes to bassoon parser
-            fwrite(data + i, 1, to_copy, st->bass[0]);
+static size_t handle_http_body_bytes(struct fetch_state *st,
+                                     const char *data,
+                                     size_t len)
+{
+    if (!st->chunked_mode) {
+        return handle_identity_bytes(st, data, len);
+    }
 
+    size_t i = 0;
+    while (i < len && !st->http_done) {
+        /* 1. CHUNK PAYLOAD, AS MUCH OF IT AS WE HAVE */
+        if (st->current_chunk_size > 0) {
+            size_t to_copy = MIN(len - i, st->current_chunk_size);
+            fetch_body(st, data + i, to_copy);
             i += to_copy;
             st->current_chunk_size -= to_copy;
+            st->expecting_crlf = st->current_chunk_size == 0;
+            continue;
+        }
 
-            // If not enough bytes to finish payload, exit now
-            if (st->current_chunk_size > 0) {
-                return;
-            }
+        /* 2. FRAMING LINES: CRLF AFTER PAYLOAD, CHUNK SIZE, TRAILERS */
+        const char *line;
+        size_t line_len;
+        if (!take_chunk_line(st, data, len, &i, &line, &line_len)) {
+            return i;
+        }
 
-            // Payload exactly finished expect CRLF next
-            // so switch to CRLF-skip mode
-            if (st->current_chunk_size == 0) {
-                // Next bytes should be "\r\n"
-                st->reading_chunk_size = false; // momentary
-                st->expecting_crlf = 2;
+        if (st->expecting_crlf) {
+            st->expecting_crlf = false;
+            if (line_len != 0) {
+                fprintf(stderr, "fetch: chunk overran its size\n");
+                st->http_done = true;
             }
+        } else if (st->reading_trailer) {
+            // Trailers end at the first empty line
+            if (line_len == 0) {
+                st->body_done = true;
+                st->http_done = true;
+            }
+        } else {
+            long long size = http_chunk_size(line, line_len);
+            if (size < 0) {
+                fprintf(stderr, "fetch: bad chunk size line\n");
+                st->http_done = true;
+            } else if (size == 0) {
+                st->reading_trailer = true;
+            } else {
+                st->current_chunk_size = size;
+            }
+        }
+    }
+    return i;
+}
 
+size_t fetch_feed(struct fetch_state *st, const char *data, size_t len) {
+    size_t used = 0;
+    while (!st->headers_done && !st->http_done && used < len) {
+        size_t room = sizeof(st->header_buf) - st->header_len;
+        if (room == 0) {
+            // headers too big
+            st->http_done = true;
+            return used;
+        }
+        size_t take = MIN(room, len - used);
+        size_t before = st->header_len;
+        memcpy(st->header_buf + st->header_len, data + used, take);
+        st->header_len += take;
+
+        ssize_t head_len = http_parse_head(&st->head, st->header_buf, st->header_len);
+        if (head_len < 0) {
+            fprintf(stderr, "fetch: malformed response head from %s\n", st->hostname);
+            st->http_done = true;
+            return used;
+        }
+        if (head_len == 0) {
+            used += take;
             continue;
         }
 
-        /* 3. SKIP CRLF AFTER PAYLOAD */
-        if (st->expecting_crlf > 0) {
-            char c = data[i++];
-            if (c == '\r' || c == '\n') {
-                st->expecting_crlf--;
-                if (st->expecting_crlf == 0) {
-                    // Now start the next chunk-size line
-                    st->reading_chunk_size = true;
-                }
-            }
+        // The head ended somewhere in what was just copied, and what
+        // follows it stays in DATA
+        used += head_len - before;
+        st->header_len = head_len;
+        if (st->head.status < 200) {
+            // 1xx interim responses come before the real one, skip them
+            st->header_len = 0;
+            memset(&st->head, 0, sizeof(st->head));
             continue;
         }
+        st->headers_done = true;
+        parse_http_headers(st);
+        if (!st->http_done && st->has_content_length && st->content_length == 0) {
+            st->body_done = true;
+            st->http_done = true;
+        }
+    }
 
-        /* Should not reach here */
-        i++;
+    if (st->headers_done && !st->http_done && used < len) {
+        used += handle_http_body_bytes(st, data + used, len - used);
     }
+    return used;
 }
 
 static bool handle_http_headers(struct fetch_state *st) {
-    char buf[4096];
-
     for (;;) {
-        ssize_t n = ttcp_recv(st->netfd, buf, sizeof(buf), st->ssl);
+        // Straight into header_buf, where the header table points
+        size_t room = sizeof(st->header_buf) - st->header_len;
+        if (room == 0) {
+            // headers too big
+            st->http_done = true;
+            return false;
+        }
+        ssize_t n = ttcp_recv(st->netfd, st->header_buf + st->header_len, room, st->ssl);
+        if (n > 0 && st->sent_ms > 0) {
+            // First byte, whatever hedging was waiting for it is off
+            ttfb_record(st->origin, reactor_now_ms() - st->sent_ms);
+            st->sent_ms = 0;
+            st->hedge_ms = 0;
+        }
         if (n > 0) {
-            // Append to header buffer
-            if (st->header_len + n > sizeof(st->header_buf)) {
-                // headers too big
-                // you can error out or realloc
-                return false;
-            }
-
-            memcpy(st->header_buf + st->header_len, buf, n);
             st->header_len += n;
 
-            // Check if we have full header: "\r\n\r\n"
-            if (st->header_len >= 4) {
-                if (memmem(st->header_buf, st->header_len, "\r\n\r\n", 4)) {
-
-                    st->headers_done = true;
-
-                    // OPTIONAL: parse headers here
-                    parse_http_headers(st);
-
-                    // Remove header bytes from stream:
-                    // find where the header ends
-                    char *ptr = memmem(st->header_buf, st->header_len, "\r\n\r\n", 4);
-                    size_t header_end = (ptr + 4) - st->header_buf;
-
-                    // Move leftover bytes to body buffer
-                    size_t leftover = st->header_len - header_end;
+            ssize_t head_len;
+            while ((head_len = http_parse_head(&st->head, st->header_buf, st->header_len)) > 0
+                   && st->head.status < 200)
+            {
+                // 1xx interim responses come before the real one, skip them
+                st->header_len -= head_len;
+                memmove(st->header_buf, st->header_buf + head_len, st->header_len);
+                memset(&st->head, 0, sizeof(st->head));
+            }
+            if (head_len < 0) {
+                fprintf(stderr, "fetch: malformed response head from %s\n", st->hostname);
+                st->http_done = true;
+                return false;
+            }
+            if (head_len == 0) {
+                // CONTINUE LOOP — maybe more header bytes available in nonblocking recv
+                continue;
+            }
 
-                    // For next step (body), we feed leftover directly
-                    if (leftover > 0) {
-                        // feed to body parser immediately
-                        handle_http_body_bytes(st,
-                              st->header_buf + header_end, leftover);
-                    }
+            st->headers_done = true;
+            parse_http_headers(st);
+            if (st->http_done || st->phase == FETCH_BACKOFF) {
+                return false;
+            }
+            if (st->has_content_length && st->content_length == 0) {
+                st->body_done = true;
+                st->http_done = true;
+                return true;
+            }
 
-                    return true; // done with headers
-                }
+            // Whatever came in past the head is the start of the body
+            size_t leftover = st->header_len - head_len;
+            if (leftover > 0) {
+                handle_http_body_bytes(st, st->header_buf + head_len, leftover);
+                // Its rows go out now, the next read may be a while
+                fetch_deliver(st);
             }
 
-            // CONTINUE LOOP — maybe more header bytes available in nonblocking recv
-            continue;
+            // More of the body may sit decrypted in the SSL already,
+            // where epoll can't see it
+            if (!st->http_done) {
+                splice_start(st);
+                handle_http_body(st);
+            }
+            return true; // done with headers
         }
 
         else if (n == 0) {
             // Server closed unexpectedly before sending full headers
-            st->http_done = true;
+            fail(st);
             return false;
         }
 
-        else { // n < 0
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No more data NOW — epoll will wake us again
-                return false;
-            }
+        else if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            // No more data NOW — epoll will wake us again
+            wait_net(st, n);
+            return false;
+        }
+
+        else {
             // real error
+            fail(st);
             return false;
         }
     }
 }
 
 static void handle_http_body(struct fetch_state *st) {
-    char buf[4096];
-
-    ssize_t n = ttcp_recv(st->netfd, buf, sizeof(buf), st->ssl);
-    if (n > 0) {
-        // feed raw bytes to chunk/body parser
-        handle_http_body_bytes(st, buf, (size_t)n);
+    // Records OpenSSL read in before the kernel took over are copied out first
+    if (st->splicing && !(st->ssl && SSL_has_pending(st->ssl))) {
+        splice_body(st);
         return;
     }
+    // Read until the socket runs dry, not just once: with TLS, bytes
+    // OpenSSL already decrypted never show up as EPOLLIN again.
+    while (!st->http_done) {
+        // Never past the end of a sized body, what follows it on a
+        // kept-alive connection isn't ours
+        size_t limit = SIZE_MAX;
+        if (!st->chunked_mode && st->has_content_length) {
+            limit = st->content_length - st->body_received;
+        }
+        ssize_t n = ring_fill(&st->ring, st->netfd, st->ssl, limit);
+        if (n > 0) {
+            // Parse the body right where it landed
+            struct iovec iov[2];
+            int segs = ring_peek(&st->ring, iov);
+            for (int i = 0; i < segs && !st->http_done; i++) {
+                handle_http_body_bytes(st, iov[i].iov_base, iov[i].iov_len);
+            }
+            ring_consume(&st->ring, ring_len(&st->ring));
+
+            // Rows go out as soon as they're parsed, unless the consumer
+            // can't keep up, in which case TCP gets to hold the server back
+            if (fetch_deliver(st) >= st->high_water && !st->http_done) {
+                pause_net(st);
+                return;
+            }
+        } else if (n == 0) {
+            // TCP closed — if chunked, this could be abrupt
+            st->http_done = true;
+        } else if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            // no data right now — epoll will tell us later
+            ring_settle(&st->ring);
+            wait_net(st, n);
+            return;
+        } else {
+            // real error
+            st->http_done = true;
+        }
+    }
+}
 
-    if (n == 0) {
-        // TCP closed — if chunked, this could be abrupt
-        st->http_done = true;
+// Splice a raw body from here on, if it's bytes as they are on the socket:
+// neither chunked nor compressed, read by FS itself, and in the clear or
+// decrypted by the kernel.
+static void splice_start(struct fetch_state *st) {
+    if (!st->raw || st->chunked_mode || st->decoder.encoding != ENCODING_IDENTITY
+        || st->cache || st->segment.active
+        || (st->ssl && !BIO_get_ktls_recv(SSL_get_rbio(st->ssl))))
+    {
         return;
     }
-
-    // n < 0: check errno
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        // no data right now — epoll will tell us later
+    if (pipe2(st->splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        // Copied then, like any other raw body
+        perror("pipe2()");
         return;
     }
+    st->splicing = true;
+}
 
-    // real error
-    st->http_done = true;
+// Copy the rest of the body, if any, the way splice_start() didn't. Only
+// once splice_pipe is empty.
+static void splice_stop(struct fetch_state *st) {
+    if (!st->splicing) {
+        return;
+    }
+    close(st->splice_pipe[0]);
+    close(st->splice_pipe[1]);
+    st->splicing = false;
 }
 
-static bool flush_pending(struct fetch_state *st) {
-    while (st->pending_len > 0) {
-        ssize_t n = send(st->outfd,
-                         st->pending_buf + st->pending_off,
-                         st->pending_len,
-                         0);
+// Move a raw body from netfd to outfd through splice_pipe, never through
+// user space, until either one has to wait.
+static void splice_body(struct fetch_state *st) {
+    // Whatever was copied out before goes first
+    if (fetch_deliver(st) > 0) {
+        pause_net(st);
+        return;
+    }
+    for (;;) {
+        while (st->spliced > 0) {
+            ssize_t n = splice(st->splice_pipe[0], NULL, st->outfd, NULL, st->spliced,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EAGAIN) {
+                pause_net(st);
+                return;
+            }
+            if (n <= 0) {
+                consumer_gone(st);
+                return;
+            }
+            st->spliced -= n;
+        }
+        if (st->body_done) {
+            st->http_done = true;
+            return;
+        }
 
-        if (n > 0) {
-            st->pending_off += (size_t)n;
-            st->pending_len -= (size_t)n;
+        size_t limit = FETCH_SPLICE_CHUNK;
+        if (st->has_content_length) {
+            limit = MIN(limit, st->content_length - st->body_received);
         }
-        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return false; // still pending
+        ssize_t n = limit == 0 ? 0
+            : splice(st->netfd, NULL, st->splice_pipe[1], NULL, limit,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EAGAIN) {
+            wait_net(st, TTCP_WANT_READ);
+            return;
         }
-        else {
-            // real error — stop producing
+        if (n < 0 && st->ssl && (errno == EINVAL || errno == EIO)) {
+            // A TLS record that isn't data, say an alert, which OpenSSL
+            // has to see. The rest is copied.
+            splice_stop(st);
+            handle_http_body(st);
+            return;
+        }
+        if (n < 0) {
+            perror("splice()");
             st->http_done = true;
-            return false;
+            return;
         }
+        if (n == 0) {
+            // A body without a length ends with the connection, one with a
+            // length was cut short
+            st->body_done = !st->has_content_length;
+            st->http_done = true;
+            return;
+        }
+        st->spliced += n;
+        st->body_received += n;
+        stat_add(STAT_BODY_WIRE, n);
+        stat_add(STAT_BODY_DECODED, n);
+        stat_add(STAT_BODY_SPLICED, n);
+        if (st->has_content_length && st->body_received == st->content_length) {
+            // Done once the pipe is through to outfd
+            st->body_done = true;
+        }
+    }
+}
+
+// Body bytes as they are, for #fetch_state.raw.
+static void raw_rows(struct fetch_state *st, const char *data, size_t len) {
+    ssize_t sent = 0;
+    if (st->pending_len == 0) {
+        sent = send_rows(st, data, len);
+        if (sent < 0) {
+            consumer_gone(st);
+            return;
+        }
+    }
+    if ((size_t) sent < len && !hold_rows(st, data + sent, len - sent)) {
+        perror("realloc()");
+        consumer_gone(st);
     }
+}
 
-    // pending complete: free and reset
-    free(st->pending_buf);
-    st->pending_buf = NULL;
+// The consumer stopped reading, so there's no one left to fetch for.
+static void consumer_gone(struct fetch_state *st) {
+    st->http_done = true;
     st->pending_off = 0;
     st->pending_len = 0;
-
-    return true; // pending fully flushed
 }
 
-static void flush_bassoon(struct fetch_state *st) {
-    FILE *rd = st->bass[1];
-    int out = st->outfd;
+// Keep LEN bytes of rows at DATA until outfd takes them.
+static bool hold_rows(struct fetch_state *st, const char *data, size_t len) {
+    if (st->pending_off > 0) {
+        st->pending_len -= st->pending_off;
+        memmove(st->pending_buf, st->pending_buf + st->pending_off, st->pending_len);
+        st->pending_off = 0;
+    }
+    if (st->pending_len + len > st->pending_cap) {
+        size_t cap = st->pending_cap ? st->pending_cap : 4096;
+        while (cap < st->pending_len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(st->pending_buf, cap);
+        if (!buf) {
+            return false;
+        }
+        st->pending_buf = buf;
+        st->pending_cap = cap;
+    }
+    memcpy(st->pending_buf + st->pending_len, data, len);
+    st->pending_len += len;
+    return true;
+}
 
-    /* 1. Handle pending partial send */
-    if (st->pending_len > 0) {
-        ssize_t n = send(out,
-                         st->pending_buf + st->pending_off,
-                         st->pending_len - st->pending_off,
-                         MSG_NOSIGNAL);
+// As much of DATA as outfd takes right now, -1 once the consumer's gone.
+static ssize_t send_rows(struct fetch_state *st, const char *data, size_t len) {
+    ssize_t n = send(st->outfd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return n;
+}
 
+static void flush_bassoon(struct fetch_state *st) {
+    /* 1. What outfd didn't take last time goes first */
+    if (st->pending_off < st->pending_len) {
+        ssize_t n = send_rows(st, st->pending_buf + st->pending_off,
+                              st->pending_len - st->pending_off);
         if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
-            }
-            st->http_done = true;
+            consumer_gone(st);
             return;
         }
-
         st->pending_off += n;
-
-        if (st->pending_off < st->pending_len) {
-            return;
+        if (st->pending_off == st->pending_len) {
+            st->pending_off = 0;
+            st->pending_len = 0;
         }
-
-        free(st->pending_buf);
-        st->pending_buf = NULL;
-        st->pending_len = 0;
-        st->pending_off = 0;
     }
 
-    /* 2. Read NDJSON from Bassoon */
+    /* 2. Then every row parsed since, straight through while outfd takes them */
+    FILE *rd = st->bass[1];
+    // Running out of rows last time wasn't the end of them
+    clearerr(rd);
+
     char *line = NULL;
     size_t cap = 0;
     ssize_t got;
-
-
     while ((got = getline(&line, &cap, rd)) != -1) {
-
-        ssize_t sent = send(out, line, got, MSG_NOSIGNAL);
-
-        if (sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                st->pending_buf = malloc(got);
-                memcpy(st->pending_buf, line, got);
-                st->pending_len = got;
-                st->pending_off = 0;
-                free(line);
-                return;
+        ssize_t sent = 0;
+        if (st->pending_len == 0) {
+            sent = send_rows(st, line, got);
+            if (sent < 0) {
+                consumer_gone(st);
+                break;
             }
-            st->http_done = true;
-            free(line);
-            return;
         }
-
-        if (sent < got) {
-            size_t rem = got - sent;
-            st->pending_buf = malloc(rem);
-            memcpy(st->pending_buf, line + sent, rem);
-            st->pending_len = rem;
-            st->pending_off = 0;
-            free(line);
-            return;
+        if (sent < got && !hold_rows(st, line + sent, got - sent)) {
+            perror("realloc()");
+            consumer_gone(st);
+            break;
         }
     }
-
     free(line);
+}
+
+size_t fetch_deliver(struct fetch_state *fs) {
+    // Rows only reach the queue once the parser's stdio buffer goes out
+    fflush(fs->bass[0]);
+    flush_bassoon(fs);
+    return fs->pending_len - fs->pending_off;
+}
+
+// The consumer fell behind. Leave netfd unread until outfd takes enough
+// of what's waiting.
+static void pause_net(struct fetch_state *fs) {
+    watch_net(fs, 0);
+    if (!watch_out(fs, EPOLLOUT)) {
+        fs->http_done = true;
+        return;
+    }
+    fs->paused = true;
+}
 
-    if (feof(rd) && st->http_done && st->pending_len == 0 && !st->closed_outfd) {
-        close(out);
-        st->closed_outfd = true;
+static void resume_net(struct fetch_state *fs) {
+    if (fetch_deliver(fs) > fs->high_water / 2 || fs->http_done) {
+        return;
     }
+    watch_out(fs, 0);
+    fs->paused = false;
+    // Some of the body may sit decrypted in the SSL, where epoll can't see it
+    handle_http_body(fs);
 }
@@ -4,9 +4,20 @@
  */
 
 #pragma once
+#include "admit.h"
+#include "cache.h"
 #include "cfns.h"
+#include "decode.h"
+#include "http1.h"
+#include "ranges.h"
+#include "retry.h"
+#include "reactor.h"
+#include "ring.h"
+#include "tcp.h"
 #include <openssl/types.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /**
@@ -36,6 +47,14 @@ struct url {
      */
     struct string pathname;
 
+    /**
+     * @brief A string containing a '?' followed by the query string of the
+     * URL, or empty when it has none.
+     *
+     * {@link https://developer.mozilla.org/en-US/docs/Web/API/URL/search}
+     */
+    struct string search;
+
     /**
      * @brief A string containing the port number of the URL.
      *
@@ -55,49 +74,261 @@ void url_free(struct url *url);
 struct dispatch {
     int sockfd;
     SSL *ssl;
-    SSL_CTX *ctx;
     struct url url;
+    /** Resolved addresses of the host, unless #reused. */
     struct addrinfo *addrinfo;
+    /** The serialized request line and headers, sent once connected. */
+    struct string request;
+
+    /** `scheme://host:port` key into the connection pool. */
+    char *origin;
+    /** True when #sockfd came out of the pool already connected. Otherwise
+     * #sockfd is -1 and the reactor connects to #addrinfo. */
+    bool reused;
 };
 void dispatch_free(struct dispatch *dispatch);
-struct dispatch *fetch_socket(const char *url, const char *init[4]);
-int use_fetch(int fds[4], struct dispatch *dispatch);
+/**
+ * @brief What a fetch of URL goes out over: a connection from the pool, or
+ * the addresses to connect to.
+ *
+ * `http+unix://` URLs, and any URL when UNIX_SOCKET isn't `NULL`, go to a
+ * Unix domain socket in plain HTTP instead, see #HTTP_UNIX.
+ */
+struct dispatch *fetch_socket(const char *url, const char *init[4], const char *unix_socket);
+int use_fetch(int fds[3], struct dispatch *dispatch);
+
+/**
+ * @brief Serialized GET request for PATH on HOST (`host:port`), taking
+ * ACCEPT_ENCODING, with EXTRA header lines (each ending in CRLF) on top.
+ */
+struct string fetch_request(const char *path, const char *host,
+                            const char *accept_encoding, const char *extra);
+
+/**
+ * @brief A fetch of the same URL as FS sending REQUEST, which it takes over,
+ * with a parser of its own and no consumer yet (#fetch_state.outfd is -1).
+ *
+ * Its connection comes from the pool, or else it connects to the addresses
+ * the DNS cache has for the host.
+ */
+struct fetch_state *fetch_clone(const struct fetch_state *fs, struct string request);
+
+/**
+ * @brief Status and headers of a response, shared by the fetch filling them
+ * in and whoever asked for them through #fetch_with_response().
+ */
+struct fetch_response {
+    atomic_int refs;
+    /** Set once #status and #headers are in. They never change after. */
+    atomic_bool ready;
+    /** Set before the consumer sees EOF, if the whole body came through. */
+    atomic_bool complete;
+    int status;
+    size_t headers_len;
+    size_t headers_cap;
+    /** Names lowercased, both NUL terminated. */
+    struct fetch_header {
+        char *name;
+        char *value;
+    } *headers;
+};
+
+/**
+ * @brief Append header NAME: VALUE to RES, which isn't #fetch_response.ready yet.
+ */
+void fetch_response_add(struct fetch_response *res,
+                        const char *name, size_t name_len,
+                        const char *value, size_t value_len);
+
+/**
+ * @brief Make RES's headers visible to other threads, with STATUS.
+ */
+void fetch_response_publish(struct fetch_response *res, int status);
+
+/**
+ * @brief Take another reference to RES.
+ */
+struct fetch_response *fetch_response_retain(struct fetch_response *res);
+
+/**
+ * @brief Drop a reference to RES, freeing it with the last one.
+ */
+void fetch_response_release(struct fetch_response *res);
+
+/** How long a fetch may take to connect before giving up, by default. */
+#define FETCH_CONNECT_TIMEOUT_MS 30000
+
+/** Bytes of rows a fetch holds for a consumer that fell behind before it stops reading, by default. */
+#define FETCH_HIGH_WATER (1 << 20)
+
+/** Most bytes of a raw body spliced through the kernel at once, a pipe's worth. */
+#define FETCH_SPLICE_CHUNK (64 << 10)
+
+/**
+ * Scheme of URLs served over a Unix domain socket, whose host is the
+ * socket's absolute path percent-encoded, like
+ * `http+unix://%2Frun%2Fsidecar.sock/items?page=2`.
+ */
+#define HTTP_UNIX "http+unix://"
+
+enum fetch_phase {
+    FETCH_CONNECTING,   // racing connection attempts, see #tcp_race
+    FETCH_HANDSHAKING,  // connected, TLS handshake under way
+    FETCH_SENDING,      // writing out the request
+    FETCH_RECEIVING,    // request sent, reading the response
+    FETCH_BACKOFF,      // waiting to try again, see retry.h
+};
 
 struct fetch_state {
+    struct reactor_task task;   // first, so a task pointer is a fetch_state pointer
+
     /* FDs */
     int netfd;        // TCP socket (nonblocking)
     int outfd;        // socketpair writer FD (nonblocking)
-    int ep;           // epoll instance FD
+    uint32_t net_events;  // what netfd is registered for with the shard, 0 if not at all
 
     char *hostname;
-    SSL_CTX *ssl_ctx;
+    char *port;
+    char *origin;     // pool key netfd goes back to when reusable
     SSL     *ssl;
+    bool is_tls;
+
+    /* --- CONNECTING --- */
+    enum fetch_phase phase;
+    struct addrinfo *addrinfo;  // resolved candidates, owned
+    struct tcp_race race;
+    long connect_timeout_ms;
+
+    char *authority;            // host[:port] and path, for HTTP/2 streams
+    char *path;
+    int32_t stream_id;          // HTTP/2 stream, 0 when on its own connection
+    struct fetch_state *next_stream;  // HTTP/2 connection's queue link
+
+    char *request;              // request bytes to send once connected
+    size_t request_len;
+    size_t request_off;         // how much of it went out so far
 
     /* --- HTTP HEADER PARSING --- */
     bool headers_done;
+    int status;             // response status code, once headers_done
     char header_buf[8192];  // store header bytes
     size_t header_len;
+    struct http_head head;  // header table, pointing into header_buf
+    struct fetch_response *response;  // shared with the caller, if asked for
+
+    struct recv_ring ring;      // body bytes off netfd, parsed in place
 
     bool chunked_mode;
+    bool has_content_length;
     size_t content_length;
+    size_t body_received;       // identity body bytes seen so far
+    size_t ranges;              // most connections to split a big body over, see ranges.h
+    struct range_segment segment;  // which part of a split body this fetch reads
+    bool keep_alive;            // server is fine with us reusing netfd
+    struct decoder decoder;     // undoes Content-Encoding before bass[0]
 
     /* --- CHUNKED DECODING STATE --- */
-    bool reading_chunk_size;    // true = reading hex size line
     char chunk_line[128];       // buffer for chunk-size line
     size_t chunk_line_len;      // how many chars collected
     size_t current_chunk_size;  // remaining bytes in current chunk
-    int expecting_crlf;         // 2 -> expecting "\r\n"
+    bool expecting_crlf;        // the empty line after a chunk's payload
+    bool reading_trailer;       // past the last chunk, skipping trailers
 
     FILE *bass[2];
 
     /* --- NONBLOCKING SEND STATE FOR outfd --- */
-    char *pending_buf;         // partial write buffer (JSON object)
-    size_t pending_len;         // bytes left to send
-    size_t pending_off;         // current offset in pending_send
+    char *pending_buf;          // rows outfd didn't take yet
+    size_t pending_len;         // end of them in pending_buf
+    size_t pending_off;         // how far they went out
+    size_t pending_cap;
+    size_t high_water;          // backlog past which netfd isn't read, see #fetch_deliver()
+    bool paused;                // netfd left unread until outfd catches up
+    uint32_t out_events;        // what outfd is registered for, 0 if not at all
+    size_t unconsumed;          // HTTP/2 DATA bytes held back from the stream window
+
+    /* --- RAW FRAMES, SEE FRAME_RAW --- */
+    bool raw;                   // body goes to outfd as is, not through the parser
+    bool splicing;              // and from netfd to outfd in the kernel, via splice_pipe
+    int splice_pipe[2];
+    size_t spliced;             // bytes in splice_pipe that outfd didn't take yet
+
+    /* --- RETRIES AND HEDGING --- */
+    unsigned retries;           // most times to try again, see retry.h
+    unsigned attempt;           // times tried again so far
+    long long retry_ms;         // when to try again, while FETCH_BACKOFF
+    unsigned hedge_percentile;  // send a copy once the first byte is later than this percentile, 0 never
+    long long sent_ms;          // when the request went out, 0 once the first byte came back
+    long long hedge_ms;         // when to send the copy, 0 for never
+    struct hedge *hedge;        // shared by both copies of a hedged request
+    int hedge_side;             // which copy this is, 0 the original
+
+    struct admit_ticket admit;  // place with the scheduler, see admit.h
+    struct cache_entry *cache;  // on-disk copy of the response, see cache.h
 
     /* --- TERMINATION STATE --- */
     bool http_done;             // reached end of chunked stream or TCP closed
+    bool body_done;             // response framing says the body is complete
     bool closed_outfd;          // have we closed outfd yet?
 };
 
-void *fetcher(void *arg);
+/**
+ * @brief Run FS to completion on a reactor shard, which frees it when done.
+ *
+ * @retval 0 OK, FS is the shard's now.
+ * @retval -1 Error, FS is still the caller's.
+ */
+int fetch_submit(struct fetch_state *fs);
+
+/**
+ * @brief Give the pooled connection FS came with back while FS waits its
+ * turn, with its host resolved to connect to instead.
+ *
+ * FS keeps the connection if the host doesn't resolve.
+ */
+void fetch_park(struct fetch_state *fs);
+
+/**
+ * @brief Take an idle connection for FS out of the pool, if it has none
+ * and there's one, once it's FS's turn.
+ */
+void fetch_unpark(struct fetch_state *fs);
+
+/**
+ * @brief Feed body bytes DATA of FS, with any transfer framing already
+ * stripped, through its Content-Encoding decoder into the JSON parser.
+ */
+void fetch_body(struct fetch_state *fs, const char *data, size_t len);
+
+/**
+ * @brief Send LEN decoded body bytes at DATA on to FS's consumer, through
+ * the parser, or as they are for a #fetch_state.raw fetch.
+ */
+void fetch_emit(struct fetch_state *fs, const char *data, size_t len);
+
+/**
+ * @brief Feed LEN response bytes at DATA, head and then body, to FS, which
+ * reads nothing off its connection itself.
+ *
+ * @return How many of them belong to FS's response. On a pipelined
+ * connection, whatever comes after is the next response's.
+ */
+size_t fetch_feed(struct fetch_state *fs, const char *data, size_t len);
+
+/**
+ * @brief Pass the rows FS parsed out so far on to the consumer, as far as
+ * it takes them.
+ *
+ * @return Bytes of rows still waiting for the consumer. Once that reaches
+ * #fetch_state.high_water, stop reading the network until outfd is writable
+ * and this drops to half of it.
+ */
+size_t fetch_deliver(struct fetch_state *fs);
+
+/**
+ * @brief Flush what FS parsed out to the consumer, hang up on it and free FS.
+ *
+ * FS's connection and any watch on its outfd are the caller's to take care
+ * of beforehand. Rows the consumer isn't ready for yet are handed to a task
+ * of their own, which hangs up once they're through.
+ */
+void fetch_end(struct fetch_state *fs);
@@ -0,0 +1,375 @@
+#include "flight.h"
+#include "fetch.h"
+#include "rowcache.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct row {
+    yyjson_doc *doc;            // NULL once dropped for readers too far behind
+    size_t bytes;
+    bool owned;                 // or the fill's
+};
+
+struct flight {
+    pthread_mutex_t lock;
+    pthread_cond_t more;        // a row went in, or there won't be any more
+    char *url;                  // NULL when nobody else may join
+    const void *group;
+    size_t keep;
+
+    FILE *stream;               // NULL once read through
+    struct fetch_response *response;
+    struct rowcache_entry *fill;
+    bool filling;               // rows still go into fill
+    struct flight_reader *filler;   // whose table fill is for
+
+    struct row *rows;           // rows from #base on
+    size_t base;
+    size_t len;
+    size_t cap;
+    size_t bytes;
+    bool reading;               // a reader is off parsing the next row
+    bool done;
+    bool bad;                   // the row after the last isn't JSON
+    bool failed;                // ran out of memory for the row after the last
+    bool full;                  // rows were dropped for readers behind, nobody may join
+
+    struct flight_reader *readers;
+    struct flight *next;        // on the list of flights
+};
+
+struct flight_reader {
+    struct flight *flight;
+    size_t next;                // row read next, counting from the first
+    struct flight_reader *link;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *flights = NULL;
+
+// Add reader R at the first row to F. Holds F's lock.
+static void board(struct flight *f, struct flight_reader *r) {
+    r->flight = f;
+    r->next = 0;
+    r->link = f->readers;
+    f->readers = r;
+}
+
+struct flight_reader *flight_join(const char *url, const void *group) {
+    struct flight_reader *r = calloc(1, sizeof(struct flight_reader));
+    if (!r) {
+        return perror_rc(NULL, "calloc()", 0);
+    }
+    pthread_mutex_lock(&lock);
+    for (struct flight *f = flights; f && !r->flight; f = f->next) {
+        if (strcmp(f->url, url) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&f->lock);
+        if (f->base == 0 && !f->full && (!f->done || (f->group == group && !f->bad))) {
+            board(f, r);
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    pthread_mutex_unlock(&lock);
+    if (!r->flight) {
+        free(r);
+        return NULL;
+    }
+    stat_add(STAT_COALESCED, 1);
+    return r;
+}
+
+static void flight_free(struct flight *f) {
+    for (size_t i = 0; i < f->len; i++) {
+        if (f->rows[i].owned) {
+            yyjson_doc_free(f->rows[i].doc);
+        }
+    }
+    if (f->stream) {
+        fclose(f->stream);
+    }
+    fetch_response_release(f->response);
+    rowcache_release(f->fill);
+    pthread_cond_destroy(&f->more);
+    pthread_mutex_destroy(&f->lock);
+    free(f->rows);
+    free(f->url);
+    free(f);
+}
+
+// A flight for R, which takes nothing if it can't be made.
+static struct flight *flight_new(const char *url, const void *group, FILE *stream,
+                                 struct fetch_response *response,
+                                 struct rowcache_entry *fill, size_t keep,
+                                 struct flight_reader *r) {
+    struct flight *f = calloc(1, sizeof(struct flight));
+    if (!f) {
+        return perror_rc(NULL, "calloc()", 0);
+    }
+    if (url && !(f->url = strdup(url))) {
+        return perror_rc(NULL, "strdup()", free(f));
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->more, NULL);
+    f->group = group;
+    // A flight nobody can join only keeps rows its one reader is on
+    f->keep = !url ? 0 : keep > 0 ? keep : FETCH_HIGH_WATER;
+    f->stream = stream;
+    f->response = response;
+    f->fill = fill;
+    f->filling = fill != NULL;
+    f->filler = r;
+    board(f, r);
+
+    if (f->url) {
+        pthread_mutex_lock(&lock);
+        f->next = flights;
+        flights = f;
+        pthread_mutex_unlock(&lock);
+    }
+    return f;
+}
+
+struct flight_reader *flight_begin(const char *url, const void *group, FILE *stream,
+                                   struct fetch_response *response,
+                                   struct rowcache_entry *fill, size_t keep) {
+    struct flight_reader *r = calloc(1, sizeof(struct flight_reader));
+    if (!r) {
+        return perror_rc(NULL, "calloc()", 0);
+    }
+    if (!flight_new(url, group, stream, response, fill, keep, r)) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// The row reader R is on, and keeps until it reads again.
+static size_t row_on(const struct flight_reader *r) {
+    return r->next > 0 ? r->next - 1 : 0;
+}
+
+// Drop the rows that only readers behind the others still want, but not
+// the ones they're on. They read on from downloads of their own, see
+// #FLIGHT_BEHIND. Holds F's lock.
+static void drop_behind(struct flight *f) {
+    size_t ahead = 0;
+    for (struct flight_reader *r = f->readers; r; r = r->link) {
+        ahead = MAX(ahead, r->next);
+    }
+    for (size_t i = f->base; i + 1 < ahead && f->bytes > f->keep; i++) {
+        struct row *row = &f->rows[i - f->base];
+        bool on = false;
+        for (struct flight_reader *r = f->readers; r && !on; r = r->link) {
+            on = row_on(r) == i;
+        }
+        if (on || !row->doc) {
+            continue;
+        }
+        if (row->owned) {
+            yyjson_doc_free(row->doc);
+        }
+        row->doc = NULL;
+        f->bytes -= row->bytes;
+        row->bytes = 0;
+        f->full = true;
+    }
+}
+
+// Drop rows every reader is past, once F holds more than it keeps. Holds F's lock.
+static void trim(struct flight *f) {
+    if (f->bytes <= f->keep) {
+        return;
+    }
+    // A reader's last row is still the one it's on
+    size_t from = f->base + f->len;
+    for (struct flight_reader *r = f->readers; r; r = r->link) {
+        from = MIN(from, row_on(r));
+    }
+    size_t n = from - f->base;
+    for (size_t i = 0; i < n; i++) {
+        if (f->rows[i].owned) {
+            yyjson_doc_free(f->rows[i].doc);
+        }
+        f->bytes -= f->rows[i].bytes;
+    }
+    memmove(f->rows, f->rows + n, (f->len - n) * sizeof(struct row));
+    f->base += n;
+    f->len -= n;
+
+    // Still too much, for readers left behind
+    if (f->bytes > f->keep) {
+        drop_behind(f);
+    }
+}
+
+// Parse LEN bytes of JSON at LINE into ROW, into F's fill or not.
+static bool parse(struct flight *f, bool fill, char *line, size_t len, struct row *row) {
+    row->bytes = len;
+    row->owned = !fill;
+    row->doc = fill ? rowcache_parse(f->fill, line, len) : yyjson_read(line, len, 0);
+    return row->doc != NULL;
+}
+
+// F's stream ended: keep its rows if all of a 2xx response made it.
+static void land(struct flight *f) {
+    if (f->filling && !f->bad && !f->failed
+        && atomic_load_explicit(&f->response->ready, memory_order_acquire)
+        && f->response->status >= 200 && f->response->status < 300
+        && atomic_load_explicit(&f->response->complete, memory_order_acquire))
+    {
+        rowcache_commit(f->fill, f->response);
+    }
+    fclose(f->stream);
+    f->stream = NULL;
+}
+
+// Read the row after the last off F's stream. Holds F's lock, and lets go
+// of it while waiting on the stream.
+static void read_row(struct flight *f) {
+    if (f->filling && rowcache_full(f->fill)) {
+        // Too big to keep, the rest goes as if there were no cache. The
+        // fill is held on to for the rows already in it.
+        f->filling = false;
+    }
+    bool fill = f->filling;
+    f->reading = true;
+    pthread_mutex_unlock(&f->lock);
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, f->stream);
+    if (n > 0 && line[n - 1] == '\n') {
+        n -= 1;
+    }
+    struct row row = {0};
+    bool parsed = n >= 0 && parse(f, fill, line, n, &row);
+    free(line);
+
+    pthread_mutex_lock(&f->lock);
+    f->reading = false;
+    if (parsed && f->len == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 64;
+        struct row *rows = realloc(f->rows, cap * sizeof(struct row));
+        if (!rows) {
+            perror("realloc()");
+            if (row.owned) {
+                yyjson_doc_free(row.doc);
+            }
+            parsed = false;
+            f->failed = true;
+        } else {
+            f->rows = rows;
+            f->cap = cap;
+        }
+    }
+    if (parsed) {
+        f->rows[f->len++] = row;
+        f->bytes += row.bytes;
+    } else {
+        f->done = true;
+        f->bad = n >= 0 && !f->failed;
+        land(f);
+    }
+    pthread_cond_broadcast(&f->more);
+}
+
+int flight_read(struct flight_reader *r, yyjson_doc **doc) {
+    struct flight *f = r->flight;
+    pthread_mutex_lock(&f->lock);
+    while (r->next == f->base + f->len && !f->done) {
+        if (f->reading) {
+            pthread_cond_wait(&f->more, &f->lock);
+        } else {
+            read_row(f);
+        }
+    }
+
+    int rc = f->failed ? FLIGHT_NOMEM : f->bad ? -1 : 0;
+    if (r->next < f->base + f->len && !f->rows[r->next - f->base].doc) {
+        rc = FLIGHT_BEHIND;
+    } else if (r->next < f->base + f->len) {
+        *doc = f->rows[r->next - f->base].doc;
+        r->next++;
+        trim(f);
+        rc = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+// Take R off its flight, and whether it was the last one on it.
+static bool unboard(struct flight_reader *r) {
+    struct flight *f = r->flight;
+    pthread_mutex_lock(&lock);
+    pthread_mutex_lock(&f->lock);
+    for (struct flight_reader **p = &f->readers; *p; p = &(*p)->link) {
+        if (*p == r) {
+            *p = r->link;
+            break;
+        }
+    }
+    if (r == f->filler) {
+        // The table the rows were for may be going away
+        f->filling = false;
+        f->filler = NULL;
+    }
+    bool last = !f->readers;
+    if (last && f->url) {
+        for (struct flight **p = &flights; *p; p = &(*p)->next) {
+            if (*p == f) {
+                *p = f->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+    pthread_mutex_unlock(&lock);
+    return last;
+}
+
+int flight_resume(struct flight_reader *r, FILE *stream, struct fetch_response *response) {
+    struct flight *old = r->flight;
+    const void *group = old->group;
+    size_t read = r->next;
+    if (unboard(r)) {
+        flight_free(old);
+    }
+    if (!flight_new(NULL, group, stream, response, NULL, 0, r)) {
+        r->flight = NULL;
+        fclose(stream);
+        fetch_response_release(response);
+        return FLIGHT_NOMEM;
+    }
+    stat_add(STAT_COALESCE_BEHIND, 1);
+
+    // Up to where it was on the old one
+    yyjson_doc *doc = NULL;
+    for (size_t i = 0; i < read; i++) {
+        int rc = flight_read(r, &doc);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+    return 1;
+}
+
+const struct fetch_response *flight_response(const struct flight_reader *r) {
+    return r->flight->response;
+}
+
+void flight_leave(struct flight_reader *r) {
+    if (!r) {
+        return;
+    }
+    struct flight *f = r->flight;
+    bool last = f && unboard(r);
+    free(r);
+    if (last) {
+        flight_free(f);
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * @file flight.h
+ * @brief One download of a URL, read by every cursor that asks for it
+ * while it's going.
+ *
+ * A flight owns a response stream and parses it a row at a time, on behalf
+ * of whichever of its readers first wants a row nobody read yet. Each reader
+ * has a position of its own, so rows stay in the flight for the readers
+ * behind, and only go once every reader passed them and the flight holds
+ * more than it may keep.
+ *
+ * What a flight keeps for readers behind is capped, see #FLIGHT_BEHIND.
+ *
+ * A cursor asking for a URL already on its way joins its flight instead of
+ * sending the request again, for as long as the flight still has its first
+ * row. Once the body is all in, only cursors of the database that started
+ * the flight may still join: a self-join downloads once, while another
+ * connection coming by later sends a request of its own.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <yyjson.h>
+
+struct fetch_response;
+struct rowcache_entry;
+struct flight_reader;
+
+/**
+ * @brief #flight_read() found the reader's next row dropped, the flight
+ * having held more than it may keep for it. The reader reads on from a
+ * download of its own, see #flight_resume().
+ */
+#define FLIGHT_BEHIND (-2)
+
+/**
+ * @brief Out of memory for the next row, which may well be fine.
+ */
+#define FLIGHT_NOMEM (-3)
+
+/**
+ * @brief A reader at the first row of a flight for URL that can be joined
+ * from GROUP, or `NULL`.
+ */
+struct flight_reader *flight_join(const char *url, const void *group);
+
+/**
+ * @brief Start a flight reading rows off STREAM, and a reader for it.
+ *
+ * The flight takes STREAM, the RESPONSE it's for and FILL, if given, which
+ * gets the rows parsed into it to be kept once they're all in, unless the
+ * reader returned leaves before.
+ *
+ * @param url What others join it by, or `NULL` to keep it to the caller.
+ * @param group Who started it, see #flight_join().
+ * @param keep Bytes of rows kept around for readers behind or yet to come,
+ * 0 for #FETCH_HIGH_WATER.
+ * @return A reader at the first row, or `NULL` with nothing taken.
+ */
+struct flight_reader *flight_begin(const char *url, const void *group, FILE *stream,
+                                   struct fetch_response *response,
+                                   struct rowcache_entry *fill, size_t keep);
+
+/**
+ * @brief R's next row into DOC. The row is the flight's, and stays valid
+ * until R reads again or leaves.
+ *
+ * @retval 1 A row.
+ * @retval 0 No more rows.
+ * @retval -1 The next row isn't JSON, and there are no more after it.
+ * @retval FLIGHT_BEHIND The next row is gone.
+ * @retval FLIGHT_NOMEM Out of memory.
+ */
+int flight_read(struct flight_reader *r, yyjson_doc **doc);
+
+/**
+ * @brief Move R, behind on its flight, to one of its own reading the
+ * same rows off STREAM, and skip it to where it was.
+ *
+ * Takes STREAM and RESPONSE either way. On failure R can only be left.
+ *
+ * @return 1 when R is back where it was, or what #flight_read() said.
+ */
+int flight_resume(struct flight_reader *r, FILE *stream, struct fetch_response *response);
+
+/**
+ * @brief The response R's flight reads.
+ */
+const struct fetch_response *flight_response(const struct flight_reader *r);
+
+/**
+ * @brief Let go of R, and of its flight with its last reader.
+ */
+void flight_leave(struct flight_reader *r);
@@ -0,0 +1,751 @@
+#include "h2.h"
+
+#ifndef YARTS_HTTP2
+
+int h2_submit(struct fetch_state *fs) {
+    return fetch_submit(fs);
+}
+
+#else
+#include "dns.h"
+#include "pool.h"
+#include "reactor.h"
+#include "ring.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <nghttp2/nghttp2.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* How long an origin that turned HTTP/2 down gets HTTP/1.1 before we offer again */
+#define H1_ONLY_MS 300000
+
+/* What we offer over ALPN, in wire format */
+#define ALPN_H2 "\x02h2\x08http/1.1"
+
+#define NV(name, value) {                                   \
+    (uint8_t *) (name), (uint8_t *) (value),                \
+    strlen(name), strlen(value), NGHTTP2_NV_FLAG_NONE       \
+}
+
+enum h2_phase {
+    H2_CONNECTING,
+    H2_HANDSHAKING,
+    H2_OPEN,
+};
+
+struct h2conn {
+    struct reactor_task task;   // first, so a task pointer is an h2conn pointer
+
+    char *origin;
+    char *hostname;
+    char *port;
+    bool tls;
+    long connect_timeout_ms;
+
+    enum h2_phase phase;
+    struct addrinfo *addrinfo;
+    struct tcp_race race;
+    int fd;
+    SSL *ssl;
+    uint32_t net_events;
+    struct recv_ring ring;
+    nghttp2_session *session;
+
+    /* Streams handed over by other threads */
+    int wakeup;                     // eventfd, written to when #inbox grows
+    pthread_mutex_t lock;
+    struct fetch_state *inbox;
+
+    /* Shard thread only */
+    struct fetch_state *waiting;    // taken on before the session opened
+    struct fetch_state *open;       // submitted and not closed yet
+    struct fetch_state *refused;    // turned away unprocessed, to send elsewhere
+    size_t streams;                 // length of #open
+    bool draining;                  // out of the registry, ends with its last stream
+    bool failed;                    // never got to speak HTTP/2
+
+    struct h2conn *next;            // registry link
+};
+
+struct h1_only {
+    char *origin;
+    long long until_ms;
+    struct h1_only *next;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct h2conn *registry = NULL;
+static struct h1_only *h1_origins = NULL;
+
+// Whether ORIGIN turned HTTP/2 down lately. Caller holds registry_lock.
+static bool is_h1_only(const char *origin) {
+    long long now = reactor_now_ms();
+    for (struct h1_only **link = &h1_origins; *link; ) {
+        struct h1_only *h = *link;
+        if (h->until_ms <= now) {
+            *link = h->next;
+            free(h->origin);
+            free(h);
+            continue;
+        }
+        if (strcmp(h->origin, origin) == 0) {
+            return true;
+        }
+        link = &h->next;
+    }
+    return false;
+}
+
+static void mark_h1_only(const char *origin) {
+    struct h1_only *h = calloc(1, sizeof(struct h1_only));
+    if (!h || !(h->origin = strdup(origin))) {
+        free(h);
+        return;
+    }
+    h->until_ms = reactor_now_ms() + H1_ONLY_MS;
+    pthread_mutex_lock(&registry_lock);
+    h->next = h1_origins;
+    h1_origins = h;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Take CONN out of the registry, so new streams get a connection of their own.
+static void unregister(struct h2conn *conn) {
+    pthread_mutex_lock(&registry_lock);
+    for (struct h2conn **link = &registry; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    conn->draining = true;
+}
+
+// Send FS over HTTP/1.1, on a connection of its own.
+static int run_as_http1(struct fetch_state *fs) {
+    if (fs->netfd < 0 && !fs->addrinfo
+        && dns_resolve(fs->hostname, fs->port, &fs->addrinfo) != 0) {
+        return -1;
+    }
+    return fetch_submit(fs);
+}
+
+static void watch_net(struct h2conn *conn, uint32_t events) {
+    if (events != conn->net_events && reactor_watch(&conn->task, conn->fd, events) == 0) {
+        conn->net_events = events;
+    }
+}
+
+/* ---------------- nghttp2 callbacks ---------------- */
+
+static ssize_t on_send(nghttp2_session *session, const uint8_t *data,
+                       size_t len, int flags, void *user_data)
+{
+    (void) session;
+    (void) flags;
+    struct h2conn *conn = user_data;
+    ssize_t n = ttcp_send(conn->fd, (const char *) data, len, conn->ssl);
+    if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+        return NGHTTP2_ERR_WOULDBLOCK;
+    }
+    return n < 0 ? NGHTTP2_ERR_CALLBACK_FAILURE : n;
+}
+
+static int on_header(nghttp2_session *session, const nghttp2_frame *frame,
+                     const uint8_t *name, size_t namelen,
+                     const uint8_t *value, size_t valuelen,
+                     uint8_t flags, void *user_data)
+{
+    (void) flags;
+    (void) user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE) {
+        return 0;
+    }
+    struct fetch_state *fs = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (!fs) {
+        return 0;
+    }
+    // nghttp2 hands out NUL terminated, lowercase names
+    if (namelen == 7 && memcmp(name, ":status", 7) == 0) {
+        fs->status = atoi((const char *) value);
+        return 0;
+    }
+    if (fs->response && name[0] != ':') {
+        fetch_response_add(fs->response, (const char *) name, namelen,
+                           (const char *) value, valuelen);
+    }
+    if (namelen == 16 && memcmp(name, "content-encoding", 16) == 0
+        && decoder_init(&fs->decoder, content_encoding_of((const char *) value)) < 0)
+    {
+        fprintf(stderr, "fetch: can't decode content-encoding: %s\n", (const char *) value);
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, frame->hd.stream_id, NGHTTP2_CANCEL);
+    }
+    return 0;
+}
+
+static int on_frame(nghttp2_session *session, const nghttp2_frame *frame, void *user_data) {
+    struct h2conn *conn = user_data;
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        // Streams past the last one the server took come back as refused
+        unregister(conn);
+    } else if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_RESPONSE) {
+        struct fetch_state *fs = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+        if (fs) {
+            fs->headers_done = true;
+            if (fs->response) {
+                fetch_response_publish(fs->response, fs->status);
+            }
+        }
+    }
+    return 0;
+}
+
+static int on_data(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                   const uint8_t *data, size_t len, void *user_data)
+{
+    (void) flags;
+    struct h2conn *conn = user_data;
+    // Other streams keep flowing whatever happens to this one
+    nghttp2_session_consume_connection(session, len);
+
+    struct fetch_state *fs = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!fs || fs->http_done) {
+        nghttp2_session_consume_stream(session, stream_id, len);
+        return 0;
+    }
+    fetch_body(fs, (const char *) data, len);
+    size_t backlog = fetch_deliver(fs);
+    if (fs->http_done) {
+        // Corrupt body, or no one's reading it anymore
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+        return 0;
+    }
+
+    // Until the consumer catches up, the stream's window stays shut
+    // once the server used it up
+    if (fs->unconsumed == 0 && backlog < fs->high_water) {
+        nghttp2_session_consume_stream(session, stream_id, len);
+        return 0;
+    }
+    fs->unconsumed += len;
+    if (!(fs->out_events & EPOLLOUT)
+        && reactor_watch(&conn->task, fs->outfd, EPOLLOUT | EPOLLRDHUP) == 0) {
+        fs->out_events = EPOLLOUT | EPOLLRDHUP;
+    }
+    return 0;
+}
+
+// FS's outfd became writable while its stream was held back.
+static void catch_up(struct h2conn *conn, struct fetch_state *fs) {
+    if (fetch_deliver(fs) > fs->high_water / 2 && !fs->http_done) {
+        return;
+    }
+    if (reactor_watch(&conn->task, fs->outfd, EPOLLRDHUP) == 0) {
+        fs->out_events = EPOLLRDHUP;
+    }
+    if (fs->http_done) {
+        nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, fs->stream_id, NGHTTP2_CANCEL);
+    } else {
+        nghttp2_session_consume_stream(conn->session, fs->stream_id, fs->unconsumed);
+    }
+    fs->unconsumed = 0;
+}
+
+// FS's consumer hung up, so the server can stop sending its stream.
+static void hang_up(struct h2conn *conn, struct fetch_state *fs) {
+    reactor_unwatch(&conn->task, fs->outfd);
+    fs->out_events = 0;
+    fs->unconsumed = 0;
+    fs->http_done = true;
+    nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, fs->stream_id, NGHTTP2_CANCEL);
+}
+
+// Done with FS, which is off #h2conn.open already.
+static void end_stream(struct h2conn *conn, struct fetch_state *fs) {
+    if (fs->out_events) {
+        reactor_unwatch(&conn->task, fs->outfd);
+        fs->out_events = 0;
+    }
+    fetch_end(fs);
+}
+
+static void unlink_open(struct h2conn *conn, struct fetch_state *fs) {
+    for (struct fetch_state **link = &conn->open; *link; link = &(*link)->next_stream) {
+        if (*link == fs) {
+            *link = fs->next_stream;
+            fs->next_stream = NULL;
+            conn->streams--;
+            return;
+        }
+    }
+}
+
+static int on_stream_close(nghttp2_session *session, int32_t stream_id,
+                           uint32_t error_code, void *user_data)
+{
+    struct h2conn *conn = user_data;
+    struct fetch_state *fs = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!fs) {
+        return 0;
+    }
+    unlink_open(conn, fs);
+    if (fs->out_events) {
+        reactor_unwatch(&conn->task, fs->outfd);
+        fs->out_events = 0;
+    }
+
+    if (error_code == NGHTTP2_REFUSED_STREAM && fs->decoder.encoded_bytes == 0) {
+        // Never processed, so it's safe to send again on another connection
+        fs->stream_id = 0;
+        fs->next_stream = conn->refused;
+        conn->refused = fs;
+        unregister(conn);
+        return 0;
+    }
+
+    fs->body_done = error_code == NGHTTP2_NO_ERROR && !fs->http_done;
+    fs->http_done = true;
+    end_stream(conn, fs);
+    return 0;
+}
+
+/* ---------------- connection ---------------- */
+
+static void start_stream(struct h2conn *conn, struct fetch_state *fs) {
+    nghttp2_nv headers[] = {
+        NV(":method", "GET"),
+        NV(":scheme", conn->tls ? "https" : "http"),
+        NV(":authority", fs->authority),
+        NV(":path", fs->path),
+        NV("user-agent", "yarts/1.0"),
+        NV("accept", "*/*"),
+        NV("accept-encoding", decoder_accept_encoding()),
+    };
+    int32_t id = nghttp2_submit_request(conn->session, NULL, headers,
+                                        sizeof(headers) / sizeof(headers[0]), NULL, fs);
+    if (id < 0) {
+        fprintf(stderr, "nghttp2_submit_request(): %s\n", nghttp2_strerror(id));
+        fetch_end(fs);
+        return;
+    }
+    fs->stream_id = id;
+    fs->next_stream = conn->open;
+    conn->open = fs;
+    conn->streams++;
+    // The consumer hanging up resets the stream, see hang_up()
+    if (reactor_watch(&conn->task, fs->outfd, EPOLLRDHUP) == 0) {
+        fs->out_events = EPOLLRDHUP;
+    }
+    stat_add(STAT_H2_STREAM, 1);
+}
+
+// Move streams other threads handed us onto the session, or into the
+// waiting line while there's no session yet.
+static void adopt_inbox(struct h2conn *conn) {
+    uint64_t count;
+    if (read(conn->wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read()");
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    struct fetch_state *inbox = conn->inbox;
+    conn->inbox = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    while (inbox) {
+        struct fetch_state *next = inbox->next_stream;
+        if (conn->phase == H2_OPEN) {
+            start_stream(conn, inbox);
+        } else {
+            inbox->next_stream = conn->waiting;
+            conn->waiting = inbox;
+        }
+        inbox = next;
+    }
+}
+
+// Send whatever the session has queued up and watch the socket for what's next.
+static bool pump(struct h2conn *conn) {
+    int rc = nghttp2_session_send(conn->session);
+    if (rc != 0) {
+        fprintf(stderr, "nghttp2_session_send(): %s\n", nghttp2_strerror(rc));
+        return false;
+    }
+    bool want_write = nghttp2_session_want_write(conn->session);
+    if (!want_write && !nghttp2_session_want_read(conn->session)) {
+        return false;
+    }
+    if (conn->draining && conn->streams == 0) {
+        return false;
+    }
+    watch_net(conn, EPOLLIN | (want_write ? EPOLLOUT : 0));
+    conn->task.deadline_ms = conn->streams == 0
+        ? reactor_now_ms() + H2_IDLE_TIMEOUT_MS
+        : 0;
+    return true;
+}
+
+static bool receive(struct h2conn *conn) {
+    for (;;) {
+        ssize_t n = ring_fill(&conn->ring, conn->fd, conn->ssl, SIZE_MAX);
+        if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            ring_settle(&conn->ring);
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        struct iovec iov[2];
+        int segs = ring_peek(&conn->ring, iov);
+        for (int i = 0; i < segs; i++) {
+            ssize_t used = nghttp2_session_mem_recv(conn->session, iov[i].iov_base, iov[i].iov_len);
+            if (used < 0) {
+                fprintf(stderr, "nghttp2_session_mem_recv(): %s\n", nghttp2_strerror((int) used));
+                return false;
+            }
+        }
+        ring_consume(&conn->ring, ring_len(&conn->ring));
+    }
+}
+
+static bool open_session(struct h2conn *conn) {
+    nghttp2_session_callbacks *callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+        return false;
+    }
+    nghttp2_session_callbacks_set_send_callback(callbacks, on_send);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+
+    // Streams give their window back as the consumer takes rows, see on_data()
+    nghttp2_option *option;
+    if (nghttp2_option_new(&option) != 0) {
+        nghttp2_session_callbacks_del(callbacks);
+        return false;
+    }
+    nghttp2_option_set_no_auto_window_update(option, 1);
+    int rc = nghttp2_session_client_new2(&conn->session, callbacks, conn, option);
+    nghttp2_option_del(option);
+    nghttp2_session_callbacks_del(callbacks);
+    if (rc != 0) {
+        conn->failed = true;
+        return false;
+    }
+
+    // Windows well past the 64 KiB defaults, so a fast server isn't kept
+    // waiting on WINDOW_UPDATEs. They go out as we consume data.
+    nghttp2_settings_entry settings[] = {
+        { NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+        { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW },
+    };
+    nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, settings,
+                            sizeof(settings) / sizeof(settings[0]));
+    nghttp2_session_set_local_window_size(conn->session, NGHTTP2_FLAG_NONE, 0,
+                                          H2_CONNECTION_WINDOW);
+    conn->phase = H2_OPEN;
+    stat_add(STAT_H2_CONNECT, 1);
+
+    struct fetch_state *waiting = conn->waiting;
+    conn->waiting = NULL;
+    while (waiting) {
+        struct fetch_state *next = waiting->next_stream;
+        start_stream(conn, waiting);
+        waiting = next;
+    }
+    return pump(conn);
+}
+
+// The origin turned HTTP/2 down. Everyone goes HTTP/1.1, the first
+// waiting stream over the connection we already have.
+static bool fall_back(struct h2conn *conn) {
+    stat_add(STAT_H2_FALLBACK, 1);
+    mark_h1_only(conn->origin);
+    unregister(conn);
+
+    if (conn->net_events) {
+        reactor_unwatch(&conn->task, conn->fd);
+        conn->net_events = 0;
+    }
+    struct fetch_state *first = conn->waiting;
+    if (first) {
+        conn->waiting = first->next_stream;
+        first->next_stream = NULL;
+        first->netfd = conn->fd;
+        first->ssl = conn->ssl;
+        if (fetch_submit(first) < 0) {
+            fetch_end(first);
+        }
+    } else {
+        pool_release(conn->origin, (struct pooled) { .fd = conn->fd, .ssl = conn->ssl });
+    }
+    conn->fd = -1;
+    conn->ssl = NULL;
+    return false;
+}
+
+static bool handshake(struct h2conn *conn) {
+    int rc = ttcp_tls_handshake(conn->fd, &conn->ssl, conn->hostname, conn->port, ALPN_H2);
+    if (rc == TTCP_WANT_READ || rc == TTCP_WANT_WRITE) {
+        watch_net(conn, rc == TTCP_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+        return true;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "ttcp_tls_handshake(%s:%s) failed\n", conn->hostname, conn->port);
+        conn->failed = true;
+        return false;
+    }
+    return ttcp_tls_alpn_is(conn->ssl, "h2") ? open_session(conn) : fall_back(conn);
+}
+
+// Outcome RC of a #tcp_race call.
+static bool on_race(struct h2conn *conn, int rc) {
+    if (rc == -1) {
+        conn->task.deadline_ms = reactor_now_ms() + tcp_race_timeout(&conn->race);
+        return true;
+    }
+    conn->task.deadline_ms = 0;
+    if (rc == -2) {
+        fprintf(stderr, "connect(%s:%s): %s\n", conn->hostname, conn->port, strerror(errno));
+        conn->failed = true;
+        return false;
+    }
+
+    conn->fd = rc;
+    if (!conn->tls) {
+        // h2c with prior knowledge
+        return open_session(conn);
+    }
+    conn->phase = H2_HANDSHAKING;
+    return handshake(conn);
+}
+
+static bool conn_start(struct reactor_task *task) {
+    struct h2conn *conn = (struct h2conn *) task;
+    if (reactor_watch(task, conn->wakeup, EPOLLIN) < 0) {
+        conn->failed = true;
+        return false;
+    }
+    adopt_inbox(conn);
+    conn->phase = H2_CONNECTING;
+    return on_race(conn, tcp_race_start(&conn->race, conn->addrinfo, task,
+                                        conn->connect_timeout_ms));
+}
+
+static bool conn_ready(struct reactor_task *task, int fd, uint32_t events) {
+    struct h2conn *conn = (struct h2conn *) task;
+    if (fd == conn->wakeup) {
+        adopt_inbox(conn);
+        return conn->phase != H2_OPEN || pump(conn);
+    }
+
+    if (conn->phase == H2_OPEN && fd != conn->fd) {
+        for (struct fetch_state *fs = conn->open; fs; fs = fs->next_stream) {
+            if (fs->outfd == fd && fs->out_events) {
+                if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    hang_up(conn, fs);
+                } else {
+                    catch_up(conn, fs);
+                }
+                break;
+            }
+        }
+        return pump(conn);
+    }
+
+    switch (conn->phase) {
+    case H2_CONNECTING:
+        return !tcp_race_owns(&conn->race, fd)
+            || on_race(conn, tcp_race_ready(&conn->race, fd, events));
+    case H2_HANDSHAKING:
+        return handshake(conn);
+    default:
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !receive(conn)) {
+            return false;
+        }
+        return pump(conn);
+    }
+}
+
+static bool conn_expired(struct reactor_task *task) {
+    struct h2conn *conn = (struct h2conn *) task;
+    if (conn->phase == H2_CONNECTING) {
+        return on_race(conn, tcp_race_tick(&conn->race));
+    }
+    if (conn->phase == H2_OPEN && conn->streams == 0) {
+        // Idle for long enough, say goodbye properly
+        nghttp2_session_terminate_session(conn->session, NGHTTP2_NO_ERROR);
+        nghttp2_session_send(conn->session);
+        return false;
+    }
+    return true;
+}
+
+// Pass the streams on LIST to another connection, or end them if
+// this origin can't be reached at all.
+static void requeue(struct fetch_state *list, bool failed) {
+    while (list) {
+        struct fetch_state *next = list->next_stream;
+        list->next_stream = NULL;
+        if (failed || h2_submit(list) < 0) {
+            fetch_end(list);
+        }
+        list = next;
+    }
+}
+
+static void conn_finish(struct reactor_task *task) {
+    struct h2conn *conn = (struct h2conn *) task;
+    unregister(conn);
+    if (conn->phase == H2_CONNECTING) {
+        tcp_race_abort(&conn->race);
+    }
+    reactor_unwatch(task, conn->wakeup);
+    if (conn->net_events) {
+        reactor_unwatch(task, conn->fd);
+    }
+
+    // Streams in flight die with the connection. nghttp2_session_del()
+    // doesn't call on_stream_close(), so they're ended here.
+    while (conn->open) {
+        struct fetch_state *fs = conn->open;
+        conn->open = fs->next_stream;
+        fs->next_stream = NULL;
+        fs->http_done = true;
+        end_stream(conn, fs);
+    }
+    nghttp2_session_del(conn->session);
+
+    pthread_mutex_lock(&conn->lock);
+    struct fetch_state *inbox = conn->inbox;
+    conn->inbox = NULL;
+    pthread_mutex_unlock(&conn->lock);
+    requeue(inbox, conn->failed);
+    requeue(conn->waiting, conn->failed);
+    requeue(conn->refused, false);
+
+    if (conn->fd >= 0) {
+        ttcp_tls_free(conn->ssl);
+        close(conn->fd);
+    }
+    close(conn->wakeup);
+    ring_free(&conn->ring);
+    dns_freeaddrinfo(conn->addrinfo);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->origin);
+    free(conn->hostname);
+    free(conn->port);
+    free(conn);
+}
+
+// A connection to FS's origin, taking FS's resolved addresses.
+static struct h2conn *conn_new(struct fetch_state *fs) {
+    struct h2conn *conn = calloc(1, sizeof(struct h2conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    conn->origin = strdup(fs->origin);
+    conn->hostname = strdup(fs->hostname);
+    conn->port = strdup(fs->port);
+    if (conn->wakeup < 0 || !conn->origin || !conn->hostname || !conn->port) {
+        if (conn->wakeup >= 0) close(conn->wakeup);
+        free(conn->origin);
+        free(conn->hostname);
+        free(conn->port);
+        free(conn);
+        return NULL;
+    }
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->fd = -1;
+    conn->tls = fs->is_tls;
+    conn->connect_timeout_ms = fs->connect_timeout_ms;
+    conn->addrinfo = fs->addrinfo;
+    fs->addrinfo = NULL;
+    conn->task = (struct reactor_task) {
+        .start = conn_start,
+        .ready = conn_ready,
+        .expired = conn_expired,
+        .finish = conn_finish,
+    };
+    return conn;
+}
+
+int h2_submit(struct fetch_state *fs) {
+    pthread_mutex_lock(&registry_lock);
+    bool h1_only = is_h1_only(fs->origin);
+    pthread_mutex_unlock(&registry_lock);
+    if (h1_only) {
+        return run_as_http1(fs);
+    }
+
+    if (fs->netfd >= 0) {
+        // fetch_socket() found a pooled HTTP/1.1 connection, leave it for someone else
+        pool_release(fs->origin, (struct pooled) { .fd = fs->netfd, .ssl = fs->ssl });
+        fs->netfd = -1;
+        fs->ssl = NULL;
+    }
+    if (!fs->addrinfo && dns_resolve(fs->hostname, fs->port, &fs->addrinfo) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    struct h2conn *conn = registry;
+    while (conn && strcmp(conn->origin, fs->origin) != 0) {
+        conn = conn->next;
+    }
+
+    bool fresh = !conn;
+    if (fresh) {
+        conn = conn_new(fs);
+        if (!conn) {
+            pthread_mutex_unlock(&registry_lock);
+            return run_as_http1(fs);
+        }
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    fs->next_stream = conn->inbox;
+    conn->inbox = fs;
+    pthread_mutex_unlock(&conn->lock);
+
+    // Still holding registry_lock, so CONN can't finish (and be freed)
+    // before it sees FS
+    if (fresh) {
+        if (reactor_submit(&conn->task) < 0) {
+            fs->addrinfo = conn->addrinfo;
+            conn->addrinfo = NULL;
+            conn->inbox = NULL;
+            pthread_mutex_unlock(&registry_lock);
+            close(conn->wakeup);
+            pthread_mutex_destroy(&conn->lock);
+            free(conn->origin);
+            free(conn->hostname);
+            free(conn->port);
+            free(conn);
+            return -1;
+        }
+        conn->next = registry;
+        registry = conn;
+    } else {
+        uint64_t one = 1;
+        if (write(conn->wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write()");
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+#endif
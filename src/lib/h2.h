@@ -0,0 +1,30 @@
+/**
+ * @file h2.h
+ * @brief HTTP/2 transport, many fetches as streams over one connection per origin.
+ *
+ * Over TLS, HTTP/2 is offered through ALPN and origins that turn it down
+ * are remembered and served over HTTP/1.1. Plain `http:` origins are
+ * spoken to in HTTP/2 right away ("prior knowledge" h2c), so only ask for
+ * it on those when the server is known to take it.
+ *
+ * Needs nghttp2, built with `make HTTP2=1`. Without it, #h2_submit() is
+ * just #fetch_submit().
+ */
+#pragma once
+#include "fetch.h"
+
+/** How long a connection with no streams is kept around for new ones. */
+#define H2_IDLE_TIMEOUT_MS 4000
+
+/** Receive window we give each stream, and the connection as a whole. */
+#define H2_STREAM_WINDOW (1 << 20)
+#define H2_CONNECTION_WINDOW (16 << 20)
+
+/**
+ * @brief Run FS as a stream on FS's origin's HTTP/2 connection, opening
+ * one if there's none, or over HTTP/1.1 when the origin won't speak HTTP/2.
+ *
+ * @retval 0 OK, FS belongs to the transport now.
+ * @retval -1 Error, FS is still the caller's.
+ */
+int h2_submit(struct fetch_state *fs);
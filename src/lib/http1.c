@@ -0,0 +1,185 @@
+#include "http1.h"
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_X86 1
+#endif
+
+#ifdef HTTP_X86
+__attribute__((target("avx2")))
+static size_t find_lf_avx2(const char *buf, size_t len) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    const char *lf_at = memchr(buf + i, '\n', len - i);
+    return lf_at ? (size_t) (lf_at - buf) : len;
+}
+
+__attribute__((target("sse2")))
+static size_t find_lf_sse2(const char *buf, size_t len) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    const char *lf_at = memchr(buf + i, '\n', len - i);
+    return lf_at ? (size_t) (lf_at - buf) : len;
+}
+#endif
+
+/* Lines up to this long are found quicker a byte at a time, like
+ * chunk framing ("\r\n", "1000\r\n") */
+#define SHORT_LINE 8
+
+size_t http_find_lf(const char *buf, size_t len) {
+    size_t probe = len < SHORT_LINE ? len : SHORT_LINE;
+    for (size_t i = 0; i < probe; i++) {
+        if (buf[i] == '\n') {
+            return i;
+        }
+    }
+    if (probe == len) {
+        return len;
+    }
+
+#ifdef HTTP_X86
+    size_t rest = len - probe;
+    if (rest >= 64 && __builtin_cpu_supports("avx2")) {
+        return probe + find_lf_avx2(buf + probe, rest);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return probe + find_lf_sse2(buf + probe, rest);
+    }
+#endif
+    const char *lf_at = memchr(buf + probe, '\n', len - probe);
+    return lf_at ? (size_t) (lf_at - buf) : len;
+}
+
+static bool is_ows(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// "HTTP/1.1 200 OK"
+static int parse_status_line(struct http_head *head, const char *line, size_t len) {
+    if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+        return -1;
+    }
+    head->minor_version = line[7] - '0';
+    int status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            return -1;
+        }
+        status = status * 10 + (line[i] - '0');
+    }
+    head->status = status;
+    return 0;
+}
+
+static int parse_header_line(struct http_head *head, const char *line, size_t len) {
+    const char *colon = memchr(line, ':', len);
+    if (!colon || colon == line || is_ows(colon[-1])) {
+        return -1;
+    }
+    if (head->headers_len == HTTP_MAX_HEADERS) {
+        return -1;
+    }
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && is_ows(*value)) value++;
+    while (end > value && is_ows(end[-1])) end--;
+
+    head->headers[head->headers_len++] = (struct http_header) {
+        .name = line,
+        .name_len = colon - line,
+        .value = value,
+        .value_len = end - value,
+    };
+    return 0;
+}
+
+ssize_t http_parse_head(struct http_head *head, const char *buf, size_t len) {
+    while (head->parsed < len) {
+        const char *line = buf + head->parsed;
+        size_t avail = len - head->parsed;
+        size_t lf = http_find_lf(line, avail);
+        if (lf == avail) {
+            return 0;
+        }
+
+        size_t line_len = lf > 0 && line[lf - 1] == '\r' ? lf - 1 : lf;
+        bool first = head->parsed == 0;
+        head->parsed += lf + 1;
+
+        if (first) {
+            if (parse_status_line(head, line, line_len) < 0) {
+                return -1;
+            }
+        } else if (line_len == 0) {
+            return head->parsed;
+        } else if (parse_header_line(head, line, line_len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const struct http_header *http_head_get(const struct http_head *head, const char *name) {
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < head->headers_len; i++) {
+        const struct http_header *h = &head->headers[i];
+        if (h->name_len == name_len && strncasecmp(h->name, name, name_len) == 0) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+bool http_header_has_token(const struct http_header *header, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = header->value;
+    const char *end = header->value + header->value_len;
+    while (p < end) {
+        while (p < end && (is_ows(*p) || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ';' && !is_ows(*p)) p++;
+        if ((size_t) (p - start) == token_len && strncasecmp(start, token, token_len) == 0) {
+            return true;
+        }
+        // Skip parameters, like "chunked;foo=bar"
+        while (p < end && *p != ',') p++;
+    }
+    return false;
+}
+
+long long http_chunk_size(const char *line, size_t len) {
+    long long size = 0;
+    size_t i = 0;
+    for (; i < len; i++) {
+        char c = line[i];
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else break;
+        if (size > (1LL << 56)) {
+            return -1;
+        }
+        size = size * 16 + digit;
+    }
+    return i == 0 ? -1 : size;
+}
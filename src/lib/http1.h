@@ -0,0 +1,72 @@
+/**
+ * @file http1.h
+ * @brief Incremental HTTP/1.1 response head parser.
+ *
+ * Bytes are fed as they arrive and each line is tokenized exactly once,
+ * into a table of headers pointing back into the caller's buffer. Line
+ * ends are found 16 or 32 bytes at a time with SSE2 or AVX2 when the CPU
+ * has them.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Most headers a response may carry. */
+#define HTTP_MAX_HEADERS 64
+
+/**
+ * @brief One header line. Neither string is NUL terminated and the value
+ * has its surrounding whitespace trimmed.
+ */
+struct http_header {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+struct http_head {
+    /** `HTTP/1.x` minor version. */
+    int minor_version;
+    int status;
+    size_t headers_len;
+    struct http_header headers[HTTP_MAX_HEADERS];
+
+    /** Where the next unparsed line starts. */
+    size_t parsed;
+};
+
+/**
+ * @brief Offset of the first `'\n'` in BUF[0, LEN), or LEN when there's none.
+ */
+size_t http_find_lf(const char *buf, size_t len);
+
+/**
+ * @brief Parse the response head at the start of BUF, which holds LEN bytes.
+ *
+ * Call again with the same, grown, BUF as more bytes arrive. HEAD carries
+ * the progress between calls and has to be zeroed before the first one.
+ *
+ * @retval >0 Length of the head, blank line included. HEAD is complete.
+ * @retval 0 Need more bytes.
+ * @retval -1 Malformed, or more than #HTTP_MAX_HEADERS headers.
+ */
+ssize_t http_parse_head(struct http_head *head, const char *buf, size_t len);
+
+/**
+ * @brief First header in HEAD called NAME, case insensitively.
+ */
+const struct http_header *http_head_get(const struct http_head *head, const char *name);
+
+/**
+ * @brief Whether comma separated list HEADER holds TOKEN, case insensitively.
+ */
+bool http_header_has_token(const struct http_header *header, const char *token);
+
+/**
+ * @brief Chunk size at the start of chunk-size line LINE, extensions ignored.
+ *
+ * @retval -1 Not a hex number.
+ */
+long long http_chunk_size(const char *line, size_t len);
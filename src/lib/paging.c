@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include "paging.h"
+#include "cfns.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+bool paging_kind(const char *name, enum paging_kind *kind) {
+    static const char *names[] = {
+        [PAGING_LINK] = "link",
+        [PAGING_CURSOR] = "cursor",
+        [PAGING_OFFSET] = "offset",
+        [PAGING_PAGE] = "page",
+    };
+    for (size_t i = PAGING_LINK; i <= PAGING_PAGE; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *kind = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *paging_param(enum paging_kind kind) {
+    switch (kind) {
+    case PAGING_CURSOR: return "cursor";
+    case PAGING_OFFSET: return "offset";
+    case PAGING_PAGE: return "page";
+    default: return NULL;
+    }
+}
+
+// Where the value of query parameter NAME of URL starts, or NULL.
+static const char *query_value(const char *url, const char *name) {
+    size_t end = strcspn(url, "#");
+    const char *q = memchr(url, '?', end);
+    if (!q) {
+        return NULL;
+    }
+    size_t len = strlen(name);
+    const char *p = q + 1;
+    while (p < url + end) {
+        size_t n = strcspn(p, "&#");
+        if (n > len && strncmp(p, name, len) == 0 && p[len] == '=') {
+            return p + len + 1;
+        }
+        if (p[n] != '&') {
+            break;
+        }
+        p += n + 1;
+    }
+    return NULL;
+}
+
+char *paging_with(const char *url, const char *name, const char *value) {
+    char *out = NULL;
+    const char *at = query_value(url, name);
+    int n;
+    if (at) {
+        // In place of what it was
+        size_t old = strcspn(at, "&#");
+        n = asprintf(&out, "%.*s%s%s", (int) (at - url), url, value, at + old);
+    } else {
+        // Last in the query, before any fragment
+        size_t end = strcspn(url, "#");
+        const char *sep = !memchr(url, '?', end) ? "?"
+            : url[end - 1] == '?' || url[end - 1] == '&' ? "" : "&";
+        n = asprintf(&out, "%.*s%s%s=%s%s", (int) end, url, sep, name, value, url + end);
+    }
+    return n < 0 ? perror_rc(NULL, "asprintf()", 0) : out;
+}
+
+char *paging_nth(const struct paging *p, const char *url, long n) {
+    // Counting from wherever URL already is, if it says
+    const char *at = query_value(url, p->param);
+    long first = at ? strtol(at, NULL, 10) : p->kind == PAGING_PAGE ? 1 : 0;
+    long value = p->kind == PAGING_OFFSET ? first + n * p->size : first + n;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", value);
+    return paging_with(url, p->param, buf);
+}
+
+char *paging_cursor(const struct paging *p, const char *url, const char *cursor) {
+    if (strncmp(cursor, "http://", 7) == 0 || strncmp(cursor, "https://", 8) == 0
+        || strncmp(cursor, "http+unix://", 12) == 0 || cursor[0] == '/' || cursor[0] == '?')
+    {
+        return paging_resolve(cursor, url);
+    }
+
+    // Escaped, since cursors tend to be base64
+    size_t len = strlen(cursor);
+    char *value = malloc(3 * len + 1);
+    if (!value) {
+        return perror_rc(NULL, "malloc()", 0);
+    }
+    char *v = value;
+    for (const unsigned char *c = (const unsigned char *) cursor; *c; c++) {
+        if (isalnum(*c) || strchr("-._~", *c)) {
+            *v++ = *c;
+        } else {
+            v += sprintf(v, "%%%02X", *c);
+        }
+    }
+    *v = '\0';
+    char *next = paging_with(url, p->param, value);
+    free(value);
+    return next;
+}
+
+// Whether link-params PARAMS, LEN bytes of them, have "next" among their rel.
+static bool rel_next(const char *params, size_t len) {
+    for (const char *p = params; p < params + len; p++) {
+        if (strncasecmp(p, "rel", 3) != 0 || (p > params && isalnum((unsigned char) p[-1]))) {
+            continue;
+        }
+        const char *v = p + 3;
+        while (*v == ' ') v++;
+        if (*v != '=') {
+            continue;
+        }
+        v++;
+        while (*v == ' ') v++;
+        bool quoted = *v == '"';
+        v += quoted;
+        // Space separated, like rel="next last"
+        while (v < params + len && *v != '"' && *v != ';' && *v != ',') {
+            size_t n = strcspn(v, " \";,");
+            if (n == 4 && strncasecmp(v, "next", 4) == 0) {
+                return true;
+            }
+            v += n;
+            while (*v == ' ') v++;
+            if (!quoted) {
+                break;
+            }
+        }
+    }
+    return false;
+}
+
+char *paging_link(const char *link, const char *url) {
+    const char *p = link;
+    while ((p = strchr(p, '<'))) {
+        const char *end = strchr(p, '>');
+        if (!end) {
+            return NULL;
+        }
+        // Its params go up to the next link
+        const char *params = end + 1;
+        size_t len = strcspn(params, "<");
+        if (rel_next(params, len)) {
+            char *ref = strndup(p + 1, end - p - 1);
+            if (!ref) {
+                return perror_rc(NULL, "strndup()", 0);
+            }
+            char *next = paging_resolve(ref, url);
+            free(ref);
+            return next;
+        }
+        p = params;
+    }
+    return NULL;
+}
+
+char *paging_resolve(const char *ref, const char *url) {
+    const char *scheme_end = strstr(url, "://");
+    char *out = NULL;
+    int n;
+    if (strstr(ref, "://") || !scheme_end) {
+        n = asprintf(&out, "%s", ref);
+    } else if (strncmp(ref, "//", 2) == 0) {
+        n = asprintf(&out, "%.*s:%s", (int) (scheme_end - url), url, ref);
+    } else if (ref[0] == '/') {
+        const char *host = scheme_end + 3;
+        size_t origin = host - url + strcspn(host, "/?#");
+        n = asprintf(&out, "%.*s%s", (int) origin, url, ref);
+    } else if (ref[0] == '?') {
+        n = asprintf(&out, "%.*s%s", (int) strcspn(url, "?#"), url, ref);
+    } else {
+        // Next to the last path segment
+        size_t path_end = strcspn(url, "?#");
+        const char *host = scheme_end + 3;
+        size_t dir = host - url + strcspn(host, "/?#");
+        for (size_t i = dir; i < path_end; i++) {
+            if (url[i] == '/') {
+                dir = i + 1;
+            }
+        }
+        n = asprintf(&out, "%.*s%s%s", (int) dir, url, url[dir - 1] == '/' ? "" : "/", ref);
+    }
+    return n < 0 ? perror_rc(NULL, "asprintf()", 0) : out;
+}
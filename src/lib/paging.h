@@ -0,0 +1,80 @@
+/**
+ * @file paging.h
+ * @brief Where the next page is, for APIs that split what they have over
+ * many responses.
+ *
+ * A table says how its API paginates with one of four strategies:
+ *
+ * - #PAGING_LINK follows `Link: <...>; rel="next"` response headers.
+ * - #PAGING_CURSOR takes a top-level field of the rows, say `next`, as
+ *   either the next page's URL or a query parameter to ask for it with.
+ * - #PAGING_OFFSET and #PAGING_PAGE set a query parameter to the offset of
+ *   the page's first row or to the page's number, and know where every page
+ *   is up front.
+ *
+ * Everything here is about URLs, and allocates what it returns with
+ * `malloc()`.
+ */
+#pragma once
+#include <stdbool.h>
+
+/** Pages of an offset or page API on their way at once, by default. */
+#define PAGING_FANOUT 4
+
+enum paging_kind {
+    PAGING_NONE,
+    PAGING_LINK,
+    PAGING_CURSOR,
+    PAGING_OFFSET,
+    PAGING_PAGE,
+};
+
+struct paging {
+    enum paging_kind kind;
+    const char *param;          // query parameter a page is asked for with
+    const char *field;          // for #PAGING_CURSOR, where the next cursor is
+    long size;                  // rows a page has, 0 when unknown
+    long fanout;                // pages on their way at once, once the total is known
+    long max;                   // pages read at most, 0 for as many as there are
+};
+
+/**
+ * @brief The strategy called NAME, `link`, `cursor`, `offset` or `page`.
+ *
+ * @retval false No strategy goes by NAME.
+ */
+bool paging_kind(const char *name, enum paging_kind *kind);
+
+/**
+ * @brief The query parameter pages of KIND are asked for with, unless the
+ * table says otherwise.
+ */
+const char *paging_param(enum paging_kind kind);
+
+/**
+ * @brief URL with its query parameter NAME set to VALUE, as is.
+ */
+char *paging_with(const char *url, const char *name, const char *value);
+
+/**
+ * @brief URL of page N of an offset or page API, counting from the first
+ * one, which is URL itself.
+ */
+char *paging_nth(const struct paging *p, const char *url, long n);
+
+/**
+ * @brief URL of the page after the one at URL, given the next CURSOR the
+ * page had, a URL of its own or a value for the query parameter.
+ */
+char *paging_cursor(const struct paging *p, const char *url, const char *cursor);
+
+/**
+ * @brief The `rel="next"` target of `Link` header LINK, resolved against
+ * URL, or `NULL`.
+ */
+char *paging_link(const char *link, const char *url);
+
+/**
+ * @brief REF resolved against URL.
+ */
+char *paging_resolve(const char *ref, const char *url);
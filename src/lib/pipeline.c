@@ -0,0 +1,536 @@
+#include "pipeline.h"
+#include "dns.h"
+#include "pool.h"
+#include "reactor.h"
+#include "ring.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/* A batch's fetches to one origin, and the connections working through them */
+struct host {
+    pthread_mutex_t lock;
+    struct fetch_state *queue;  // not sent yet, in batch order
+    size_t queued;
+    size_t conns;               // connections still running
+
+    char *origin;
+    char *hostname;
+    char *port;
+    bool tls;
+    long connect_timeout_ms;
+};
+
+enum conn_phase {
+    CONN_CONNECTING,
+    CONN_HANDSHAKING,
+    CONN_OPEN,
+};
+
+struct conn {
+    struct reactor_task task;   // first, so a task pointer is a conn pointer
+    struct host *host;
+
+    enum conn_phase phase;
+    struct addrinfo *addrinfo;
+    struct tcp_race race;
+    int fd;
+    SSL *ssl;
+    bool pooled;                // came out of the pool rather than connecting
+    uint32_t net_events;
+    struct recv_ring ring;
+
+    /* Requests taken on and not written out yet, back to back */
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+
+    /* Requests in flight, oldest (the one being read) first */
+    struct fetch_state *inflight;
+    struct fetch_state *inflight_tail;
+    size_t depth;
+
+    size_t answered;            // responses read in full
+    bool reusable;              // the last response left the connection fit for more
+    bool paused;                // the oldest request's consumer fell behind
+};
+
+static void host_free(struct host *host) {
+    pthread_mutex_destroy(&host->lock);
+    free(host->origin);
+    free(host->hostname);
+    free(host->port);
+    free(host);
+}
+
+static void watch_net(struct conn *conn, uint32_t events) {
+    if (events == conn->net_events) {
+        return;
+    }
+    if (events == 0) {
+        reactor_unwatch(&conn->task, conn->fd);
+        conn->net_events = 0;
+    } else if (reactor_watch(&conn->task, conn->fd, events) == 0) {
+        conn->net_events = events;
+    }
+}
+
+// Done with FS, which is off #conn.inflight already.
+static void end_fetch(struct conn *conn, struct fetch_state *fs) {
+    if (fs->out_events) {
+        reactor_unwatch(&conn->task, fs->outfd);
+        fs->out_events = 0;
+        conn->paused = false;
+    }
+    fetch_end(fs);
+}
+
+// Append FS's request to what goes out next.
+static bool queue_request(struct conn *conn, struct fetch_state *fs) {
+    if (conn->out_len + fs->request_len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : 4096;
+        while (cap < conn->out_len + fs->request_len) {
+            cap *= 2;
+        }
+        char *out = realloc(conn->out, cap);
+        if (!out) {
+            return false;
+        }
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, fs->request, fs->request_len);
+    conn->out_len += fs->request_len;
+    return true;
+}
+
+// Take requests off the host's queue until #PIPELINE_DEPTH are in flight,
+// or the connection has its share of what's left. A small batch then goes
+// out over all of its connections, rather than queueing up behind the first
+// one to open, as slow responses would hold up the rest of it.
+static void pull(struct conn *conn) {
+    if (!conn->reusable) {
+        return;
+    }
+    struct host *host = conn->host;
+    pthread_mutex_lock(&host->lock);
+    size_t share = (host->queued + conn->depth + host->conns - 1) / host->conns;
+    size_t most = MIN(share, PIPELINE_DEPTH);
+    while (conn->depth < most && host->queue) {
+        struct fetch_state *fs = host->queue;
+        if (!queue_request(conn, fs)) {
+            break;
+        }
+        host->queue = fs->next_stream;
+        host->queued--;
+        fs->next_stream = NULL;
+        if (conn->inflight_tail) {
+            conn->inflight_tail->next_stream = fs;
+        } else {
+            conn->inflight = fs;
+        }
+        conn->inflight_tail = fs;
+        conn->depth++;
+        stat_add(STAT_PIPE_REQUEST, 1);
+    }
+    pthread_mutex_unlock(&host->lock);
+}
+
+// Write out what's queued and watch the socket for what's next. False
+// once there's nothing left in flight.
+static bool pump(struct conn *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t n = ttcp_send(conn->fd, conn->out + conn->out_off,
+                              conn->out_len - conn->out_off, conn->ssl);
+        if (n > 0) {
+            conn->out_off += n;
+        } else if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            break;
+        } else {
+            perror("ttcp_send()");
+            return false;
+        }
+    }
+    if (conn->out_off == conn->out_len) {
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+    if (!conn->inflight) {
+        return false;
+    }
+    watch_net(conn, (conn->paused ? 0 : EPOLLIN) | (conn->out_len > 0 ? EPOLLOUT : 0));
+    return true;
+}
+
+// The oldest response is through, one way or another. False when the
+// connection can't carry another one.
+static bool complete(struct conn *conn) {
+    struct fetch_state *fs = conn->inflight;
+    conn->inflight = fs->next_stream;
+    if (!conn->inflight) {
+        conn->inflight_tail = NULL;
+    }
+    fs->next_stream = NULL;
+    conn->depth--;
+    if (fs->body_done) {
+        conn->answered++;
+    }
+    conn->reusable = fs->body_done && fs->keep_alive;
+    end_fetch(conn, fs);
+    return conn->reusable;
+}
+
+// FS's consumer fell behind. Leave the socket unread until outfd takes
+// enough of what's waiting.
+static bool pause_net(struct conn *conn, struct fetch_state *fs) {
+    if (reactor_watch(&conn->task, fs->outfd, EPOLLOUT) < 0) {
+        perror("reactor_watch()");
+        return false;
+    }
+    fs->out_events = EPOLLOUT;
+    conn->paused = true;
+    return true;
+}
+
+// Hand what's in the ring to the responses in flight, oldest first.
+static bool parse(struct conn *conn) {
+    struct iovec iov[2];
+    while (!conn->paused && ring_peek(&conn->ring, iov) > 0) {
+        struct fetch_state *fs = conn->inflight;
+        if (!fs) {
+            fprintf(stderr, "fetch: unsolicited bytes from %s\n", conn->host->hostname);
+            return false;
+        }
+        ring_consume(&conn->ring, fetch_feed(fs, iov[0].iov_base, iov[0].iov_len));
+
+        size_t backlog = fetch_deliver(fs);
+        if (fs->http_done) {
+            if (!complete(conn)) {
+                return false;
+            }
+        } else if (backlog >= fs->high_water && !pause_net(conn, fs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool receive(struct conn *conn) {
+    for (;;) {
+        if (!parse(conn)) {
+            return false;
+        }
+        if (conn->paused) {
+            return true;
+        }
+        ssize_t n = ring_fill(&conn->ring, conn->fd, conn->ssl, SIZE_MAX);
+        if (n == TTCP_WANT_READ || n == TTCP_WANT_WRITE) {
+            ring_settle(&conn->ring);
+            return true;
+        }
+        if (n == 0) {
+            struct fetch_state *fs = conn->inflight;
+            if (fs && fs->headers_done && !fs->chunked_mode && !fs->has_content_length) {
+                // Its body ran until the server hung up, as it said it would
+                fs->body_done = true;
+                fs->http_done = true;
+                complete(conn);
+            }
+            return false;
+        }
+        if (n < 0) {
+            return false;
+        }
+    }
+}
+
+// The oldest request's outfd became writable while its consumer was behind.
+static bool catch_up(struct conn *conn) {
+    struct fetch_state *fs = conn->inflight;
+    if (fetch_deliver(fs) > fs->high_water / 2 && !fs->http_done) {
+        return true;
+    }
+    reactor_unwatch(&conn->task, fs->outfd);
+    fs->out_events = 0;
+    conn->paused = false;
+    if (fs->http_done) {
+        // No one's reading it anymore, and the rest of it is in the way
+        return complete(conn) && receive(conn);
+    }
+    return receive(conn);
+}
+
+static bool open_conn(struct conn *conn) {
+    conn->phase = CONN_OPEN;
+    conn->reusable = true;
+    stat_add(STAT_PIPE_CONNECT, 1);
+    pull(conn);
+    return pump(conn);
+}
+
+static bool handshake(struct conn *conn) {
+    struct host *host = conn->host;
+    int rc = ttcp_tls_handshake(conn->fd, &conn->ssl, host->hostname, host->port, NULL);
+    if (rc == TTCP_WANT_READ || rc == TTCP_WANT_WRITE) {
+        watch_net(conn, rc == TTCP_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+        return true;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "ttcp_tls_handshake(%s:%s) failed\n", host->hostname, host->port);
+        return false;
+    }
+    return open_conn(conn);
+}
+
+// Outcome RC of a #tcp_race call.
+static bool on_race(struct conn *conn, int rc) {
+    if (rc == -1) {
+        conn->task.deadline_ms = reactor_now_ms() + tcp_race_timeout(&conn->race);
+        return true;
+    }
+    conn->task.deadline_ms = 0;
+    if (rc == -2) {
+        fprintf(stderr, "connect(%s:%s): %s\n",
+                conn->host->hostname, conn->host->port, strerror(errno));
+        return false;
+    }
+
+    conn->fd = rc;
+    if (!conn->host->tls) {
+        return open_conn(conn);
+    }
+    conn->phase = CONN_HANDSHAKING;
+    return handshake(conn);
+}
+
+static bool conn_start(struct reactor_task *task) {
+    struct conn *conn = (struct conn *) task;
+    struct host *host = conn->host;
+
+    struct pooled idle = {0};
+    if (pool_acquire(host->origin, &idle)) {
+        conn->fd = idle.fd;
+        conn->ssl = idle.ssl;
+        conn->pooled = true;
+        return open_conn(conn);
+    }
+
+    // Every queued fetch's own addresses went to other connections, but
+    // by now the cache has them
+    if (!conn->addrinfo && dns_resolve(host->hostname, host->port, &conn->addrinfo) != 0) {
+        fprintf(stderr, "dns_resolve(%s:%s) failed\n", host->hostname, host->port);
+        return false;
+    }
+    conn->phase = CONN_CONNECTING;
+    return on_race(conn, tcp_race_start(&conn->race, conn->addrinfo, task,
+                                        host->connect_timeout_ms));
+}
+
+static bool conn_ready(struct reactor_task *task, int fd, uint32_t events) {
+    struct conn *conn = (struct conn *) task;
+    switch (conn->phase) {
+    case CONN_CONNECTING:
+        return !tcp_race_owns(&conn->race, fd)
+            || on_race(conn, tcp_race_ready(&conn->race, fd, events));
+    case CONN_HANDSHAKING:
+        return handshake(conn);
+    default:
+        break;
+    }
+
+    if (fd != conn->fd) {
+        if (conn->paused && !catch_up(conn)) {
+            return false;
+        }
+    } else if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !conn->paused && !receive(conn)) {
+        return false;
+    }
+    pull(conn);
+    return pump(conn);
+}
+
+static bool conn_expired(struct reactor_task *task) {
+    struct conn *conn = (struct conn *) task;
+    if (conn->phase == CONN_CONNECTING) {
+        return on_race(conn, tcp_race_tick(&conn->race));
+    }
+    return true;
+}
+
+static void conn_finish(struct reactor_task *task);
+
+// Resolved addresses for another connection, off one of the fetches on LIST.
+static struct addrinfo *take_addrinfo(struct fetch_state *list) {
+    for (; list; list = list->next_stream) {
+        if (list->addrinfo) {
+            struct addrinfo *addrinfo = list->addrinfo;
+            list->addrinfo = NULL;
+            return addrinfo;
+        }
+    }
+    return NULL;
+}
+
+// Start another connection working through HOST's queue. Caller holds
+// HOST's lock, which the connection needs before it can get anywhere.
+static int spawn(struct host *host) {
+    struct conn *conn = calloc(1, sizeof(struct conn));
+    if (!conn) {
+        return -1;
+    }
+    conn->host = host;
+    conn->fd = -1;
+    conn->addrinfo = take_addrinfo(host->queue);
+    conn->task = (struct reactor_task) {
+        .start = conn_start,
+        .ready = conn_ready,
+        .expired = conn_expired,
+        .finish = conn_finish,
+    };
+    if (reactor_submit(&conn->task) < 0) {
+        dns_freeaddrinfo(conn->addrinfo);
+        free(conn);
+        return -1;
+    }
+    host->conns++;
+    return 0;
+}
+
+static void conn_finish(struct reactor_task *task) {
+    struct conn *conn = (struct conn *) task;
+    struct host *host = conn->host;
+    if (conn->phase == CONN_CONNECTING) {
+        tcp_race_abort(&conn->race);
+    }
+    if (conn->net_events) {
+        reactor_unwatch(task, conn->fd);
+    }
+
+    // Requests the server never answered can go again on another
+    // connection, unless this one never got anywhere. A pooled connection
+    // may just have been closed by the server while it sat idle.
+    bool retry = conn->answered > 0 || conn->pooled;
+    bool idle = !conn->inflight;
+    struct fetch_state *again = NULL;
+    struct fetch_state **tail = &again;
+    size_t retried = 0;
+    while (conn->inflight) {
+        struct fetch_state *fs = conn->inflight;
+        conn->inflight = fs->next_stream;
+        fs->next_stream = NULL;
+        if (retry && !fs->headers_done && fs->header_len == 0) {
+            *tail = fs;
+            tail = &fs->next_stream;
+            retried++;
+            stat_add(STAT_PIPE_RETRY, 1);
+        } else {
+            fs->http_done = true;
+            end_fetch(conn, fs);
+        }
+    }
+
+    if (conn->fd >= 0) {
+        if (conn->phase == CONN_OPEN && conn->reusable && idle
+            && ring_len(&conn->ring) == 0 && conn->out_len == 0) {
+            pool_release(host->origin, (struct pooled) { .fd = conn->fd, .ssl = conn->ssl });
+        } else {
+            ttcp_tls_free(conn->ssl);
+            close(conn->fd);
+        }
+    }
+    ring_free(&conn->ring);
+    dns_freeaddrinfo(conn->addrinfo);
+    free(conn->out);
+    free(conn);
+
+    pthread_mutex_lock(&host->lock);
+    *tail = host->queue;
+    host->queue = again;
+    host->queued += retried;
+    host->conns--;
+    if (retry && host->queue) {
+        spawn(host);
+    }
+    // With no connection left, the rest of the queue can't be reached
+    struct fetch_state *orphans = NULL;
+    if (host->conns == 0) {
+        orphans = host->queue;
+        host->queue = NULL;
+        host->queued = 0;
+    }
+    bool last = host->conns == 0;
+    pthread_mutex_unlock(&host->lock);
+
+    while (orphans) {
+        struct fetch_state *fs = orphans;
+        orphans = fs->next_stream;
+        fs->next_stream = NULL;
+        fs->http_done = true;
+        fetch_end(fs);
+    }
+    if (last) {
+        host_free(host);
+    }
+}
+
+int pipeline_submit(struct fetch_state **batch, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    struct host *host = calloc(1, sizeof(struct host));
+    if (!host) {
+        return -1;
+    }
+    pthread_mutex_init(&host->lock, NULL);
+    host->origin = strdup(batch[0]->origin);
+    host->hostname = strdup(batch[0]->hostname);
+    host->port = strdup(batch[0]->port);
+    if (!host->origin || !host->hostname || !host->port) {
+        host_free(host);
+        return -1;
+    }
+    host->tls = batch[0]->is_tls;
+    host->connect_timeout_ms = batch[0]->connect_timeout_ms;
+
+    struct fetch_state **tail = &host->queue;
+    for (size_t i = 0; i < n; i++) {
+        struct fetch_state *fs = batch[i];
+        if (fs->netfd >= 0) {
+            // fetch_socket() found a pooled connection, which one of ours picks up
+            pool_release(fs->origin, (struct pooled) { .fd = fs->netfd, .ssl = fs->ssl });
+            fs->netfd = -1;
+            fs->ssl = NULL;
+        }
+        fs->next_stream = NULL;
+        *tail = fs;
+        tail = &fs->next_stream;
+    }
+    host->queued = n;
+
+    pthread_mutex_lock(&host->lock);
+    size_t conns = n < PIPELINE_CONNS ? n : PIPELINE_CONNS;
+    for (size_t i = 0; i < conns; i++) {
+        if (spawn(host) < 0) {
+            break;
+        }
+    }
+    bool started = host->conns > 0;
+    pthread_mutex_unlock(&host->lock);
+
+    if (!started) {
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->next_stream = NULL;
+        }
+        host_free(host);
+        return -1;
+    }
+    return 0;
+}
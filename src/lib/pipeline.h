@@ -0,0 +1,34 @@
+/**
+ * @file pipeline.h
+ * @brief HTTP/1.1 pipelining, a batch of fetches to one origin over a few
+ * keep-alive connections.
+ *
+ * The batch sits in a queue shared by its connections. Each one keeps up to
+ * #PIPELINE_DEPTH requests in flight, written out back to back, and reads
+ * the responses in the order it sent them. A connection that's faster
+ * than the others simply takes more of the queue.
+ *
+ * Requests the server never answered, because it closed the connection or
+ * said `Connection: close` part way through, go back in the queue and onto
+ * a new connection, as long as the one they were on answered something.
+ */
+#pragma once
+#include "fetch.h"
+
+/** Most connections a batch opens to its origin. */
+#define PIPELINE_CONNS 4
+
+/** Most requests a connection has in flight at once. */
+#define PIPELINE_DEPTH 8
+
+/**
+ * @brief Run the N fetches in BATCH, all to the same origin, as pipelined
+ * requests over up to #PIPELINE_CONNS connections.
+ *
+ * Connections come out of the pool first, and go back into it once the
+ * batch is through with them.
+ *
+ * @retval 0 OK, the fetches belong to the transport now.
+ * @retval -1 Error, they're all still the caller's.
+ */
+int pipeline_submit(struct fetch_state **batch, size_t n);
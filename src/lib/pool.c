@@ -0,0 +1,170 @@
+#include "pool.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Most servers drop idle keep-alive connections after 5 seconds,
+ * so we let go of ours a little before that. */
+#define DEFAULT_MAX_IDLE 8
+#define DEFAULT_IDLE_TIMEOUT_MS 4000
+
+struct idle {
+    struct pooled conn;
+    long long since_ms;
+    struct idle *next;
+};
+
+struct origin {
+    char *key;
+    /* Most recently parked first */
+    struct idle *head;
+    size_t count;
+    struct origin *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct origin *origins = NULL;
+static size_t max_idle = DEFAULT_MAX_IDLE;
+static long idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void close_pooled(struct pooled conn) {
+    ttcp_tls_free(conn.ssl);
+    close(conn.fd);
+}
+
+// An idle HTTP/1.1 connection has nothing to say, so anything but
+// EAGAIN means the peer closed it or it's out of sync with us.
+static bool is_alive(struct pooled *conn) {
+    char c;
+    ssize_t n = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (n == 0 || !conn->ssl) {
+        return false;
+    }
+    // TLS 1.3 servers send session tickets after the handshake, which
+    // may still be sitting unread. Let OpenSSL swallow those records:
+    // if no application data comes out of them, we're still in sync.
+    int rc = SSL_peek(conn->ssl, &c, 1);
+    return rc <= 0 && SSL_get_error(conn->ssl, rc) == SSL_ERROR_WANT_READ;
+}
+
+static struct origin *find_origin(const char *key, bool create) {
+    for (struct origin *o = origins; o; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    struct origin *o = calloc(1, sizeof(struct origin));
+    if (!o) {
+        return NULL;
+    }
+    o->key = strdup(key);
+    if (!o->key) {
+        free(o);
+        return NULL;
+    }
+    o->next = origins;
+    origins = o;
+    return o;
+}
+
+bool pool_acquire(const char *key, struct pooled *conn) {
+    pthread_mutex_lock(&lock);
+    struct origin *o = find_origin(key, false);
+    long long now = now_ms();
+
+    while (o && o->head) {
+        struct idle *top = o->head;
+        o->head = top->next;
+        o->count--;
+
+        if (now - top->since_ms < idle_timeout_ms && is_alive(&top->conn)) {
+            *conn = top->conn;
+            free(top);
+            pthread_mutex_unlock(&lock);
+            stat_add(STAT_POOL_HIT, 1);
+            return true;
+        }
+
+        close_pooled(top->conn);
+        free(top);
+        stat_add(STAT_POOL_EVICT, 1);
+    }
+
+    pthread_mutex_unlock(&lock);
+    stat_add(STAT_POOL_MISS, 1);
+    return false;
+}
+
+void pool_release(const char *key, struct pooled conn) {
+    struct idle *entry = calloc(1, sizeof(struct idle));
+    if (!entry) {
+        close_pooled(conn);
+        return;
+    }
+    entry->conn = conn;
+    entry->since_ms = now_ms();
+
+    pthread_mutex_lock(&lock);
+    struct origin *o = find_origin(key, true);
+    if (!o) {
+        pthread_mutex_unlock(&lock);
+        close_pooled(conn);
+        free(entry);
+        return;
+    }
+
+    entry->next = o->head;
+    o->head = entry;
+    o->count++;
+
+    // Trim from the cold end: drop whatever's beyond the cap
+    // along with anything that already timed out.
+    struct idle **link = &o->head;
+    size_t kept = 0;
+    while (*link) {
+        struct idle *cur = *link;
+        if (kept < max_idle && entry->since_ms - cur->since_ms < idle_timeout_ms) {
+            kept++;
+            link = &cur->next;
+            continue;
+        }
+        *link = cur->next;
+        o->count--;
+        close_pooled(cur->conn);
+        free(cur);
+        stat_add(STAT_POOL_EVICT, 1);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void pool_configure(size_t max, long timeout_ms) {
+    pthread_mutex_lock(&lock);
+    if (max > 0) {
+        max_idle = max;
+    }
+    if (timeout_ms > 0) {
+        idle_timeout_ms = timeout_ms;
+    }
+    pthread_mutex_unlock(&lock);
+}
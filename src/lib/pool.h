@@ -0,0 +1,47 @@
+/**
+ * @file pool.h
+ * @brief Process-wide pool of idle keep-alive connections.
+ *
+ * Connections are parked per origin, which is the `scheme://host:port`
+ * triple a request was sent to, and handed back out most recently used first.
+ */
+#pragma once
+#include <openssl/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief An idle connection, TCP socket plus its TLS session if any.
+ */
+struct pooled {
+    int fd;
+    SSL *ssl;
+};
+
+/**
+ * @brief Take an idle connection to ORIGIN out of the pool into CONN.
+ *
+ * Connections that sat idle past the idle timeout, or that the peer
+ * closed (or wrote unsolicited bytes to) in the meantime, are evicted
+ * on the way.
+ *
+ * @retval true Hit. CONN is connected and owned by the caller.
+ * @retval false Miss. CONN is left untouched.
+ */
+bool pool_acquire(const char *origin, struct pooled *conn);
+
+/**
+ * @brief Park CONN as idle under ORIGIN.
+ *
+ * The pool takes ownership of CONN. When ORIGIN already holds the maximum
+ * number of idle connections, the least recently used one is closed.
+ */
+void pool_release(const char *origin, struct pooled conn);
+
+/**
+ * @brief Set the per origin idle connection cap MAX_IDLE and the
+ * IDLE_TIMEOUT_MS after which a parked connection is evicted.
+ *
+ * Zero leaves the corresponding setting unchanged.
+ */
+void pool_configure(size_t max_idle, long idle_timeout_ms);
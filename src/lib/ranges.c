@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include "ranges.h"
+#include "fetch.h"
+#include "reactor.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* How much of a segment's rows the merge reads at once, to begin with */
+#define MERGE_READ_SIZE (64 << 10)
+
+/* Rows of every segment of a split body, on their way to its consumer */
+struct merge {
+    struct reactor_task task;
+    int outfd;                  // the consumer's socket, taken over from the first segment
+    bool blocked;               // outfd is full, segments wait until it isn't
+    size_t live;                // segments still sending rows
+    size_t next;                // where the next look for a whole row starts
+    ssize_t current;            // segment whose row went out part way, -1 for none
+    size_t n;
+    struct merge_input {
+        int fd;                 // our end of the segment's outfd, -1 once it hung up
+        char *buf;              // read and not sent yet, from off to len
+        size_t off;
+        size_t len;
+        size_t cap;
+    } *in;
+};
+
+static void merge_free(struct merge *m) {
+    for (size_t i = 0; i < m->n; i++) {
+        if (m->in[i].fd >= 0) {
+            close(m->in[i].fd);
+        }
+        free(m->in[i].buf);
+    }
+    free(m->in);
+    free(m);
+}
+
+// Where the row at the front of IN ends, past its newline, or 0 if it
+// isn't all there yet.
+static size_t row_end(const struct merge_input *in) {
+    if (in->off == in->len) {
+        return 0;
+    }
+    const char *lf = memchr(in->buf + in->off, '\n', in->len - in->off);
+    return lf ? lf + 1 - in->buf : 0;
+}
+
+// Watch either the segments for rows or outfd for room, never both.
+static bool merge_watch(struct merge *m) {
+    for (size_t i = 0; i < m->n; i++) {
+        if (m->in[i].fd < 0) {
+            continue;
+        }
+        if (m->blocked) {
+            reactor_unwatch(&m->task, m->in[i].fd);
+        } else if (reactor_watch(&m->task, m->in[i].fd, EPOLLIN) < 0) {
+            return false;
+        }
+    }
+    if (m->blocked) {
+        return reactor_watch(&m->task, m->outfd, EPOLLOUT) == 0;
+    }
+    reactor_unwatch(&m->task, m->outfd);
+    return true;
+}
+
+// Send whole rows to the consumer, taking turns between segments, until
+// it's full or there are none. False once the consumer is gone.
+static bool merge_flush(struct merge *m) {
+    bool was_blocked = m->blocked;
+    m->blocked = false;
+    for (;;) {
+        // A row that went out part way has to be finished first
+        ssize_t pick = m->current;
+        size_t end = pick >= 0 ? row_end(&m->in[pick]) : 0;
+        for (size_t k = 0; pick < 0 && k < m->n; k++) {
+            size_t i = (m->next + k) % m->n;
+            if ((end = row_end(&m->in[i])) > 0) {
+                pick = i;
+                m->next = i + 1;
+            }
+        }
+        if (pick < 0) {
+            break;
+        }
+
+        struct merge_input *in = &m->in[pick];
+        ssize_t n = send(m->outfd, in->buf + in->off, end - in->off, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        in->off += n > 0 ? n : 0;
+        m->current = in->off < end ? pick : -1;
+        if (m->current >= 0) {
+            m->blocked = true;
+            break;
+        }
+    }
+    return m->blocked == was_blocked || merge_watch(m);
+}
+
+// Read what IN's segment sent. False once it hung up.
+static bool merge_fill(struct merge_input *in) {
+    if (in->off > 0) {
+        in->len -= in->off;
+        memmove(in->buf, in->buf + in->off, in->len);
+        in->off = 0;
+    }
+    if (in->len == in->cap) {
+        size_t cap = in->cap ? in->cap * 2 : MERGE_READ_SIZE;
+        char *buf = realloc(in->buf, cap);
+        if (!buf) {
+            return perror_rc(false, "realloc()", 0);
+        }
+        in->buf = buf;
+        in->cap = cap;
+    }
+    ssize_t n = recv(in->fd, in->buf + in->len, in->cap - in->len, 0);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    in->len += n;
+    return n > 0;
+}
+
+static bool merge_start(struct reactor_task *task) {
+    return merge_watch((struct merge *) task);
+}
+
+static bool merge_ready(struct reactor_task *task, int fd, uint32_t events) {
+    (void) events;
+    struct merge *m = (struct merge *) task;
+    for (size_t i = 0; fd != m->outfd && i < m->n; i++) {
+        struct merge_input *in = &m->in[i];
+        if (in->fd == fd && !merge_fill(in)) {
+            reactor_unwatch(task, in->fd);
+            close(in->fd);
+            in->fd = -1;
+            m->live--;
+        }
+    }
+    if (!merge_flush(m)) {
+        return false;
+    }
+    // Done once every segment hung up and their rows are through
+    return m->live > 0 || m->blocked;
+}
+
+static bool merge_expired(struct reactor_task *task) {
+    (void) task;
+    return true;
+}
+
+static void merge_finish(struct reactor_task *task) {
+    struct merge *m = (struct merge *) task;
+    for (size_t i = 0; i < m->n; i++) {
+        if (m->in[i].fd >= 0) {
+            reactor_unwatch(task, m->in[i].fd);
+        }
+    }
+    if (m->blocked) {
+        reactor_unwatch(task, m->outfd);
+    }
+    close(m->outfd);
+    merge_free(m);
+}
+
+// How FS's body lays its rows out, if one per line: '[' for a JSON array
+// with an element per line, '\n' for NDJSON. 0 for anything else.
+static char shape_of(const struct fetch_state *fs, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n')) {
+        i++;
+    }
+    // An array all on one line never gets past the first segment, so
+    // don't bother
+    if (i < len && data[i] == '[' && memchr(data + i, '\n', len - i)) {
+        return '[';
+    }
+    const struct http_header *ct = http_head_get(&fs->head, "Content-Type");
+    if (ct && (memmem(ct->value, ct->value_len, "ndjson", 6)
+               || memmem(ct->value, ct->value_len, "jsonl", 5))) {
+        return '\n';
+    }
+    return 0;
+}
+
+// How many segments FS's body splits into, 0 or 1 when it doesn't.
+static size_t segments_for(const struct fetch_state *fs) {
+    if (fs->ranges < 2 || fs->stream_id != 0 || fs->netfd < 0 || fs->status != 200
+        || fs->chunked_mode || !fs->has_content_length
+        || fs->decoder.encoding != ENCODING_IDENTITY) {
+        return 0;
+    }
+    const struct http_header *ar = http_head_get(&fs->head, "Accept-Ranges");
+    if (!ar || !http_header_has_token(ar, "bytes")) {
+        return 0;
+    }
+    size_t n = fs->content_length / RANGES_MIN_SEGMENT;
+    return MIN(n, fs->ranges);
+}
+
+// A fetch of FS's body from byte START on, its rows going to OUTFD.
+static struct fetch_state *segment_new(const struct fetch_state *fs, size_t start, size_t stop,
+                                       char shape, int outfd)
+{
+    // Offsets are into the body as stored, so nothing may come compressed
+    char range[64];
+    snprintf(range, sizeof(range), "Range: bytes=%zu-\r\n", start);
+    struct fetch_state *seg = fetch_clone(fs, fetch_request(fs->path, fs->authority, "identity", range));
+    if (!seg) {
+        return NULL;
+    }
+    seg->segment = (struct range_segment) {
+        .active = true,
+        .start = start,
+        .stop = stop,
+        .skipping = true,
+    };
+    seg->outfd = outfd;
+    seg->closed_outfd = false;
+    if (shape == '[') {
+        // Picks up in the middle of the array
+        fputc('[', seg->bass[0]);
+    }
+    return seg;
+}
+
+// Take back a split that couldn't get going: the N - 1 segments SEGS
+// that were set up, and the WRITERS of the others.
+static void undo(struct merge *m, struct fetch_state **segs, int *writers, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (segs[i]) {
+            // Closes its writer with the rest of it
+            fetch_end(segs[i]);
+        } else if (writers[i] >= 0) {
+            close(writers[i]);
+        }
+    }
+    merge_free(m);
+    free(segs);
+    free(writers);
+}
+
+void ranges_split(struct fetch_state *fs, const char *data, size_t len) {
+    size_t n = segments_for(fs);
+    char shape = n > 1 ? shape_of(fs, data, len) : 0;
+    if (!shape) {
+        return;
+    }
+
+    struct merge *m = calloc(1, sizeof(struct merge));
+    struct fetch_state **segs = calloc(n, sizeof(struct fetch_state *));
+    int *writers = malloc(n * sizeof(int));
+    if (!m || !segs || !writers || !(m->in = calloc(n, sizeof(struct merge_input)))) {
+        free(m);
+        free(segs);
+        free(writers);
+        return;
+    }
+    m->n = n;
+    m->current = -1;
+    for (size_t i = 0; i < n; i++) {
+        m->in[i].fd = -1;
+        writers[i] = -1;
+    }
+
+    // Segment I owns the lines starting in [LEN * I / N, LEN * (I + 1) / N)
+    for (size_t i = 0; i < n; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("socketpair()");
+            undo(m, segs, writers, n);
+            return;
+        }
+        m->in[i].fd = sv[0];
+        writers[i] = sv[1];
+        if (i == 0) {
+            continue;
+        }
+        size_t start = fs->content_length * i / n - 1;
+        size_t stop = i + 1 < n ? fs->content_length * (i + 1) / n - 1 : SIZE_MAX;
+        segs[i] = segment_new(fs, start, stop, shape, writers[i]);
+        if (!segs[i]) {
+            undo(m, segs, writers, n);
+            return;
+        }
+    }
+
+    m->outfd = fs->outfd;
+    m->live = n;
+    m->task = (struct reactor_task) {
+        .start = merge_start,
+        .ready = merge_ready,
+        .expired = merge_expired,
+        .finish = merge_finish,
+    };
+    if (reactor_submit(&m->task) < 0) {
+        perror("reactor_submit()");
+        undo(m, segs, writers, n);
+        return;
+    }
+
+    // The merge has the consumer now, and FS goes on as the first segment
+    stat_add(STAT_RANGE_SPLIT, 1);
+    fs->outfd = writers[0];
+    fs->segment = (struct range_segment) {
+        .active = true,
+        .stop = fs->content_length / n - 1,
+    };
+    for (size_t i = 1; i < n; i++) {
+        if (admit_submit(segs[i]) < 0) {
+            fprintf(stderr, "fetch: can't start range %zu of %s\n", segs[i]->segment.start, fs->path);
+            fetch_end(segs[i]);
+            continue;
+        }
+        stat_add(STAT_RANGE_SEGMENT, 1);
+    }
+    free(segs);
+    free(writers);
+}
+
+bool ranges_head(struct fetch_state *fs) {
+    struct range_segment *seg = &fs->segment;
+    if (fs->decoder.encoding != ENCODING_IDENTITY) {
+        fprintf(stderr, "fetch: %s compressed a range we asked for as is\n", fs->hostname);
+        return false;
+    }
+    if (fs->status == 200) {
+        // The range was ignored, so what comes before it is skipped over
+        seg->base = 0;
+        return true;
+    }
+
+    // Header values run up to their line end, where sscanf stops
+    const struct http_header *cr = http_head_get(&fs->head, "Content-Range");
+    unsigned long long first;
+    if (fs->status != 206 || !cr || sscanf(cr->value, "bytes %llu-", &first) != 1
+        || first > seg->start) {
+        fprintf(stderr, "fetch: %s didn't send the range asked for\n", fs->hostname);
+        return false;
+    }
+    seg->base = first;
+    return true;
+}
+
+bool ranges_clip(struct range_segment *seg, size_t pos, const char *data, size_t len,
+                 size_t *skip, size_t *keep)
+{
+    *skip = len;
+    *keep = 0;
+    size_t i = 0;
+    if (pos < seg->start) {
+        // Ahead of the range, when the server sent the whole body
+        if (pos + len <= seg->start) {
+            return false;
+        }
+        i = seg->start - pos;
+    }
+
+    if (seg->skipping) {
+        const char *lf = memchr(data + i, '\n', len - i);
+        size_t end = lf ? (size_t) (lf - data) : len;
+        if (pos + end >= seg->stop) {
+            // The line the segment before finishes runs past this one's
+            // end, so there's nothing in here for it
+            return true;
+        }
+        if (!lf) {
+            return false;
+        }
+        i = end + 1;
+        seg->skipping = false;
+    }
+
+    *skip = i;
+    if (seg->stop == SIZE_MAX || pos + len <= seg->stop) {
+        *keep = len - i;
+        return false;
+    }
+    // Past the end, up to the line end that finishes the last line
+    size_t from = seg->stop > pos ? MAX(i, seg->stop - pos) : i;
+    const char *lf = memchr(data + from, '\n', len - from);
+    if (!lf) {
+        *keep = len - i;
+        return false;
+    }
+    *keep = lf + 1 - (data + i);
+    return true;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file ranges.h
+ * @brief Large static bodies downloaded as byte ranges over parallel connections.
+ *
+ * When a response says `Accept-Ranges: bytes`, has a big enough
+ * Content-Length and isn't compressed, the fetch that got it carries on as
+ * the first segment and the rest of the body goes out as `Range` requests
+ * on connections of their own.
+ *
+ * Segments are cut at line ends, so each one parses on its own: a segment
+ * owns the lines that start inside its byte range, skipping the line it
+ * starts in the middle of and reading past its end to finish its last one.
+ * That only needs bodies to keep rows on lines of their own, like NDJSON or
+ * JSON arrays written one element per line.
+ *
+ * Every segment's rows go to the consumer through a task of their own,
+ * whole rows at a time, so rows of different segments interleave.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+struct fetch_state;
+
+/** Smallest byte range worth a connection of its own. */
+#define RANGES_MIN_SEGMENT (8 << 20)
+
+/**
+ * @brief Where a segment's lines start and end.
+ */
+struct range_segment {
+    /** FS fetches one segment of a split body. */
+    bool active;
+    /** Body offset of the first byte the segment looks at. */
+    size_t start;
+    /** The first line end at or past this offset ends the segment, `SIZE_MAX` for the last one. */
+    size_t stop;
+    /** Body offset of what the response's body starts at (`Content-Range`). */
+    size_t base;
+    /** Still inside the line the segment before finishes. */
+    bool skipping;
+};
+
+/**
+ * @brief Split the rest of FS's body into segments, if it's worth it and
+ * the response allows it. DATA holds its first LEN bytes.
+ *
+ * Call before any of the body went to FS's parser. FS becomes the first
+ * segment, or is left as it was.
+ */
+void ranges_split(struct fetch_state *fs, const char *data, size_t len);
+
+/**
+ * @brief Check the head of segment FS's response, finding out where its body starts.
+ *
+ * @retval true OK
+ * @retval false The server sent something else than what was asked for.
+ */
+bool ranges_head(struct fetch_state *fs);
+
+/**
+ * @brief What of LEN body bytes at DATA, POS bytes into the whole body,
+ * belongs to SEG, as KEEP bytes at DATA + SKIP.
+ *
+ * @return True once SEG has all its lines, and the rest of the body is
+ * some other segment's.
+ */
+bool ranges_clip(struct range_segment *seg, size_t pos, const char *data, size_t len,
+                 size_t *skip, size_t *keep);
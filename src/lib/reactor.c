@@ -0,0 +1,450 @@
+#include "reactor.h"
+#include "cfns.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+/* Submission ring size of an io_uring shard. Fuller rings get flushed early. */
+#define URING_ENTRIES 256
+
+/* Epoll data of a shard's wakeup eventfd. Task tags start at 1 << 32. */
+#define WAKEUP_TAG 0
+
+/*
+ * What an io_uring shard polls an fd for. Polls are one shot and get armed
+ * again after each completion the task didn't react to by changing the
+ * watch, which keeps epoll's level triggered behavior.
+ */
+struct watch {
+    uint64_t tag;       // task the fd belongs to, or WAKEUP_TAG
+    uint32_t events;    // 0 when not watched
+    uint32_t gen;       // in the poll's user_data, to tell a replaced poll's completion apart
+    bool armed;         // a poll for it is in flight
+};
+
+struct shard {
+    pthread_t thread;
+    int ep;                 // epoll backend
+    struct uring ring;      // io_uring backend
+    struct watch *watches;  // io_uring backend, by fd
+    size_t watches_cap;
+    int wakeup;     // eventfd, written to when #inbox gets a task
+
+    /* Tasks handed over by other threads, adopted between event batches */
+    pthread_mutex_t lock;
+    struct reactor_task *inbox;
+
+    /* Tasks the shard runs, by slot; a task's tag is its (slot + 1) << 32 */
+    struct reactor_task **slots;
+    size_t slots_cap;
+
+    /* Tasks submitted and not finished yet */
+    atomic_size_t load;
+};
+
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static struct shard *shards = NULL;
+static size_t shards_len = 0;
+static size_t configured_shards = 0;
+static enum reactor_backend backend = REACTOR_EPOLL;
+static int start_error = 0;
+
+long long reactor_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void reactor_configure(size_t n) {
+    configured_shards = n;
+}
+
+void reactor_use(enum reactor_backend b) {
+    backend = b;
+}
+
+enum reactor_backend reactor_backend(void) {
+    return backend;
+}
+
+size_t reactor_shards(void) {
+    return shards_len;
+}
+
+static uint64_t poll_data(const struct watch *w, int fd) {
+    return (uint64_t) w->gen << 32 | (uint32_t) fd;
+}
+
+static void arm(struct shard *shard, struct watch *w, int fd) {
+    uring_poll_add(&shard->ring, fd, w->events, poll_data(w, fd));
+    w->armed = true;
+}
+
+// Cancel the poll in flight for FD, if any. Bumping the generation makes
+// sure a completion it already produced is dropped.
+static void disarm(struct shard *shard, struct watch *w, int fd) {
+    if (w->armed) {
+        uring_poll_remove(&shard->ring, poll_data(w, fd));
+        w->armed = false;
+    }
+    // user_data 0 is taken by poll removals
+    if (++w->gen == 0) {
+        w->gen = 1;
+    }
+}
+
+static int watch_fd(struct shard *shard, uint64_t tag, int fd, uint32_t events) {
+    if ((size_t) fd >= shard->watches_cap) {
+        size_t cap = shard->watches_cap ? shard->watches_cap : 64;
+        while (cap <= (size_t) fd) {
+            cap *= 2;
+        }
+        struct watch *watches = realloc(shard->watches, cap * sizeof(*watches));
+        if (!watches) {
+            return -1;
+        }
+        memset(watches + shard->watches_cap, 0, (cap - shard->watches_cap) * sizeof(*watches));
+        shard->watches = watches;
+        shard->watches_cap = cap;
+    }
+
+    struct watch *w = &shard->watches[fd];
+    if (w->armed && w->tag == tag && w->events == events) {
+        return 0;
+    }
+    disarm(shard, w, fd);
+    w->tag = tag;
+    w->events = events;
+    arm(shard, w, fd);
+    return 0;
+}
+
+static void unwatch_fd(struct shard *shard, int fd) {
+    if ((size_t) fd < shard->watches_cap && shard->watches[fd].events) {
+        disarm(shard, &shard->watches[fd], fd);
+        shard->watches[fd].events = 0;
+    }
+}
+
+int reactor_watch(struct reactor_task *task, int fd, uint32_t events) {
+    if (backend == REACTOR_IO_URING) {
+        return watch_fd(task->shard, task->tag, fd, events);
+    }
+    struct epoll_event ev = { .events = events, .data.u64 = task->tag | (uint32_t) fd };
+    if (epoll_ctl(task->shard->ep, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+    return epoll_ctl(task->shard->ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void reactor_unwatch(struct reactor_task *task, int fd) {
+    if (backend == REACTOR_IO_URING) {
+        unwatch_fd(task->shard, fd);
+        return;
+    }
+    epoll_ctl(task->shard->ep, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Forget the task in SLOT and let it clean up after itself.
+static void retire(struct shard *shard, size_t slot) {
+    struct reactor_task *task = shard->slots[slot];
+    shard->slots[slot] = NULL;
+    atomic_fetch_sub_explicit(&shard->load, 1, memory_order_relaxed);
+
+    // Closing an fd takes it out of an epoll set, but a pending poll
+    // keeps the socket open. Drop whatever the task left watched.
+    if (backend == REACTOR_IO_URING) {
+        for (size_t fd = 0; fd < shard->watches_cap; fd++) {
+            if (shard->watches[fd].events && shard->watches[fd].tag == task->tag) {
+                unwatch_fd(shard, (int) fd);
+            }
+        }
+    }
+    task->finish(task);
+}
+
+// Give TASK a slot and start it. Only ever between event batches, so
+// a slot freed during a batch can't get events meant for its last task.
+static void adopt(struct shard *shard, struct reactor_task *task) {
+    size_t slot = 0;
+    while (slot < shard->slots_cap && shard->slots[slot]) {
+        slot++;
+    }
+    if (slot == shard->slots_cap) {
+        size_t cap = shard->slots_cap ? shard->slots_cap * 2 : 64;
+        struct reactor_task **slots = realloc(shard->slots, cap * sizeof(*slots));
+        if (!slots) {
+            perror("realloc()");
+            atomic_fetch_sub_explicit(&shard->load, 1, memory_order_relaxed);
+            task->finish(task);
+            return;
+        }
+        for (size_t i = shard->slots_cap; i < cap; i++) {
+            slots[i] = NULL;
+        }
+        shard->slots = slots;
+        shard->slots_cap = cap;
+    }
+
+    task->shard = shard;
+    task->tag = (uint64_t) (slot + 1) << 32;
+    task->deadline_ms = 0;
+    shard->slots[slot] = task;
+    if (!task->start(task)) {
+        retire(shard, slot);
+    }
+}
+
+// Wait timeout until the earliest task deadline, -1 for none.
+static int next_timeout(struct shard *shard) {
+    long long earliest = 0;
+    for (size_t i = 0; i < shard->slots_cap; i++) {
+        struct reactor_task *task = shard->slots[i];
+        if (task && task->deadline_ms && (!earliest || task->deadline_ms < earliest)) {
+            earliest = task->deadline_ms;
+        }
+    }
+    if (!earliest) {
+        return -1;
+    }
+    long long now = reactor_now_ms();
+    return earliest > now ? (int) (earliest - now) : 0;
+}
+
+// Hand EVENTS on FD to the task tagged TAG.
+static void deliver(struct shard *shard, uint64_t tag, int fd, uint32_t events) {
+    size_t slot = (tag >> 32) - 1;
+    struct reactor_task *task = shard->slots[slot];
+    if (!task) {
+        // Task finished earlier in this batch
+        return;
+    }
+    if (!task->ready(task, fd, events)) {
+        retire(shard, slot);
+    }
+}
+
+// Wait for and handle one batch of events. Returns whether the wakeup
+// eventfd was among them.
+static bool epoll_batch(struct shard *shard) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(shard->ep, events, MAX_EVENTS, next_timeout(shard));
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait()");
+    }
+
+    bool wakeup = false;
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64 & ~(uint64_t) 0xffffffff;
+        int fd = (int) (events[i].data.u64 & 0xffffffff);
+        if (tag == WAKEUP_TAG) {
+            wakeup = true;
+            continue;
+        }
+        deliver(shard, tag, fd, events[i].events);
+    }
+    return wakeup;
+}
+
+// Same for io_uring. The polls tasks (re)armed since the last batch are
+// submitted by the same io_uring_enter() that waits.
+static bool uring_batch(struct shard *shard) {
+    if (uring_wait(&shard->ring, next_timeout(shard)) < 0) {
+        perror("io_uring_enter()");
+    }
+
+    bool wakeup = false;
+    struct io_uring_cqe cqe;
+    while (uring_reap(&shard->ring, &cqe)) {
+        int fd = (int) (cqe.user_data & 0xffffffff);
+        uint32_t gen = (uint32_t) (cqe.user_data >> 32);
+        if (cqe.user_data == 0 || (size_t) fd >= shard->watches_cap) {
+            continue;
+        }
+        struct watch *w = &shard->watches[fd];
+        if (!w->armed || w->gen != gen) {
+            // Unwatched or replaced since
+            continue;
+        }
+        w->armed = false;
+
+        if (w->tag == WAKEUP_TAG) {
+            wakeup = true;
+            arm(shard, w, fd);
+            continue;
+        }
+        deliver(shard, w->tag, fd, cqe.res < 0 ? EPOLLERR : (uint32_t) cqe.res);
+
+        // Still ready? Ask again, unless the task changed the watch itself.
+        // A failed poll would only fail again.
+        w = &shard->watches[fd];
+        if (w->events && !w->armed && cqe.res >= 0) {
+            arm(shard, w, fd);
+        }
+    }
+    return wakeup;
+}
+
+static void *shard_loop(void *arg) {
+    struct shard *shard = arg;
+
+    for (;;) {
+        bool wakeup = backend == REACTOR_IO_URING ? uring_batch(shard) : epoll_batch(shard);
+
+        long long now = reactor_now_ms();
+        for (size_t i = 0; i < shard->slots_cap; i++) {
+            struct reactor_task *task = shard->slots[i];
+            if (task && task->deadline_ms && task->deadline_ms <= now) {
+                task->deadline_ms = 0;
+                if (!task->expired(task)) {
+                    retire(shard, i);
+                }
+            }
+        }
+
+        if (wakeup) {
+            uint64_t count;
+            if (read(shard->wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read()");
+            }
+            pthread_mutex_lock(&shard->lock);
+            struct reactor_task *inbox = shard->inbox;
+            shard->inbox = NULL;
+            pthread_mutex_unlock(&shard->lock);
+
+            // Inbox is LIFO, start the oldest first
+            struct reactor_task *fifo = NULL;
+            while (inbox) {
+                struct reactor_task *next = inbox->next;
+                inbox->next = fifo;
+                fifo = inbox;
+                inbox = next;
+            }
+            while (fifo) {
+                struct reactor_task *next = fifo->next;
+                fifo->next = NULL;
+                adopt(shard, fifo);
+                fifo = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int shard_init(struct shard *shard) {
+    shard->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wakeup < 0) {
+        return -1;
+    }
+    if (backend == REACTOR_IO_URING) {
+        shard->ep = -1;
+        if (uring_init(&shard->ring, URING_ENTRIES) < 0) {
+            return perror_rc(-1, "io_uring_setup()", close(shard->wakeup));
+        }
+        if (watch_fd(shard, WAKEUP_TAG, shard->wakeup, EPOLLIN) < 0) {
+            return perror_rc(-1, "realloc()", uring_free(&shard->ring), close(shard->wakeup));
+        }
+    } else {
+        shard->ep = epoll_create1(EPOLL_CLOEXEC);
+        if (shard->ep < 0) {
+            return perror_rc(-1, "epoll_create1()", close(shard->wakeup));
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = WAKEUP_TAG };
+        if (epoll_ctl(shard->ep, EPOLL_CTL_ADD, shard->wakeup, &ev) < 0) {
+            return perror_rc(-1, "epoll_ctl()", close(shard->wakeup), close(shard->ep));
+        }
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    atomic_init(&shard->load, 0);
+
+    if (pthread_create(&shard->thread, NULL, shard_loop, shard) != 0) {
+        perror("pthread_create()");
+        if (backend == REACTOR_IO_URING) {
+            uring_free(&shard->ring);
+            free(shard->watches);
+        } else {
+            close(shard->ep);
+        }
+        close(shard->wakeup);
+        return -1;
+    }
+    pthread_detach(shard->thread);
+    return 0;
+}
+
+static void start_shards(void) {
+    size_t n = configured_shards;
+    if (n == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cores > 0 ? (size_t) cores : 1;
+    }
+    if (n > REACTOR_MAX_SHARDS) {
+        n = REACTOR_MAX_SHARDS;
+    }
+    if (backend == REACTOR_IO_URING) {
+        // Kernels without io_uring, too old for it or with it disabled get epoll
+        struct uring probe;
+        if (uring_init(&probe, 1) < 0) {
+            backend = REACTOR_EPOLL;
+        } else {
+            uring_free(&probe);
+        }
+    }
+
+    shards = calloc(n, sizeof(struct shard));
+    if (!shards) {
+        start_error = errno;
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (shard_init(&shards[i]) < 0) {
+            start_error = errno;
+            break;
+        }
+        shards_len++;
+    }
+}
+
+int reactor_submit(struct reactor_task *task) {
+    pthread_once(&shards_once, start_shards);
+    if (shards_len == 0) {
+        errno = start_error ? start_error : EAGAIN;
+        return -1;
+    }
+
+    struct shard *shard = &shards[0];
+    size_t least = atomic_load_explicit(&shard->load, memory_order_relaxed);
+    for (size_t i = 1; i < shards_len && least > 0; i++) {
+        size_t load = atomic_load_explicit(&shards[i].load, memory_order_relaxed);
+        if (load < least) {
+            least = load;
+            shard = &shards[i];
+        }
+    }
+    atomic_fetch_add_explicit(&shard->load, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&shard->lock);
+    task->next = shard->inbox;
+    shard->inbox = task;
+    pthread_mutex_unlock(&shard->lock);
+
+    uint64_t one = 1;
+    if (write(shard->wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write()");
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file reactor.h
+ * @brief Fixed pool of event loop threads ("shards") that run many tasks each.
+ *
+ * Every shard owns one epoll set, or io_uring instance, and multiplexes
+ * whatever tasks were handed to it, so the thread and fd counts stay flat
+ * no matter how many requests are in flight. New tasks go to the shard with
+ * the fewest tasks.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Default shard count when #reactor_configure() wasn't called: one per core, up to this. */
+#define REACTOR_MAX_SHARDS 64
+
+/**
+ * @brief What shards wait for events with.
+ */
+enum reactor_backend {
+    /** One \c epoll_wait() per batch, one \c epoll_ctl() per change of what a task watches. */
+    REACTOR_EPOLL,
+    /** Polls are queued to an io_uring and submitted together with the wait, one syscall a batch. */
+    REACTOR_IO_URING,
+};
+
+struct shard;
+
+/**
+ * @brief A state machine a shard drives. Embed it into the task's own state.
+ *
+ * Callbacks run on the shard thread and return false once the task is done,
+ * after which the shard forgets it and calls #finish right away. By the time
+ * #finish returns, every fd the task registered must be unregistered or closed.
+ */
+struct reactor_task {
+    /** Runs once the shard took the task on. */
+    bool (*start)(struct reactor_task *task);
+
+    /** epoll EVENTS came in on FD, which the task registered. */
+    bool (*ready)(struct reactor_task *task, int fd, uint32_t events);
+
+    /** #deadline_ms passed. Cleared before the call, so set it again to keep a timer. */
+    bool (*expired)(struct reactor_task *task);
+
+    /** Last call, the task is free to free itself. */
+    void (*finish)(struct reactor_task *task);
+
+    /** When (monotonic ms) to call #expired, 0 for never. */
+    long long deadline_ms;
+
+    /* Set by the shard before #start */
+
+    /** The shard running the task. */
+    struct shard *shard;
+
+    /** Tells the task's fds apart from other tasks', high 32 bits only. */
+    uint64_t tag;
+
+    /* Shard's own bookkeeping */
+    struct reactor_task *next;
+};
+
+/**
+ * @brief Set how many shards to start. Only works before the first #reactor_submit().
+ *
+ * 0 picks one shard per online core.
+ */
+void reactor_configure(size_t shards);
+
+/**
+ * @brief Pick the backend shards run on. Only works before the first #reactor_submit().
+ *
+ * #REACTOR_IO_URING falls back to #REACTOR_EPOLL where the kernel can't do it.
+ */
+void reactor_use(enum reactor_backend backend);
+
+/**
+ * @brief The backend shards run on, once they started.
+ */
+enum reactor_backend reactor_backend(void);
+
+/**
+ * @brief Hand TASK to the least loaded shard, starting the shards on first use.
+ *
+ * @retval 0 OK. TASK belongs to the shard until #reactor_task.finish runs.
+ * @retval -1 Error starting the shards, errno is set.
+ */
+int reactor_submit(struct reactor_task *task);
+
+/**
+ * @brief Have TASK's shard report EVENTS (`EPOLL*` bits) on FD, registering
+ * FD if needed. Only from TASK's callbacks.
+ *
+ * Readiness is level triggered on either backend.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, errno is set.
+ */
+int reactor_watch(struct reactor_task *task, int fd, uint32_t events);
+
+/**
+ * @brief Stop reporting events on FD. Do this before handing FD to anyone else.
+ */
+void reactor_unwatch(struct reactor_task *task, int fd);
+
+/**
+ * @brief Monotonic clock in ms, the one #reactor_task.deadline_ms is on.
+ */
+long long reactor_now_ms(void);
+
+/**
+ * @brief Number of shard threads running, 0 before the first #reactor_submit().
+ */
+size_t reactor_shards(void);
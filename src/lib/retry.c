@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include "retry.h"
+#include "fetch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+bool retry_status(int status) {
+    switch (status) {
+    case 408:   // Request Timeout
+    case 429:   // Too Many Requests
+    case 502:   // Bad Gateway
+    case 503:   // Service Unavailable
+    case 504:   // Gateway Timeout
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Seconds HEAD's Retry-After asks for, either as delta-seconds or an
+// HTTP-date. -1 without one.
+static long retry_after_s(const struct http_head *head) {
+    const struct http_header *ra = head ? http_head_get(head, "Retry-After") : NULL;
+    if (!ra || ra->value_len == 0 || ra->value_len >= 64) {
+        return -1;
+    }
+    char value[64];
+    memcpy(value, ra->value, ra->value_len);
+    value[ra->value_len] = '\0';
+
+    char *end;
+    long seconds = strtol(value, &end, 10);
+    if (end != value && *end == '\0') {
+        return seconds < 0 ? 0 : seconds;
+    }
+
+    struct tm tm = {0};
+    end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return -1;
+    }
+    seconds = timegm(&tm) - time(NULL);
+    return seconds < 0 ? 0 : seconds;
+}
+
+long retry_delay_ms(unsigned attempt, const struct http_head *head) {
+    long after = retry_after_s(head);
+    if (after >= 0) {
+        return after * 1000 > RETRY_AFTER_MAX_MS ? -1 : after * 1000;
+    }
+
+    // Full jitter: anywhere up to the exponential cap, so clients that
+    // failed together don't come back together
+    static _Thread_local unsigned seed;
+    if (seed == 0) {
+        seed = (unsigned) time(NULL) ^ (unsigned) (uintptr_t) &seed;
+    }
+    long cap = attempt < 16 ? MIN((long) RETRY_BASE_MS << attempt, RETRY_MAX_MS) : RETRY_MAX_MS;
+    return rand_r(&seed) % (cap + 1);
+}
+
+/* Recent times to first byte of one origin */
+struct ttfb {
+    char *origin;
+    long samples[TTFB_SAMPLES];
+    size_t len;
+    size_t next;    // where the next sample goes once all slots are taken
+    struct ttfb *next_origin;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ttfb *origins = NULL;
+
+static struct ttfb *find_origin(const char *origin, bool create) {
+    for (struct ttfb *t = origins; t; t = t->next_origin) {
+        if (strcmp(t->origin, origin) == 0) {
+            return t;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    struct ttfb *t = calloc(1, sizeof(struct ttfb));
+    if (!t) {
+        return NULL;
+    }
+    t->origin = strdup(origin);
+    if (!t->origin) {
+        free(t);
+        return NULL;
+    }
+    t->next_origin = origins;
+    origins = t;
+    return t;
+}
+
+void ttfb_record(const char *origin, long ms) {
+    pthread_mutex_lock(&lock);
+    struct ttfb *t = find_origin(origin, true);
+    if (t) {
+        if (t->len < TTFB_SAMPLES) {
+            t->samples[t->len++] = ms;
+        } else {
+            t->samples[t->next] = ms;
+            t->next = (t->next + 1) % TTFB_SAMPLES;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+long ttfb_percentile(const char *origin, unsigned percentile) {
+    long sorted[TTFB_SAMPLES];
+    size_t len = 0;
+
+    pthread_mutex_lock(&lock);
+    struct ttfb *t = find_origin(origin, false);
+    if (t) {
+        len = t->len;
+        memcpy(sorted, t->samples, len * sizeof(long));
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (len < TTFB_MIN_SAMPLES) {
+        return -1;
+    }
+    qsort(sorted, len, sizeof(long), compare_longs);
+    return sorted[MIN(len * percentile / 100, len - 1)];
+}
+
+struct hedge {
+    atomic_int refs;
+    atomic_int winner;              // side that won, -1 while racing
+    int cancel[2];                  // eventfd per side, written to when it lost
+    int outfd;                      // the consumer's, until a side wins it
+    struct fetch_response *response;
+};
+
+struct hedge *hedge_new(int outfd, struct fetch_response *response) {
+    struct hedge *h = malloc(sizeof(struct hedge));
+    if (!h) {
+        return NULL;
+    }
+    h->cancel[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    h->cancel[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (h->cancel[0] < 0 || h->cancel[1] < 0) {
+        perror("eventfd()");
+        if (h->cancel[0] >= 0) {
+            close(h->cancel[0]);
+        }
+        if (h->cancel[1] >= 0) {
+            close(h->cancel[1]);
+        }
+        free(h);
+        return NULL;
+    }
+    atomic_init(&h->refs, 2);
+    atomic_init(&h->winner, -1);
+    h->outfd = outfd;
+    h->response = response;
+    return h;
+}
+
+int hedge_fd(const struct hedge *h, int side) {
+    return h->cancel[side];
+}
+
+bool hedge_claim(struct hedge *h, int side, int *outfd, struct fetch_response **response) {
+    int racing = -1;
+    if (!atomic_compare_exchange_strong(&h->winner, &racing, side)) {
+        return racing == side;
+    }
+    *outfd = h->outfd;
+    *response = h->response;
+    h->outfd = -1;
+    h->response = NULL;
+
+    uint64_t one = 1;
+    if (write(h->cancel[!side], &one, sizeof(one)) < 0) {
+        perror("write()");
+    }
+    return true;
+}
+
+void hedge_release(struct hedge *h) {
+    if (atomic_fetch_sub(&h->refs, 1) != 1) {
+        return;
+    }
+    // Neither side got as far as a response head
+    if (h->outfd >= 0) {
+        close(h->outfd);
+    }
+    if (h->response) {
+        fetch_response_release(h->response);
+    }
+    close(h->cancel[0]);
+    close(h->cancel[1]);
+    free(h);
+}
@@ -0,0 +1,99 @@
+/**
+ * @file retry.h
+ * @brief When to send a GET again, and when to race a second copy of it.
+ *
+ * A fetch on a connection of its own is retried as long as none of its
+ * response reached the consumer yet: when connecting, the TLS handshake or
+ * sending fails, the server hangs up before the head is in, or it answers
+ * 408, 429, 502, 503 or 504. Waits between attempts grow exponentially with
+ * full jitter, unless the server said how long to wait with `Retry-After`.
+ *
+ * Hedging sends a copy of a request whose first response byte takes longer
+ * than a percentile of recent times to first byte from the same origin.
+ * Whichever copy gets its head in first is kept and the other one is
+ * cancelled, so one slow replica doesn't decide the tail latency.
+ */
+#pragma once
+#include "http1.h"
+#include <stdbool.h>
+
+struct fetch_response;
+
+/** First backoff cap, doubling with every attempt. */
+#define RETRY_BASE_MS 100
+
+/** Longest backoff between attempts. */
+#define RETRY_MAX_MS 10000
+
+/** A `Retry-After` longer than this isn't waited out, the response goes through as is. */
+#define RETRY_AFTER_MAX_MS 60000
+
+/** Times to first byte remembered per origin. */
+#define TTFB_SAMPLES 64
+
+/** Never hedge sooner than this, however quick the origin usually is. */
+#define HEDGE_MIN_MS 10
+
+/** Samples an origin needs before its requests get hedged. */
+#define TTFB_MIN_SAMPLES 16
+
+/**
+ * @brief Whether a response with STATUS is worth asking for again.
+ */
+bool retry_status(int status);
+
+/**
+ * @brief How long to wait before attempt ATTEMPT + 1, going by the
+ * `Retry-After` of HEAD if it has one. HEAD may be NULL.
+ *
+ * @return Milliseconds, or -1 when the server asked for a longer wait than
+ * #RETRY_AFTER_MAX_MS.
+ */
+long retry_delay_ms(unsigned attempt, const struct http_head *head);
+
+/**
+ * @brief Note that a response from ORIGIN took MS to its first byte.
+ */
+void ttfb_record(const char *origin, long ms);
+
+/**
+ * @brief PERCENTILE (1 to 99) of ORIGIN's recent times to first byte.
+ *
+ * @return Milliseconds, or -1 while there are fewer than #TTFB_MIN_SAMPLES.
+ */
+long ttfb_percentile(const char *origin, unsigned percentile);
+
+/**
+ * @brief The consumer a request and its hedge are racing for, shared by both.
+ *
+ * Side 0 is the request as first sent, side 1 its copy.
+ */
+struct hedge;
+
+/**
+ * @brief Hold on to OUTFD and RESPONSE until one side of the race wins them.
+ *
+ * Comes with a reference for each side.
+ */
+struct hedge *hedge_new(int outfd, struct fetch_response *response);
+
+/**
+ * @brief An eventfd that turns readable once SIDE lost the race.
+ */
+int hedge_fd(const struct hedge *h, int side);
+
+/**
+ * @brief Have SIDE win the race, unless the other side did already.
+ *
+ * The winner gets *OUTFD and *RESPONSE, and the other side is told to stop.
+ *
+ * @retval true SIDE won.
+ * @retval false SIDE lost, give up.
+ */
+bool hedge_claim(struct hedge *h, int side, int *outfd, struct fetch_response **response);
+
+/**
+ * @brief Drop a side's reference to H. With the last one, a consumer
+ * nobody won gets hung up on.
+ */
+void hedge_release(struct hedge *h);
@@ -0,0 +1,107 @@
+#include "ring.h"
+#include "cfns.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Move RING's unread bytes to the front of a new CAP byte buffer.
+static int resize(struct recv_ring *ring, size_t cap) {
+    char *buf = malloc(cap);
+    if (!buf) {
+        return -1;
+    }
+    struct iovec iov[2];
+    int segs = ring_peek(ring, iov);
+    size_t len = 0;
+    for (int i = 0; i < segs; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    free(ring->buf);
+    ring->buf = buf;
+    ring->cap = cap;
+    ring->head = 0;
+    ring->tail = len;
+    return 0;
+}
+
+ssize_t ring_fill(struct recv_ring *ring, int fd, SSL *ssl, size_t limit) {
+    if (ring->cap == 0 || (ring->filled && ring->cap < RING_MAX)) {
+        // First fill, or the socket had more than fit last time
+        bool grow = ring->cap > 0;
+        if (resize(ring, grow ? ring->cap * 2 : RING_MIN) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (grow) {
+            stat_add(STAT_RING_RESIZE, 1);
+        }
+    }
+    ring->filled = 0;
+    if (ring_len(ring) == 0) {
+        // Start over at the front, so the read doesn't need to wrap
+        ring->head = ring->tail = 0;
+    }
+
+    size_t room = ring->cap - ring_len(ring);
+    size_t want = MIN(room, limit);
+    if (want == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    size_t at = ring->tail & (ring->cap - 1);
+    size_t first = MIN(want, ring->cap - at);
+    struct iovec iov[2] = {
+        { .iov_base = ring->buf + at, .iov_len = first },
+        { .iov_base = ring->buf, .iov_len = want - first },
+    };
+
+    ssize_t n = ttcp_recvv(fd, iov, want > first ? 2 : 1, ssl);
+    if (n > 0) {
+        ring->tail += n;
+        ring->drained += n;
+        ring->filled = (size_t) n == room;
+        stat_add(STAT_NET_READ, 1);
+    }
+    return n;
+}
+
+int ring_peek(const struct recv_ring *ring, struct iovec iov[2]) {
+    size_t len = ring_len(ring);
+    if (len == 0) {
+        return 0;
+    }
+    size_t at = ring->head & (ring->cap - 1);
+    size_t first = MIN(len, ring->cap - at);
+    iov[0] = (struct iovec) { .iov_base = ring->buf + at, .iov_len = first };
+    if (first == len) {
+        return 1;
+    }
+    iov[1] = (struct iovec) { .iov_base = ring->buf, .iov_len = len - first };
+    return 2;
+}
+
+void ring_consume(struct recv_ring *ring, size_t n) {
+    ring->head += MIN(n, ring_len(ring));
+}
+
+void ring_settle(struct recv_ring *ring) {
+    bool quiet = ring->cap > RING_MIN
+        && ring->drained < ring->cap / 4
+        && ring_len(ring) <= ring->cap / 2;
+    ring->quiet = quiet ? ring->quiet + 1 : 0;
+    ring->drained = 0;
+
+    if (ring->quiet >= RING_SHRINK_AFTER && resize(ring, ring->cap / 2) == 0) {
+        stat_add(STAT_RING_RESIZE, 1);
+        ring->quiet = 0;
+    }
+}
+
+void ring_free(struct recv_ring *ring) {
+    free(ring->buf);
+    memset(ring, 0, sizeof(*ring));
+}
@@ -0,0 +1,73 @@
+/**
+ * @file ring.h
+ * @brief Per-connection receive ring that sizes itself to the traffic.
+ *
+ * Reads land in the ring's free space, wrapped around its end in one
+ * \c readv(), and get parsed straight out of it. A ring starts small, doubles
+ * whenever a read fills all the room it had (the socket had more than we
+ * took) and halves again after a run of wakeups that barely used it, so
+ * idle and slow connections stay cheap while fast ones take big reads.
+ */
+#pragma once
+#include <openssl/types.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Smallest and largest a #recv_ring gets, both powers of two. */
+#define RING_MIN (16 << 10)
+#define RING_MAX (1 << 20)
+
+/** Wakeups in a row using under a quarter of the ring before it halves. */
+#define RING_SHRINK_AFTER 8
+
+struct recv_ring {
+    char *buf;
+    /** Size of #buf, a power of two. 0 until the first fill. */
+    size_t cap;
+    /** Free running offsets of the next byte to consume and to fill. */
+    size_t head;
+    size_t tail;
+
+    /** The last read filled every byte of room it was given. */
+    int filled;
+    /** Bytes brought in since the last #ring_settle(), and how many settles in a row were quiet. */
+    size_t drained;
+    unsigned quiet;
+};
+
+/**
+ * @brief Bytes waiting in RING.
+ */
+static inline size_t ring_len(const struct recv_ring *ring) {
+    return ring->tail - ring->head;
+}
+
+/**
+ * @brief Read from FD (over SSL, if any) into RING, at most LIMIT bytes.
+ *
+ * @return Same as #ttcp_recv(). -1 with errno ENOMEM when RING couldn't be allocated.
+ */
+ssize_t ring_fill(struct recv_ring *ring, int fd, SSL *ssl, size_t limit);
+
+/**
+ * @brief The unread bytes of RING, as up to two segments.
+ *
+ * @return How many segments of IOV are set, 0 when RING is empty.
+ */
+int ring_peek(const struct recv_ring *ring, struct iovec iov[2]);
+
+/**
+ * @brief Mark N bytes of RING as consumed.
+ */
+void ring_consume(struct recv_ring *ring, size_t n);
+
+/**
+ * @brief Call when the socket ran dry, so RING shrinks after quiet stretches.
+ */
+void ring_settle(struct recv_ring *ring);
+
+/**
+ * @brief Free RING's buffer. A zeroed RING is fine too.
+ */
+void ring_free(struct recv_ring *ring);
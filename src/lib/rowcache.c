@@ -0,0 +1,293 @@
+#include "rowcache.h"
+#include "fetch.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Memory rows are parsed into, handed out front to back */
+struct chunk {
+    struct chunk *next;
+    size_t used;
+    size_t cap;
+    _Alignas(16) char data[];
+};
+
+struct rowcache_entry {
+    atomic_int refs;
+    const void *table;
+    char *url;
+    long long ttl_ms;
+    long long expires_ms;       // monotonic, once kept
+    struct fetch_response *response;
+
+    yyjson_doc **rows;
+    size_t len;
+    size_t cap;
+    struct chunk *chunks;       // the one being filled first
+    yyjson_alc alc;             // allocates out of chunks
+    size_t bytes;               // chunks and rows together
+
+    /* Kept entries, most recently used first */
+    struct rowcache_entry *prev;
+    struct rowcache_entry *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rowcache_entry *head = NULL;
+static struct rowcache_entry *tail = NULL;
+static size_t used = 0;
+static size_t budget = ROWCACHE_BUDGET;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t round_up(size_t size) {
+    return (size + 15) & ~(size_t) 15;
+}
+
+static void *chunk_malloc(void *ctx, size_t size) {
+    struct rowcache_entry *e = ctx;
+    size = round_up(size);
+    struct chunk *c = e->chunks;
+    if (c && c->cap - c->used >= size) {
+        void *p = c->data + c->used;
+        c->used += size;
+        return p;
+    }
+
+    // Big rows get a chunk to themselves, behind the one being filled
+    size_t cap = MAX(size, ROWCACHE_CHUNK);
+    struct chunk *fresh = malloc(sizeof(struct chunk) + cap);
+    if (!fresh) {
+        return NULL;
+    }
+    fresh->used = size;
+    fresh->cap = cap;
+    if (c && cap - size < c->cap - c->used) {
+        fresh->next = c->next;
+        c->next = fresh;
+    } else {
+        fresh->next = c;
+        e->chunks = fresh;
+    }
+    e->bytes += sizeof(struct chunk) + cap;
+    return fresh->data;
+}
+
+static void *chunk_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    struct rowcache_entry *e = ctx;
+    struct chunk *c = e->chunks;
+    old_size = round_up(old_size);
+    // The last thing handed out grows in place while there's room
+    if (c && (char *) ptr + old_size == c->data + c->used
+        && c->cap - (c->used - old_size) >= round_up(size))
+    {
+        c->used = c->used - old_size + round_up(size);
+        return ptr;
+    }
+    void *p = chunk_malloc(ctx, size);
+    if (p) {
+        memcpy(p, ptr, MIN(old_size, size));
+    }
+    return p;
+}
+
+static void chunk_free(void *ctx, void *ptr) {
+    // Chunks go all at once, with their entry
+    (void) ctx;
+    (void) ptr;
+}
+
+static void entry_free(struct rowcache_entry *e) {
+    while (e->chunks) {
+        struct chunk *next = e->chunks->next;
+        free(e->chunks);
+        e->chunks = next;
+    }
+    if (e->response) {
+        fetch_response_release(e->response);
+    }
+    free(e->rows);
+    free(e->url);
+    free(e);
+}
+
+void rowcache_release(struct rowcache_entry *e) {
+    if (e && atomic_fetch_sub(&e->refs, 1) == 1) {
+        entry_free(e);
+    }
+}
+
+// Take E off the list, dropping the list's reference. Holds lock.
+static void unkeep(struct rowcache_entry *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+    used -= e->bytes;
+    rowcache_release(e);
+}
+
+// Put E first on the list. Holds lock.
+static void push_front(struct rowcache_entry *e) {
+    e->prev = NULL;
+    e->next = head;
+    if (head) {
+        head->prev = e;
+    } else {
+        tail = e;
+    }
+    head = e;
+}
+
+static struct rowcache_entry *find(const void *table, const char *url) {
+    for (struct rowcache_entry *e = head; e; e = e->next) {
+        if (e->table == table && strcmp(e->url, url) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void rowcache_configure(size_t bytes) {
+    pthread_mutex_lock(&lock);
+    if (bytes > 0) {
+        budget = bytes;
+    }
+    while (tail && used > budget) {
+        stat_add(STAT_ROW_EVICT, 1);
+        unkeep(tail);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+struct rowcache_entry *rowcache_get(const void *table, const char *url) {
+    pthread_mutex_lock(&lock);
+    struct rowcache_entry *e = find(table, url);
+    if (e && e->expires_ms <= now_ms()) {
+        unkeep(e);
+        e = NULL;
+    }
+    if (e) {
+        if (e != head) {
+            // Unlinked by hand, the list's reference stays
+            e->prev->next = e->next;
+            if (e->next) {
+                e->next->prev = e->prev;
+            } else {
+                tail = e->prev;
+            }
+            push_front(e);
+        }
+        atomic_fetch_add(&e->refs, 1);
+        stat_add(STAT_ROW_HIT, 1);
+    }
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+size_t rowcache_len(const struct rowcache_entry *e) {
+    return e->len;
+}
+
+yyjson_doc *rowcache_row(const struct rowcache_entry *e, size_t i) {
+    return e->rows[i];
+}
+
+const struct fetch_response *rowcache_response(const struct rowcache_entry *e) {
+    return e->response;
+}
+
+struct rowcache_entry *rowcache_begin(const void *table, const char *url, long long ttl_ms) {
+    struct rowcache_entry *e = calloc(1, sizeof(struct rowcache_entry));
+    if (!e) {
+        return perror_rc(NULL, "calloc()", 0);
+    }
+    e->url = strdup(url);
+    if (!e->url) {
+        return perror_rc(NULL, "strdup()", free(e));
+    }
+    atomic_init(&e->refs, 1);
+    e->table = table;
+    e->ttl_ms = ttl_ms;
+    e->alc = (yyjson_alc) {
+        .malloc = chunk_malloc,
+        .realloc = chunk_realloc,
+        .free = chunk_free,
+        .ctx = e,
+    };
+    return e;
+}
+
+yyjson_doc *rowcache_parse(struct rowcache_entry *e, char *row, size_t len) {
+    if (e->len == e->cap) {
+        size_t cap = e->cap ? e->cap * 2 : 64;
+        yyjson_doc **rows = realloc(e->rows, cap * sizeof(yyjson_doc *));
+        if (!rows) {
+            return perror_rc(NULL, "realloc()", 0);
+        }
+        e->bytes += (cap - e->cap) * sizeof(yyjson_doc *);
+        e->rows = rows;
+        e->cap = cap;
+    }
+    yyjson_doc *doc = yyjson_read_opts(row, len, 0, &e->alc, NULL);
+    if (doc) {
+        e->rows[e->len++] = doc;
+    }
+    return doc;
+}
+
+bool rowcache_full(const struct rowcache_entry *e) {
+    // One table's rows can't take up more than half of everyone's
+    return e->bytes > budget / 2;
+}
+
+void rowcache_commit(struct rowcache_entry *e, struct fetch_response *response) {
+    if (e->len == 0 || rowcache_full(e)) {
+        return;
+    }
+    e->response = fetch_response_retain(response);
+    e->expires_ms = now_ms() + e->ttl_ms;
+
+    pthread_mutex_lock(&lock);
+    struct rowcache_entry *stale = find(e->table, e->url);
+    if (stale) {
+        unkeep(stale);
+    }
+    atomic_fetch_add(&e->refs, 1);
+    push_front(e);
+    used += e->bytes;
+    while (used > budget && tail != e) {
+        stat_add(STAT_ROW_EVICT, 1);
+        unkeep(tail);
+    }
+    pthread_mutex_unlock(&lock);
+    stat_add(STAT_ROW_STORE, 1);
+}
+
+void rowcache_forget(const void *table) {
+    pthread_mutex_lock(&lock);
+    struct rowcache_entry *e = head;
+    while (e) {
+        struct rowcache_entry *next = e->next;
+        if (e->table == table) {
+            unkeep(e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&lock);
+}
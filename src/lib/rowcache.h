@@ -0,0 +1,88 @@
+/**
+ * @file rowcache.h
+ * @brief Rows a table already parsed out of a URL's response, kept in
+ * memory to be read again without the network or the parser.
+ *
+ * An entry holds one `yyjson_doc` per row, all allocated out of chunks of
+ * its own, along with the response they came from. Entries stay fresh for
+ * the TTL of the table that made them, and all of them together stay under
+ * a byte budget by evicting the least recently used ones.
+ *
+ * Entries are shared: whoever reads one holds a reference, and an entry
+ * evicted meanwhile is only freed once its last reader lets go.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <yyjson.h>
+
+struct fetch_response;
+
+/** Bytes all entries together may take, by default. */
+#define ROWCACHE_BUDGET (64 << 20)
+
+/** Bytes of rows allocated at once. */
+#define ROWCACHE_CHUNK (64 << 10)
+
+struct rowcache_entry;
+
+/**
+ * @brief Set the BUDGET, in bytes, that entries have to stay under. Zero
+ * leaves it as it is.
+ */
+void rowcache_configure(size_t budget);
+
+/**
+ * @brief Fresh rows TABLE got out of URL, with a reference for the caller,
+ * or `NULL`.
+ */
+struct rowcache_entry *rowcache_get(const void *table, const char *url);
+
+/**
+ * @brief Number of rows in E.
+ */
+size_t rowcache_len(const struct rowcache_entry *e);
+
+/**
+ * @brief Row I of E, which is E's for as long as it's referenced.
+ */
+yyjson_doc *rowcache_row(const struct rowcache_entry *e, size_t i);
+
+/**
+ * @brief The response E's rows came from.
+ */
+const struct fetch_response *rowcache_response(const struct rowcache_entry *e);
+
+/**
+ * @brief A new entry for the rows TABLE gets out of URL, to be kept for
+ * TTL_MS once they're all in. Comes with a reference for the caller.
+ */
+struct rowcache_entry *rowcache_begin(const void *table, const char *url, long long ttl_ms);
+
+/**
+ * @brief Parse LEN bytes of JSON at ROW into a row of E.
+ *
+ * @return The row, which is E's, or `NULL` when ROW isn't JSON.
+ */
+yyjson_doc *rowcache_parse(struct rowcache_entry *e, char *row, size_t len);
+
+/**
+ * @brief Whether E outgrew what it may take of the budget, and won't be kept.
+ */
+bool rowcache_full(const struct rowcache_entry *e);
+
+/**
+ * @brief Keep E, which has all its rows, along with RESPONSE. Evicts the
+ * least recently used entries past the budget.
+ */
+void rowcache_commit(struct rowcache_entry *e, struct fetch_response *response);
+
+/**
+ * @brief Drop a reference to E, freeing it with the last one.
+ */
+void rowcache_release(struct rowcache_entry *e);
+
+/**
+ * @brief Drop every entry of TABLE, which is going away.
+ */
+void rowcache_forget(const void *table);
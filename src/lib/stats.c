@@ -0,0 +1,21 @@
+#include "stats.h"
+
+static long long counters[STAT_COUNT];
+
+static const char *names[STAT_COUNT] = {
+#define X(id, name) [STAT_##id] = name,
+    STATS(X)
+#undef X
+};
+
+void stat_add(enum stat_counter s, long long n) {
+    __atomic_fetch_add(&counters[s], n, __ATOMIC_RELAXED);
+}
+
+long long stat_get(enum stat_counter s) {
+    return __atomic_load_n(&counters[s], __ATOMIC_RELAXED);
+}
+
+const char *stat_name(enum stat_counter s) {
+    return names[s];
+}
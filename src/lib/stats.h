@@ -0,0 +1,78 @@
+/**
+ * @file stats.h
+ * @brief Process-wide runtime counters.
+ *
+ * Every counter is a monotonically increasing 64 bit integer that any
+ * thread can bump without taking a lock. The extension exposes the whole
+ * table to SQL through `SELECT fetch_stats()`.
+ */
+#pragma once
+
+/**
+ * @brief Counter table, as `X(ID, "name")` pairs.
+ *
+ * `ID` becomes `STAT_ID` in #stat_counter and `"name"` is the key
+ * reported by `fetch_stats()`.
+ */
+#define STATS(X)                               \
+    X(POOL_HIT,   "pool_hits")                 \
+    X(POOL_MISS,  "pool_misses")               \
+    X(POOL_EVICT, "pool_evictions")            \
+    X(TLS_HANDSHAKE,    "tls_handshakes")      \
+    X(TLS_HANDSHAKE_US, "tls_handshake_us")    \
+    X(TLS_RESUMED,      "tls_resumed")         \
+    X(TLS_RESUMED_US,   "tls_resumed_us")      \
+    X(DNS_HIT,          "dns_hits")            \
+    X(DNS_STALE,        "dns_stale_hits")      \
+    X(DNS_MISS,         "dns_misses")          \
+    X(DNS_FAIL,         "dns_failures")        \
+    X(BODY_WIRE,        "body_bytes_received") \
+    X(BODY_DECODED,     "body_bytes_decoded")  \
+    X(BODY_SPLICED,     "body_bytes_spliced")  \
+    X(H2_CONNECT,       "h2_connections")      \
+    X(H2_STREAM,        "h2_streams")          \
+    X(H2_FALLBACK,      "h2_fallbacks")        \
+    X(NET_READ,         "net_reads")           \
+    X(RING_RESIZE,      "ring_resizes")        \
+    X(PIPE_CONNECT,     "pipeline_connections") \
+    X(PIPE_REQUEST,     "pipelined_requests")  \
+    X(PIPE_RETRY,       "pipeline_retries")    \
+    X(RANGE_SPLIT,      "range_splits")        \
+    X(RANGE_SEGMENT,    "range_segments")      \
+    X(RETRY,            "retries")             \
+    X(HEDGE,            "hedged_requests")     \
+    X(HEDGE_WON,        "hedges_won")          \
+    X(ADMIT_QUEUED,     "admission_waits")     \
+    X(ADMIT_WAIT_MS,    "admission_wait_ms")   \
+    X(ADMIT_OVERDUE,    "admission_overdue")   \
+    X(CACHE_HIT,        "cache_hits")          \
+    X(CACHE_REVALIDATED, "cache_revalidations") \
+    X(CACHE_MISS,       "cache_misses")        \
+    X(CACHE_STORE,      "cache_stores")        \
+    X(ROW_HIT,          "row_cache_hits")      \
+    X(ROW_STORE,        "row_cache_stores")    \
+    X(ROW_EVICT,        "row_cache_evictions") \
+    X(COALESCED,        "coalesced_fetches")   \
+    X(COALESCE_BEHIND,  "coalesce_refetches")
+
+enum stat_counter {
+#define X(id, name) STAT_##id,
+    STATS(X)
+#undef X
+    STAT_COUNT
+};
+
+/**
+ * @brief Add N to counter S.
+ */
+void stat_add(enum stat_counter s, long long n);
+
+/**
+ * @brief Read the current value of counter S.
+ */
+long long stat_get(enum stat_counter s);
+
+/**
+ * @brief The name counter S is reported under.
+ */
+const char *stat_name(enum stat_counter s);
@@ -1,13 +1,22 @@
 #include "tcp.h"
 #include "cfns.h"
+#include "stats.h"
 
 #include <asm-generic/errno-base.h>
+#include <errno.h>
 #include <netdb.h>
 #include <openssl/err.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Cap on remembered TLS sessions, one per host:port */
+#define MAX_TLS_SESSIONS 256
+
 static void err_print() {
     unsigned long err = ERR_get_error();
     if (err != 0) {
@@ -17,32 +26,54 @@ static void err_print() {
     }
 }
 
-static int tls_connect(int sockfd, SSL **ssl,
-                       SSL_CTX **ctx, const char *hostname);
-
 int ttcp_connect(int fd, struct sockaddr *addr, socklen_t len,
-                 SSL **ssl, SSL_CTX **ctx, const char *hostname)
+                 SSL **ssl, const char *hostname, const char *port)
 {
     if (connect(fd, addr, len) < 0) {
         return perror_rc(-1, "connect()", 0);
     }
-    if (ssl != NULL && ctx != NULL && hostname != NULL) {
-        if (tls_connect(fd, ssl, ctx, hostname) < 0) {
-            return perror_rc(-1, "tls_connect()", 0);
+    if (ssl != NULL && hostname != NULL && port != NULL) {
+        if (ttcp_tls_connect(fd, ssl, hostname, port) < 0) {
+            return perror_rc(-1, "ttcp_tls_connect()", 0);
         } // else { ok! }
     }
     return 0;
 }
 
+// Map the SSL_read()/SSL_write() result RC <= 0 onto the ttcp return values.
+static ssize_t tls_result(SSL *ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return TTCP_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TTCP_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // errno is the socket's. An EOF without close_notify comes back as
+        // SSL_ERROR_ZERO_RETURN instead, see init_client_ctx()
+        return -1;
+    default:
+        err_print();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
 ssize_t ttcp_send(int fd, const char *bytes, size_t len, SSL *ssl) {
     if (fd < 0 && !ssl) {
         return -1;
     }
     if (ssl) {
-        return SSL_write(ssl, bytes, len);
-    } else {
-        return send(fd, bytes, len, 0);
+        int n = SSL_write(ssl, bytes, len);
+        return n > 0 ? n : tls_result(ssl, n);
+    }
+
+    ssize_t n = send(fd, bytes, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return TTCP_WANT_WRITE;
     }
+    return n;
 }
 
 ssize_t ttcp_recv(int sockfd, char *buf, size_t len, SSL *ssl) {
@@ -52,20 +83,53 @@ ssize_t ttcp_recv(int sockfd, char *buf, size_t len, SSL *ssl) {
     }
 
     if (ssl) {
-        return SSL_read(ssl, buf, len);
-    } else {
-        return recv(sockfd, buf, len, 0);
+        int n = SSL_read(ssl, buf, len);
+        return n > 0 ? n : tls_result(ssl, n);
     }
+
+    ssize_t n = recv(sockfd, buf, len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return TTCP_WANT_READ;
+    }
+    return n;
 }
 
-void ttcp_tls_free(SSL *ssl, SSL_CTX *ctx) {
+ssize_t ttcp_recvv(int sockfd, const struct iovec *iov, int iovcnt, SSL *ssl) {
+    if (!ssl) {
+        if (sockfd < 0) {
+            return -1;
+        }
+        ssize_t n = readv(sockfd, iov, iovcnt);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return TTCP_WANT_READ;
+        }
+        return n;
+    }
+
+    ssize_t got = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        ssize_t n = ttcp_recv(sockfd, iov[i].iov_base, iov[i].iov_len, ssl);
+        if (n <= 0) {
+            // What we got so far counts, the rest comes up next call
+            return got > 0 ? got : n;
+        }
+        got += n;
+        if ((size_t) n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return got;
+}
+
+void ttcp_tls_free(SSL *ssl) {
     if (ssl) {
+        free(SSL_get_app_data(ssl));
         SSL_shutdown(ssl);
         SSL_free(ssl);
     }
-    if (ctx) {
-        SSL_CTX_free(ctx);
-    }
 }
 
 int tcp_getaddrinfo(const char *hostname, const char *port,
@@ -76,7 +140,7 @@ int tcp_getaddrinfo(const char *hostname, const char *port,
         return EINVAL;
     }
     struct addrinfo hints = {
-        .ai_family=AF_INET,
+        .ai_family=AF_UNSPEC,
         .ai_socktype=SOCK_STREAM
     };
     int rc = getaddrinfo(hostname, port, &hints, addr);
@@ -87,6 +151,209 @@ int tcp_getaddrinfo(const char *hostname, const char *port,
     return 0;
 }
 
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reorder LIST in place so address families alternate (RFC 8305 section 4),
+// keeping getaddrinfo()'s RFC 6724 order within each family.
+static struct addrinfo *interleave(struct addrinfo *list) {
+    if (!list) {
+        return NULL;
+    }
+    int first = list->ai_family;
+    struct addrinfo *primary = NULL, **ptail = &primary;
+    struct addrinfo *secondary = NULL, **stail = &secondary;
+    for (struct addrinfo *ai = list; ai; ) {
+        struct addrinfo *next = ai->ai_next;
+        ai->ai_next = NULL;
+        if (ai->ai_family == first) {
+            *ptail = ai;
+            ptail = &ai->ai_next;
+        } else {
+            *stail = ai;
+            stail = &ai->ai_next;
+        }
+        ai = next;
+    }
+
+    struct addrinfo *head = NULL, **tail = &head;
+    while (primary || secondary) {
+        if (primary) {
+            *tail = primary;
+            primary = primary->ai_next;
+            tail = &(*tail)->ai_next;
+        }
+        if (secondary) {
+            *tail = secondary;
+            secondary = secondary->ai_next;
+            tail = &(*tail)->ai_next;
+        }
+    }
+    *tail = NULL;
+    return head;
+}
+
+static void race_close(struct tcp_race *race, int slot) {
+    reactor_unwatch(race->task, race->fds[slot]);
+    close(race->fds[slot]);
+    race->fds[slot] = -1;
+}
+
+static int race_inflight(const struct tcp_race *race) {
+    int n = 0;
+    for (int i = 0; i < TCP_RACE_MAX; i++) {
+        n += race->fds[i] >= 0;
+    }
+    return n;
+}
+
+// Start attempts until one is in flight or connected, or we run out
+// of addresses. Returns the socket when connect() finished right away.
+static int race_next(struct tcp_race *race) {
+    while (race->next) {
+        int slot = -1;
+        for (int i = 0; i < TCP_RACE_MAX; i++) {
+            if (race->fds[i] < 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) {
+            race->next_attempt_ms = now_ms() + TCP_RACE_DELAY_MS;
+            return -1;
+        }
+
+        struct addrinfo *ai = race->next;
+        race->next = ai->ai_next;
+        race->next_attempt_ms = now_ms() + TCP_RACE_DELAY_MS;
+
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+        if (fd < 0) {
+            race->last_error = errno;
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            return fd;
+        }
+        if (errno != EINPROGRESS) {
+            // e.g. ENETUNREACH on a host without IPv6, try the next one now
+            race->last_error = errno;
+            close(fd);
+            continue;
+        }
+
+        if (reactor_watch(race->task, fd, EPOLLOUT) < 0) {
+            race->last_error = errno;
+            close(fd);
+            continue;
+        }
+        race->fds[slot] = fd;
+        return -1;
+    }
+    return -1;
+}
+
+// Either connected (FD), still racing (-1), or out of options (-2).
+static int race_settle(struct tcp_race *race, int fd) {
+    if (fd >= 0) {
+        tcp_race_abort(race);
+        return fd;
+    }
+    if (race_inflight(race) == 0 && !race->next) {
+        errno = race->last_error ? race->last_error : ECONNREFUSED;
+        return -2;
+    }
+    return -1;
+}
+
+int tcp_race_start(struct tcp_race *race, struct addrinfo *addrinfo,
+                   struct reactor_task *task, long timeout_ms)
+{
+    *race = (struct tcp_race) {
+        .next = interleave(addrinfo),
+        .task = task,
+        .deadline_ms = now_ms() + timeout_ms,
+    };
+    for (int i = 0; i < TCP_RACE_MAX; i++) {
+        race->fds[i] = -1;
+    }
+    return race_settle(race, race_next(race));
+}
+
+bool tcp_race_owns(const struct tcp_race *race, int fd) {
+    for (int i = 0; i < TCP_RACE_MAX; i++) {
+        if (race->fds[i] == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int tcp_race_ready(struct tcp_race *race, int fd, uint32_t events) {
+    int slot = -1;
+    for (int i = 0; i < TCP_RACE_MAX; i++) {
+        if (race->fds[i] == fd) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        return -1;
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err == 0 && !(events & (EPOLLERR | EPOLLHUP))) {
+        // Winner: hand it over clean, without its registration
+        reactor_unwatch(race->task, fd);
+        race->fds[slot] = -1;
+        return race_settle(race, fd);
+    }
+
+    race->last_error = err ? err : ECONNREFUSED;
+    race_close(race, slot);
+    // A failed attempt doesn't wait out the delay
+    return race_settle(race, race_next(race));
+}
+
+int tcp_race_tick(struct tcp_race *race) {
+    long long now = now_ms();
+    if (now >= race->deadline_ms) {
+        tcp_race_abort(race);
+        race->next = NULL;
+        errno = ETIMEDOUT;
+        return -2;
+    }
+    if (race->next && now >= race->next_attempt_ms) {
+        return race_settle(race, race_next(race));
+    }
+    return race_settle(race, -1);
+}
+
+int tcp_race_timeout(const struct tcp_race *race) {
+    long long now = now_ms();
+    long long until = race->deadline_ms;
+    if (race->next && race->next_attempt_ms < until) {
+        until = race->next_attempt_ms;
+    }
+    return until > now ? (int) (until - now) : 0;
+}
+
+void tcp_race_abort(struct tcp_race *race) {
+    for (int i = 0; i < TCP_RACE_MAX; i++) {
+        if (race->fds[i] >= 0) {
+            race_close(race, i);
+        }
+    }
+}
+
 int tcp_socket(struct addrinfo *addrinfo) {
     int sockfd = socket(
         addrinfo->ai_family,
@@ -100,37 +367,213 @@ int tcp_socket(struct addrinfo *addrinfo) {
     return sockfd;
 }
 
-static int tls_connect(int sockfd, SSL **ssl,
-                       SSL_CTX **ctx, const char *hostname)
-{
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
+/* Resumable sessions by "host:port", most recent ticket wins */
+struct tls_session {
+    char *key;
+    SSL_SESSION *session;
+    struct tls_session *next;
+};
 
-    if (sockfd < 0 || !hostname || !ctx || !ssl) {
-        return -1;
+/* What a client SSL carries as app data, see ttcp_tls_free() */
+struct tls_app {
+    long long started_us;   // when the handshake began
+    char key[];             // "host:port" the session resumes by
+};
+
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static SSL_CTX *client_ctx = NULL;
+
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_session *sessions = NULL;
+static size_t sessions_len = 0;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Session ticket callback. OpenSSL calls this once the server hands
+// us a ticket, which for TLS 1.3 is *after* the handshake, somewhere
+// in the first few SSL_read() calls. Returning 1 keeps the reference.
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    struct tls_app *app = SSL_get_app_data(ssl);
+    if (!app) {
+        return 0;
+    }
+    const char *key = app->key;
+
+    pthread_mutex_lock(&sessions_lock);
+    struct tls_session **link = &sessions;
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->key, key) == 0) {
+            SSL_SESSION_free((*link)->session);
+            (*link)->session = session;
+            pthread_mutex_unlock(&sessions_lock);
+            return 1;
+        }
     }
 
-    *ctx = SSL_CTX_new(TLS_client_method());
-    if (!*ctx) {
+    if (sessions_len >= MAX_TLS_SESSIONS) {
+        // Full, forget the oldest host (the tail)
+        struct tls_session **tail = &sessions;
+        while ((*tail)->next) {
+            tail = &(*tail)->next;
+        }
+        SSL_SESSION_free((*tail)->session);
+        free((*tail)->key);
+        free(*tail);
+        *tail = NULL;
+        sessions_len--;
+    }
+
+    struct tls_session *entry = calloc(1, sizeof(struct tls_session));
+    char *owned_key = strdup(key);
+    if (!entry || !owned_key) {
+        pthread_mutex_unlock(&sessions_lock);
+        free(entry);
+        free(owned_key);
+        return 0;
+    }
+    entry->key = owned_key;
+    entry->session = session;
+    entry->next = sessions;
+    sessions = entry;
+    sessions_len++;
+    pthread_mutex_unlock(&sessions_lock);
+    return 1;
+}
+
+// Resumable session for KEY with an extra reference the
+// caller drops, NULL when we've never talked to KEY.
+static SSL_SESSION *find_session(const char *key) {
+    SSL_SESSION *found = NULL;
+    pthread_mutex_lock(&sessions_lock);
+    for (struct tls_session *s = sessions; s; s = s->next) {
+        if (strcmp(s->key, key) == 0) {
+            if (SSL_SESSION_is_resumable(s->session)) {
+                SSL_SESSION_up_ref(s->session);
+                found = s->session;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return found;
+}
+
+static void init_client_ctx(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
         err_print();
+        return;
+    }
+    // We keep the sessions ourselves, keyed by host:port, since OpenSSL's
+    // internal cache only ever looks sessions up on the server side.
+    SSL_CTX_set_session_cache_mode(ctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+    // Plenty of servers close the socket without a close_notify once the
+    // response is out. Taking that as a clean EOF rather than a fatal error
+    // also stops OpenSSL from marking the session as not resumable.
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Records decrypted in the kernel, where the cipher and kernel allow,
+    // so a raw body can be spliced off the socket like a plain one. OpenSSL
+    // quietly does without otherwise.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    client_ctx = ctx;
+}
+
+SSL_CTX *ttcp_tls_ctx(void) {
+    pthread_once(&ctx_once, init_client_ctx);
+    return client_ctx;
+}
+
+int ttcp_tls_handshake(int sockfd, SSL **ssl, const char *hostname,
+                       const char *port, const char *alpn)
+{
+    if (sockfd < 0 || !hostname || !port || !ssl) {
         return -1;
     }
 
-    *ssl = SSL_new(*ctx);
     if (!*ssl) {
-        err_print();
-        SSL_CTX_free(*ctx);
-        return -1;
+        SSL_CTX *ctx = ttcp_tls_ctx();
+        if (!ctx) {
+            return -1;
+        }
+
+        struct string key = dynamic("%s:%s", hostname, port);
+        if (!key.hd) {
+            return -1;
+        }
+        struct tls_app *app = malloc(sizeof(struct tls_app) + key.length + 1);
+        if (!app) {
+            free(key.hd);
+            return -1;
+        }
+        memcpy(app->key, key.hd, key.length + 1);
+        free(key.hd);
+
+        *ssl = SSL_new(ctx);
+        if (!*ssl) {
+            err_print();
+            free(app);
+            return -1;
+        }
+        // Owned by the SSL from here on, see ttcp_tls_free()
+        SSL_set_app_data(*ssl, app);
+
+        SSL_SESSION *session = find_session(app->key);
+        if (session) {
+            SSL_set_session(*ssl, session);
+            SSL_SESSION_free(session);
+        }
+
+        SSL_set_fd(*ssl, sockfd);
+        SSL_set_tlsext_host_name(*ssl, hostname);
+        if (alpn) {
+            SSL_set_alpn_protos(*ssl, (const unsigned char *) alpn, strlen(alpn));
+        }
+        app->started_us = now_us();
     }
 
-    SSL_set_fd(*ssl, sockfd);
-    SSL_set_tlsext_host_name(*ssl, hostname);
     int rc = SSL_connect(*ssl);
-
     if (rc <= 0) {
-        err_print();
-        SSL_free(*ssl);
-        SSL_CTX_free(*ctx);
+        switch (SSL_get_error(*ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+            return TTCP_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TTCP_WANT_WRITE;
+        default:
+            err_print();
+            ttcp_tls_free(*ssl);
+            *ssl = NULL;
+            return -1;
+        }
+    }
+
+    struct tls_app *app = SSL_get_app_data(*ssl);
+    long long elapsed = now_us() - app->started_us;
+    stat_add(STAT_TLS_HANDSHAKE, 1);
+    stat_add(STAT_TLS_HANDSHAKE_US, elapsed);
+    if (SSL_session_reused(*ssl)) {
+        stat_add(STAT_TLS_RESUMED, 1);
+        stat_add(STAT_TLS_RESUMED_US, elapsed);
     }
     return 0;
 }
+
+int ttcp_tls_connect(int sockfd, SSL **ssl,
+                     const char *hostname, const char *port)
+{
+    // A blocking socket never leaves the handshake halfway
+    *ssl = NULL;
+    return ttcp_tls_handshake(sockfd, ssl, hostname, port, NULL) == 0 ? 0 : -1;
+}
+
+bool ttcp_tls_alpn_is(SSL *ssl, const char *protocol) {
+    const unsigned char *selected = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(ssl, &selected, &len);
+    return selected && len == strlen(protocol) && memcmp(selected, protocol, len) == 0;
+}
@@ -7,13 +7,56 @@
  * using the socket counterparts \c send() \c recv() otherwise.
  */
 #pragma once
+#include "reactor.h"
 #include <netdb.h>
 #include <openssl/ssl.h>
 #include <openssl/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #define MAX_HOSTNAME_LENGTH 255
 
+/** #ttcp_send(), #ttcp_recv() or #ttcp_tls_handshake() can't go on until the socket is readable. */
+#define TTCP_WANT_READ (-2)
+
+/** #ttcp_send(), #ttcp_recv() or #ttcp_tls_handshake() can't go on until the socket is writable. */
+#define TTCP_WANT_WRITE (-3)
+
+/** Most connection attempts a #tcp_race keeps in flight at once. */
+#define TCP_RACE_MAX 8
+
+/** RFC 8305 "Connection Attempt Delay" between staggered attempts. */
+#define TCP_RACE_DELAY_MS 250
+
+/**
+ * @brief Nonblocking connection attempts racing over a list of addresses.
+ *
+ * Implements Happy Eyeballs v2 (RFC 8305): addresses are tried in an order
+ * that alternates IPv6 and IPv4, starting a new attempt every
+ * #TCP_RACE_DELAY_MS or as soon as one fails, and the first attempt
+ * to connect wins. Attempts are watched for `EPOLLOUT` on behalf of a
+ * reactor task, see #tcp_race_ready() and #tcp_race_tick().
+ */
+struct tcp_race {
+    /** Next address to try, NULL once all of them were started. */
+    struct addrinfo *next;
+
+    /** Sockets of attempts in flight, -1 for free slots. */
+    int fds[TCP_RACE_MAX];
+
+    /** Task whose shard watches the attempts. */
+    struct reactor_task *task;
+
+    /** When (monotonic ms) the next staggered attempt starts. */
+    long long next_attempt_ms;
+
+    /** When (monotonic ms) the whole race gives up. */
+    long long deadline_ms;
+
+    /** errno of the last failed attempt. */
+    int last_error;
+};
 /**
  * @brief Write address info from HOSTNAME and PORT into ADDR.
  *
@@ -23,6 +66,57 @@
  */
 int tcp_getaddrinfo(const char *hostname, const char *port, struct addrinfo **addr);
 
+/**
+ * @brief Start racing connections to the addresses at ADDRINFO, with
+ * TASK's shard watching the attempts.
+ *
+ * Attempts report to TASK's #reactor_task.ready like its own fds.
+ * ADDRINFO is reordered in place to alternate address families, so the
+ * list must outlive RACE. The whole race gives up after TIMEOUT_MS.
+ *
+ * @retval NONNEGATIVE A socket that connected right away. RACE is done.
+ * @retval -1 Racing. Drive RACE with #tcp_race_ready() and #tcp_race_tick().
+ * @retval -2 Every address failed, errno is set.
+ */
+int tcp_race_start(struct tcp_race *race, struct addrinfo *addrinfo,
+                   struct reactor_task *task, long timeout_ms);
+
+/**
+ * @brief Whether FD belongs to an attempt in RACE.
+ */
+bool tcp_race_owns(const struct tcp_race *race, int fd);
+
+/**
+ * @brief Handle epoll EVENTS on attempt FD of RACE.
+ *
+ * The winning socket is no longer watched and every other attempt
+ * is closed, so the caller owns it outright.
+ *
+ * @retval NONNEGATIVE The connected socket. RACE is done.
+ * @retval -1 Still racing.
+ * @retval -2 Every address failed, errno is set.
+ */
+int tcp_race_ready(struct tcp_race *race, int fd, uint32_t events);
+
+/**
+ * @brief Start the next staggered attempt if it's due, or give up if
+ * the deadline passed. Call whenever #tcp_race_timeout() elapses.
+ *
+ * @retval -1 Still racing.
+ * @retval -2 Timed out (`ETIMEDOUT`) or every address failed, errno is set.
+ */
+int tcp_race_tick(struct tcp_race *race);
+
+/**
+ * @brief Milliseconds until RACE needs a #tcp_race_tick(), for #reactor_task.deadline_ms.
+ */
+int tcp_race_timeout(const struct tcp_race *race);
+
+/**
+ * @brief Close every attempt still in flight.
+ */
+void tcp_race_abort(struct tcp_race *race);
+
 /**
  * @brief Open socket fd from ADDRINFO and return it.
  *
@@ -33,14 +127,62 @@ int tcp_socket(struct addrinfo *addrinfo);
 
 /**
  * @brief \c connect() to socket FD using ADDR, optionally using TLS
- * if TLS is not NULL.
+ * if SSL is not NULL.
+ *
+ * The TLS session runs off the shared #ttcp_tls_ctx(), sending HOSTNAME
+ * as SNI and resuming the last session we had with HOSTNAME:PORT, if any.
  *
  * @retval 0 OK
  * @retval -1 Error connecting to socket
  * @retval -2 Error with TLS connection
  */
 int ttcp_connect(int fd, struct sockaddr * addr, socklen_t len,
-                 SSL **ssl, SSL_CTX **ctx, const char *hostname);
+                 SSL **ssl, const char *hostname, const char *port);
+
+/**
+ * @brief Start, or carry on with, the TLS client handshake over the connected SOCKFD.
+ *
+ * Meant for nonblocking sockets: call it with `*SSL == NULL` to start, then
+ * again with the same SSL whenever SOCKFD is ready for what the last call
+ * asked for. Same session handling as #ttcp_connect(). On error, `*SSL` is
+ * freed and left `NULL`.
+ *
+ * ALPN, if not `NULL`, lists the application protocols to offer in ALPN wire
+ * format (length prefixed, e.g. `"\x02h2\x08http/1.1"`), see #ttcp_tls_alpn_is().
+ *
+ * @retval 0 OK, the handshake is done.
+ * @retval TTCP_WANT_READ Call again once SOCKFD is readable.
+ * @retval TTCP_WANT_WRITE Call again once SOCKFD is writable.
+ * @retval -1 Error with TLS connection
+ */
+int ttcp_tls_handshake(int sockfd, SSL **ssl, const char *hostname,
+                       const char *port, const char *alpn);
+
+/**
+ * @brief Whether the server picked PROTOCOL (e.g. `"h2"`) over ALPN during SSL's handshake.
+ */
+bool ttcp_tls_alpn_is(SSL *ssl, const char *protocol);
+
+/**
+ * @brief Run the TLS client handshake over the already connected, blocking SOCKFD.
+ *
+ * #ttcp_tls_handshake() in one go. On error, SSL is left `NULL`.
+ *
+ * @retval 0 OK, SSL holds the new session.
+ * @retval -1 Error with TLS connection
+ */
+int ttcp_tls_connect(int sockfd, SSL **ssl,
+                     const char *hostname, const char *port);
+
+/**
+ * @brief The process-wide client TLS context, created on first use.
+ *
+ * It keeps a client session cache keyed by host and port, so repeat
+ * connections to a server take the abbreviated (resumed) handshake.
+ *
+ * @retval NULL Error creating the context.
+ */
+SSL_CTX *ttcp_tls_ctx(void);
 
 /**
  * @brief Send LEN BYTES over tcp connection at FD, potentially writing
@@ -49,6 +191,8 @@ int ttcp_connect(int fd, struct sockaddr * addr, socklen_t len,
  * If SSL is `NULL`, then #ttcp_send() fallsback to plain \c send() call to SOCKFD.
  *
  * @retval -1 ERROR - Neither the SOCKFD or SSL sockets can be written to.
+ * @retval TTCP_WANT_READ Nonblocking SOCKFD has to be readable before going on (TLS only).
+ * @retval TTCP_WANT_WRITE Nonblocking SOCKFD has to be writable before going on.
  * @retval x>=0 OK - `x` bytes written out.
  */
 ssize_t ttcp_send(int fd, const char *bytes, size_t len, SSL *ssl);
@@ -57,17 +201,32 @@ ssize_t ttcp_send(int fd, const char *bytes, size_t len, SSL *ssl);
  * @brief Maybe recv LEN BYTES over the TCP connection at SSL, if it exists.
  *
  * If SSL is `NULL` then #ttcp_recv() fallsback to plain \c recv() call to SOCKFD.
+ * SSL may hold decrypted bytes SOCKFD no longer signals as readable, so keep
+ * calling until it wants to wait rather than waiting on SOCKFD after each read.
  *
  * @retval -1 ERROR - Neither the SOCKFD or SSL sockets can be written to.
- * @retval (x >= 0) OK - X bytes written out.
+ * @retval TTCP_WANT_READ Nonblocking SOCKFD has to be readable before going on.
+ * @retval TTCP_WANT_WRITE Nonblocking SOCKFD has to be writable before going on (TLS only).
+ * @retval 0 EOF
+ * @retval (x > 0) OK - X bytes written out.
  */
 ssize_t ttcp_recv(int fd, char *bytes, size_t len, SSL *ssl);
 
 /**
- * @brief Shutdown and free SSL and CTX.
+ * @brief #ttcp_recv() into the IOVCNT buffers of IOV, in order.
+ *
+ * Plain sockets fill them all with one \c readv(). TLS reads them one
+ * after another, stopping at the first that isn't filled.
+ *
+ * @return Same as #ttcp_recv().
+ */
+ssize_t ttcp_recvv(int fd, const struct iovec *iov, int iovcnt, SSL *ssl);
+
+/**
+ * @brief Shutdown and free SSL.
  *
- * If both SSL and CTX are NULL, then this is effectively a no-op.
+ * The shared context stays alive. If SSL is NULL, then this is a no-op.
  */
-void ttcp_tls_free(SSL *ssl, SSL_CTX *ctx);
+void ttcp_tls_free(SSL *ssl);
 
 #undef MAX_HOSTNAME_LENGTH
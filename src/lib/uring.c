@@ -0,0 +1,158 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                 void *arg, size_t arg_len)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_len);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params p = {0};
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->fd = fd;
+
+    // One mapping covers both rings
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_map_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int err = errno;
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    char *cq = ring->sq_map;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+static int submit(struct uring *ring) {
+    while (ring->sq_pending > 0) {
+        int n = enter(ring->fd, ring->sq_pending, 0, 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->sq_pending -= n;
+    }
+    return 0;
+}
+
+// Next free submission slot, handing what's queued to the kernel first
+// if the ring is full.
+static struct io_uring_sqe *next_sqe(struct uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > ring->sq_mask) {
+        submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    return sqe;
+}
+
+static void queue(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+}
+
+void uring_poll_add(struct uring *ring, int fd, uint32_t events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = events << 16 | events >> 16;
+#endif
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    queue(ring);
+}
+
+void uring_poll_remove(struct uring *ring, uint64_t user_data) {
+    struct io_uring_sqe *sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    // Its own completion comes back with user_data 0
+    sqe->user_data = 0;
+    queue(ring);
+}
+
+int uring_wait(struct uring *ring, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long) (timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout_ms >= 0 ? (uint64_t) (uintptr_t) &ts : 0,
+    };
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    int n = enter(ring->fd, ring->sq_pending, 1, flags, &arg, sizeof(arg));
+    if (n < 0) {
+        return errno == EINTR || errno == ETIME ? 0 : -1;
+    }
+    ring->sq_pending -= n;
+    // A full completion ring can make the kernel take only part of the batch
+    return submit(ring);
+}
+
+int uring_reap(struct uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    *cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void uring_free(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
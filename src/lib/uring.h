@@ -0,0 +1,82 @@
+/**
+ * @file uring.h
+ * @brief Just enough of io_uring, over the raw syscalls, for the reactor.
+ *
+ * Requests are queued into the submission ring without any syscall and all
+ * go to the kernel together with the next #uring_wait(), which also blocks
+ * for completions. So a reactor round trip costs one \c io_uring_enter()
+ * however many polls it (re)armed.
+ */
+#pragma once
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+    int fd;
+
+    /* Submission ring, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    /** Queued and not handed to the kernel yet. */
+    unsigned sq_pending;
+
+    /* Completion ring, shared with the kernel */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /** Both rings, in one mapping. */
+    void *sq_map;
+    size_t sq_map_len;
+    size_t sqes_len;
+};
+
+/**
+ * @brief Set up RING with room for ENTRIES queued requests.
+ *
+ * Fails on kernels whose io_uring lacks what the reactor needs, like
+ * timeouts on waits (5.11), so callers can fall back to epoll.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, errno is set.
+ */
+int uring_init(struct uring *ring, unsigned entries);
+
+/**
+ * @brief Queue a one shot poll for EVENTS (`EPOLL*` bits) on FD.
+ *
+ * Completes once with the events that came in, as the CQE's `res`.
+ */
+void uring_poll_add(struct uring *ring, int fd, uint32_t events, uint64_t user_data);
+
+/**
+ * @brief Queue cancelling the poll queued with USER_DATA, if it's still pending.
+ *
+ * The removal's own completion carries `user_data` 0.
+ */
+void uring_poll_remove(struct uring *ring, uint64_t user_data);
+
+/**
+ * @brief Submit what's queued and wait up to TIMEOUT_MS (-1 for ever) for a completion.
+ *
+ * @retval 0 OK, completions may be in.
+ * @retval -1 Error, errno is set. EINTR and timeouts aren't errors.
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/**
+ * @brief Take the oldest completion out of RING into CQE.
+ *
+ * @return 1 if there was one, 0 otherwise.
+ */
+int uring_reap(struct uring *ring, struct io_uring_cqe *cqe);
+
+/**
+ * @brief Tear down RING. Pending requests are cancelled.
+ */
+void uring_free(struct uring *ring);
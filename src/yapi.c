@@ -1,36 +1,43 @@
+#include "yapi.h"
 #include "lib/bhop.h"
 #include "lib/fetch.h"
+#include "lib/h2.h"
+#include "lib/pipeline.h"
+#include "lib/tcp.h"
 #include <asm-generic/errno-base.h>
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 int bhop(FILE *files[2]) {
-    struct deque8 *dq = calloc(1, sizeof(struct deque8));
-    if (!dq) {
-        return perror_rc(-1, "calloc", deque8_free(dq));
-    }
-    deque8_init(dq);
+    return bhop_open(files);
+}
 
-    FILE *writable = bhop_writable(dq);
-    if (!writable) {
-        return perror_rc(-1, "bhop_writable", deque8_free(dq));
-    }
-    FILE *readable = bhop_readable(dq);
-    if (!readable) {
-        return perror_rc(-1, "bhop_readable", fclose(writable), deque8_free(dq));
-    }
+FILE *fetch(const char *url, const char *init[4]) {
+    return fetch_with(url, init, NULL);
+}
 
-    files[0] = writable;
-    files[1] = readable;
-    return 0;
+FILE *fetch_with(const char *url, const char *init[4],
+                 const struct fetch_options *options)
+{
+    return fetch_with_response(url, init, options, NULL);
 }
 
-FILE *fetch(const char *url, const char *init[4]) {
-    int fds[4] = {0};
-    struct dispatch *dispatch = fetch_socket(url, init);
+// Everything a fetch of URL needs before it goes to a transport, with
+// the consumer's end of its rows in *APPFD. RESPONSE, if not NULL, gets
+// the response's status and headers.
+static struct fetch_state *fetch_prepare(const char *url, const char *init[4],
+                                         const struct fetch_options *options,
+                                         struct fetch_response **response,
+                                         int *appfd)
+{
+    int fds[3] = {0};
+    struct dispatch *dispatch = fetch_socket(url, init, options ? options->unix_socket : NULL);
     if (!dispatch) {
         return perror_rc(NULL, "fetch_socket()", 0);
     }
@@ -38,6 +45,12 @@ FILE *fetch(const char *url, const char *init[4]) {
     int rc = use_fetch(fds, dispatch);
     if (rc != 0) {
         perror("use_fetch()");
+        if (dispatch->reused) {
+            ttcp_tls_free(dispatch->ssl);
+            close(dispatch->sockfd);
+        }
+        free(hostname);
+        dispatch_free(dispatch);
         return NULL;
     }
     struct fetch_state *fs = calloc(1, sizeof(struct fetch_state));
@@ -47,38 +60,370 @@ FILE *fetch(const char *url, const char *init[4]) {
     }
 
     fs->ssl = dispatch->ssl;
-    fs->ssl_ctx = dispatch->ctx;
     fs->netfd = fds[0];
-    int appfd = fds[1];
+    *appfd = fds[1];
     fs->outfd = fds[2];
-    fs->ep = fds[3];
     fs->headers_done = false;
     fs->header_len = 0;
     fs->hostname = hostname;
+    fs->port = strdup(dispatch->url.port.hd);
+    fs->origin = strdup(dispatch->origin);
+    fs->is_tls = strncmp(dispatch->url.protocol.hd, "https:", 6) == 0;
+    fs->connect_timeout_ms = options && options->connect_timeout_ms > 0
+        ? options->connect_timeout_ms
+        : FETCH_CONNECT_TIMEOUT_MS;
+    fs->high_water = options && options->high_water > 0
+        ? options->high_water
+        : FETCH_HIGH_WATER;
+    // Ranges are merged row by row, which a raw body doesn't have
+    fs->raw = init && init[3] == FRAME_RAW;
+    fs->ranges = options && !fs->raw ? options->ranges : 0;
+    fs->retries = options ? options->retries : 0;
+    fs->hedge_percentile = options ? options->hedge_percentile : 0;
+    if (options) {
+        fs->admit.priority = options->priority;
+        fs->admit.group = options->group;
+        fs->admit.flow = options->flow;
+    }
+
+    fs->addrinfo = dispatch->addrinfo;
+    dispatch->addrinfo = NULL;
+
+    // Pseudo-headers, in case the request goes out as an HTTP/2 stream
+    fs->authority = strdup(dispatch->url.host.hd);
+    fs->path = dynamic("%s%s", dispatch->url.pathname.hd, dispatch->url.search.hd).hd;
+
+    // Sent by the reactor once connected
+    fs->request = dispatch->request.hd;
+    fs->request_len = dispatch->request.length;
+    dispatch->request.hd = NULL;
 
     // Initialize body parsing state
     fs->chunked_mode = false;
     fs->current_chunk_size = 0;
-    fs->reading_chunk_size = true;
     fs->chunk_line_len = 0;
 
     if (bhop(fs->bass)) {
-        return perror_rc(NULL, "bhop()", close(appfd));
+        return perror_rc(NULL, "bhop()", close(*appfd));
     }
 
     fs->http_done = false;
 
-    // spawn background worker thread
-    pthread_t tid;
-    pthread_create(&tid, NULL, fetcher, fs);
+    if (response) {
+        // One reference for the fetch, one for the caller
+        struct fetch_response *res = calloc(1, sizeof(struct fetch_response));
+        if (!res) {
+            return perror_rc(NULL, "calloc()", close(*appfd));
+        }
+        atomic_init(&res->refs, 2);
+        fs->response = res;
+        *response = res;
+    }
+    dispatch_free(dispatch);
+
+    // With the request final, which is what its entry is looked up by.
+    // A directory that's no use just means no cache.
+    if (options && options->cache_dir) {
+        cache_attach(fs, options->cache_dir);
+    }
+    return fs;
+}
 
-    // detach so it cleans up after finishing
-    pthread_detach(tid);
+void fetch_limit(size_t per_origin, size_t total) {
+    admit_configure(per_origin, total);
+}
+
+FILE *fetch_with_response(const char *url, const char *init[4],
+                          const struct fetch_options *options,
+                          struct fetch_response **response)
+{
+    int appfd;
+    struct fetch_response *res = NULL;
+    struct fetch_state *fs = fetch_prepare(url, init, options, response ? &res : NULL, &appfd);
+    if (!fs) {
+        return NULL;
+    }
 
     FILE *fetchfile = fdopen(appfd, "r");
     if (!fetchfile) {
-        return perror_rc(NULL, "fdopen()", close(appfd));
+        return perror_rc(NULL, "fdopen()", close(appfd), fetch_response_free(res), fetch_end(fs));
+    }
+
+    // The reactor owns FS from here on and frees it when done. A fresh
+    // cache entry is all it needs, otherwise the request goes out.
+    int submitted = 0;
+    if (!cache_replay(fs)) {
+        submitted = options && options->http2 ? h2_submit(fs) : admit_submit(fs);
+    }
+    if (submitted < 0) {
+        return perror_rc(NULL, "fetch_submit()", fclose(fetchfile), fetch_response_free(res), fetch_end(fs));
+    }
+    if (response) {
+        *response = res;
     }
-    dispatch_free(dispatch);
     return fetchfile;
 }
+
+/* How much of a URL's rows a batch reads at once, to begin with */
+#define BATCH_READ_SIZE (16 << 10)
+
+/* One URL of a #fetch_many() batch */
+struct batch_source {
+    char *url;
+    struct fetch_response *response;
+    int fd;         // consumer end of its rows, -1 once they ran out
+    char *buf;      // read off fd and not handed out yet, from off to len
+    size_t off;
+    size_t len;
+    size_t cap;
+};
+
+struct fetch_batch {
+    struct batch_source *sources;
+    size_t len;
+    size_t live;            // sources whose fd is still open
+    size_t next;            // where the next look for a whole row starts
+    struct pollfd *polls;
+};
+
+// Hand the fetches in STATES whose index MINE says belong to the same
+// origin as STATES[FIRST] to one pipeline.
+static void submit_origin(struct fetch_state **states, bool *mine, size_t first, size_t len) {
+    struct fetch_state **group = malloc((len - first) * sizeof(struct fetch_state *));
+    if (!group) {
+        perror("malloc()");
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = first; i < len; i++) {
+        if (states[i] && strcmp(states[i]->origin, states[first]->origin) == 0) {
+            group[n++] = states[i];
+            mine[i] = true;
+        }
+    }
+    if (pipeline_submit(group, n) < 0) {
+        perror("pipeline_submit()");
+        for (size_t i = 0; i < n; i++) {
+            fetch_end(group[i]);
+        }
+    }
+    free(group);
+}
+
+struct fetch_batch *fetch_many(const char *const urls[], size_t n, const char *init[4],
+                               const struct fetch_options *options)
+{
+    struct fetch_batch *batch = calloc(1, sizeof(struct fetch_batch));
+    if (!batch) {
+        return perror_rc(NULL, "calloc()", 0);
+    }
+    batch->sources = calloc(n ? n : 1, sizeof(struct batch_source));
+    batch->polls = calloc(n ? n : 1, sizeof(struct pollfd));
+    struct fetch_state **states = calloc(n ? n : 1, sizeof(struct fetch_state *));
+    bool *submitted = calloc(n ? n : 1, sizeof(bool));
+    if (!batch->sources || !batch->polls || !states || !submitted) {
+        return perror_rc(NULL, "calloc()", free(states), free(submitted), fetch_batch_free(batch));
+    }
+    batch->len = n;
+
+    // A URL that can't even be asked for comes back without rows, the
+    // others go ahead
+    for (size_t i = 0; i < n; i++) {
+        struct batch_source *src = &batch->sources[i];
+        src->fd = -1;
+        src->url = strdup(urls[i]);
+        if (!src->url) {
+            continue;
+        }
+        states[i] = fetch_prepare(urls[i], init, options, &src->response, &src->fd);
+        if (!states[i]) {
+            src->fd = -1;
+            fprintf(stderr, "fetch_many(): can't fetch %s\n", urls[i]);
+            continue;
+        }
+        batch->live++;
+        if (cache_replay(states[i])) {
+            // Fresh in the cache, nothing to send
+            states[i] = NULL;
+        }
+    }
+
+    // HTTP/2 multiplexes on its own, HTTP/1.1 gets a pipeline per origin
+    for (size_t i = 0; i < n; i++) {
+        if (!states[i] || submitted[i]) {
+            continue;
+        }
+        if (options && options->http2) {
+            submitted[i] = true;
+            if (h2_submit(states[i]) < 0) {
+                perror("h2_submit()");
+                fetch_end(states[i]);
+            }
+        } else {
+            submit_origin(states, submitted, i, n);
+        }
+    }
+    free(states);
+    free(submitted);
+    return batch;
+}
+
+// A row SRC already has in full, NUL terminated in place of its newline.
+static ssize_t take_row(struct batch_source *src, const char **row) {
+    if (src->off == src->len) {
+        return -1;
+    }
+    char *start = src->buf + src->off;
+    char *lf = memchr(start, '\n', src->len - src->off);
+    if (!lf) {
+        return -1;
+    }
+    *lf = '\0';
+    *row = start;
+    src->off = lf + 1 - src->buf;
+    return lf - start;
+}
+
+// Read what SRC's fd has for us. False once there's nothing more to come.
+static bool refill(struct batch_source *src) {
+    if (src->off > 0) {
+        src->len -= src->off;
+        memmove(src->buf, src->buf + src->off, src->len);
+        src->off = 0;
+    }
+    if (src->len == src->cap) {
+        // Rows longer than the buffer just make it grow
+        size_t cap = src->cap ? src->cap * 2 : BATCH_READ_SIZE;
+        char *buf = realloc(src->buf, cap);
+        if (!buf) {
+            return perror_rc(false, "realloc()", 0);
+        }
+        src->buf = buf;
+        src->cap = cap;
+    }
+    ssize_t n = read(src->fd, src->buf + src->len, src->cap - src->len);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    src->len += n;
+    return true;
+}
+
+ssize_t fetch_batch_next(struct fetch_batch *batch, const char **row, size_t *index) {
+    for (;;) {
+        // Rows already read go first, taking turns between the URLs
+        for (size_t k = 0; k < batch->len; k++) {
+            size_t i = (batch->next + k) % batch->len;
+            ssize_t len = take_row(&batch->sources[i], row);
+            if (len >= 0) {
+                batch->next = i + 1;
+                *index = i;
+                return len;
+            }
+        }
+        if (batch->live == 0) {
+            return -1;
+        }
+
+        // Then whichever URL gets its next row first
+        size_t npolls = 0;
+        for (size_t i = 0; i < batch->len; i++) {
+            if (batch->sources[i].fd >= 0) {
+                batch->polls[npolls++] = (struct pollfd) {
+                    .fd = batch->sources[i].fd, .events = POLLIN,
+                };
+            }
+        }
+        if (poll(batch->polls, npolls, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return perror_rc(-1, "poll()", 0);
+        }
+        for (size_t i = 0, p = 0; i < batch->len; i++) {
+            struct batch_source *src = &batch->sources[i];
+            if (src->fd < 0) {
+                continue;
+            }
+            if (batch->polls[p++].revents && !refill(src)) {
+                close(src->fd);
+                src->fd = -1;
+                batch->live--;
+            }
+        }
+    }
+}
+
+size_t fetch_batch_len(const struct fetch_batch *batch) {
+    return batch->len;
+}
+
+const char *fetch_batch_url(const struct fetch_batch *batch, size_t index) {
+    return batch->sources[index].url;
+}
+
+const struct fetch_response *fetch_batch_response(const struct fetch_batch *batch, size_t index) {
+    return batch->sources[index].response;
+}
+
+void fetch_batch_free(struct fetch_batch *batch) {
+    if (!batch) {
+        return;
+    }
+    for (size_t i = 0; batch->sources && i < batch->len; i++) {
+        struct batch_source *src = &batch->sources[i];
+        if (src->fd >= 0) {
+            close(src->fd);
+        }
+        fetch_response_free(src->response);
+        free(src->buf);
+        free(src->url);
+    }
+    free(batch->sources);
+    free(batch->polls);
+    free(batch);
+}
+
+int fetch_response_status(const struct fetch_response *response) {
+    if (!atomic_load_explicit(&response->ready, memory_order_acquire)) {
+        return 0;
+    }
+    return response->status;
+}
+
+bool fetch_response_complete(const struct fetch_response *response) {
+    return atomic_load_explicit(&response->complete, memory_order_acquire);
+}
+
+size_t fetch_response_header_count(const struct fetch_response *response) {
+    if (!atomic_load_explicit(&response->ready, memory_order_acquire)) {
+        return 0;
+    }
+    return response->headers_len;
+}
+
+void fetch_response_header_at(const struct fetch_response *response, size_t i,
+                              const char **name, const char **value)
+{
+    *name = response->headers[i].name;
+    *value = response->headers[i].value;
+}
+
+const char *fetch_response_header(const struct fetch_response *response, const char *name) {
+    size_t count = fetch_response_header_count(response);
+    for (size_t i = 0; i < count; i++) {
+        if (strcasecmp(response->headers[i].name, name) == 0) {
+            return response->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+void fetch_response_free(struct fetch_response *response) {
+    if (response) {
+        fetch_response_release(response);
+    }
+}
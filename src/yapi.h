@@ -11,10 +11,12 @@
  * `gcc fetch_print.c -lyarts -o fetch_print`
  */
 #pragma once
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 
  /* FETCH FRAME OPTIONS. These are just plain integers
-  * that are statically cast to `const char *` for convenience.
+  * cast to `const char *` by the macros for convenience.
   * You can pass in plain integers to the frame slot and that will
   * work just fine, you will just get some compiler warnings. */
 
@@ -22,7 +24,19 @@
  * @brief Parse JSON objects into NDJSON.
  * This is also the default parse strategy.
  */
-static const char *FRAME_NDJSON = 0;
+#define FRAME_NDJSON ((const char *) 0)
+
+/**
+ * @brief Pass the body through as it is, unparsed, for upstreams that
+ * already serve NDJSON.
+ *
+ * An uncompressed body that isn't chunked goes from the socket to the
+ * stream with `splice()`, without ever being copied into user space, also
+ * over `https` where the kernel decrypts it (kTLS). Any other body is
+ * still passed through unparsed, just copied on the way. Raw fetches
+ * aren't split into #fetch_options.ranges.
+ */
+#define FRAME_RAW ((const char *) 1)
 
 /**
  * @brief Initialize a write/read pipe over a #bassoon queue.
@@ -63,3 +77,223 @@ int bhop(FILE *files[2]);
  * @snippet fetch_print.c fetch basic usage
  */
 FILE *fetch(const char *url, const char *init[4]);
+
+/**
+ * @brief Knobs for a single #fetch_with() call. Zeroed fields mean the defaults.
+ */
+struct fetch_options {
+    /**
+     * @brief Give up connecting after this many milliseconds (30s by default).
+     *
+     * Covers every address of the host, which are raced against each other
+     * IPv6 and IPv4 alternating, RFC 8305 style.
+     */
+    long connect_timeout_ms;
+
+    /**
+     * @brief Nonzero to send the request as a stream on a shared HTTP/2
+     * connection to the origin (needs a `HTTP2=1` build).
+     *
+     * `https:` origins that don't take HTTP/2 over ALPN are served over
+     * HTTP/1.1 instead. `http:` origins are spoken to in HTTP/2 right
+     * away, so only ask for it there when the server is known to take it.
+     */
+    int http2;
+
+    /**
+     * @brief Most bytes of rows held for a reader that doesn't keep up
+     * (1 MiB by default), on top of what the socket to it buffers.
+     *
+     * Rows go out as soon as they're parsed. Past this many waiting, the
+     * response isn't read off the network until the reader catches up,
+     * which holds the server back through TCP or HTTP/2 flow control.
+     */
+    size_t high_water;
+
+    /**
+     * @brief Most connections to download a large response over (0 or 1
+     * for just the one), as byte ranges fetched side by side.
+     *
+     * Only done when the server takes `Range` requests, the body is
+     * uncompressed, at least 8 MiB per connection, and keeps its rows on
+     * lines of their own (NDJSON, or a JSON array with one element per
+     * line). Rows then come in the order their ranges get to them.
+     */
+    size_t ranges;
+
+    /**
+     * @brief Most times to send the request again when it fails before
+     * any of the response came in (0 by default).
+     *
+     * Covers failing to connect or to send the request, the server hanging
+     * up before the response head, and 408, 429, 502, 503 and 504 answers.
+     * Waits between attempts grow exponentially from 100ms with full
+     * jitter, or are what the server's `Retry-After` says, up to a minute.
+     */
+    unsigned retries;
+
+    /**
+     * @brief Send a second copy of the request when its first byte takes
+     * longer than this percentile (1 to 99) of the origin's recent times to
+     * first byte, 0 for never.
+     *
+     * Whichever copy gets its response head first is kept and the other
+     * one is cancelled. Origins need a few responses behind them first.
+     */
+    unsigned hedge_percentile;
+
+    /**
+     * @brief Where the request gets in line when its origin, or everything,
+     * is at the cap on fetches running at once. Higher goes first.
+     */
+    int priority;
+
+    /**
+     * @brief Who the request is for, the group (a database connection, say)
+     * and flow (a cursor) it's queued under. Waiting requests take turns
+     * between groups, then between the flows of a group. NULL for
+     * nobody in particular.
+     */
+    const void *group;
+    const void *flow;
+
+    /**
+     * @brief Directory to keep responses in and answer from, made if
+     * missing. `NULL` for no cache.
+     *
+     * `200` responses are kept when they're fresh for a while
+     * (`Cache-Control: max-age`) or carry an `ETag` or `Last-Modified`. A
+     * fresh one is answered from disk without a request, a stale one is
+     * asked about again with `If-None-Match` / `If-Modified-Since`, and on
+     * a `304` its body is parsed from disk.
+     */
+    const char *cache_dir;
+
+    /**
+     * @brief Absolute path of a Unix domain socket to send every request
+     * to instead, `NULL` to connect to each URL's host.
+     *
+     * Requests go over it in plain HTTP, with the URL's host in the `Host`
+     * header. URLs of the form `http+unix://%2Fpath%2Fto.sock/items` pick
+     * a socket of their own without this.
+     */
+    const char *unix_socket;
+};
+
+/**
+ * @brief #fetch() with OPTIONS, which may be `NULL`.
+ */
+FILE *fetch_with(const char *url, const char *init[4],
+                 const struct fetch_options *options);
+
+/**
+ * @brief Set the caps on fetches running at once, to any one origin
+ * (PER_ORIGIN, 8 by default) and overall (TOTAL, 256 by default). Zero
+ * leaves a cap as it is.
+ */
+void fetch_limit(size_t per_origin, size_t total);
+
+/**
+ * @brief Status and headers of a #fetch_with_response() response.
+ */
+struct fetch_response;
+
+/**
+ * @brief #fetch_with() that also hands back the response's status line and
+ * headers in RESPONSE, to be released with #fetch_response_free().
+ *
+ * They're in by the time the first line can be read off the returned
+ * stream. Before that, and for responses that never got that far, the
+ * status is 0 and there are no headers.
+ */
+FILE *fetch_with_response(const char *url, const char *init[4],
+                          const struct fetch_options *options,
+                          struct fetch_response **response);
+
+/**
+ * @brief Status code of RESPONSE, 0 until its headers are in.
+ */
+int fetch_response_status(const struct fetch_response *response);
+
+/**
+ * @brief Whether all of RESPONSE's body came through, once its stream hit
+ * EOF. A stream cut short by the network, or a bad body, ends all the same.
+ */
+bool fetch_response_complete(const struct fetch_response *response);
+
+/**
+ * @brief Number of headers in RESPONSE, 0 until they're in.
+ */
+size_t fetch_response_header_count(const struct fetch_response *response);
+
+/**
+ * @brief The Ith header of RESPONSE, its lowercased name in NAME and its value in VALUE.
+ */
+void fetch_response_header_at(const struct fetch_response *response, size_t i,
+                              const char **name, const char **value);
+
+/**
+ * @brief Value of the first header of RESPONSE called NAME, case insensitively, or `NULL`.
+ */
+const char *fetch_response_header(const struct fetch_response *response, const char *name);
+
+/**
+ * @brief Let go of RESPONSE. `NULL` is fine.
+ */
+void fetch_response_free(struct fetch_response *response);
+
+/**
+ * @brief Responses to a list of URLs, fetched together, see #fetch_many().
+ */
+struct fetch_batch;
+
+/**
+ * @brief #fetch_with() every one of the N URLS at once, their rows coming
+ * back through one batch as each URL gets them, to be freed with
+ * #fetch_batch_free().
+ *
+ * Requests to the same origin are pipelined over a few keep-alive
+ * connections, many in flight on each, rather than each waiting for a
+ * connection of its own. With #fetch_options.http2 they go out as HTTP/2
+ * streams instead.
+ *
+ * A URL that fails, however early, just has no rows.
+ *
+ * @retval NOT_0 OK.
+ * @retval NULL Error - Check `errno`.
+ */
+struct fetch_batch *fetch_many(const char *const urls[], size_t n, const char *init[4],
+                               const struct fetch_options *options);
+
+/**
+ * @brief Next row of BATCH from whichever URL has one first, in no
+ * particular order across URLs but in order within each.
+ *
+ * @param row Set to the row, without its newline. It's NUL terminated and
+ * valid until the next call.
+ * @param index Set to which of the URLs the row is from.
+ *
+ * @return Length of ROW, or -1 once every URL's rows ran out.
+ */
+ssize_t fetch_batch_next(struct fetch_batch *batch, const char **row, size_t *index);
+
+/**
+ * @brief Number of URLs in BATCH.
+ */
+size_t fetch_batch_len(const struct fetch_batch *batch);
+
+/**
+ * @brief The INDEXth URL of BATCH, as it was given to #fetch_many().
+ */
+const char *fetch_batch_url(const struct fetch_batch *batch, size_t index);
+
+/**
+ * @brief Status and headers of the INDEXth URL of BATCH, or `NULL` if it
+ * couldn't be fetched at all.
+ */
+const struct fetch_response *fetch_batch_response(const struct fetch_batch *batch, size_t index);
+
+/**
+ * @brief Let go of BATCH, hanging up on URLs whose rows weren't all read. `NULL` is fine.
+ */
+void fetch_batch_free(struct fetch_batch *batch);
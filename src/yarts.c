@@ -4,6 +4,11 @@ SQLITE_EXTENSION_INIT1
 
 #include "yapi.h"
 #include "lib/sql.h"
+#include "lib/flight.h"
+#include "lib/paging.h"
+#include "lib/reactor.h"
+#include "lib/rowcache.h"
+#include "lib/stats.h"
 
 // uncomment to remove all debug prints
 #define NDEBUG
@@ -13,6 +18,7 @@ SQLITE_EXTENSION_INIT1
 #include <openssl/types.h>
 #include <yyjson.h>
 #include <curl/curl.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +30,9 @@ SQLITE_EXTENSION_INIT1
 #define FETCH_BODY 1
 #define FETCH_HEADERS 2
 
+/* Schema position of the hidden `headers` column, which holds the response's */
+#define COL_RESPONSE_HEADERS 1
+
 /* For debug logs */
 #ifdef NDEBUG
   #define println(...) do { } while (0)
@@ -79,39 +88,6 @@ static const char *fetch_status_text(int status) {
     return "Unknown Status";
 }
 
-yyjson_doc *read_next_json_object(FILE *stream, char **errmsg) {
-    char *buf = NULL;
-    size_t cap = 0;
-
-    ssize_t n = getline(&buf, &cap, stream);
-    if (n == -1) {
-        if (errmsg) {
-            *errmsg = sqlite3_mprintf("fetch: no body");
-        }
-        free(buf);
-        return NULL;
-    }
-
-    /* Trim trailing newline ONLY — standard for NDJSON */
-    if (n > 0 && buf[n - 1] == '\n') {
-        buf[n - 1] = '\0';
-        n -= 1;
-    }
-
-    /* Parse */
-    yyjson_doc *doc = yyjson_read(buf, n, 0);
-    if (!doc) {
-        if (errmsg) {
-            *errmsg = sqlite3_mprintf("fetch: invalid json object");
-        }
-        free(buf);
-        return NULL;
-    }
-
-    free(buf);
-    return doc;
-}
-
 /**
  * The SQLite virtual table
  */
@@ -135,17 +111,78 @@ typedef struct {
      * Resolved schema string.
      */
     char *schema;
+
+    /**
+     * Per table fetch settings, from `name=value` table arguments.
+     */
+    struct fetch_options options;
+
+    /**
+     * Index of the hidden `status` column, or -1 when a declared column
+     * already goes by that name.
+     */
+    int status_column;
+
+    /**
+     * How long rows stay in the row cache, in ms, 0 for not at all.
+     */
+    long long row_cache_ttl_ms;
+
+    /**
+     * Whether a cursor joins a download of its URL that's already going,
+     * rather than starting its own.
+     */
+    bool coalesce;
+
+    /**
+     * How the table's API paginates, if it does.
+     */
+    struct paging paging;
 } Fetch;
 
+/* A page of a paginated table's rows, on its way */
+struct page {
+    struct flight_reader *flight;
+    char *url;
+};
+
 /// Cursor
 typedef struct fetch_cursor {
     sqlite3_vtab_cursor base;
-    FILE *stream;
+    /* Rows off its URL's response, shared with whoever else asked for it */
+    struct flight_reader *flight;
+    char *url;          // what flight is for, when not paging
+
+    /* For `WHERE url = '[...]'`, every URL's rows through one batch instead */
+    struct fetch_batch *batch;
+    size_t source;      // which of the batch's URLs the current row is from
+
     unsigned int count;
     int eof;
 
     // Completed row (a fully constructed immutable doc)
     yyjson_doc *next_doc;
+    // next_doc belongs to the flight or the row cache, not the cursor
+    bool shared_doc;
+
+    /* Rows read again out of the row cache */
+    struct rowcache_entry *cached;
+    size_t cached_next;
+
+    /* For paginated tables, flight is the current page's, and the pages
+       after it already asked for wait here in order */
+    char *first_url;
+    char *page_url;
+    struct page *ahead;
+    size_t ahead_len;
+    size_t ahead_cap;
+    char **seen;            // pages read before the current one, for link and cursor APIs
+    size_t seen_len;
+    size_t seen_cap;
+    long pages;             // pages asked for so far
+    long last_page;         // pages there are, -1 until the API says
+    long page_rows;         // rows off the current page so far
+    bool page_next;         // the page after the current one is decided
 } fetch_cursor_t;
 
 #define X_UPDATE_OFFSET 2
@@ -189,8 +226,223 @@ static yyjson_doc *array_wrap(yyjson_val *val) {
     return im_doc;
 }
 
+// Name of a `name=value` table argument into NAME, if ARG is one.
+static bool is_table_option(const char *arg, char name[32]) {
+    size_t n = 0;
+    while (arg[n] && (isalnum((unsigned char) arg[n]) || arg[n] == '_')) {
+        if (n + 1 >= 32) return false;
+        name[n] = arg[n];
+        n++;
+    }
+    name[n] = '\0';
+    while (arg[n] == ' ') n++;
+    return n > 0 && arg[n] == '=';
+}
+
+// VALUE, without the quotes it may have, into *OUT.
+static int option_string(const char *value, const char **out) {
+    size_t len = strlen(value);
+    if (len >= 2 && (value[0] == '\'' || value[0] == '"') && value[len - 1] == value[0]) {
+        value++;
+        len -= 2;
+    }
+    if (len == 0) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_free((char *) *out);
+    *out = sqlite3_mprintf("%.*s", (int) len, value);
+    return *out ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+// Parse table option ARG into VTAB.
+static int parse_table_option(const char *arg, const char *name,
+                              Fetch *vtab, char **pz_err)
+{
+    struct fetch_options *options = &vtab->options;
+    const char *value = strchr(arg, '=') + 1;
+    while (*value == ' ') value++;
+
+    char *end = NULL;
+    long number = strtol(value, &end, 10);
+    bool is_number = end != value && *end == '\0';
+
+    if (strcmp(name, "connect_timeout") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: connect_timeout wants a positive number of ms, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->connect_timeout_ms = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "http2") == 0) {
+        if (!is_number || (number != 0 && number != 1)) {
+            *pz_err = sqlite3_mprintf("fetch: http2 wants 0 or 1, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->http2 = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "high_water") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: high_water wants a positive number of bytes, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->high_water = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "ranges") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: ranges wants a positive number of connections, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->ranges = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "retries") == 0) {
+        if (!is_number || number < 0) {
+            *pz_err = sqlite3_mprintf("fetch: retries wants a number of attempts, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->retries = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "hedge") == 0) {
+        if (!is_number || number < 0 || number > 99) {
+            *pz_err = sqlite3_mprintf("fetch: hedge wants a percentile from 1 to 99, or 0, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->hedge_percentile = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "priority") == 0) {
+        if (!is_number) {
+            *pz_err = sqlite3_mprintf("fetch: priority wants a number, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        options->priority = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "row_cache_ttl") == 0) {
+        if (!is_number || number < 0) {
+            *pz_err = sqlite3_mprintf("fetch: row_cache_ttl wants a number of ms, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        vtab->row_cache_ttl_ms = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "coalesce") == 0) {
+        if (!is_number || (number != 0 && number != 1)) {
+            *pz_err = sqlite3_mprintf("fetch: coalesce wants 0 or 1, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        vtab->coalesce = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "cache") == 0) {
+        // A directory, quoted or not
+        int rc = option_string(value, &options->cache_dir);
+        if (rc == SQLITE_ERROR) {
+            *pz_err = sqlite3_mprintf("fetch: cache wants a directory");
+        }
+        return rc;
+    }
+    if (strcmp(name, "socket") == 0) {
+        int rc = option_string(value, &options->unix_socket);
+        if (rc == SQLITE_OK && options->unix_socket[0] != '/') {
+            rc = SQLITE_ERROR;
+        }
+        if (rc == SQLITE_ERROR) {
+            *pz_err = sqlite3_mprintf("fetch: socket wants the absolute path of a Unix domain socket, got '%s'", value);
+        }
+        return rc;
+    }
+    if (strcmp(name, "paginate") == 0) {
+        const char *kind = NULL;
+        int rc = option_string(value, &kind);
+        if (rc == SQLITE_OK && !paging_kind(kind, &vtab->paging.kind)) {
+            rc = SQLITE_ERROR;
+        }
+        if (rc == SQLITE_ERROR) {
+            *pz_err = sqlite3_mprintf("fetch: paginate wants link, cursor, offset or page, got '%s'", value);
+        }
+        sqlite3_free((char *) kind);
+        return rc;
+    }
+    if (strcmp(name, "page_param") == 0 || strcmp(name, "next_field") == 0) {
+        const char **out = name[0] == 'p' ? &vtab->paging.param : &vtab->paging.field;
+        int rc = option_string(value, out);
+        if (rc == SQLITE_ERROR) {
+            *pz_err = sqlite3_mprintf("fetch: %s wants a name", name);
+        }
+        return rc;
+    }
+    if (strcmp(name, "page_size") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: page_size wants a positive number of rows, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        vtab->paging.size = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "max_pages") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: max_pages wants a positive number of pages, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        vtab->paging.max = number;
+        return SQLITE_OK;
+    }
+    if (strcmp(name, "page_fanout") == 0) {
+        if (!is_number || number <= 0) {
+            *pz_err = sqlite3_mprintf("fetch: page_fanout wants a positive number of pages, got '%s'", value);
+            return SQLITE_ERROR;
+        }
+        vtab->paging.fanout = number;
+        return SQLITE_OK;
+    }
+    *pz_err = sqlite3_mprintf("fetch: unknown table option '%s'", name);
+    return SQLITE_ERROR;
+}
+
+// Fill in what VTAB's pagination options left out.
+static int paging_defaults(Fetch *vtab, char **pz_err) {
+    struct paging *p = &vtab->paging;
+    if (p->kind == PAGING_NONE) {
+        return SQLITE_OK;
+    }
+    if ((p->kind == PAGING_OFFSET || p->kind == PAGING_PAGE) && p->size == 0) {
+        *pz_err = sqlite3_mprintf("fetch: paginate=%s wants a page_size",
+                                  p->kind == PAGING_OFFSET ? "offset" : "page");
+        return SQLITE_ERROR;
+    }
+    if (!p->param && paging_param(p->kind)) {
+        p->param = sqlite3_mprintf("%s", paging_param(p->kind));
+        if (!p->param) {
+            return SQLITE_NOMEM;
+        }
+    }
+    if (!p->field && p->kind == PAGING_CURSOR) {
+        p->field = sqlite3_mprintf("next");
+        if (!p->field) {
+            return SQLITE_NOMEM;
+        }
+    }
+    if (p->fanout == 0) {
+        p->fanout = PAGING_FANOUT;
+    }
+    return SQLITE_OK;
+}
+
+// Free what parsing VTAB's table options allocated.
+static void free_table_options(Fetch *vtab) {
+    sqlite3_free((char *) vtab->options.cache_dir);
+    sqlite3_free((char *) vtab->options.unix_socket);
+    sqlite3_free((char *) vtab->paging.param);
+    sqlite3_free((char *) vtab->paging.field);
+}
+
 static Fetch *fetch_alloc(sqlite3 *db, int argc,
-                          const char *const *argv)
+                          const char *const *argv, char **pz_err)
 {
     Fetch *vtab = sqlite3_malloc(sizeof(Fetch));
     if (!vtab) {
@@ -198,7 +450,36 @@ static Fetch *fetch_alloc(sqlite3 *db, int argc,
         return NULL;
     }
     memset(vtab, 0, sizeof(Fetch));
-    vtab->columns = column_defs_of_declrs(argc, argv, &vtab->columns_len);
+    // Requests waiting for a connection take turns between databases
+    vtab->options.group = db;
+    vtab->coalesce = true;
+
+    // Options aren't columns, so keep them away from the column parser
+    const char **declrs = sqlite3_malloc(argc * sizeof(char *));
+    if (!declrs) {
+        sqlite3_free(vtab);
+        return NULL;
+    }
+    int declrs_len = 0;
+    for (int i = 0; i < argc; i++) {
+        char name[32];
+        if (i < 3 || !is_table_option(argv[i], name)) {
+            declrs[declrs_len++] = argv[i];
+        } else if (parse_table_option(argv[i], name, vtab, pz_err) != SQLITE_OK) {
+            sqlite3_free(declrs);
+            free_table_options(vtab);
+            sqlite3_free(vtab);
+            return NULL;
+        }
+    }
+    if (paging_defaults(vtab, pz_err) != SQLITE_OK) {
+        sqlite3_free(declrs);
+        free_table_options(vtab);
+        sqlite3_free(vtab);
+        return NULL;
+    }
+    vtab->columns = column_defs_of_declrs(declrs_len, declrs, &vtab->columns_len);
+    sqlite3_free(declrs);
 
     /* max number of tokens valid inside a single xCreate argument for the table declaration */
     int MAX_ARG_TOKENS = 2;
@@ -215,6 +496,16 @@ static Fetch *fetch_alloc(sqlite3 *db, int argc,
         if (i + 1 < vtab->columns_len)
             sqlite3_str_appendall(s, ",");
     }
+    // Status of the response, unless the JSON has a status of its own
+    vtab->status_column = vtab->columns_len;
+    for (size_t i = 3; i < vtab->columns_len; i++) {
+        if (sqlite3_stricmp(vtab->columns[i]->name.hd, "status") == 0) {
+            vtab->status_column = -1;
+        }
+    }
+    if (vtab->status_column >= 0) {
+        sqlite3_str_appendall(s, ",status hidden int");
+    }
     sqlite3_str_appendall(s, ")");
     vtab->schema = sqlite3_str_finish(s);
     free(first_line.hd);
@@ -233,10 +524,10 @@ static int xConnect(sqlite3 *pdb, void *paux, int argc,
         return SQLITE_ERROR;
     }
     int rc = SQLITE_OK;
-    *pp_vtab = (sqlite3_vtab *) fetch_alloc(pdb, argc, argv);
+    *pp_vtab = (sqlite3_vtab *) fetch_alloc(pdb, argc, argv, pz_err);
     Fetch *vtab = (Fetch *) *pp_vtab;
     if (!vtab) {
-        return SQLITE_NOMEM;
+        return *pz_err ? SQLITE_ERROR : SQLITE_NOMEM;
     }
 
     rc += sqlite3_declare_vtab(pdb, vtab->schema);
@@ -266,6 +557,8 @@ static bool is_url_set_index_constraint(struct sqlite3_index_constraint *cst) {
 #define IS_CST_HEADERS_EQ(cst) (cst->iColumn == FETCH_HEADERS && cst->op == SQLITE_INDEX_CONSTRAINT_EQ && cst->usable)
 /* expected bitmask value of the index_info from xBestIndex */
 #define REQUIRED_BITS 0b01
+/* set when the url constraint is an IN list, handed to xFilter all at once */
+#define URL_IN_BITS 0b10
 
 /**
  * Check INDEX_INFO value against REQUIRED_BITS mask.
@@ -322,6 +615,12 @@ static int xBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
             usage->omit = 1;
             usage->argvIndex = argPos++;
             planMask |= 0b01;
+            // Every URL of `url IN (...)` in one xFilter, to fetch them
+            // together, unless each is to be paged through
+            if (vtab->paging.kind == PAGING_NONE && sqlite3_vtab_in(pIdxInfo, i, -1)) {
+                sqlite3_vtab_in(pIdxInfo, i, 1);
+                planMask |= URL_IN_BITS;
+            }
         }
     }
 
@@ -355,6 +654,8 @@ static int xDisconnect(sqlite3_vtab *pvtab) {
     vtab->columns_len = 0;
 
     sqlite3_free(vtab->schema);
+    free_table_options(vtab);
+    rowcache_forget(vtab);
     sqlite3_free(pvtab);
     println("xDisconnect end");
     return SQLITE_OK;
@@ -378,22 +679,449 @@ static int xOpen(sqlite3_vtab *pvtab, sqlite3_vtab_cursor **pp_cursor) {
     return SQLITE_OK;
 }
 
+/**
+ * Let go of the pages after the cursor's current one.
+ */
+static void page_drop(fetch_cursor_t *cur) {
+    for (size_t i = 0; i < cur->ahead_len; i++) {
+        flight_leave(cur->ahead[i].flight);
+        free(cur->ahead[i].url);
+    }
+    cur->ahead_len = 0;
+}
+
+/**
+ * Be done with the cursor's pages, if it's paging.
+ */
+static void page_end(fetch_cursor_t *cur) {
+    page_drop(cur);
+    for (size_t i = 0; i < cur->seen_len; i++) {
+        free(cur->seen[i]);
+    }
+    free(cur->seen);
+    cur->seen = NULL;
+    cur->seen_len = 0;
+    cur->seen_cap = 0;
+    free(cur->ahead);
+    free(cur->page_url);
+    free(cur->first_url);
+    cur->ahead = NULL;
+    cur->ahead_cap = 0;
+    cur->page_url = NULL;
+    cur->first_url = NULL;
+}
+
 static int xClose(sqlite3_vtab_cursor *cur) {
     println("xClose begin");
     fetch_cursor_t *cursor = (fetch_cursor_t *)cur;
     if (cursor) {
-        if (cursor->next_doc) {
+        if (cursor->next_doc && !cursor->shared_doc) {
             yyjson_doc_free(cursor->next_doc);
         }
-        if (cursor->stream) {
-            fclose(cursor->stream);
-        }
+        rowcache_release(cursor->cached);
+        flight_leave(cursor->flight);
+        free(cursor->url);
+        page_end(cursor);
+        fetch_batch_free(cursor->batch);
         sqlite3_free(cur);
     }
     println("xClose end");
     return SQLITE_OK;
 }
 
+/**
+ * Next row the row cache has for the cursor.
+ */
+static yyjson_doc *cached_row(fetch_cursor_t *cur, char **errmsg) {
+    if (cur->cached_next == rowcache_len(cur->cached)) {
+        if (errmsg) {
+            *errmsg = sqlite3_mprintf("fetch: no body");
+        }
+        return NULL;
+    }
+    cur->shared_doc = true;
+    return rowcache_row(cur->cached, cur->cached_next++);
+}
+
+/**
+ * Next row of the cursor's flight for URL into DOC, see #flight_read(). A
+ * cursor too far behind the others on it gets URL's rows again for itself.
+ */
+static int read_flight(fetch_cursor_t *cur, const char *url, yyjson_doc **doc) {
+    int rc = cur->flight ? flight_read(cur->flight, doc) : 0;
+    if (rc != FLIGHT_BEHIND || !url) {
+        return rc;
+    }
+    Fetch *vtab = (Fetch *) cur->base.pVtab;
+    struct fetch_options options = vtab->options;
+    options.flow = cur;
+
+    struct fetch_response *response = NULL;
+    FILE *stream = fetch_with_response(url, (const char *[4]){0}, &options, &response);
+    if (!stream) {
+        return rc;
+    }
+    rc = flight_resume(cur->flight, stream, response);
+    if (rc == FLIGHT_NOMEM) {
+        flight_leave(cur->flight);
+        cur->flight = NULL;
+    }
+    return rc > 0 ? flight_read(cur->flight, doc) : rc;
+}
+
+/**
+ * What's wrong, by #read_flight()'s RC, with the rows of URL.
+ */
+static char *flight_error(int rc, const char *url) {
+    switch (rc) {
+    case 0:
+        return sqlite3_mprintf("fetch: no body");
+    case FLIGHT_BEHIND:
+        return sqlite3_mprintf("fetch: couldn't fetch %s again", url);
+    case FLIGHT_NOMEM:
+        return sqlite3_mprintf("fetch: out of memory");
+    default:
+        return url ? sqlite3_mprintf("fetch: invalid json object from %s", url)
+                   : sqlite3_mprintf("fetch: invalid json object");
+    }
+}
+
+/**
+ * Next row off the cursor's response, which it may be reading along with
+ * other cursors.
+ */
+static yyjson_doc *flight_row(fetch_cursor_t *cur, char **errmsg) {
+    yyjson_doc *doc = NULL;
+    int rc = read_flight(cur, cur->url, &doc);
+    if (rc <= 0 && errmsg) {
+        *errmsg = flight_error(rc, cur->url);
+    }
+    cur->shared_doc = true;
+    return doc;
+}
+
+/**
+ * Rows of URL for the cursor, off a download of it that's already going or
+ * a new one, which fills the table's row cache if FILL.
+ */
+static struct flight_reader *open_url(fetch_cursor_t *cur, const char *url, bool fill) {
+    Fetch *vtab = (Fetch *) cur->base.pVtab;
+    // Over a socket of the table's, URL is somebody else's than other tables'
+    char *key = NULL;
+    if (url && vtab->coalesce) {
+        key = vtab->options.unix_socket
+            ? sqlite3_mprintf("%s %s", vtab->options.unix_socket, url)
+            : sqlite3_mprintf("%s", url);
+        if (!key) {
+            return NULL;
+        }
+        // Another cursor already asked for it, so the rows come from its response
+        struct flight_reader *flight = flight_join(key, vtab->options.group);
+        if (flight) {
+            sqlite3_free(key);
+            return flight;
+        }
+    }
+
+    // Each cursor is a flow of its own, so within a database, requests
+    // waiting for a connection take turns between cursors
+    struct fetch_options options = vtab->options;
+    options.flow = cur;
+
+    struct fetch_response *response = NULL;
+    FILE *stream = fetch_with_response(url, (const char *[4]){0}, &options, &response);
+    if (!stream) {
+        sqlite3_free(key);
+        return NULL;
+    }
+    struct rowcache_entry *entry = fill && url && vtab->row_cache_ttl_ms > 0
+        ? rowcache_begin(vtab, url, vtab->row_cache_ttl_ms)
+        : NULL;
+    struct flight_reader *flight = flight_begin(key, options.group, stream,
+                                                response, entry, options.high_water);
+    sqlite3_free(key);
+    if (!flight) {
+        fclose(stream);
+        fetch_response_free(response);
+        rowcache_release(entry);
+    }
+    return flight;
+}
+
+/**
+ * Ask for the page at URL, which is the cursor's from here on, after the
+ * ones already asked for.
+ */
+static bool page_start(fetch_cursor_t *cur, char *url) {
+    if (cur->ahead_len == cur->ahead_cap) {
+        size_t cap = cur->ahead_cap ? cur->ahead_cap * 2 : 4;
+        struct page *ahead = realloc(cur->ahead, cap * sizeof(struct page));
+        if (!ahead) {
+            return perror_rc(false, "realloc()", free(url));
+        }
+        cur->ahead = ahead;
+        cur->ahead_cap = cap;
+    }
+    struct flight_reader *flight = open_url(cur, url, false);
+    if (!flight) {
+        free(url);
+        return false;
+    }
+    cur->ahead[cur->ahead_len++] = (struct page) { flight, url };
+    return true;
+}
+
+/**
+ * Keep the pages of an offset or page API coming: the next one while the
+ * total is unknown, and up to `page_fanout` at once when it is.
+ */
+static void page_top_up(fetch_cursor_t *cur) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    if (p->kind != PAGING_OFFSET && p->kind != PAGING_PAGE) {
+        return;
+    }
+    size_t want = cur->last_page < 0 || p->fanout < 2 ? 1 : p->fanout - 1;
+    while (cur->ahead_len < want && (cur->last_page < 0 || cur->pages < cur->last_page)
+           && (p->max == 0 || cur->pages < p->max))
+    {
+        char *url = paging_nth(p, cur->first_url, cur->pages);
+        if (!url || !page_start(cur, url)) {
+            return;
+        }
+        cur->pages++;
+    }
+}
+
+/**
+ * Move the cursor on to the first of the pages after its current one.
+ */
+static bool page_advance(fetch_cursor_t *cur) {
+    if (cur->ahead_len == 0) {
+        return false;
+    }
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    flight_leave(cur->flight);
+    if (cur->page_url && (p->kind == PAGING_LINK || p->kind == PAGING_CURSOR)) {
+        // Kept to tell a loop of pages from more of them
+        if (cur->seen_len == cur->seen_cap) {
+            size_t cap = cur->seen_cap ? cur->seen_cap * 2 : 8;
+            char **seen = realloc(cur->seen, cap * sizeof(char *));
+            if (!seen) {
+                perror("realloc()");
+                free(cur->page_url);
+                cur->page_url = NULL;
+            } else {
+                cur->seen = seen;
+                cur->seen_cap = cap;
+            }
+        }
+        if (cur->page_url) {
+            cur->seen[cur->seen_len++] = cur->page_url;
+        }
+    } else {
+        free(cur->page_url);
+    }
+    cur->flight = cur->ahead[0].flight;
+    cur->page_url = cur->ahead[0].url;
+    memmove(cur->ahead, cur->ahead + 1, --cur->ahead_len * sizeof(struct page));
+    cur->page_rows = 0;
+    cur->page_next = false;
+    if (cur->last_page >= 0) {
+        page_top_up(cur);
+    }
+    return true;
+}
+
+/**
+ * Ask for URL, the page after the current one of a link or cursor API,
+ * unless it was read already or the table reads no more pages.
+ */
+static void page_after(fetch_cursor_t *cur, char *url) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    bool again = !url || strcmp(url, cur->page_url) == 0;
+    for (size_t i = 0; i < cur->seen_len && !again; i++) {
+        again = strcmp(url, cur->seen[i]) == 0;
+    }
+    if (again || (p->max > 0 && cur->pages >= p->max)) {
+        free(url);
+        return;
+    }
+    if (page_start(cur, url)) {
+        cur->pages++;
+    }
+}
+
+/**
+ * Let go of the pages asked for past the last one there is.
+ */
+static void page_trim(fetch_cursor_t *cur) {
+    while (cur->ahead_len > 0 && cur->pages > cur->last_page) {
+        struct page *page = &cur->ahead[--cur->ahead_len];
+        flight_leave(page->flight);
+        free(page->url);
+        cur->pages--;
+    }
+}
+
+/**
+ * Find out from its response head what comes after the current page, for
+ * link, offset and page APIs. Before the END of the page, the head may not
+ * be in yet.
+ */
+static void page_decide(fetch_cursor_t *cur, bool end) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    const struct fetch_response *res = cur->flight ? flight_response(cur->flight) : NULL;
+    bool head = res && fetch_response_status(res) != 0;
+    if (!end && (p->kind == PAGING_CURSOR || !head)) {
+        return;
+    }
+    cur->page_next = true;
+    if (!res) {
+        return;
+    }
+
+    if (p->kind == PAGING_LINK) {
+        const char *link = fetch_response_header(res, "link");
+        page_after(cur, link ? paging_link(link, cur->page_url) : NULL);
+        return;
+    }
+    const char *total = fetch_response_header(res, "x-total-count");
+    if (p->kind != PAGING_CURSOR && cur->last_page < 0 && total && p->size > 0) {
+        long rows = strtol(total, NULL, 10);
+        cur->last_page = (rows + p->size - 1) / p->size;
+        page_trim(cur);
+    }
+    // Without a total, the next page waits for this one's head to say there's
+    // none, and at its end for it to be short
+    if (!end) {
+        page_top_up(cur);
+    }
+}
+
+/**
+ * Ask for the page after the current one of a cursor API, if DOC, a row
+ * of it, says where that is.
+ */
+static void page_follow(fetch_cursor_t *cur, yyjson_doc *doc) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    yyjson_val *next = yyjson_obj_get(yyjson_doc_get_root(doc), p->field);
+    char buf[32];
+    const char *cursor = NULL;
+    if (yyjson_is_str(next) && yyjson_get_len(next) > 0) {
+        cursor = yyjson_get_str(next);
+    } else if (yyjson_is_int(next)) {
+        snprintf(buf, sizeof(buf), "%lld", (long long) yyjson_get_sint(next));
+        cursor = buf;
+    }
+    if (!cursor) {
+        return;
+    }
+
+    cur->page_next = true;
+    page_after(cur, paging_cursor(p, cur->page_url, cursor));
+}
+
+/**
+ * Whether the current page, read through, is the last of an offset or page
+ * API whose total is unknown: it's short, empty or not a page at all.
+ */
+static bool page_last(fetch_cursor_t *cur) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    if ((p->kind != PAGING_OFFSET && p->kind != PAGING_PAGE) || cur->last_page >= 0) {
+        return false;
+    }
+    int status = cur->flight ? fetch_response_status(flight_response(cur->flight)) : 0;
+    return cur->page_rows == 0 || (p->size > 0 && cur->page_rows < p->size)
+        || status < 200 || status >= 300;
+}
+
+/**
+ * Next row of a paginated table, from the current page or the ones after.
+ */
+static yyjson_doc *page_row(fetch_cursor_t *cur, char **errmsg) {
+    const struct paging *p = &((Fetch *) cur->base.pVtab)->paging;
+    for (;;) {
+        yyjson_doc *doc = NULL;
+        int rc = read_flight(cur, cur->page_url, &doc);
+        if (rc > 0) {
+            cur->page_rows++;
+            if (!cur->page_next && p->kind == PAGING_CURSOR) {
+                page_follow(cur, doc);
+            } else if (!cur->page_next) {
+                page_decide(cur, false);
+            }
+            cur->shared_doc = true;
+            return doc;
+        }
+        if (rc < 0) {
+            if (errmsg) {
+                *errmsg = flight_error(rc, cur->page_url);
+            }
+            return NULL;
+        }
+
+        if (!cur->page_next) {
+            page_decide(cur, true);
+        }
+        if (page_last(cur)) {
+            page_drop(cur);
+        } else {
+            page_top_up(cur);
+        }
+        if (!page_advance(cur)) {
+            if (errmsg) {
+                *errmsg = sqlite3_mprintf("fetch: no body");
+            }
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Next row of the cursor, from the row cache, its one response or
+ * whichever of its batch's URLs has one first.
+ */
+static yyjson_doc *next_row(fetch_cursor_t *cur, char **errmsg) {
+    if (cur->cached) {
+        return cached_row(cur, errmsg);
+    }
+    if (cur->first_url) {
+        return page_row(cur, errmsg);
+    }
+    if (!cur->batch) {
+        return flight_row(cur, errmsg);
+    }
+    cur->shared_doc = false;
+
+    const char *row;
+    ssize_t len = fetch_batch_next(cur->batch, &row, &cur->source);
+    if (len < 0) {
+        if (errmsg) {
+            *errmsg = sqlite3_mprintf("fetch: no body");
+        }
+        return NULL;
+    }
+    yyjson_doc *doc = yyjson_read(row, len, 0);
+    if (!doc && errmsg) {
+        *errmsg = sqlite3_mprintf("fetch: invalid json object from %s",
+                                  fetch_batch_url(cur->batch, cur->source));
+    }
+    return doc;
+}
+
+/**
+ * The response the cursor's current row is from, or `NULL`.
+ */
+static const struct fetch_response *row_response(const fetch_cursor_t *cur) {
+    if (cur->cached) {
+        return rowcache_response(cur->cached);
+    }
+    if (cur->flight) {
+        return flight_response(cur->flight);
+    }
+    return cur->batch ? fetch_batch_response(cur->batch, cur->source) : NULL;
+}
+
 static int xNext(sqlite3_vtab_cursor *cur0) {
     fetch_cursor_t *cur = (fetch_cursor_t*)cur0;
     Fetch *vtab = (void*) cur->base.pVtab;
@@ -409,9 +1137,12 @@ static int xNext(sqlite3_vtab_cursor *cur0) {
     }
 
     yyjson_doc *prev = cur->next_doc;
+    bool prev_shared = cur->shared_doc;
     char *errmsg = NULL;
-    cur->next_doc = read_next_json_object(cur->stream, &errmsg);
-    yyjson_doc_free(prev);
+    cur->next_doc = next_row(cur, &errmsg);
+    if (!prev_shared) {
+        yyjson_doc_free(prev);
+    }
 
     return SQLITE_OK;
 }
@@ -447,6 +1178,45 @@ static yyjson_val *follow_generated_path(
     return cur;
 }
 
+/**
+ * Response headers as a JSON object, repeated headers joined with ", ".
+ */
+static void response_headers_result(sqlite3_context *pctx,
+                                    const struct fetch_response *response)
+{
+    size_t count = response ? fetch_response_header_count(response) : 0;
+    if (count == 0) {
+        sqlite3_result_null(pctx);
+        return;
+    }
+
+    yyjson_mut_doc *mdoc = yyjson_mut_doc_new(NULL);
+    yyjson_mut_val *obj = yyjson_mut_obj(mdoc);
+    yyjson_mut_doc_set_root(mdoc, obj);
+    for (size_t i = 0; i < count; i++) {
+        const char *name, *value;
+        fetch_response_header_at(response, i, &name, &value);
+
+        yyjson_mut_val *seen = yyjson_mut_obj_get(obj, name);
+        if (seen) {
+            char *joined = sqlite3_mprintf("%s, %s", yyjson_mut_get_str(seen), value);
+            yyjson_mut_set_str(seen, yyjson_mut_get_str(yyjson_mut_strcpy(mdoc, joined)));
+            sqlite3_free(joined);
+        } else {
+            yyjson_mut_obj_add_str(mdoc, obj, name, value);
+        }
+    }
+
+    char *json = yyjson_mut_write(mdoc, 0, NULL);
+    yyjson_mut_doc_free(mdoc);
+    if (json) {
+        sqlite3_result_text(pctx, json, -1, SQLITE_TRANSIENT);
+        free(json);
+    } else {
+        sqlite3_result_null(pctx);
+    }
+}
+
 /** Populates the Fetch row */
 static int xColumn(sqlite3_vtab_cursor *pcursor,
                     sqlite3_context *pctx,
@@ -462,6 +1232,23 @@ static int xColumn(sqlite3_vtab_cursor *pcursor,
         return SQLITE_ERROR;
     }
 
+    const struct fetch_response *response = row_response(cursor);
+    if (icol == vtab->status_column) {
+        int status = response ? fetch_response_status(response) : 0;
+        if (status > 0) {
+            sqlite3_result_int(pctx, status);
+        }
+        return SQLITE_OK;
+    }
+    if (icol == COL_RESPONSE_HEADERS) {
+        response_headers_result(pctx, response);
+        return SQLITE_OK;
+    }
+    if (icol == FETCH_URL && cursor->batch) {
+        // Batch rows say which URL they came from
+        sqlite3_result_text(pctx, fetch_batch_url(cursor->batch, cursor->source), -1, SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
     if (icol < 3) {
         // Skip hidden columns
         return SQLITE_OK;
@@ -531,6 +1318,98 @@ static int xRowid(sqlite3_vtab_cursor *pcursor, sqlite3_int64 *prowid) {
     return SQLITE_OK;
 }
 
+/**
+ * All the URLs of a JSON array LIST, as in `WHERE url = '["...", ...]'`,
+ * fetched as one batch.
+ */
+static struct fetch_batch *fetch_url_list(const char *list,
+                                          const struct fetch_options *options,
+                                          char **errmsg)
+{
+    yyjson_doc *doc = yyjson_read(list, strlen(list), 0);
+    yyjson_val *arr = yyjson_doc_get_root(doc);
+    if (!yyjson_is_arr(arr)) {
+        *errmsg = sqlite3_mprintf("fetch: url list isn't a JSON array");
+        yyjson_doc_free(doc);
+        return NULL;
+    }
+
+    size_t n = yyjson_arr_size(arr);
+    const char **urls = sqlite3_malloc64((n ? n : 1) * sizeof(char *));
+    if (!urls) {
+        yyjson_doc_free(doc);
+        return NULL;
+    }
+    size_t i, max;
+    yyjson_val *val;
+    yyjson_arr_foreach(arr, i, max, val) {
+        if (!yyjson_is_str(val)) {
+            *errmsg = sqlite3_mprintf("fetch: url list entry %lld isn't a string", (long long) i);
+            sqlite3_free(urls);
+            yyjson_doc_free(doc);
+            return NULL;
+        }
+        urls[i] = yyjson_get_str(val);
+    }
+
+    struct fetch_batch *batch = fetch_many(urls, n, (const char *[4]){0}, options);
+    if (!batch) {
+        *errmsg = sqlite3_mprintf("fetch: couldn't start fetching the url list");
+    }
+    sqlite3_free(urls);
+    yyjson_doc_free(doc);
+    return batch;
+}
+
+/**
+ * All the URLs of `url IN (...)` right-hand side SET, fetched as one batch.
+ */
+static struct fetch_batch *fetch_url_set(sqlite3_value *set,
+                                         const struct fetch_options *options,
+                                         char **errmsg)
+{
+    size_t n = 0, cap = 0;
+    const char **urls = NULL;
+    sqlite3_value *val = NULL;
+    int rc;
+    for (rc = sqlite3_vtab_in_first(set, &val); rc == SQLITE_OK && val;
+         rc = sqlite3_vtab_in_next(set, &val))
+    {
+        const char *url = (const char *) sqlite3_value_text(val);
+        if (!url) {
+            // NULL never equals a url
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            const char **more = sqlite3_realloc64(urls, cap * sizeof(char *));
+            if (!more) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            urls = more;
+        }
+        // Values of the set only last until the next one is read
+        if (!(urls[n] = sqlite3_mprintf("%s", url))) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        n++;
+    }
+
+    struct fetch_batch *batch = NULL;
+    if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+        *errmsg = sqlite3_mprintf("fetch: couldn't read the url IN list");
+    } else if (!(batch = fetch_many(urls, n, (const char *[4]){0}, options))) {
+        *errmsg = sqlite3_mprintf("fetch: couldn't start fetching the url IN list");
+    }
+    for (size_t i = 0; i < n; i++) {
+        sqlite3_free((char *) urls[i]);
+    }
+    sqlite3_free(urls);
+    return batch;
+}
+
 static int xFilter(sqlite3_vtab_cursor *cur0,
                     int idxNum, const char *idxStr,
                     int argc, sqlite3_value **argv)
@@ -541,7 +1420,18 @@ static int xFilter(sqlite3_vtab_cursor *cur0,
 
     Cur->eof       = 0;
     Cur->count     = 0;
+    if (Cur->next_doc && !Cur->shared_doc) {
+        yyjson_doc_free(Cur->next_doc);
+    }
     Cur->next_doc  = NULL;
+    Cur->shared_doc = false;
+    rowcache_release(Cur->cached);
+    Cur->cached = NULL;
+    flight_leave(Cur->flight);
+    Cur->flight = NULL;
+    free(Cur->url);
+    Cur->url = NULL;
+    page_end(Cur);
 
     // Extract URL
     if (argc == 0 && !vtab->columns[FETCH_URL]->default_value.hd) {
@@ -554,10 +1444,49 @@ static int xFilter(sqlite3_vtab_cursor *cur0,
         ? (const char*)sqlite3_value_text(argv[0])
         : vtab->columns[FETCH_URL]->default_value.hd;
 
-    Cur->stream = fetch(url, (const char *[]){0});
+    fetch_batch_free(Cur->batch);
+    Cur->batch = NULL;
+
+    // Each cursor is a flow of its own, so within a database, requests
+    // waiting for a connection take turns between cursors
+    struct fetch_options options = vtab->options;
+    options.flow = Cur;
 
     char *errmsg = NULL;
-    Cur->next_doc = read_next_json_object(Cur->stream, &errmsg);
+    if (argc > 0 && (idxNum & URL_IN_BITS)) {
+        Cur->batch = fetch_url_set(argv[0], &options, &errmsg);
+        if (!Cur->batch) {
+            cur0->pVtab->zErrMsg = errmsg;
+            return SQLITE_ERROR;
+        }
+    } else if (url && url[strspn(url, " \t\r\n")] == '[') {
+        Cur->batch = fetch_url_list(url, &options, &errmsg);
+        if (!Cur->batch) {
+            cur0->pVtab->zErrMsg = errmsg;
+            return SQLITE_ERROR;
+        }
+    } else if (url && vtab->paging.kind != PAGING_NONE) {
+        // The first page, and for offset and page APIs the next right away
+        Cur->first_url = strdup(url);
+        char *first = !Cur->first_url ? NULL
+            : vtab->paging.kind == PAGING_OFFSET || vtab->paging.kind == PAGING_PAGE
+            ? paging_nth(&vtab->paging, url, 0)
+            : strdup(url);
+        Cur->pages = 1;
+        Cur->last_page = -1;
+        if (first && page_start(Cur, first)) {
+            page_advance(Cur);
+        }
+    } else if (url && vtab->row_cache_ttl_ms > 0
+               && (Cur->cached = rowcache_get(vtab, url))) {
+        // Fresh rows are read again, without the network or the parser
+        Cur->cached_next = 0;
+    } else {
+        Cur->url = url ? strdup(url) : NULL;
+        Cur->flight = open_url(Cur, url, true);
+    }
+
+    Cur->next_doc = next_row(Cur, &errmsg);
 
     if (!Cur->next_doc) {
         cur0->pVtab->zErrMsg = errmsg;
@@ -590,11 +1519,53 @@ static sqlite3_module fetch_vtab_module = {
     .xFindFunction=NULL
 };
 
+/**
+ * `fetch_stats()` SQL function, reports every runtime counter
+ * from #stats.h as one JSON object.
+ */
+static void fetch_stats(sqlite3_context *pctx, int argc, sqlite3_value **argv) {
+    (void) argc;
+    (void) argv;
+    sqlite3_str *s = sqlite3_str_new(sqlite3_context_db_handle(pctx));
+    sqlite3_str_appendchar(s, 1, '{');
+    for (int i = 0; i < STAT_COUNT; i++) {
+        sqlite3_str_appendf(s, "%s\"%s\":%lld", i > 0 ? "," : "", stat_name(i), stat_get(i));
+    }
+    sqlite3_str_appendchar(s, 1, '}');
+
+    int len = sqlite3_str_length(s);
+    sqlite3_result_text(pctx, sqlite3_str_finish(s), len, sqlite3_free);
+}
+
 // Runtime loadable entry
 int sqlite3_yarts_init(sqlite3 *db, char **pzErrMsg,
                        const sqlite3_api_routines *pApi) {
     SQLITE_EXTENSION_INIT2(pApi);
+
+    // Reactor threads start with the first fetch, so this has to come first
+    const char *threads = getenv("YARTS_REACTOR_THREADS");
+    if (threads) {
+        reactor_configure(strtoul(threads, NULL, 10));
+    }
+    const char *backend = getenv("YARTS_REACTOR");
+    if (backend && strcmp(backend, "io_uring") == 0) {
+        reactor_use(REACTOR_IO_URING);
+    }
+    const char *row_cache = getenv("YARTS_ROW_CACHE_BYTES");
+    if (row_cache) {
+        rowcache_configure(strtoull(row_cache, NULL, 10));
+    }
+    const char *per_origin = getenv("YARTS_MAX_PER_ORIGIN");
+    const char *total = getenv("YARTS_MAX_CONNECTIONS");
+    fetch_limit(per_origin ? strtoul(per_origin, NULL, 10) : 0,
+                total ? strtoul(total, NULL, 10) : 0);
+
     // oh yeah baby
     int rc = sqlite3_create_module(db, "fetch", &fetch_vtab_module, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    rc = sqlite3_create_function(db, "fetch_stats", 0, SQLITE_UTF8, 0,
+                                 fetch_stats, 0, 0);
     return rc;
 }
@@ -0,0 +1,88 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, queryElsewhere, startUpstream } from "./common.js";
+
+// Read when the extension loads
+process.env.YARTS_MAX_PER_ORIGIN = "2";
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+describe("Requests in line for an origin", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // /hold/K sends a row, then the last one once we set COUNTERS[4 + K].
+        // Everything else is one row saying in what order it came in, as
+        // counted in COUNTERS[3].
+        upstream = await startUpstream((req, res, counters) => {
+            const [, route, k] = req.url.split("/");
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            if (route === "hold") {
+                res.write(JSON.stringify({ id: -1 }) + "\n");
+                const poll = setInterval(() => {
+                    if (Atomics.load(counters, 4 + Number(k)) === 1) {
+                        clearInterval(poll);
+                        res.end(JSON.stringify({ id: -2 }) + "\n");
+                    }
+                }, 10);
+                return;
+            }
+            res.end(JSON.stringify({ id: Atomics.add(counters, 3, 1) }) + "\n");
+        });
+    });
+    afterAll(() => upstream.close());
+
+    // Takes up a slot until let go of
+    const hold = (k) => {
+        Atomics.store(upstream.counters, 4 + k, 0);
+        const rows = db.prepare("select id from items where url = ?").iterate(`${upstream.origin}/hold/${k}`);
+        expect(rows.next().value.id).toBe(-1);
+        return () => {
+            Atomics.store(upstream.counters, 4 + k, 1);
+            expect([...rows].map((row) => row.id)).toEqual([-2]);
+        };
+    };
+
+    const queued = async (n) => {
+        for (let waited = 0; waited < 3000 && fetchStat(db, "admission_waits") < n; waited += 20) {
+            await sleep(20);
+        }
+        expect(fetchStat(db, "admission_waits")).toBe(n);
+    };
+
+    it("runs no more at once than YARTS_MAX_PER_ORIGIN", async () => {
+        const waits = fetchStat(db, "admission_waits");
+        upstream.peak();
+        const release = [hold(0), hold(1)];
+        const after = queryElsewhere(
+            "create virtual table items using fetch (id int);",
+            `${upstream.origin}/after`,
+        );
+        await queued(waits + 1);
+        release.forEach((release) => release());
+        expect((await after).length).toBe(1);
+        expect(upstream.peak()).toBe(2);
+    });
+
+    it("lets a higher priority in first", async () => {
+        const waits = fetchStat(db, "admission_waits");
+        const release = [hold(0), hold(1)];
+        const low = queryElsewhere(
+            "create virtual table items using fetch (id int, priority=0);",
+            `${upstream.origin}/low`,
+        );
+        await queued(waits + 1);
+        const high = queryElsewhere(
+            "create virtual table items using fetch (id int, priority=10);",
+            `${upstream.origin}/high`,
+        );
+        await queued(waits + 2);
+        release[0]();
+        const [[first], [second]] = await Promise.all([high, low]);
+        expect(first.id).toBeLessThan(second.id);
+        release[1]();
+    });
+});
@@ -0,0 +1,91 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import { mkdtempSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("The response cache", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    const dir = mkdtempSync(join(tmpdir(), "yarts-cache-"));
+    db.exec(`create virtual table items using fetch (id int, cache='${dir}');`);
+    let upstream;
+
+    beforeAll(async () => {
+        // /etag/K is validated by its ETag, /fresh/K is fresh for a minute
+        // and gzipped, /nostore/K isn't to be kept. Answers to a matching
+        // If-None-Match are counted in COUNTERS[3].
+        upstream = await startUpstream((req, res, counters) => {
+            const [, route, k] = req.url.split("/");
+            const etag = `"v${k}"`;
+            if (req.headers["if-none-match"] === etag) {
+                Atomics.add(counters, 3, 1);
+                return res.writeHead(304, { ETag: etag }).end();
+            }
+            const rows = [...Array(100).keys()].map((id) => JSON.stringify({ id })).join("\n") + "\n";
+            const headers = { "Content-Type": "application/x-ndjson", ETag: etag };
+            if (route === "fresh") {
+                headers["Cache-Control"] = "max-age=60";
+                headers["Content-Encoding"] = "gzip";
+                return res.writeHead(200, headers).end(require("node:zlib").gzipSync(rows));
+            }
+            if (route === "nostore") {
+                headers["Cache-Control"] = "no-store";
+            }
+            res.writeHead(200, headers).end(rows);
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const ids = (url) => db.prepare("select id from items where url = ?").pluck().all(url);
+    const all = [...Array(100).keys()];
+
+    it("keeps a response with an ETag, and gets its rows from disk on a 304", () => {
+        const url = `${upstream.origin}/etag/1`;
+        const stores = fetchStat(db, "cache_stores");
+        const misses = fetchStat(db, "cache_misses");
+        expect(ids(url)).toEqual(all);
+        expect(fetchStat(db, "cache_stores")).toBe(stores + 1);
+        expect(fetchStat(db, "cache_misses")).toBe(misses + 1);
+
+        const revalidations = fetchStat(db, "cache_revalidations");
+        upstream.requests();
+        expect(ids(url)).toEqual(all);
+        expect(upstream.requests()).toBe(1);
+        expect(Atomics.load(upstream.counters, 3)).toBe(1);
+        expect(fetchStat(db, "cache_revalidations")).toBe(revalidations + 1);
+    });
+
+    it("answers from disk while fresh, without asking", () => {
+        const url = `${upstream.origin}/fresh/1`;
+        expect(ids(url)).toEqual(all);
+        const hits = fetchStat(db, "cache_hits");
+        upstream.requests();
+        const [row] = db.prepare("select headers from items where url = ? limit 1").all(url);
+        expect(ids(url)).toEqual(all);
+        expect(upstream.requests()).toBe(0);
+        expect(fetchStat(db, "cache_hits")).toBe(hits + 2);
+        // The body on disk is decompressed already
+        expect(JSON.parse(row.headers)["content-encoding"]).toBeUndefined();
+    });
+
+    it("keeps across connections", () => {
+        const other = new Database().loadExtension("./libyarts");
+        other.exec(`create virtual table items using fetch (id int, cache='${dir}');`);
+        upstream.requests();
+        expect(other.prepare("select count(*) from items where url = ?").pluck().get(`${upstream.origin}/fresh/1`))
+            .toBe(100);
+        expect(upstream.requests()).toBe(0);
+    });
+
+    it("doesn't keep no-store responses", () => {
+        const url = `${upstream.origin}/nostore/1`;
+        const stores = fetchStat(db, "cache_stores");
+        upstream.requests();
+        expect(ids(url)).toEqual(all);
+        expect(ids(url)).toEqual(all);
+        expect(upstream.requests()).toBe(2);
+        expect(fetchStat(db, "cache_stores")).toBe(stores);
+    });
+});
@@ -0,0 +1,82 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+// Whether the client hung up on the upstream within MS
+async function hungUp(counters, ms) {
+    for (let waited = 0; waited < ms; waited += 50) {
+        if (Atomics.load(counters, 4) === 1) {
+            return true;
+        }
+        await sleep(50);
+    }
+    return false;
+}
+
+describe("Closing a cursor early", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table endless using fetch (id int);");
+    let upstream;
+    let origin;
+
+    beforeAll(async () => {
+        // In COUNTERS, what it sent of the last body, and whether the client
+        // hung up on it
+        upstream = await startUpstream((req, res, counters) => {
+            const ROW = Buffer.from(JSON.stringify({ id: 1, pad: "x".repeat(1000) }) + "\n");
+            const BLOCK = Buffer.concat(Array(64).fill(ROW));
+            Atomics.store(counters, 3, 0);
+            Atomics.store(counters, 4, 0);
+            res.on("close", () => Atomics.store(counters, 4, 1));
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            if (req.url === "/silent") {
+                // One row, then nothing for as long as the client stays
+                res.write(ROW);
+                Atomics.add(counters, 3, ROW.length);
+                return;
+            }
+            // Rows for as long as the client takes them
+            const pump = () => {
+                while (!res.destroyed && res.write(BLOCK)) {
+                    Atomics.add(counters, 3, BLOCK.length);
+                }
+                if (!res.destroyed) {
+                    Atomics.add(counters, 3, BLOCK.length);
+                    res.once("drain", pump);
+                }
+            };
+            pump();
+        });
+        origin = upstream.origin;
+    });
+    afterAll(() => upstream.close());
+
+    const bytesReceived = () => fetchStat(db, "body_bytes_received");
+
+    it("stops the download of an endless body", async () => {
+        const before = bytesReceived();
+        const row = db
+            .prepare("select id from endless where url = ? limit 1")
+            .get(`${origin}/endless`);
+        expect(row.id).toBe(1);
+
+        expect(await hungUp(upstream.counters, 2000)).toBe(true);
+        const received = bytesReceived() - before;
+        await sleep(500);
+        expect(bytesReceived() - before).toBe(received);
+        // Whatever was in flight, not the body
+        expect(received).toBeLessThan(32 << 20);
+        expect(Atomics.load(upstream.counters, 3)).toBeLessThan(64 << 20);
+    });
+
+    it("hangs up on an upstream that went quiet", async () => {
+        const row = db
+            .prepare("select id from endless where url = ? limit 1")
+            .get(`${origin}/silent`);
+        expect(row.id).toBe(1);
+        expect(await hungUp(upstream.counters, 2000)).toBe(true);
+    });
+});
@@ -0,0 +1,92 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Coalescing downloads", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, pad text);");
+    db.exec("create virtual table alone using fetch (id int, coalesce=0);");
+    let upstream;
+    let origin;
+
+    beforeAll(async () => {
+        // /NAME/PARAMS, with n rows padded by pad characters in PARAMS
+        upstream = await startUpstream((req, res) => {
+            const q = new URLSearchParams(req.url.split("/")[2]);
+            const pad = "x".repeat(Number(q.get("pad") ?? 0));
+            const rows = [];
+            for (let id = 0; id < Number(q.get("n")); id++) {
+                rows.push(JSON.stringify({ id, pad }));
+            }
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            res.end(rows.join("\n") + "\n");
+        });
+        origin = upstream.origin;
+    });
+    afterAll(() => upstream.close());
+
+    const stat = (name) => fetchStat(db, name);
+
+    const selfJoin = (table, url) => db.prepare(`
+        select count(*) as n from ${table} a join ${table} b on a.id = b.id
+        where a.url = ?1 and b.url = ?1
+    `).get(url).n;
+
+    it("downloads a self-join's URL once", () => {
+        const url = `${origin}/self/n=50`;
+        const coalesced = stat("coalesced_fetches");
+        upstream.requests();
+        expect(selfJoin("items", url)).toBe(50);
+        expect(upstream.requests()).toBe(1);
+        expect(stat("coalesced_fetches")).toBeGreaterThan(coalesced);
+    });
+
+    it("lets another connection join a download that's going", () => {
+        const url = `${origin}/shared/n=200`;
+        const other = new Database().loadExtension("./libyarts");
+        other.exec("create virtual table items using fetch (id int, pad text);");
+        const coalesced = stat("coalesced_fetches");
+        upstream.requests();
+
+        const rows = db.prepare("select id from items where url = ?").iterate(url);
+        expect(rows.next().value.id).toBe(0);
+        expect(other.prepare("select count(*) as n from items where url = ?").get(url).n).toBe(200);
+        let n = 1;
+        for (const row of rows) {
+            expect(row.id).toBe(n++);
+        }
+        expect(n).toBe(200);
+        expect(upstream.requests()).toBe(1);
+        expect(stat("coalesced_fetches")).toBe(coalesced + 1);
+    });
+
+    it("downloads again for a reader left past high_water", () => {
+        const url = `${origin}/lagging/n=500&pad=1000`;
+        const other = new Database().loadExtension("./libyarts");
+        other.exec("create virtual table items using fetch (id int, pad text, high_water=65536);");
+        db.exec("create virtual table capped using fetch (id int, pad text, high_water=65536);");
+        const refetches = stat("coalesce_refetches");
+        upstream.requests();
+
+        const rows = db.prepare("select id from capped where url = ?").iterate(url);
+        expect(rows.next().value.id).toBe(0);
+        expect(other.prepare("select count(*) as n from items where url = ?").get(url).n).toBe(500);
+        let n = 1;
+        for (const row of rows) {
+            expect(row.id).toBe(n++);
+        }
+        expect(n).toBe(500);
+        expect(upstream.requests()).toBe(2);
+        expect(stat("coalesce_refetches")).toBe(refetches + 1);
+    });
+
+    it("doesn't with coalesce=0", () => {
+        const url = `${origin}/alone/n=50`;
+        const coalesced = stat("coalesced_fetches");
+        upstream.requests();
+        expect(selfJoin("alone", url)).toBe(50);
+        expect(upstream.requests()).toBeGreaterThanOrEqual(2);
+        expect(stat("coalesced_fetches")).toBe(coalesced);
+    });
+});
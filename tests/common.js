@@ -1,5 +1,10 @@
+import { execFileSync } from "node:child_process";
+import { mkdtempSync, readFileSync } from "node:fs";
 import { access } from "node:fs/promises";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
 import { exit } from "node:process";
+import { Worker } from "node:worker_threads";
 
 export async function checkExtensionExists() {
     const isExtensionMade = await access("./libyarts.so")
@@ -12,3 +17,109 @@ export async function checkExtensionExists() {
         console.log("Extension found");
     }
 }
+
+// Queries block the main thread, so upstreams run in a worker. HANDLER is
+// its (req, res, counters) request listener, or with RAW its (socket,
+// counters) connection listener, and runs there: it can only see what it
+// requires itself. Past the first three, COUNTERS are the handler's own.
+const upstream = (handler) => `
+const { parentPort, workerData } = require("node:worker_threads");
+const { tls, h2, path, raw } = workerData;
+const counters = new Int32Array(workerData.counters);
+const handler = ${handler};
+
+function listener(req, res) {
+    // Requests, the ones still being answered, and the most at once
+    Atomics.add(counters, 0, 1);
+    const open = Atomics.add(counters, 1, 1) + 1;
+    for (let peak = Atomics.load(counters, 2); open > peak; peak = Atomics.load(counters, 2)) {
+        Atomics.compareExchange(counters, 2, peak, open);
+    }
+    res.on("close", () => Atomics.sub(counters, 1, 1));
+    handler(req, res, counters);
+}
+
+let server;
+if (raw) {
+    server = require("node:net").createServer((socket) => {
+        Atomics.add(counters, 0, 1);
+        handler(socket, counters);
+    });
+} else if (h2) {
+    server = require("node:http2").createSecureServer({ ...tls, allowHTTP1: true }, listener);
+} else {
+    server = require(tls ? "node:https" : "node:http").createServer(tls ?? {}, listener);
+}
+server.listen(...(path ? [path] : [0, "127.0.0.1"]), () => {
+    parentPort.postMessage(path ?? server.address().port);
+});
+`;
+
+/**
+ * Serves HANDLER from a worker, over TLS with the key and cert in TLS (also
+ * offering HTTP/2 with H2), or on the unix socket at PATH. Its origin is in
+ * ORIGIN once this resolves.
+ */
+export async function startUpstream(handler, { counters = 8, tls, h2 = false, path, raw = false } = {}) {
+    const shared = new SharedArrayBuffer(4 * counters);
+    const worker = new Worker(upstream(handler), {
+        eval: true,
+        workerData: { counters: shared, tls, h2, path, raw },
+    });
+    const port = await new Promise((resolve, reject) => {
+        worker.once("message", resolve);
+        worker.once("error", reject);
+    });
+    const stats = new Int32Array(shared);
+    return {
+        origin: path ? "http://localhost" : `${tls ? "https" : "http"}://127.0.0.1:${port}`,
+        port,
+        counters: stats,
+        // Requests (connections with RAW) it got, and the most it answered
+        // at once, since the last time we asked
+        requests: () => Atomics.exchange(stats, 0, 0),
+        peak: () => Atomics.exchange(stats, 2, 0),
+        close: () => worker.terminate(),
+    };
+}
+
+/**
+ * Runs `select * from items where url = URL` in a worker, on a database of
+ * its own made with SCHEMA, for queries that have to go on while others
+ * block. Resolves to the rows.
+ */
+export function queryElsewhere(schema, url) {
+    const worker = new Worker(`
+        const { parentPort, workerData } = require("node:worker_threads");
+        const Database = require("better-sqlite3");
+        const db = new Database().loadExtension("./libyarts");
+        db.exec(workerData.schema);
+        parentPort.postMessage(db.prepare("select * from items where url = ?").all(workerData.url));
+    `, { eval: true, workerData: { schema, url } });
+    return new Promise((resolve, reject) => {
+        worker.once("message", resolve);
+        worker.once("error", reject);
+    }).finally(() => worker.terminate());
+}
+
+/**
+ * The counter NAME of `fetch_stats()`, as DB sees it.
+ */
+export function fetchStat(db, name) {
+    return db.prepare("select json_extract(fetch_stats(), ?)").pluck().get(`$.${name}`);
+}
+
+/**
+ * A key and a self-signed certificate to serve TLS with, made by the openssl CLI.
+ */
+export function selfSigned() {
+    const dir = mkdtempSync(join(tmpdir(), "yarts-"));
+    execFileSync("openssl", [
+        "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1", "-subj", "/CN=127.0.0.1",
+        "-keyout", join(dir, "key.pem"), "-out", join(dir, "cert.pem"),
+    ], { stdio: "ignore" });
+    return {
+        key: readFileSync(join(dir, "key.pem"), "utf8"),
+        cert: readFileSync(join(dir, "cert.pem"), "utf8"),
+    };
+}
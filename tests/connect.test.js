@@ -0,0 +1,39 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+describe("Connecting", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, connect_timeout=300);");
+    let upstream;
+
+    beforeAll(async () => {
+        upstream = await startUpstream((req, res) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            res.end(JSON.stringify({ id: 1 }) + "\n");
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const rowsOf = (url) => db.prepare("select id from items where url = ?").all(url);
+
+    it("finds the address of localhost that answers", () => {
+        // Listening on 127.0.0.1 only, so ::1 is refused if it's tried
+        expect(rowsOf(`http://localhost:${upstream.port}/`)).toEqual([{ id: 1 }]);
+    });
+
+    it("gives up on an address that never answers after connect_timeout", () => {
+        // Nothing routes there, so the SYN goes unanswered
+        const started = Date.now();
+        expect(() => rowsOf("http://10.255.255.1/")).toThrow();
+        expect(Date.now() - started).toBeLessThan(2000);
+    });
+
+    it("wants a positive connect_timeout", () => {
+        const fresh = new Database().loadExtension("./libyarts");
+        expect(() => fresh.exec(
+            "create virtual table never using fetch (id int, connect_timeout=0);",
+        )).toThrow(/connect_timeout/);
+    });
+});
@@ -0,0 +1,75 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Bodies with a Content-Length", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, port int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // Requests are all GET /N for N rows, answered with a Content-Length
+        // except on /N/unframed, which ends with the connection, and with
+        // more than that on /N/overlong. Rows say which client port they
+        // went to.
+        upstream = await startUpstream((socket) => {
+            let head = "";
+            socket.on("error", () => {});
+            socket.on("data", (data) => {
+                head += data;
+                for (let end; (end = head.indexOf("\r\n\r\n")) >= 0; head = head.slice(end + 4)) {
+                    const [, n, framing] = head.match(/^GET \/(\d+)\/?(\w*)/);
+                    const rows = [];
+                    for (let id = 0; id < Number(n); id++) {
+                        rows.push(JSON.stringify({ id, port: socket.remotePort }) + "\n");
+                    }
+                    const body = rows.join("");
+                    if (framing === "unframed") {
+                        socket.end(`HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n${body}`);
+                        return;
+                    }
+                    if (framing === "overlong") {
+                        // Says it's done with the connection, but stays on it
+                        socket.write(`HTTP/1.1 200 OK\r\nContent-Length: ${Buffer.byteLength(body)}\r\n`
+                            + `Connection: close\r\n\r\n${body}${JSON.stringify({ id: -1 })}\n`);
+                        return;
+                    }
+                    socket.write(`HTTP/1.1 200 OK\r\nContent-Length: ${Buffer.byteLength(body)}\r\n\r\n${body}`);
+                }
+            });
+        }, { raw: true });
+    });
+    afterAll(() => upstream.close());
+
+    const rowsOf = (path) => db
+        .prepare("select id, port from items where url = ?")
+        .all(`${upstream.origin}${path}`);
+
+    it("ends the body at its length, with the connection still open", () => {
+        const started = Date.now();
+        expect(rowsOf("/3").map((row) => row.id)).toEqual([0, 1, 2]);
+        expect(rowsOf("/3/overlong").map((row) => row.id)).toEqual([0, 1, 2]);
+        expect(Date.now() - started).toBeLessThan(1000);
+    });
+
+    it("reads a large body whole", () => {
+        const n = 100000;
+        const { count, total } = db
+            .prepare("select count(*) as count, sum(id) as total from items where url = ?")
+            .get(`${upstream.origin}/${n}`);
+        expect(count).toBe(n);
+        expect(total).toBe(n * (n - 1) / 2);
+    });
+
+    it("keeps the connection for the next request", () => {
+        const [{ port }] = rowsOf("/1");
+        const hits = fetchStat(db, "pool_hits");
+        expect(rowsOf("/1")[0].port).toBe(port);
+        expect(fetchStat(db, "pool_hits")).toBe(hits + 1);
+    });
+
+    it("reads a body without a length up to the connection's end", () => {
+        expect(rowsOf("/100/unframed").length).toBe(100);
+    });
+});
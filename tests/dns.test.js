@@ -0,0 +1,43 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Resolving hosts", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        upstream = await startUpstream((req, res) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson", Connection: "close" });
+            res.end(JSON.stringify({ id: 1 }) + "\n");
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const rowsOf = (url) => db.prepare("select id from items where url = ?").all(url);
+
+    it("looks a host up once, then answers from the cache", () => {
+        const url = `http://localhost:${upstream.port}/`;
+        const misses = fetchStat(db, "dns_misses");
+        const hits = fetchStat(db, "dns_hits");
+        expect(rowsOf(url)).toEqual([{ id: 1 }]);
+        expect(fetchStat(db, "dns_misses")).toBe(misses + 1);
+        expect(rowsOf(url)).toEqual([{ id: 1 }]);
+        expect(rowsOf(url)).toEqual([{ id: 1 }]);
+        expect(fetchStat(db, "dns_misses")).toBe(misses + 1);
+        expect(fetchStat(db, "dns_hits")).toBe(hits + 2);
+    });
+
+    it("remembers a host that doesn't resolve for a while too", () => {
+        const url = "http://nowhere.invalid/";
+        const failures = fetchStat(db, "dns_failures");
+        expect(() => rowsOf(url)).toThrow();
+        expect(fetchStat(db, "dns_failures")).toBe(failures + 1);
+        const hits = fetchStat(db, "dns_hits");
+        expect(() => rowsOf(url)).toThrow();
+        expect(fetchStat(db, "dns_failures")).toBe(failures + 1);
+        expect(fetchStat(db, "dns_hits")).toBe(hits + 1);
+    });
+});
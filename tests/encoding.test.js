@@ -0,0 +1,63 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Compressed bodies", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, accepted text);");
+    let upstream;
+
+    beforeAll(async () => {
+        // /ENCODING/N for N rows encoded that way, streamed through zlib
+        upstream = await startUpstream((req, res) => {
+            const zlib = require("node:zlib");
+            const [, encoding, n] = req.url.split("/");
+            res.writeHead(200, {
+                "Content-Type": "application/x-ndjson",
+                "Content-Encoding": encoding === "gzip" || encoding === "corrupt" ? "gzip" : "deflate",
+            });
+            if (encoding === "corrupt") {
+                // A gzip header, then garbage
+                const head = Buffer.from([0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3]);
+                return res.end(Buffer.concat([head, Buffer.alloc(4096, 0xff)]));
+            }
+            const encoder = {
+                gzip: () => zlib.createGzip(),
+                deflate: () => zlib.createDeflate(),
+                "raw-deflate": () => zlib.createDeflateRaw(),
+            }[encoding]();
+            encoder.pipe(res);
+            const accepted = req.headers["accept-encoding"];
+            for (let id = 0; id < Number(n); id++) {
+                encoder.write(JSON.stringify({ id, accepted }) + "\n");
+            }
+            encoder.end();
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const summary = (path) => db
+        .prepare("select count(*) as n, sum(id) as total, max(accepted) as accepted from items where url = ?")
+        .get(`${upstream.origin}${path}`);
+
+    for (const encoding of ["gzip", "deflate", "raw-deflate"]) {
+        it(`decodes ${encoding} as it streams in`, () => {
+            const received = fetchStat(db, "body_bytes_received");
+            const decoded = fetchStat(db, "body_bytes_decoded");
+            const n = 20000;
+            const got = summary(`/${encoding}/${n}`);
+            expect(got.n).toBe(n);
+            expect(got.total).toBe(n * (n - 1) / 2);
+            expect(got.accepted).toMatch(/gzip/);
+            expect(got.accepted).toMatch(/deflate/);
+            // Repetitive rows compress well
+            const wire = fetchStat(db, "body_bytes_received") - received;
+            expect(fetchStat(db, "body_bytes_decoded") - decoded).toBeGreaterThan(wire * 5);
+        });
+    }
+
+    it("fails a body that doesn't decode", () => {
+        expect(() => summary("/corrupt")).toThrow();
+    });
+});
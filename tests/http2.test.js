@@ -0,0 +1,58 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, selfSigned, startUpstream } from "./common.js";
+
+// A row right away with the HTTP version it came over, the other one a while later
+const slow = (req, res) => {
+    res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+    res.write(JSON.stringify({ id: 0, version: req.httpVersion }) + "\n");
+    setTimeout(() => res.end(JSON.stringify({ id: 1, version: req.httpVersion }) + "\n"), 300);
+};
+
+describe("HTTP/2", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, version text, http2=1);");
+    let h2;
+    let h1;
+
+    beforeAll(async () => {
+        const tls = selfSigned();
+        h2 = await startUpstream(slow, { tls, h2: true });
+        h1 = await startUpstream(slow, { tls });
+    });
+    afterAll(() => Promise.all([h2.close(), h1.close()]));
+
+    const versionsOf = (url) => db
+        .prepare("select distinct version from items where url = ?")
+        .pluck()
+        .all(url);
+    // Builds without HTTP2=1 go HTTP/1.1 everywhere
+    const speaksHttp2 = () => versionsOf(`${h2.origin}/probe`)[0] === "2.0";
+
+    it("sends fetches to one origin as streams of one connection", ({ skip }) => {
+        const connections = fetchStat(db, "h2_connections");
+        const streams = fetchStat(db, "h2_streams");
+        if (!speaksHttp2()) {
+            skip();
+        }
+        const cursors = [...Array(4).keys()].map((k) => db
+            .prepare("select id, version from items where url = ?")
+            .iterate(`${h2.origin}/${k}`));
+        cursors.forEach((rows) => expect(rows.next().value).toEqual({ id: 0, version: "2.0" }));
+        for (const rows of cursors) {
+            expect([...rows]).toEqual([{ id: 1, version: "2.0" }]);
+        }
+        expect(fetchStat(db, "h2_connections")).toBe(connections + 1);
+        expect(fetchStat(db, "h2_streams")).toBe(streams + 5);
+    });
+
+    it("goes HTTP/1.1 with an origin that won't speak HTTP/2", () => {
+        const http2 = speaksHttp2();
+        const fallbacks = fetchStat(db, "h2_fallbacks");
+        expect(versionsOf(`${h1.origin}/first`)).toEqual(["1.1"]);
+        expect(versionsOf(`${h1.origin}/again`)).toEqual(["1.1"]);
+        // Only the first time, the origin's remembered after that
+        expect(fetchStat(db, "h2_fallbacks")).toBe(fallbacks + (http2 ? 1 : 0));
+    });
+});
@@ -0,0 +1,93 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+describe("Parsing responses", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // Writes out the response the request's path names, one request a connection
+        upstream = await startUpstream((socket) => {
+            const rows = (n) => [...Array(n).keys()].map((id) => JSON.stringify({ id }) + "\n").join("");
+            const responses = {
+                // The head a byte at a time
+                "/dribbled": () => [..."HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\n"
+                    + "X-Custom: 1\r\nConnection: close\r\n\r\n"].concat(rows(3)),
+                // Names in any case, many of them, one more than once
+                "/headers": () => ["HTTP/1.1 200 OK\r\nX-CuStOm: a\r\n"
+                    + [...Array(40).keys()].map((k) => `X-Filler-${k}: ${k}\r\n`).join("")
+                    + "x-custom: b\r\nConnection: close\r\n\r\n" + rows(1)],
+                // Chunk sizes in either case with extensions, rows split
+                // across chunks and reads, then a trailer
+                "/chunked": () => {
+                    const body = Buffer.from(rows(100));
+                    const out = ["HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"];
+                    for (let off = 0, k = 0; off < body.length; k++) {
+                        const chunk = body.subarray(off, off + 7 + (k * 13) % 50);
+                        off += chunk.length;
+                        const size = chunk.length.toString(16);
+                        out.push(`${k % 2 ? size.toUpperCase() : size};k=${k}\r\n`, chunk, "\r\n");
+                    }
+                    return out.concat("0\r\nX-Trailer: done\r\n\r\n");
+                },
+                "/continue": () => ["HTTP/1.1 100 Continue\r\n\r\n",
+                    "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n" + rows(2)],
+                "/malformed": () => ["HTTP/1.1 2x0 OK\r\n\r\n" + rows(2)],
+            };
+            let head = "";
+            socket.setNoDelay(true);
+            socket.on("error", () => {});
+            socket.on("data", (data) => {
+                head += data;
+                if (!head.includes("\r\n\r\n")) {
+                    return;
+                }
+                const pieces = responses[head.split(" ")[1]]();
+                const next = () => {
+                    if (pieces.length === 0) {
+                        return socket.end();
+                    }
+                    socket.write(pieces.shift());
+                    setTimeout(next, 1);
+                };
+                next();
+            });
+        }, { raw: true });
+    });
+    afterAll(() => upstream.close());
+
+    const rowsOf = (path) => db
+        .prepare("select id, status, headers from items where url = ?")
+        .all(`${upstream.origin}${path}`);
+
+    it("parses a head that comes in a byte at a time", () => {
+        const rows = rowsOf("/dribbled");
+        expect(rows.map((row) => row.id)).toEqual([0, 1, 2]);
+        expect(rows[0].status).toBe(200);
+        expect(JSON.parse(rows[0].headers)["x-custom"]).toBe("1");
+    });
+
+    it("finds headers whatever their case, and joins repeated ones", () => {
+        const [row] = rowsOf("/headers");
+        const headers = JSON.parse(row.headers);
+        expect(headers["x-custom"]).toBe("a, b");
+        expect(headers["x-filler-39"]).toBe("39");
+    });
+
+    it("follows chunk framing", () => {
+        expect(rowsOf("/chunked").map((row) => row.id)).toEqual([...Array(100).keys()]);
+    });
+
+    it("skips interim responses", () => {
+        const rows = rowsOf("/continue");
+        expect(rows.map((row) => row.id)).toEqual([0, 1]);
+        expect(rows[0].status).toBe(200);
+    });
+
+    it("gives up on a malformed status line", () => {
+        expect(() => rowsOf("/malformed")).toThrow();
+    });
+});
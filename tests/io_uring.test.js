@@ -0,0 +1,53 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, queryElsewhere, selfSigned, startUpstream } from "./common.js";
+
+// Read when the extension loads. Kernels without io_uring get epoll.
+process.env.YARTS_REACTOR = "io_uring";
+
+// /K/N for N rows, the last one a while after the others on /K/N/slow
+const rows = (req, res) => {
+    const [, , n, slow] = req.url.split("/");
+    const body = [...Array(Number(n)).keys()].map((id) => JSON.stringify({ id }) + "\n");
+    res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+    if (slow !== "slow") {
+        return res.end(body.join(""));
+    }
+    res.write(body.slice(0, -1).join(""));
+    setTimeout(() => res.end(body.at(-1)), 300);
+};
+
+describe("The io_uring reactor", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let plain;
+    let secure;
+
+    beforeAll(async () => {
+        plain = await startUpstream(rows);
+        secure = await startUpstream(rows, { tls: selfSigned() });
+    });
+    afterAll(() => Promise.all([plain.close(), secure.close()]));
+
+    const summary = (url) => db
+        .prepare("select count(*) as n, sum(id) as total from items where url = ?")
+        .get(url);
+
+    it("reads bodies over plain connections and TLS", () => {
+        const n = 100000;
+        const whole = { n, total: n * (n - 1) / 2 };
+        expect(summary(`${plain.origin}/0/${n}`)).toEqual(whole);
+        expect(summary(`${secure.origin}/0/${n}`)).toEqual(whole);
+    });
+
+    it("waits on several fetches at once", async () => {
+        const started = Date.now();
+        const bodies = await Promise.all([...Array(4).keys()].map((k) => queryElsewhere(
+            "create virtual table items using fetch (id int);",
+            `${plain.origin}/${k}/2/slow`,
+        )));
+        bodies.forEach((rows) => expect(rows).toEqual([{ id: 0 }, { id: 1 }]));
+        expect(Date.now() - started).toBeLessThan(4 * 300);
+    });
+});
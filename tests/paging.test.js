@@ -0,0 +1,173 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+describe("Paginated tables", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    let upstream;
+    let origin;
+
+    // Every row says which request it came from
+    beforeAll(async () => {
+        upstream = await startUpstream((req, res) => {
+            const TOTAL = 25;
+
+            function send(res, rows, headers = {}) {
+                const body = JSON.stringify(rows);
+                res.writeHead(200, { "Content-Type": "application/json", ...headers });
+                res.end(body);
+            }
+
+            const url = new URL(req.url, "http://upstream");
+            const q = url.searchParams;
+            const path = req.url;
+            const [, route, n] = url.pathname.split("/");
+
+            if (route === "items") {
+                // jsonplaceholder style: _page from 1 or _start from 0, _limit rows
+                const limit = Number(q.get("_limit") ?? 10);
+                const start = q.has("_page") ? (Number(q.get("_page")) - 1) * limit : Number(q.get("_start") ?? 0);
+                const rows = [];
+                for (let id = start; id < Math.min(start + limit, TOTAL); id++) {
+                    rows.push({ id, path });
+                }
+                return send(res, rows, q.has("nototal") ? {} : { "X-Total-Count": String(TOTAL) });
+            }
+            if (route === "link") {
+                // Three pages, the next one relative to this one, among other rels
+                const page = Number(n);
+                const links = [`<http://${req.headers.host}/link/1>; rel="first"`];
+                if (page < 3) {
+                    links.push(`<${page + 1}>; rel="next last"`);
+                }
+                return send(res, [{ id: page, path }], { Link: links.join(", ") });
+            }
+            if (route === "loop") {
+                // 1 -> 2 -> 1 -> ...
+                const page = Number(n);
+                return send(res, [{ id: page, path }], { Link: `</loop/${page % 2 + 1}>; rel="next"` });
+            }
+            if (route === "cursor") {
+                // Cursors with characters that need escaping, then none on the last page
+                const cursors = [null, "a+b/1=", "a b&2"];
+                const at = cursors.indexOf(q.get("cursor"));
+                const next = cursors[at + 1] ?? null;
+                return send(res, [{ id: at, path, next }, { id: at, path, next }]);
+            }
+            if (route === "href") {
+                // The next page as a URL: absolute, then from the root, then a query
+                const page = Number(q.get("page") ?? 1);
+                const next = [null, `http://${req.headers.host}/href?page=2`, "/href?page=3", "?page=4"][page] ?? null;
+                return send(res, [{ id: page, path, next }]);
+            }
+            if (route === "forever") {
+                const page = Number(q.get("cursor") ?? 0);
+                return send(res, [{ id: page, path, next: page + 1 }]);
+            }
+            res.writeHead(404).end();
+        });
+        origin = upstream.origin;
+    });
+    afterAll(() => upstream.close());
+
+    const rowsOf = (table, url) => {
+        upstream.requests();
+        return db.prepare(`select * from ${table} where url = ?`).all(url);
+    };
+
+    it("follows Link headers to the last page", () => {
+        db.exec("create virtual table links using fetch (id int, path text, paginate=link);");
+        const rows = rowsOf("links", `${origin}/link/1`);
+        expect(rows.map((row) => row.path)).toEqual(["/link/1", "/link/2", "/link/3"]);
+        expect(upstream.requests()).toBe(3);
+    });
+
+    it("stops at a page it read already", () => {
+        db.exec("create virtual table loops using fetch (id int, path text, paginate=link);");
+        const rows = rowsOf("loops", `${origin}/loop/1`);
+        expect(rows.map((row) => row.path)).toEqual(["/loop/1", "/loop/2"]);
+    });
+
+    it("escapes cursor values into the query", () => {
+        db.exec(`create virtual table cursors using fetch (
+            id int, path text, next text, paginate=cursor
+        );`);
+        const rows = rowsOf("cursors", `${origin}/cursor?x=1#top`);
+        expect([...new Set(rows.map((row) => row.path))]).toEqual([
+            "/cursor?x=1",
+            "/cursor?x=1&cursor=a%2Bb%2F1%3D",
+            "/cursor?x=1&cursor=a%20b%262",
+        ]);
+        expect(rows.length).toBe(6);
+    });
+
+    it("follows cursors that are URLs", () => {
+        db.exec(`create virtual table hrefs using fetch (
+            id int, path text, next text, paginate=cursor
+        );`);
+        const rows = rowsOf("hrefs", `${origin}/href`);
+        expect(rows.map((row) => row.path)).toEqual([
+            "/href", "/href?page=2", "/href?page=3", "/href?page=4",
+        ]);
+    });
+
+    it("reads no more than max_pages", () => {
+        db.exec(`create virtual table forever using fetch (
+            id int, path text, next int, paginate=cursor, max_pages=3
+        );`);
+        const rows = rowsOf("forever", `${origin}/forever`);
+        expect(rows.map((row) => row.id)).toEqual([0, 1, 2]);
+        expect(upstream.requests()).toBe(3);
+    });
+
+    it("counts offsets by page_size", () => {
+        db.exec(`create virtual table offsets using fetch (
+            id int, path text, paginate=offset, page_param=_start, page_size=10
+        );`);
+        const rows = rowsOf("offsets", `${origin}/items?_limit=10`);
+        expect(rows.map((row) => row.id)).toEqual([...Array(25).keys()]);
+        expect([...new Set(rows.map((row) => row.path))]).toEqual([
+            "/items?_limit=10&_start=0",
+            "/items?_limit=10&_start=10",
+            "/items?_limit=10&_start=20",
+        ]);
+        expect(upstream.requests()).toBe(3);
+    });
+
+    it("stops at a short page without a total", () => {
+        const rows = rowsOf("offsets", `${origin}/items?_limit=10&nototal`);
+        expect(rows.length).toBe(25);
+    });
+
+    it("counts pages from the one in the URL", () => {
+        db.exec(`create virtual table pages using fetch (
+            id int, path text, paginate=page, page_param=_page, page_size=10
+        );`);
+        const rows = rowsOf("pages", `${origin}/items?_page=2&_limit=10`);
+        expect(rows.map((row) => row.id)).toEqual([...Array(15).keys()].map((i) => i + 10));
+        expect(rows[0].path).toBe("/items?_page=2&_limit=10");
+        expect(rows.at(-1).path).toBe("/items?_page=3&_limit=10");
+    });
+
+    it("asks for no page past the total", () => {
+        db.exec(`create virtual table whole using fetch (
+            id int, path text, paginate=page, page_param=_page, page_size=100
+        );`);
+        const rows = rowsOf("whole", `${origin}/items?_limit=100`);
+        expect(rows.length).toBe(25);
+        expect(upstream.requests()).toBe(1);
+    });
+
+    it("adds the page to a URL whose query is empty or open", () => {
+        expect(rowsOf("pages", `${origin}/items?`)[0].path).toBe("/items?_page=1");
+        expect(rowsOf("pages", `${origin}/items?_limit=10&`)[0].path).toBe("/items?_limit=10&_page=1");
+    });
+
+    it("wants a page_size to count pages by", () => {
+        const fresh = new Database().loadExtension("./libyarts");
+        expect(() => fresh.exec(
+            "create virtual table sizeless using fetch (id int, paginate=page);",
+        )).toThrow(/page_size/);
+    });
+});
@@ -0,0 +1,45 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Keep-alive connections", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table peers using fetch (port int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // Rows say which client port the request came in on
+        upstream = await startUpstream((req, res) => {
+            const headers = { "Content-Type": "application/x-ndjson" };
+            if (req.url === "/close") {
+                headers.Connection = "close";
+            }
+            res.writeHead(200, headers);
+            res.end(JSON.stringify({ port: req.socket.remotePort }) + "\n");
+        });
+    });
+    afterAll(() => upstream.close());
+
+    // Read to the end, so the connection is back in the pool by then
+    const portOf = (path) => db
+        .prepare("select port from peers where url = ?")
+        .all(`${upstream.origin}${path}`)[0].port;
+
+    it("reuses the connection of the query before", () => {
+        portOf("/first");
+        const hits = fetchStat(db, "pool_hits");
+        const misses = fetchStat(db, "pool_misses");
+        const port = portOf("/again");
+        expect(portOf("/and/again")).toBe(port);
+        expect(fetchStat(db, "pool_hits")).toBe(hits + 2);
+        expect(fetchStat(db, "pool_misses")).toBe(misses);
+    });
+
+    it("connects again after Connection: close", () => {
+        const port = portOf("/close");
+        const misses = fetchStat(db, "pool_misses");
+        expect(portOf("/close")).not.toBe(port);
+        expect(fetchStat(db, "pool_misses")).toBe(misses + 1);
+    });
+});
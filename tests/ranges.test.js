@@ -0,0 +1,76 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Range-split downloads", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, pad text, ranges=4);");
+    let upstream;
+
+    beforeAll(async () => {
+        // 32 MiB and more of rows, as NDJSON or as a JSON array with a row
+        // a line, in byte ranges unless on /whole. COUNTERS[3] counts Range
+        // requests.
+        upstream = await startUpstream((req, res, counters) => {
+            const array = req.url === "/array";
+            globalThis.bodies ??= {};
+            globalThis.bodies[array] ??= (() => {
+                const rows = [];
+                for (let id = 0; id < 34000; id++) {
+                    rows.push(JSON.stringify({ id, pad: "x".repeat(1000) }));
+                }
+                return Buffer.from(array ? "[\n" + rows.join(",\n") + "\n]\n" : rows.join("\n") + "\n");
+            })();
+            const body = globalThis.bodies[array];
+            const headers = { "Content-Type": array ? "application/json" : "application/x-ndjson" };
+            if (req.url !== "/whole") {
+                headers["Accept-Ranges"] = "bytes";
+            }
+            const range = /^bytes=(\d+)-(\d*)$/.exec(req.headers.range ?? "");
+            if (!range || req.url === "/whole") {
+                res.writeHead(200, { ...headers, "Content-Length": body.length });
+                return res.end(body);
+            }
+            Atomics.add(counters, 3, 1);
+            const start = Number(range[1]);
+            const end = range[2] ? Number(range[2]) : body.length - 1;
+            res.writeHead(206, {
+                ...headers,
+                "Content-Length": end - start + 1,
+                "Content-Range": `bytes ${start}-${end}/${body.length}`,
+            });
+            res.end(body.subarray(start, end + 1));
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const n = 34000;
+    const whole = { n, ids: n, total: n * (n - 1) / 2 };
+    const summary = (path) => db
+        .prepare("select count(*) as n, count(distinct id) as ids, sum(id) as total from items where url = ?")
+        .get(`${upstream.origin}${path}`);
+
+    for (const path of ["/ndjson", "/array"]) {
+        it(`splits ${path.slice(1)} over parallel ranges, every row once`, () => {
+            const splits = fetchStat(db, "range_splits");
+            const segments = fetchStat(db, "range_segments");
+            Atomics.store(upstream.counters, 3, 0);
+            upstream.peak();
+            expect(summary(path)).toEqual(whole);
+            expect(upstream.peak()).toBeGreaterThan(1);
+            expect(fetchStat(db, "range_splits")).toBe(splits + 1);
+            // Four of 8 MiB at least, three of them Range requests
+            expect(fetchStat(db, "range_segments")).toBe(segments + 3);
+            expect(Atomics.load(upstream.counters, 3)).toBe(3);
+        });
+    }
+
+    it("downloads in one piece from a server without ranges", () => {
+        const splits = fetchStat(db, "range_splits");
+        upstream.requests();
+        expect(summary("/whole")).toEqual(whole);
+        expect(fetchStat(db, "range_splits")).toBe(splits);
+        expect(upstream.requests()).toBe(1);
+    });
+});
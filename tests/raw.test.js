@@ -0,0 +1,44 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import { execFileSync } from "node:child_process";
+import { startUpstream } from "./common.js";
+
+// FRAME_RAW isn't reachable from SQL, so tests/raw_fetch fetches through the API
+describe("Raw bodies", () => {
+    let upstream;
+
+    beforeAll(async () => {
+        execFileSync("make", ["-s", "tests/raw_fetch"]);
+        upstream = await startUpstream((req, res) => {
+            const body = Buffer.alloc(1 << 20, "x");
+            if (req.url === "/short") {
+                // Half of what the Content-Length says, then a hang up
+                res.writeHead(200, { "Content-Length": 1000 });
+                res.write(body.subarray(0, 500), () => res.destroy());
+                return;
+            }
+            res.writeHead(200, { "Content-Length": body.length });
+            res.end(body);
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const rawFetch = (path) => JSON.parse(
+        execFileSync("./tests/raw_fetch", [`${upstream.origin}${path}`]).toString(),
+    );
+
+    it("splices the body through as it is", () => {
+        const got = rawFetch("/whole");
+        expect(got.status).toBe(200);
+        expect(got.bytes).toBe(1 << 20);
+        expect(got.complete).toBe(true);
+        expect(got.spliced).toBeGreaterThan(0);
+        expect(got.spliced).toBeLessThanOrEqual(1 << 20);
+    });
+
+    it("isn't complete when cut short of its Content-Length", () => {
+        const got = rawFetch("/short");
+        expect(got.status).toBe(200);
+        expect(got.bytes).toBe(500);
+        expect(got.complete).toBe(false);
+    });
+});
@@ -0,0 +1,43 @@
+/**
+ * @file raw_fetch.c
+ * @brief Fetches a URL with #FRAME_RAW and reports how it went, for
+ * `raw.test.js`, since SQL only ever gets parsed rows.
+ *
+ * Prints `{"status", "complete", "bytes", "spliced"}`: the response's status,
+ * whether #fetch_response_complete() said all of the body came through, the
+ * bytes read off the stream, and the ones spliced to it.
+ *
+ * `make tests/raw_fetch && ./tests/raw_fetch URL`
+ */
+#include "../src/yapi.h"
+#include "../src/lib/stats.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s URL\n", argv[0]);
+        return 2;
+    }
+    const char *init[4] = {NULL, NULL, NULL, FRAME_RAW};
+    struct fetch_response *response = NULL;
+    FILE *stream = fetch_with_response(argv[1], init, NULL, &response);
+    if (!stream) {
+        perror("fetch_with_response");
+        return 1;
+    }
+
+    char buf[1 << 14];
+    size_t bytes = 0;
+    for (size_t n; (n = fread(buf, 1, sizeof buf, stream)) > 0;) {
+        bytes += n;
+    }
+    fclose(stream);
+
+    printf("{\"status\": %d, \"complete\": %s, \"bytes\": %zu, \"spliced\": %lld}\n",
+           fetch_response_status(response),
+           fetch_response_complete(response) ? "true" : "false",
+           bytes, stat_get(STAT_BODY_SPLICED));
+    fetch_response_free(response);
+    return 0;
+}
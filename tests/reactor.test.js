@@ -0,0 +1,71 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import { readdirSync } from "node:fs";
+import { Worker } from "node:worker_threads";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+// Read when the extension loads
+process.env.YARTS_REACTOR_THREADS = "1";
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+// A query blocks its thread while it waits on rows, so the ones that go at
+// once run in workers, each on a database of its own
+function startWorker() {
+    const worker = new Worker(`
+        const { parentPort } = require("node:worker_threads");
+        const Database = require("better-sqlite3");
+        const db = new Database().loadExtension("./libyarts");
+        db.exec("create virtual table items using fetch (id int);");
+        parentPort.on("message", (url) => parentPort.postMessage(
+            db.prepare("select id from items where url = ?").all(url)));
+        parentPort.postMessage("ready");
+    `, { eval: true });
+    return new Promise((resolve, reject) => {
+        worker.once("message", () => resolve(worker));
+        worker.once("error", reject);
+    });
+}
+
+const queryOn = (worker, url) => new Promise((resolve) => {
+    worker.once("message", resolve);
+    worker.postMessage(url);
+});
+
+describe("One reactor thread", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // A row right away, the other one a while later
+        upstream = await startUpstream((req, res) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            res.write(JSON.stringify({ id: 0 }) + "\n");
+            setTimeout(() => res.end(JSON.stringify({ id: 1 }) + "\n"), 500);
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const threads = () => readdirSync("/proc/self/task").length;
+
+    it("runs many fetches at once, without a thread each", async () => {
+        db.prepare("select id from items where url = ?").all(`${upstream.origin}/warm`);
+        const workers = await Promise.all([...Array(8)].map(startWorker));
+        const before = threads();
+        upstream.peak();
+
+        const started = Date.now();
+        const queries = workers.map((worker, k) => queryOn(worker, `${upstream.origin}/${k}`));
+        await sleep(250);
+        expect(threads()).toBe(before);
+        for (const rows of await Promise.all(queries)) {
+            expect(rows).toEqual([{ id: 0 }, { id: 1 }]);
+        }
+        expect(upstream.peak()).toBe(8);
+        // Not one after the other
+        expect(Date.now() - started).toBeLessThan(8 * 500 / 2);
+        await Promise.all(workers.map((worker) => worker.terminate()));
+    });
+});
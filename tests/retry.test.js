@@ -0,0 +1,88 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+describe("Retries and hedging", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table retried using fetch (id int, retries=2);");
+    db.exec("create virtual table hedged using fetch (id int, hedge=50);");
+    let upstream;
+
+    beforeAll(async () => {
+        // /flaky/K/PARAMS fails the first PARAMS.fail times it's asked for,
+        // /hedge/K is slow the first time only. COUNTERS[3] counts answers
+        // cut off.
+        upstream = await startUpstream((req, res, counters) => {
+            const q = new URLSearchParams(req.url.split("/")[3]);
+            globalThis.seen ??= new Map();
+            const attempt = globalThis.seen.get(req.url) ?? 0;
+            globalThis.seen.set(req.url, attempt + 1);
+
+            const answer = (status, headers = {}) => {
+                res.writeHead(status, { "Content-Type": "application/x-ndjson", ...headers });
+                res.end(JSON.stringify({ id: attempt }) + "\n");
+            };
+            if (req.url.startsWith("/flaky") && attempt < Number(q.get("fail"))) {
+                return answer(Number(q.get("status") ?? 503), { "Retry-After": q.get("after") ?? "0" });
+            }
+            if (req.url.startsWith("/hedge") && attempt === 0) {
+                const slow = setTimeout(() => answer(200), 3000);
+                res.on("close", () => {
+                    if (!res.writableEnded) {
+                        clearTimeout(slow);
+                        Atomics.add(counters, 3, 1);
+                    }
+                });
+                return;
+            }
+            answer(200);
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const rowOf = (table, path) => db
+        .prepare(`select id, status from ${table} where url = ?`)
+        .get(`${upstream.origin}${path}`);
+
+    it("asks again after a 503, waiting as long as Retry-After says", () => {
+        const retries = fetchStat(db, "retries");
+        upstream.requests();
+        const started = Date.now();
+        expect(rowOf("retried", "/flaky/1/fail=2&after=1")).toEqual({ id: 2, status: 200 });
+        expect(Date.now() - started).toBeGreaterThanOrEqual(1000);
+        expect(upstream.requests()).toBe(3);
+        expect(fetchStat(db, "retries")).toBe(retries + 2);
+    });
+
+    it("hands over the last failure once out of retries", () => {
+        expect(rowOf("retried", "/flaky/2/fail=5")).toEqual({ id: 2, status: 503 });
+    });
+
+    it("doesn't ask again for what won't change, or to wait too long", () => {
+        upstream.requests();
+        expect(rowOf("retried", "/flaky/3/fail=1&status=404")).toEqual({ id: 0, status: 404 });
+        expect(rowOf("retried", "/flaky/4/fail=1&after=3600")).toEqual({ id: 0, status: 503 });
+        expect(upstream.requests()).toBe(2);
+    });
+
+    it("races a copy of a request slower than usual, and cancels the loser", async () => {
+        // Enough quick answers to know what usual is
+        for (let k = 0; k < 20; k++) {
+            expect(rowOf("hedged", `/quick/${k}`).id).toBe(0);
+        }
+        const hedged = fetchStat(db, "hedged_requests");
+        const won = fetchStat(db, "hedges_won");
+        const started = Date.now();
+        expect(rowOf("hedged", "/hedge/1")).toEqual({ id: 1, status: 200 });
+        expect(Date.now() - started).toBeLessThan(1000);
+        expect(fetchStat(db, "hedged_requests")).toBe(hedged + 1);
+        expect(fetchStat(db, "hedges_won")).toBe(won + 1);
+        for (let waited = 0; waited < 1000 && Atomics.load(upstream.counters, 3) === 0; waited += 50) {
+            await sleep(50);
+        }
+        expect(Atomics.load(upstream.counters, 3)).toBe(1);
+    });
+});
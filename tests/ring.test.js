@@ -0,0 +1,39 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Receive buffers", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, pad text);");
+    let upstream;
+
+    beforeAll(async () => {
+        // /N for N rows of about 1 KiB, as one write
+        upstream = await startUpstream((req, res) => {
+            const n = Number(req.url.slice(1));
+            const rows = [];
+            for (let id = 0; id < n; id++) {
+                rows.push(JSON.stringify({ id, pad: "x".repeat(1000) }) + "\n");
+            }
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            res.end(rows.join(""));
+        });
+    });
+    afterAll(() => upstream.close());
+
+    it("grows for a large body and reads it in big pieces", () => {
+        const reads = fetchStat(db, "net_reads");
+        const resizes = fetchStat(db, "ring_resizes");
+        const received = fetchStat(db, "body_bytes_received");
+        const n = 16384;
+        const got = db
+            .prepare("select count(*) as n, sum(id) as total from items where url = ?")
+            .get(`${upstream.origin}/${n}`);
+        expect(got).toEqual({ n, total: n * (n - 1) / 2 });
+        expect(fetchStat(db, "ring_resizes")).toBeGreaterThan(resizes);
+        // Fewer reads than 4 KiB buffers would take
+        const bytes = fetchStat(db, "body_bytes_received") - received;
+        expect(fetchStat(db, "net_reads") - reads).toBeLessThan(bytes / 4096);
+    });
+});
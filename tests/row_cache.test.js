@@ -0,0 +1,79 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+// Read when the extension loads
+process.env.YARTS_ROW_CACHE_BYTES = String(1 << 20);
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+describe("The row cache", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table kept using fetch (id int, row_cache_ttl=300);");
+    db.exec("create virtual table unkept using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // Rows say how many requests came before theirs. /big has 200 rows
+        // of over 1 KiB, the rest 3 small ones.
+        upstream = await startUpstream((req, res, counters) => {
+            const seen = Atomics.add(counters, 3, 1);
+            const status = req.url.startsWith("/gone") ? 404 : 200;
+            const big = req.url.startsWith("/big");
+            const pad = "x".repeat(big ? 1500 : 0);
+            const rows = [...Array(big ? 200 : 3).keys()].map((id) => JSON.stringify({ id: seen * 1000 + id, pad }));
+            res.writeHead(status, { "Content-Type": "application/x-ndjson" });
+            res.end(rows.join("\n") + "\n");
+        });
+    });
+    afterAll(() => upstream.close());
+
+    const ids = (table, path) => db
+        .prepare(`select id from ${table} where url = ?`)
+        .pluck()
+        .all(`${upstream.origin}${path}`);
+
+    it("reads a URL's rows again without asking", () => {
+        const first = ids("kept", "/a");
+        const hits = fetchStat(db, "row_cache_hits");
+        upstream.requests();
+        expect(ids("kept", "/a")).toEqual(first);
+        expect(upstream.requests()).toBe(0);
+        expect(fetchStat(db, "row_cache_hits")).toBe(hits + 1);
+    });
+
+    it("asks again once row_cache_ttl is up", async () => {
+        const first = ids("kept", "/b");
+        await sleep(400);
+        upstream.requests();
+        expect(ids("kept", "/b")).not.toEqual(first);
+        expect(upstream.requests()).toBe(1);
+    });
+
+    it("keeps only what a 2xx brought, and only for tables that want it", () => {
+        upstream.requests();
+        ids("kept", "/gone");
+        ids("kept", "/gone");
+        ids("unkept", "/c");
+        ids("unkept", "/c");
+        expect(upstream.requests()).toBe(4);
+    });
+
+    it("lets the least recently read go past YARTS_ROW_CACHE_BYTES", () => {
+        const evictions = fetchStat(db, "row_cache_evictions");
+        // Some of them have to go for the last ones to fit, /big/1 is the
+        // most recently read all along
+        ids("kept", "/big/1");
+        for (const k of [2, 3, 4, 5]) {
+            ids("kept", `/big/${k}`);
+            ids("kept", "/big/1");
+        }
+        expect(fetchStat(db, "row_cache_evictions")).toBeGreaterThan(evictions);
+        upstream.requests();
+        ids("kept", "/big/1");
+        expect(upstream.requests()).toBe(0);
+        ids("kept", "/big/2");
+        expect(upstream.requests()).toBe(1);
+    });
+});
@@ -0,0 +1,67 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+describe("Streaming rows", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, pad text, high_water=65536);");
+    let upstream;
+
+    beforeAll(async () => {
+        // COUNTERS[3] lets /held finish, COUNTERS[4] counts the rows /big wrote
+        upstream = await startUpstream((req, res, counters) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            if (req.url === "/held") {
+                res.write(JSON.stringify({ id: 0 }) + "\n");
+                const wait = setInterval(() => {
+                    if (Atomics.load(counters, 3) === 1) {
+                        clearInterval(wait);
+                        res.end(JSON.stringify({ id: 1 }) + "\n");
+                    }
+                }, 10);
+                return;
+            }
+            // 32 MiB of 8 KiB rows, as fast as they're taken
+            const pad = "x".repeat(8 * 1024 - 32);
+            let id = 0;
+            const pump = () => {
+                while (id < 4096) {
+                    const row = JSON.stringify({ id: id++, pad }) + "\n";
+                    Atomics.add(counters, 4, 1);
+                    if (!res.write(row)) {
+                        return res.once("drain", pump);
+                    }
+                }
+                res.end();
+            };
+            pump();
+        });
+    });
+    afterAll(() => upstream.close());
+
+    it("hands rows over before the body ends", () => {
+        Atomics.store(upstream.counters, 3, 0);
+        const rows = db.prepare("select id from items where url = ?").iterate(`${upstream.origin}/held`);
+        expect(rows.next().value.id).toBe(0);
+        Atomics.store(upstream.counters, 3, 1);
+        expect([...rows]).toEqual([{ id: 1 }]);
+    });
+
+    it("holds the upstream back past high_water, until the rows are read", async () => {
+        Atomics.store(upstream.counters, 4, 0);
+        const rows = db.prepare("select id from items where url = ?").iterate(`${upstream.origin}/big`);
+        expect(rows.next().value.id).toBe(0);
+        await sleep(500);
+        // What the sockets buffer on the way, not the body
+        expect(Atomics.load(upstream.counters, 4)).toBeLessThan(2048);
+        let n = 1;
+        for (const row of rows) {
+            expect(row.id).toBe(n++);
+        }
+        expect(n).toBe(4096);
+        expect(Atomics.load(upstream.counters, 4)).toBe(4096);
+    });
+});
@@ -0,0 +1,33 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, selfSigned, startUpstream } from "./common.js";
+
+describe("TLS sessions", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int);");
+    let upstream;
+
+    beforeAll(async () => {
+        // Every response closes its connection, so each query shakes hands
+        upstream = await startUpstream((req, res) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson", Connection: "close" });
+            res.end(JSON.stringify({ id: 1 }) + "\n");
+        }, { tls: selfSigned() });
+    });
+    afterAll(() => upstream.close());
+
+    const idOf = (path) => db
+        .prepare("select id from items where url = ?")
+        .get(`${upstream.origin}${path}`).id;
+
+    it("resumes the session of the connection before", () => {
+        expect(idOf("/first")).toBe(1);
+        const handshakes = fetchStat(db, "tls_handshakes");
+        const resumed = fetchStat(db, "tls_resumed");
+        expect(idOf("/second")).toBe(1);
+        expect(fetchStat(db, "tls_handshakes")).toBe(handshakes + 1);
+        expect(fetchStat(db, "tls_resumed")).toBe(resumed + 1);
+        expect(upstream.requests()).toBe(2);
+    });
+});
@@ -0,0 +1,60 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, selfSigned, startUpstream } from "./common.js";
+
+// NDJSON rows 0 to N - 1 for a path ending in /N, written a few at a time
+const rows = (req, res) => {
+    const n = Number(req.url.split("/").at(-1));
+    res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+    let id = 0;
+    const pump = () => {
+        while (id < n) {
+            const line = JSON.stringify({ id, pad: "x".repeat(1000) }) + "\n";
+            id++;
+            if (!res.write(line)) {
+                return res.once("drain", pump);
+            }
+        }
+        res.end();
+    };
+    pump();
+};
+
+describe("TLS from the event loop", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (id int, pad text);");
+    let secure;
+    let plain;
+
+    beforeAll(async () => {
+        secure = await startUpstream(rows, { tls: selfSigned() });
+        plain = await startUpstream(rows);
+    });
+    afterAll(() => Promise.all([secure.close(), plain.close()]));
+
+    const summary = (url) => db
+        .prepare("select count(*) as n, sum(id) as total from items where url = ?")
+        .get(url);
+
+    it("reads a body of many TLS records whole", () => {
+        const n = 5000;
+        expect(summary(`${secure.origin}/${n}`)).toEqual({ n, total: n * (n - 1) / 2 });
+    });
+
+    it("keeps up with several connections at once", () => {
+        const urls = [...Array(4).keys()].map((k) => `${secure.origin}/${k}/1000`);
+        const cursors = urls.map((url) => db.prepare("select id from items where url = ?").iterate(url));
+        // Every connection is open before any body is read to its end
+        cursors.forEach((rows) => expect(rows.next().value.id).toBe(0));
+        for (const rows of cursors) {
+            expect([...rows].length).toBe(999);
+        }
+    });
+
+    it("fails the handshake with a server that doesn't speak TLS", () => {
+        const started = Date.now();
+        expect(() => summary(`https://127.0.0.1:${plain.port}/1`)).toThrow();
+        expect(Date.now() - started).toBeLessThan(2000);
+    });
+});
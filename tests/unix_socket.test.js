@@ -0,0 +1,52 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import { mkdtempSync } from "node:fs";
+import { tmpdir } from "node:os";
+import { join } from "node:path";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("Upstreams on a Unix domain socket", () => {
+    beforeAll(checkExtensionExists);
+    const path = join(mkdtempSync(join(tmpdir(), "yarts-")), "upstream.sock");
+    const db = new Database().loadExtension("./libyarts");
+    db.exec(`create virtual table sidecar using fetch (host text, path text, socket='${path}');`);
+    db.exec("create virtual table items using fetch (host text, path text);");
+    let upstream;
+
+    beforeAll(async () => {
+        upstream = await startUpstream((req, res) => {
+            res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+            res.end(JSON.stringify({ host: req.headers.host, path: req.url }) + "\n");
+        }, { path });
+    });
+    afterAll(() => upstream.close());
+
+    it("sends every request of a table with socket= there, keeping the host", () => {
+        upstream.requests();
+        const row = db.prepare("select host, path from sidecar where url = ?").get("http://api.example/todos?x=1");
+        expect(row.host).toMatch(/^api\.example(:80)?$/);
+        expect(row.path).toBe("/todos?x=1");
+        expect(upstream.requests()).toBe(1);
+    });
+
+    it("keeps the connection alive for the next request", () => {
+        const hits = fetchStat(db, "pool_hits");
+        db.prepare("select path from sidecar where url = ?").all("http://api.example/1");
+        db.prepare("select path from sidecar where url = ?").all("http://api.example/2");
+        expect(fetchStat(db, "pool_hits")).toBeGreaterThan(hits);
+    });
+
+    it("takes the socket of an http+unix URL", () => {
+        upstream.requests();
+        const url = `http+unix://${encodeURIComponent(path)}/todos?_limit=20`;
+        expect(db.prepare("select path from items where url = ?").get(url).path).toBe("/todos?_limit=20");
+        expect(upstream.requests()).toBe(1);
+    });
+
+    it("wants an absolute path", () => {
+        const fresh = new Database().loadExtension("./libyarts");
+        expect(() => fresh.exec(
+            "create virtual table relative using fetch (id int, socket='run/sidecar.sock');",
+        )).toThrow(/absolute path/);
+    });
+});
@@ -0,0 +1,74 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, startUpstream } from "./common.js";
+
+describe("url IN (...)", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (path text, i int);");
+    let upstream;
+    let origin;
+
+    beforeAll(async () => {
+        upstream = await startUpstream((req, res) => {
+            const url = new URL(req.url, "http://upstream");
+            const n = Number(url.searchParams.get("n") ?? 1);
+            setTimeout(() => {
+                const rows = [];
+                for (let i = 0; i < n; i++) {
+                    rows.push(JSON.stringify({ path: url.pathname, i }));
+                }
+                res.writeHead(200, { "Content-Type": "application/x-ndjson" });
+                res.end(rows.join("\n") + "\n");
+            }, Number(url.searchParams.get("delay") ?? 0));
+        });
+        origin = upstream.origin;
+    });
+    afterAll(() => upstream.close());
+
+    const urls = (n, query) => [...Array(n).keys()].map((k) => `${origin}/${k}?${query}`);
+
+    it("fetches every URL of the list at once", () => {
+        const list = urls(8, "delay=300");
+        upstream.requests();
+        upstream.peak();
+        const rows = db
+            .prepare(`select url, path from items where url in (${list.map(() => "?").join(", ")})`)
+            .all(...list);
+        expect(rows.map((row) => row.url).sort()).toEqual([...list].sort());
+        rows.forEach((row) => expect(row.url).toBe(`${origin}${row.path}?delay=300`));
+        expect(upstream.requests()).toBe(8);
+        expect(upstream.peak()).toBeGreaterThan(1);
+    });
+
+    it("keeps each URL's rows in order", () => {
+        const list = urls(4, "n=20");
+        const rows = db
+            .prepare("select url, i from items where url in (?, ?, ?, ?)")
+            .all(...list);
+        expect(rows.length).toBe(80);
+        for (const url of list) {
+            expect(rows.filter((row) => row.url === url).map((row) => row.i))
+                .toEqual([...Array(20).keys()]);
+        }
+    });
+
+    it("leaves out NULL", () => {
+        const [a, b] = urls(2, "n=1");
+        const rows = db
+            .prepare("select url from items where url in (?, null, ?)")
+            .all(a, b);
+        expect(rows.map((row) => row.url).sort()).toEqual([a, b].sort());
+    });
+
+    it("takes the URLs of a subquery", () => {
+        const list = urls(3, "n=2");
+        upstream.requests();
+        const rows = db
+            .prepare("select url, i from items where url in (select value from json_each(?))")
+            .all(JSON.stringify(list));
+        expect(rows.length).toBe(6);
+        expect(new Set(rows.map((row) => row.url))).toEqual(new Set(list));
+        expect(upstream.requests()).toBe(3);
+    });
+});
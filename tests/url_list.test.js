@@ -0,0 +1,80 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { checkExtensionExists, fetchStat, startUpstream } from "./common.js";
+
+describe("A JSON array of URLs", () => {
+    beforeAll(checkExtensionExists);
+    const db = new Database().loadExtension("./libyarts");
+    db.exec("create virtual table items using fetch (path text, i int);");
+    let upstream;
+    let origin;
+
+    beforeAll(async () => {
+        // /K/PARAMS, with n rows, a status and a delay in PARAMS
+        upstream = await startUpstream((req, res) => {
+            const q = new URLSearchParams(req.url.split("/")[2]);
+            const n = Number(q.get("n") ?? 1);
+            const status = Number(q.get("status") ?? 200);
+            setTimeout(() => {
+                const rows = [];
+                for (let i = 0; i < n; i++) {
+                    rows.push(JSON.stringify({ path: req.url, i }));
+                }
+                res.writeHead(status, { "Content-Type": "application/x-ndjson" });
+                res.end(rows.join("\n") + "\n");
+            }, Number(q.get("delay") ?? 0));
+        });
+        origin = upstream.origin;
+    });
+    afterAll(() => upstream.close());
+
+    const urls = (n, params) => [...Array(n).keys()].map((k) => `${origin}/${k}/${params}`);
+
+    const rowsOf = (list) => db
+        .prepare("select url, status, path, i from items where url = ?")
+        .all(JSON.stringify(list));
+
+    it("fetches every URL together, pipelined", () => {
+        const list = urls(8, "delay=300");
+        const pipelined = fetchStat(db, "pipelined_requests");
+        upstream.requests();
+        upstream.peak();
+        const rows = rowsOf(list);
+        expect(rows.map((row) => row.url).sort()).toEqual([...list].sort());
+        expect(upstream.requests()).toBe(8);
+        expect(upstream.peak()).toBeGreaterThan(1);
+        expect(fetchStat(db, "pipelined_requests")).toBeGreaterThan(pipelined);
+    });
+
+    it("says which URL each row is from, in that URL's order", () => {
+        const list = urls(3, "n=10");
+        const rows = rowsOf(list);
+        expect(rows.length).toBe(30);
+        for (const url of list) {
+            const own = rows.filter((row) => row.url === url);
+            expect(own.map((row) => row.i)).toEqual([...Array(10).keys()]);
+            own.forEach((row) => expect(`${origin}${row.path}`).toBe(url));
+        }
+    });
+
+    it("gives each URL's rows its own status", () => {
+        const [ok] = urls(1, "n=1");
+        const gone = `${origin}/gone/status=404`;
+        const rows = rowsOf([ok, gone]);
+        expect(rows.find((row) => row.url === ok).status).toBe(200);
+        expect(rows.find((row) => row.url === gone).status).toBe(404);
+    });
+
+    it("has no rows for a URL that fails", () => {
+        const [ok] = urls(1, "n=2");
+        // Nothing listens on port 9
+        const rows = rowsOf([ok, "http://127.0.0.1:9/refused"]);
+        expect(rows.map((row) => row.url)).toEqual([ok, ok]);
+    });
+
+    it("wants an array of strings", () => {
+        const select = db.prepare("select * from items where url = ?");
+        expect(() => select.all("[1, 2]")).toThrow(/entry 0 isn't a string/);
+        expect(() => select.all("[ not json")).toThrow(/isn't a JSON array/);
+    });
+});